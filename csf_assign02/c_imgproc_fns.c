@@ -6,6 +6,10 @@
 #include <assert.h>
 #include "imgproc.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 // TODO: define your helper functions here
 // Custom ceiling function
 int custom_ceil(int numerator, int denominator) {
@@ -65,6 +69,66 @@ uint32_t to_grayscale(uint32_t pixel) {
     return make_pixel(gray, gray, gray, a);
 }
 
+// Copy a width x height block of pixels from src to dst, transposed, so
+// that dst[c * dst_stride + r] = src[r * src_stride + c]. Strides are in
+// pixels and may be negative (which is how the rotations flip rows or
+// columns as part of the transpose). 4x4 sub-blocks are transposed in
+// SSE registers; the edges of the block are copied one pixel at a time.
+void imgproc_transpose_block( const uint32_t *src, long src_stride,
+                              uint32_t *dst, long dst_stride, int width, int height ) {
+    int r = 0;
+
+#ifdef __SSE2__
+    for ( ; r + 3 < height; r += 4 ) {
+        const uint32_t *s = src + r * src_stride;
+        int c = 0;
+
+        for ( ; c + 3 < width; c += 4 ) {
+            __m128i a = _mm_loadu_si128( (const __m128i *) ( s + c ) );
+            __m128i b = _mm_loadu_si128( (const __m128i *) ( s + src_stride + c ) );
+            __m128i e = _mm_loadu_si128( (const __m128i *) ( s + 2 * src_stride + c ) );
+            __m128i f = _mm_loadu_si128( (const __m128i *) ( s + 3 * src_stride + c ) );
+
+            __m128i ab_lo = _mm_unpacklo_epi32( a, b ); // a0 b0 a1 b1
+            __m128i ab_hi = _mm_unpackhi_epi32( a, b ); // a2 b2 a3 b3
+            __m128i ef_lo = _mm_unpacklo_epi32( e, f ); // e0 f0 e1 f1
+            __m128i ef_hi = _mm_unpackhi_epi32( e, f ); // e2 f2 e3 f3
+
+            uint32_t *d = dst + c * dst_stride + r;
+            _mm_storeu_si128( (__m128i *) d, _mm_unpacklo_epi64( ab_lo, ef_lo ) );
+            _mm_storeu_si128( (__m128i *) ( d + dst_stride ), _mm_unpackhi_epi64( ab_lo, ef_lo ) );
+            _mm_storeu_si128( (__m128i *) ( d + 2 * dst_stride ), _mm_unpacklo_epi64( ab_hi, ef_hi ) );
+            _mm_storeu_si128( (__m128i *) ( d + 3 * dst_stride ), _mm_unpackhi_epi64( ab_hi, ef_hi ) );
+        }
+
+        for ( ; c < width; c++ ) {
+            for ( int i = 0; i < 4; i++ )
+                dst[c * dst_stride + r + i] = s[i * src_stride + c];
+        }
+    }
+#endif
+
+    for ( ; r < height; r++ ) {
+        for ( int c = 0; c < width; c++ )
+            dst[c * dst_stride + r] = src[r * src_stride + c];
+    }
+}
+
+// Copy a row of width pixels from src to dst in reverse order.
+void imgproc_reverse_row( const uint32_t *src, uint32_t *dst, int width ) {
+    int i = 0;
+
+#ifdef __SSE2__
+    for ( ; i + 3 < width; i += 4 ) {
+        __m128i v = _mm_loadu_si128( (const __m128i *) ( src + width - 4 - i ) );
+        _mm_storeu_si128( (__m128i *) ( dst + i ), _mm_shuffle_epi32( v, _MM_SHUFFLE( 0, 1, 2, 3 ) ) );
+    }
+#endif
+
+    for ( ; i < width; i++ )
+        dst[i] = src[width - 1 - i];
+}
+
 // end helper functions
 
 // Mirror input image horizontally.
@@ -240,6 +304,14 @@ int imgproc_tile(struct Image *input_img, int n, struct Image *output_img) {
 //   output_img - pointer to the output Image (in which the transformed
 //                pixels should be stored)
 void imgproc_grayscale( struct Image *input_img, struct Image *output_img ) {
+    // the grayscale preset of the color pipeline uses the same weights
+    // as to_grayscale, and runs vectorized on multiple threads
+    struct ColorPipeline pipeline;
+    color_pipeline_init(&pipeline);
+    color_pipeline_grayscale(&pipeline);
+    if (imgproc_color_pipeline(&pipeline, input_img, output_img))
+        return;
+
     for (int i = 0; i < input_img->width * input_img->height; i++) {
         
         uint32_t pixel = input_img->data[i];
@@ -5,10 +5,12 @@
 #include <stdbool.h>
 #include <string.h>
 #include "imgproc.h"
+#include "tune.h"
 
 void usage( const char *progname ) {
   fprintf( stderr, "Error: invalid command-line arguments\n" );
   fprintf( stderr, "Usage: %s <transform> <input img> <output img> [args...]\n", progname );
+  fprintf( stderr, "(use - as the input or output image to read stdin or write stdout)\n" );
   exit( 1 );
 }
 
@@ -34,6 +36,32 @@ struct Image *create_output_img( struct Image *input_img ) {
   return out_img;
 }
 
+// Replace the pixel buffer of given Image object with one for an image
+// of the specified dimensions (for transformations whose output isn't
+// the same size as their input)
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the IMG_ERR_* values
+int resize_output_img( struct Image *img, int32_t width, int32_t height ) {
+  img_cleanup( img );
+  img->data = NULL;
+  return img_init( img, width, height );
+}
+
+// Read an image from the named file, or from stdin if the name is "-"
+int read_img( const char *filename, struct Image *img ) {
+  if ( strcmp( filename, "-" ) == 0 )
+    return img_read_file( stdin, img );
+  return img_read( filename, img );
+}
+
+// Write an image to the named file, or to stdout if the name is "-"
+int write_img( const char *filename, struct Image *img ) {
+  if ( strcmp( filename, "-" ) == 0 )
+    return img_write_file( stdout, img, IMG_FORMAT_AUTO );
+  return img_write( filename, img );
+}
+
 // Free memory allocated to given Image object
 void cleanup_image( struct Image *img ) {
   if ( img != NULL ) {
@@ -50,13 +78,24 @@ int main( int argc, char **argv ) {
   const char *input_filename = argv[2];
   const char *output_filename = argv[3];
 
+  // Load the tuning profile written by imgproc_tune, if there is one
+  // (a missing default profile just means the defaults are used)
+  struct TuneProfile profile;
+  const char *profile_filename = getenv( "IMGPROC_PROFILE" );
+  if ( profile_filename != NULL ) {
+    if ( !tune_profile_load( &profile, profile_filename ) )
+      fprintf( stderr, "Warning: couldn't load tuning profile %s\n", profile_filename );
+  } else {
+    tune_profile_load( &profile, TUNE_DEFAULT_PROFILE );
+  }
+
   // Allocate and read the input image
   struct Image *input_img = (struct Image *) malloc( sizeof( struct Image ) );
   if ( input_img == NULL ) {
     fprintf( stderr, "Error: couldn't allocate input image\n" );
     exit( 1 );
   }
-  if ( img_read( input_filename, input_img ) != IMG_SUCCESS ) {
+  if ( read_img( input_filename, input_img ) != IMG_SUCCESS ) {
     fprintf( stderr, "Error: couldn't read input image\n" );
     free( input_img );
     return 1;
@@ -70,6 +109,9 @@ int main( int argc, char **argv ) {
     return 1;
   }
 
+  // Configure threads and bands for this transformation and image size
+  tune_profile_apply( &profile, transformation, (long) input_img->width * input_img->height );
+
   // Set to true if an error occurs
   bool error_occurred = false;
 
@@ -115,7 +157,7 @@ int main( int argc, char **argv ) {
         // will work correctly even if overlay image can't be read
         overlay_img->data = NULL;
 
-        if ( img_read( argv[4], overlay_img ) != IMG_SUCCESS ) {
+        if ( read_img( argv[4], overlay_img ) != IMG_SUCCESS ) {
           fprintf( stderr, "Error: could not read overlay image\n" );
           error_occurred = true;
         } else {
@@ -129,6 +171,87 @@ int main( int argc, char **argv ) {
       // ensure memory of overlay image is cleaned up
       cleanup_image( overlay_img );
     }
+  } else if ( strcmp( transformation, "transpose" ) == 0 ||
+              strcmp( transformation, "rotate90" ) == 0 ||
+              strcmp( transformation, "rotate270" ) == 0 ) {
+    // output has the input's dimensions swapped
+    if ( resize_output_img( output_img, input_img->height, input_img->width ) != IMG_SUCCESS ) {
+      fprintf( stderr, "Error: couldn't create output image object\n" );
+      error_occurred = true;
+    } else {
+      int success;
+      if ( strcmp( transformation, "transpose" ) == 0 )
+        success = imgproc_transpose( input_img, output_img );
+      else if ( strcmp( transformation, "rotate90" ) == 0 )
+        success = imgproc_rotate90( input_img, output_img );
+      else
+        success = imgproc_rotate270( input_img, output_img );
+      if ( !success ) {
+        fprintf( stderr, "Error: %s transformation failed\n", transformation );
+        error_occurred = true;
+      }
+    }
+  } else if ( strcmp( transformation, "rotate180" ) == 0 ) {
+    if ( !imgproc_rotate180( input_img, output_img ) ) {
+      fprintf( stderr, "Error: rotate180 transformation failed\n" );
+      error_occurred = true;
+    }
+  } else if ( strcmp( transformation, "equalize" ) == 0 ) {
+    if ( !imgproc_equalize( input_img, output_img ) ) {
+      fprintf( stderr, "Error: equalize transformation failed\n" );
+      error_occurred = true;
+    }
+  } else if ( strcmp( transformation, "autolevel" ) == 0 ) {
+    double clip = 0.0;
+    if ( argc > 5 ) {
+      fprintf( stderr, "Error: autolevel transformation takes at most one argument\n" );
+      error_occurred = true;
+    } else if ( argc == 5 && sscanf( argv[4], "%lf", &clip ) != 1 ) {
+      fprintf( stderr, "Error: could not parse clip fraction\n" );
+      error_occurred = true;
+    } else if ( !imgproc_autolevel( input_img, clip, output_img ) ) {
+      fprintf( stderr, "Error: autolevel transformation failed\n" );
+      error_occurred = true;
+    }
+  } else if ( strcmp( transformation, "color" ) == 0 ) {
+    struct ColorPipeline pipeline;
+    color_pipeline_init( &pipeline );
+    if ( argc != 5 ) {
+      fprintf( stderr, "Error: color transformation needs pipeline specification argument\n" );
+      error_occurred = true;
+    } else if ( !color_pipeline_parse( &pipeline, argv[4] ) ) {
+      fprintf( stderr, "Error: invalid color pipeline '%s'\n", argv[4] );
+      error_occurred = true;
+    } else if ( !imgproc_color_pipeline( &pipeline, input_img, output_img ) ) {
+      fprintf( stderr, "Error: color transformation failed\n" );
+      error_occurred = true;
+    }
+  } else if ( strcmp( transformation, "resize" ) == 0 ) {
+    int w, h, filter = IMGPROC_FILTER_LANCZOS3;
+    if ( argc != 6 && argc != 7 ) {
+      fprintf( stderr, "Error: resize transformation needs width and height arguments\n" );
+      error_occurred = true;
+    } else if ( sscanf( argv[4], "%d", &w ) != 1 || sscanf( argv[5], "%d", &h ) != 1 || w < 1 || h < 1 ) {
+      fprintf( stderr, "Error: could not parse resize dimensions\n" );
+      error_occurred = true;
+    } else if ( argc == 7 && strcmp( argv[6], "box" ) == 0 ) {
+      filter = IMGPROC_FILTER_BOX;
+    } else if ( argc == 7 && strcmp( argv[6], "bilinear" ) == 0 ) {
+      filter = IMGPROC_FILTER_BILINEAR;
+    } else if ( argc == 7 && strcmp( argv[6], "lanczos3" ) != 0 ) {
+      fprintf( stderr, "Error: unknown resize filter '%s'\n", argv[6] );
+      error_occurred = true;
+    }
+
+    if ( !error_occurred ) {
+      if ( resize_output_img( output_img, w, h ) != IMG_SUCCESS ) {
+        fprintf( stderr, "Error: couldn't create output image object\n" );
+        error_occurred = true;
+      } else if ( !imgproc_resize( input_img, filter, output_img ) ) {
+        fprintf( stderr, "Error: resize transformation failed\n" );
+        error_occurred = true;
+      }
+    }
   } else {
     fprintf( stderr, "Error: unknown transformation '%s'\n", transformation );
     error_occurred = true;
@@ -136,7 +259,7 @@ int main( int argc, char **argv ) {
 
   if ( !error_occurred ) {
     // Write output image
-    if ( img_write( output_filename, output_img ) != IMG_SUCCESS ) {
+    if ( write_img( output_filename, output_img ) != IMG_SUCCESS ) {
       fprintf( stderr, "Error: couldn't write output image\n" );
       error_occurred = true;
     }
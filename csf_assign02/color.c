@@ -0,0 +1,489 @@
+// color.c
+
+// Color pipelines: chains of per-channel adjustments compiled into
+// lookup tables, plus an optional 3x3 channel mixing matrix, applied
+// to an image in a single pass
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "imgproc.h"
+#include "parallel.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_AVX2_KERNELS 1
+#endif
+
+// number of pixels per band handed to a thread
+#define COLOR_BAND_PIXELS 65536
+
+// number of pixels run through all of the pipeline stages at once
+// (small enough that they stay in L1 cache between stages)
+#define COLOR_CHUNK_PIXELS 256
+
+// the mixing matrix is applied in fixed point with this many fraction bits
+#define MATRIX_BITS 8
+
+// A compiled pipeline: lookup tables expanded so that each entry is
+// already shifted into its channel's position in a pixel, and the
+// quantized mixing matrix
+struct ColorJob {
+  const uint32_t *src;
+  uint32_t *dst;
+  int use_pre, use_matrix, use_post;
+  uint32_t pre[4][256];
+  int32_t matrix[3][3];
+  uint32_t post[4][256];
+};
+
+////////////////////////////////////////////////////////////////////////
+// Kernels
+////////////////////////////////////////////////////////////////////////
+
+static void expand_lut( const uint8_t lut[4][256], uint32_t table[4][256] ) {
+  for ( int v = 0; v < 256; v++ ) {
+    table[0][v] = (uint32_t) lut[0][v] << 24;
+    table[1][v] = (uint32_t) lut[1][v] << 16;
+    table[2][v] = (uint32_t) lut[2][v] << 8;
+    table[3][v] = lut[3][v];
+  }
+}
+
+static void lut_span_scalar( const uint32_t table[4][256], const uint32_t *src, uint32_t *dst, int n ) {
+  for ( int i = 0; i < n; i++ ) {
+    uint32_t p = src[i];
+    dst[i] = table[0][p >> 24] | table[1][( p >> 16 ) & 0xFF]
+           | table[2][( p >> 8 ) & 0xFF] | table[3][p & 0xFF];
+  }
+}
+
+#ifdef HAVE_AVX2_KERNELS
+// Eight pixels at a time: one gather per channel from the expanded tables
+__attribute__(( target( "avx2" ) ))
+static void lut_span_avx2( const uint32_t table[4][256], const uint32_t *src, uint32_t *dst, int n ) {
+  const __m256i mask = _mm256_set1_epi32( 0xFF );
+  const int *t0 = (const int *) table[0], *t1 = (const int *) table[1];
+  const int *t2 = (const int *) table[2], *t3 = (const int *) table[3];
+  int i = 0;
+
+  for ( ; i + 7 < n; i += 8 ) {
+    __m256i p = _mm256_loadu_si256( (const __m256i *) ( src + i ) );
+    __m256i r = _mm256_i32gather_epi32( t0, _mm256_srli_epi32( p, 24 ), 4 );
+    __m256i g = _mm256_i32gather_epi32( t1, _mm256_and_si256( _mm256_srli_epi32( p, 16 ), mask ), 4 );
+    __m256i b = _mm256_i32gather_epi32( t2, _mm256_and_si256( _mm256_srli_epi32( p, 8 ), mask ), 4 );
+    __m256i a = _mm256_i32gather_epi32( t3, _mm256_and_si256( p, mask ), 4 );
+    __m256i out = _mm256_or_si256( _mm256_or_si256( r, g ), _mm256_or_si256( b, a ) );
+    _mm256_storeu_si256( (__m256i *) ( dst + i ), out );
+  }
+
+  lut_span_scalar( table, src + i, dst + i, n - i );
+}
+#endif
+
+static void lut_span( const uint32_t table[4][256], const uint32_t *src, uint32_t *dst, int n ) {
+#ifdef HAVE_AVX2_KERNELS
+  if ( __builtin_cpu_supports( "avx2" ) ) {
+    lut_span_avx2( table, src, dst, n );
+    return;
+  }
+#endif
+  lut_span_scalar( table, src, dst, n );
+}
+
+static inline uint32_t clamp_channel( int32_t v ) {
+  if ( v < 0 )
+    return 0;
+  return v > 255 ? 255 : (uint32_t) v;
+}
+
+// Multiply the color channels of each pixel by the mixing matrix
+// (alpha passes through unchanged)
+static void matrix_span( const int32_t m[3][3], const uint32_t *src, uint32_t *dst, int n ) {
+  int i = 0;
+
+#ifdef __SSE2__
+  // four pixels at a time, one channel per vector of 32 bit lanes; the
+  // coefficients only occupy the low 16 bits of each lane, so a 16 bit
+  // multiply-add yields channel * coefficient exactly
+  __m128i k[3][3];
+  for ( int o = 0; o < 3; o++ )
+    for ( int c = 0; c < 3; c++ )
+      k[o][c] = _mm_set1_epi32( m[o][c] & 0xFFFF );
+  const __m128i mask = _mm_set1_epi32( 0xFF );
+
+  for ( ; i + 3 < n; i += 4 ) {
+    __m128i p = _mm_loadu_si128( (const __m128i *) ( src + i ) );
+    __m128i r = _mm_srli_epi32( p, 24 );
+    __m128i g = _mm_and_si128( _mm_srli_epi32( p, 16 ), mask );
+    __m128i b = _mm_and_si128( _mm_srli_epi32( p, 8 ), mask );
+    __m128i a = _mm_and_si128( p, mask );
+
+    __m128i out[3];
+    for ( int o = 0; o < 3; o++ ) {
+      __m128i sum = _mm_add_epi32( _mm_madd_epi16( r, k[o][0] ), _mm_madd_epi16( g, k[o][1] ) );
+      sum = _mm_add_epi32( sum, _mm_madd_epi16( b, k[o][2] ) );
+      out[o] = _mm_srai_epi32( sum, MATRIX_BITS );
+    }
+
+    // clamp to bytes laid out as a0..a3 g0..g3 b0..b3 r0..r3, then
+    // interleave them back into pixels
+    __m128i x = _mm_packus_epi16( _mm_packs_epi32( a, out[1] ), _mm_packs_epi32( out[2], out[0] ) );
+    x = _mm_unpacklo_epi8( x, _mm_unpackhi_epi64( x, x ) );
+    x = _mm_unpacklo_epi16( x, _mm_srli_si128( x, 8 ) );
+    _mm_storeu_si128( (__m128i *) ( dst + i ), x );
+  }
+#endif
+
+  for ( ; i < n; i++ ) {
+    uint32_t p = src[i];
+    int32_t in[3] = { (int32_t) get_r( p ), (int32_t) get_g( p ), (int32_t) get_b( p ) };
+    uint32_t out[3];
+    for ( int o = 0; o < 3; o++ )
+      out[o] = clamp_channel( ( m[o][0] * in[0] + m[o][1] * in[1] + m[o][2] * in[2] ) >> MATRIX_BITS );
+    dst[i] = make_pixel( out[0], out[1], out[2], get_a( p ) );
+  }
+}
+
+// Run pixels [begin, end) through every stage of the pipeline, a chunk at
+// a time, so that each pixel is read from and written to memory only once
+static void color_band( void *arg, int begin, int end ) {
+  const struct ColorJob *job = arg;
+
+  for ( int i = begin; i < end; i += COLOR_CHUNK_PIXELS ) {
+    int n = end - i < COLOR_CHUNK_PIXELS ? end - i : COLOR_CHUNK_PIXELS;
+    const uint32_t *src = job->src + i;
+    uint32_t *dst = job->dst + i;
+
+    if ( job->use_pre ) {
+      lut_span( job->pre, src, dst, n );
+      src = dst;
+    }
+    if ( job->use_matrix ) {
+      matrix_span( job->matrix, src, dst, n );
+      src = dst;
+    }
+    if ( job->use_post ) {
+      lut_span( job->post, src, dst, n );
+      src = dst;
+    }
+    if ( src != dst )
+      memcpy( dst, src, n * sizeof( uint32_t ) );
+  }
+}
+
+static int is_identity_lut( const uint8_t lut[4][256] ) {
+  for ( int c = 0; c < 4; c++ )
+    for ( int v = 0; v < 256; v++ )
+      if ( lut[c][v] != v )
+        return 0;
+  return 1;
+}
+
+static void run_job( struct ColorJob *job, struct Image *input_img, struct Image *output_img ) {
+  job->src = input_img->data;
+  job->dst = output_img->data;
+  imgproc_parallel_for( input_img->width * input_img->height, COLOR_BAND_PIXELS, color_band, job );
+}
+
+void imgproc_apply_lut( struct Image *input_img, const uint8_t lut[4][256], struct Image *output_img ) {
+  struct ColorJob *job = malloc( sizeof( struct ColorJob ) );
+
+  if ( job == NULL ) {
+    // not enough memory for the expanded tables, so look up directly
+    int num_pixels = input_img->width * input_img->height;
+    for ( int i = 0; i < num_pixels; i++ ) {
+      uint32_t p = input_img->data[i];
+      output_img->data[i] = make_pixel( lut[0][get_r( p )], lut[1][get_g( p )],
+                                        lut[2][get_b( p )], lut[3][get_a( p )] );
+    }
+    return;
+  }
+
+  job->use_pre = 1;
+  job->use_matrix = job->use_post = 0;
+  expand_lut( lut, job->pre );
+  run_job( job, input_img, output_img );
+  free( job );
+}
+
+int imgproc_color_pipeline( const struct ColorPipeline *pipeline, struct Image *input_img,
+                            struct Image *output_img ) {
+  struct ColorJob *job = malloc( sizeof( struct ColorJob ) );
+  if ( job == NULL )
+    return 0;
+
+  // stages that wouldn't change anything are skipped entirely
+  job->use_pre = !is_identity_lut( pipeline->pre_lut );
+  job->use_matrix = pipeline->has_matrix;
+  job->use_post = pipeline->has_matrix && !is_identity_lut( pipeline->post_lut );
+
+  if ( job->use_pre )
+    expand_lut( pipeline->pre_lut, job->pre );
+  if ( job->use_post )
+    expand_lut( pipeline->post_lut, job->post );
+  for ( int o = 0; o < 3; o++ )
+    for ( int c = 0; c < 3; c++ )
+      job->matrix[o][c] = (int32_t) lrint( pipeline->matrix[o][c] * ( 1 << MATRIX_BITS ) );
+
+  run_job( job, input_img, output_img );
+  free( job );
+  return 1;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Building pipelines
+////////////////////////////////////////////////////////////////////////
+
+void color_pipeline_init( struct ColorPipeline *pipeline ) {
+  for ( int c = 0; c < 4; c++ ) {
+    for ( int v = 0; v < 256; v++ ) {
+      pipeline->pre_lut[c][v] = v;
+      pipeline->post_lut[c][v] = v;
+    }
+  }
+  pipeline->has_matrix = 0;
+  for ( int o = 0; o < 3; o++ )
+    for ( int c = 0; c < 3; c++ )
+      pipeline->matrix[o][c] = ( o == c ) ? 1.0 : 0.0;
+}
+
+// Compose a per-channel function after everything already in the
+// pipeline: before the matrix it folds into the pre-matrix tables,
+// after it into the post-matrix tables
+static void compose( struct ColorPipeline *pipeline, int channels,
+                     double (*fn)( double v, const double *param ), const double *param ) {
+  uint8_t (*lut)[256] = pipeline->has_matrix ? pipeline->post_lut : pipeline->pre_lut;
+
+  for ( int c = 0; c < 4; c++ ) {
+    if ( !( channels & ( 1 << c ) ) )
+      continue;
+    for ( int v = 0; v < 256; v++ ) {
+      long out = lrint( fn( lut[c][v], param ) );
+      lut[c][v] = out < 0 ? 0 : out > 255 ? 255 : (uint8_t) out;
+    }
+  }
+}
+
+static double gamma_fn( double v, const double *param ) {
+  return 255.0 * pow( v / 255.0, 1.0 / param[0] );
+}
+
+static double brightness_fn( double v, const double *param ) {
+  return v + param[0];
+}
+
+static double contrast_fn( double v, const double *param ) {
+  return ( v - 128.0 ) * param[0] + 128.0;
+}
+
+static double invert_fn( double v, const double *param ) {
+  (void) param;
+  return 255.0 - v;
+}
+
+// param holds the number of points followed by their x, y pairs
+static double curve_fn( double v, const double *param ) {
+  int n = (int) param[0];
+  const double *pt = param + 1;
+
+  if ( v <= pt[0] )
+    return pt[1];
+  for ( int i = 1; i < n; i++ ) {
+    double x0 = pt[2 * i - 2], y0 = pt[2 * i - 1];
+    double x1 = pt[2 * i], y1 = pt[2 * i + 1];
+    if ( v <= x1 )
+      return x1 == x0 ? y1 : y0 + ( y1 - y0 ) * ( v - x0 ) / ( x1 - x0 );
+  }
+  return pt[2 * n - 1];
+}
+
+int color_pipeline_gamma( struct ColorPipeline *pipeline, int channels, double gamma ) {
+  if ( !( gamma > 0.0 ) )
+    return 0;
+  compose( pipeline, channels, gamma_fn, &gamma );
+  return 1;
+}
+
+void color_pipeline_brightness( struct ColorPipeline *pipeline, int channels, int delta ) {
+  double param = delta;
+  compose( pipeline, channels, brightness_fn, &param );
+}
+
+int color_pipeline_contrast( struct ColorPipeline *pipeline, int channels, double factor ) {
+  if ( factor < 0.0 )
+    return 0;
+  compose( pipeline, channels, contrast_fn, &factor );
+  return 1;
+}
+
+void color_pipeline_invert( struct ColorPipeline *pipeline, int channels ) {
+  compose( pipeline, channels, invert_fn, NULL );
+}
+
+int color_pipeline_curve( struct ColorPipeline *pipeline, int channels,
+                          const uint8_t points[][2], int num_points ) {
+  if ( num_points < 1 || num_points > 256 )
+    return 0;
+
+  double param[1 + 2 * 256];
+  param[0] = num_points;
+  for ( int i = 0; i < num_points; i++ ) {
+    if ( i > 0 && points[i][0] < points[i - 1][0] )
+      return 0; // points must be in order of increasing input value
+    param[1 + 2 * i] = points[i][0];
+    param[2 + 2 * i] = points[i][1];
+  }
+  compose( pipeline, channels, curve_fn, param );
+  return 1;
+}
+
+int color_pipeline_mix( struct ColorPipeline *pipeline, const double mix[3][3] ) {
+  // tables after the matrix can't be moved past another matrix
+  if ( pipeline->has_matrix && !is_identity_lut( pipeline->post_lut ) )
+    return 0;
+
+  double product[3][3];
+  for ( int o = 0; o < 3; o++ ) {
+    for ( int c = 0; c < 3; c++ ) {
+      product[o][c] = 0.0;
+      for ( int k = 0; k < 3; k++ )
+        product[o][c] += mix[o][k] * pipeline->matrix[k][c];
+      // coefficients must fit in 16 bits once converted to fixed point
+      if ( fabs( product[o][c] ) >= 127.0 )
+        return 0;
+    }
+  }
+
+  memcpy( pipeline->matrix, product, sizeof( product ) );
+  pipeline->has_matrix = 1;
+  return 1;
+}
+
+int color_pipeline_swap( struct ColorPipeline *pipeline, const char *order ) {
+  static const char names[] = "rgb";
+  double mix[3][3] = { { 0 } };
+
+  if ( strlen( order ) != 3 )
+    return 0;
+  for ( int o = 0; o < 3; o++ ) {
+    const char *src = strchr( names, order[o] );
+    if ( order[o] == '\0' || src == NULL )
+      return 0;
+    mix[o][src - names] = 1.0;
+  }
+  return color_pipeline_mix( pipeline, (const double (*)[3]) mix );
+}
+
+int color_pipeline_grayscale( struct ColorPipeline *pipeline ) {
+  // the same weights as to_grayscale: (79*r + 128*g + 49*b) / 256
+  static const double gray[3][3] = {
+    { 79 / 256.0, 128 / 256.0, 49 / 256.0 },
+    { 79 / 256.0, 128 / 256.0, 49 / 256.0 },
+    { 79 / 256.0, 128 / 256.0, 49 / 256.0 },
+  };
+  return color_pipeline_mix( pipeline, gray );
+}
+
+// Parse an optional "<channels>:" prefix of a pipeline step
+static const char *parse_channels( const char *step, int *channels ) {
+  const char *colon = strchr( step, ':' ), *eq = strchr( step, '=' );
+  *channels = IMGPROC_CHANNELS_RGB;
+  if ( colon == NULL || ( eq != NULL && eq < colon ) )
+    return step;
+
+  *channels = 0;
+  for ( const char *p = step; p < colon; p++ ) {
+    switch ( *p ) {
+    case 'r': *channels |= IMGPROC_CHANNEL_R; break;
+    case 'g': *channels |= IMGPROC_CHANNEL_G; break;
+    case 'b': *channels |= IMGPROC_CHANNEL_B; break;
+    case 'a': *channels |= IMGPROC_CHANNEL_A; break;
+    default: return NULL;
+    }
+  }
+  return colon + 1;
+}
+
+// Parse "x:y/x:y/..." curve control points
+static int parse_curve( struct ColorPipeline *pipeline, int channels, const char *arg ) {
+  uint8_t points[256][2];
+  int n = 0;
+
+  while ( *arg != '\0' ) {
+    unsigned x, y;
+    int len;
+    if ( n == 256 || sscanf( arg, "%u:%u%n", &x, &y, &len ) != 2 || x > 255 || y > 255 )
+      return 0;
+    points[n][0] = x;
+    points[n][1] = y;
+    n++;
+    arg += len;
+    if ( *arg == '/' )
+      arg++;
+    else if ( *arg != '\0' )
+      return 0;
+  }
+  return color_pipeline_curve( pipeline, channels, (const uint8_t (*)[2]) points, n );
+}
+
+static int parse_step( struct ColorPipeline *pipeline, const char *step ) {
+  int channels;
+  step = parse_channels( step, &channels );
+  if ( step == NULL )
+    return 0;
+
+  const char *eq = strchr( step, '=' );
+  size_t name_len = eq != NULL ? (size_t) ( eq - step ) : strlen( step );
+  const char *arg = eq != NULL ? eq + 1 : NULL;
+  double value;
+  char extra;
+
+#define STEP_IS( name ) ( name_len == strlen( name ) && strncmp( step, name, name_len ) == 0 )
+  if ( STEP_IS( "gray" ) || STEP_IS( "grayscale" ) )
+    return arg == NULL && color_pipeline_grayscale( pipeline );
+  if ( STEP_IS( "invert" ) ) {
+    if ( arg != NULL )
+      return 0;
+    color_pipeline_invert( pipeline, channels );
+    return 1;
+  }
+  if ( arg == NULL )
+    return 0;
+  if ( STEP_IS( "swap" ) )
+    return color_pipeline_swap( pipeline, arg );
+  if ( STEP_IS( "curve" ) )
+    return parse_curve( pipeline, channels, arg );
+  if ( sscanf( arg, "%lf%c", &value, &extra ) != 1 )
+    return 0;
+  if ( STEP_IS( "gamma" ) )
+    return color_pipeline_gamma( pipeline, channels, value );
+  if ( STEP_IS( "contrast" ) )
+    return color_pipeline_contrast( pipeline, channels, value );
+  if ( STEP_IS( "brightness" ) ) {
+    color_pipeline_brightness( pipeline, channels, (int) lrint( value ) );
+    return 1;
+  }
+#undef STEP_IS
+
+  return 0;
+}
+
+int color_pipeline_parse( struct ColorPipeline *pipeline, const char *spec ) {
+  char step[1024];
+
+  while ( *spec != '\0' ) {
+    size_t len = strcspn( spec, "," );
+    if ( len == 0 || len >= sizeof( step ) )
+      return 0;
+    memcpy( step, spec, len );
+    step[len] = '\0';
+    if ( !parse_step( pipeline, step ) )
+      return 0;
+    spec += len;
+    if ( *spec == ',' )
+      spec++;
+  }
+  return 1;
+}
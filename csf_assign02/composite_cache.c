@@ -0,0 +1,180 @@
+// composite_cache.c
+
+// Incremental compositing: an overlay that changes a little between
+// frames only causes the changed parts of the output to be recomputed
+
+#include <stdlib.h>
+#include <string.h>
+#include "imgproc.h"
+#include "parallel.h"
+
+// overlays are compared in blocks of this many pixels (one 64 byte
+// cache line), and blocks are grouped into tiles this many rows high
+#define COMPOSITE_BLOCK_PIXELS 16
+#define COMPOSITE_TILE_ROWS 16
+
+static void copy_img( const struct Image *src, struct Image *dst ) {
+  memcpy( dst->data, src->data, (size_t) src->width * src->height * sizeof( uint32_t ) );
+}
+
+int composite_cache_init( struct CompositeCache *cache, struct Image *base_img ) {
+  int w = base_img->width, h = base_img->height;
+
+  memset( cache, 0, sizeof( *cache ) );
+  cache->tiles_x = ( w + COMPOSITE_BLOCK_PIXELS - 1 ) / COMPOSITE_BLOCK_PIXELS;
+  cache->tiles_y = ( h + COMPOSITE_TILE_ROWS - 1 ) / COMPOSITE_TILE_ROWS;
+  int num_tiles = cache->tiles_x * cache->tiles_y;
+
+  if ( img_init( &cache->base, w, h ) != IMG_SUCCESS ) {
+    cache->base.data = NULL;
+  }
+  if ( img_init( &cache->overlay, w, h ) != IMG_SUCCESS ) {
+    cache->overlay.data = NULL;
+  }
+  if ( img_init( &cache->output, w, h ) != IMG_SUCCESS ) {
+    cache->output.data = NULL;
+  }
+  cache->dirty = malloc( num_tiles > 0 ? num_tiles : 1 );
+  cache->dirty_rects = malloc( ( num_tiles > 0 ? num_tiles : 1 ) * sizeof( struct ImgRect ) );
+  cache->open_rects = malloc( ( 2 * cache->tiles_x + 1 ) * sizeof( int ) );
+
+  if ( cache->base.data == NULL || cache->overlay.data == NULL || cache->output.data == NULL ||
+       cache->dirty == NULL || cache->dirty_rects == NULL || cache->open_rects == NULL ) {
+    composite_cache_cleanup( cache );
+    return 0;
+  }
+
+  copy_img( base_img, &cache->base );
+  return 1;
+}
+
+void composite_cache_cleanup( struct CompositeCache *cache ) {
+  free( cache->base.data );
+  free( cache->overlay.data );
+  free( cache->output.data );
+  free( cache->dirty );
+  free( cache->dirty_rects );
+  free( cache->open_rects );
+  memset( cache, 0, sizeof( *cache ) );
+}
+
+// Composite a span of n pixels starting at index i, and remember the
+// overlay pixels it was computed from
+static void composite_span( struct CompositeCache *cache, const uint32_t *overlay, long i, int n ) {
+  const uint32_t *base = cache->base.data + i;
+  uint32_t *out = cache->output.data + i;
+
+  for ( int k = 0; k < n; k++ )
+    out[k] = create_composite_pixel( base[k], overlay[i + k] );
+  memcpy( cache->overlay.data + i, overlay + i, n * sizeof( uint32_t ) );
+}
+
+// Parameters of one update, shared by the threads working on it
+struct CompositeUpdate {
+  struct CompositeCache *cache;
+  const uint32_t *overlay;
+  int full;   // recomposite everything, without comparing
+};
+
+// Compare tile rows [begin, end) of the new overlay against the previous
+// one, a cache line at a time, and recomposite every tile that differs
+static void update_band( void *arg, int begin, int end ) {
+  struct CompositeUpdate *update = arg;
+  struct CompositeCache *cache = update->cache;
+  int w = cache->base.width, h = cache->base.height;
+
+  for ( int ty = begin; ty < end; ty++ ) {
+    int y0 = ty * COMPOSITE_TILE_ROWS;
+    int y1 = y0 + COMPOSITE_TILE_ROWS < h ? y0 + COMPOSITE_TILE_ROWS : h;
+
+    for ( int tx = 0; tx < cache->tiles_x; tx++ ) {
+      int x0 = tx * COMPOSITE_BLOCK_PIXELS;
+      int n = x0 + COMPOSITE_BLOCK_PIXELS < w ? COMPOSITE_BLOCK_PIXELS : w - x0;
+      int dirty = update->full;
+
+      for ( int y = y0; y < y1 && !dirty; y++ ) {
+        long i = (long) y * w + x0;
+        dirty = memcmp( update->overlay + i, cache->overlay.data + i, n * sizeof( uint32_t ) ) != 0;
+      }
+
+      cache->dirty[ty * cache->tiles_x + tx] = (uint8_t) dirty;
+      if ( dirty ) {
+        for ( int y = y0; y < y1; y++ )
+          composite_span( cache, update->overlay, (long) y * w + x0, n );
+      }
+    }
+  }
+}
+
+// Merge the dirty tiles into rectangles: runs of dirty tiles within a row
+// of tiles, extended downwards while the rows below have the same run.
+// Runs are found in order of increasing x, so the rectangles still open
+// from the previous row of tiles can be matched up in a single sweep.
+static void collect_dirty_rects( struct CompositeCache *cache ) {
+  int w = cache->base.width, h = cache->base.height;
+  int *open = cache->open_rects, *next_open = cache->open_rects + cache->tiles_x;
+  int num_open = 0;
+
+  cache->num_dirty_rects = 0;
+  cache->dirty_row_begin = cache->dirty_row_end = 0;
+
+  for ( int ty = 0; ty < cache->tiles_y; ty++ ) {
+    const uint8_t *row = cache->dirty + ty * cache->tiles_x;
+    int y0 = ty * COMPOSITE_TILE_ROWS;
+    int rows = y0 + COMPOSITE_TILE_ROWS < h ? COMPOSITE_TILE_ROWS : h - y0;
+    int num_next_open = 0, o = 0;
+
+    for ( int tx = 0; tx < cache->tiles_x; ) {
+      if ( !row[tx] ) {
+        tx++;
+        continue;
+      }
+      int run_end = tx;
+      while ( run_end < cache->tiles_x && row[run_end] )
+        run_end++;
+
+      int x0 = tx * COMPOSITE_BLOCK_PIXELS;
+      int x1 = run_end * COMPOSITE_BLOCK_PIXELS < w ? run_end * COMPOSITE_BLOCK_PIXELS : w;
+
+      // extend the open rectangle covering exactly the same columns, if any
+      while ( o < num_open && cache->dirty_rects[open[o]].x < x0 )
+        o++;
+      int r;
+      if ( o < num_open && cache->dirty_rects[open[o]].x == x0 &&
+           cache->dirty_rects[open[o]].width == x1 - x0 ) {
+        r = open[o];
+        cache->dirty_rects[r].height += rows;
+      } else {
+        r = cache->num_dirty_rects++;
+        cache->dirty_rects[r].x = x0;
+        cache->dirty_rects[r].y = y0;
+        cache->dirty_rects[r].width = x1 - x0;
+        cache->dirty_rects[r].height = rows;
+      }
+      next_open[num_next_open++] = r;
+
+      if ( cache->dirty_row_end == 0 )
+        cache->dirty_row_begin = y0;
+      cache->dirty_row_end = y0 + rows;
+      tx = run_end;
+    }
+
+    int *tmp = open;
+    open = next_open;
+    next_open = tmp;
+    num_open = num_next_open;
+  }
+}
+
+int imgproc_composite_update( struct CompositeCache *cache, struct Image *overlay_img ) {
+  if ( cache->base.data == NULL || overlay_img->width != cache->base.width ||
+       overlay_img->height != cache->base.height )
+    return 0;
+
+  struct CompositeUpdate update = { cache, overlay_img->data, !cache->has_overlay };
+  imgproc_parallel_for( cache->tiles_y, 1, update_band, &update );
+  cache->has_overlay = 1;
+
+  collect_dirty_rects( cache );
+  return 1;
+}
@@ -0,0 +1,167 @@
+// histogram.c
+
+// Per-channel histograms, and the equalize and autolevel
+// transformations built on them (the lookup tables they compute are
+// applied by imgproc_apply_lut in color.c)
+
+#include <stdlib.h>
+#include <string.h>
+#include "imgproc.h"
+#include "parallel.h"
+
+// number of pixels per band when computing histograms
+#define HISTOGRAM_BAND_PIXELS 65536
+
+// Partial histograms, one per band, merged once all bands are done.
+// Keeping a private copy per band means threads never write to the
+// same counters.
+struct HistogramJob {
+  const uint32_t *data;
+  int band_pixels;
+  struct Histogram *partial;
+};
+
+static void histogram_band( void *arg, int begin, int end ) {
+  struct HistogramJob *job = arg;
+
+  // two copies of the counters, for even and odd pixels, so that runs of
+  // identical pixels don't serialize on incrementing the same counter
+  uint32_t count[2][4][256];
+  memset( count, 0, sizeof( count ) );
+
+  const uint32_t *p = job->data;
+  int i = begin;
+  for ( ; i + 1 < end; i += 2 ) {
+    uint32_t a = p[i], b = p[i + 1];
+    count[0][0][a >> 24]++;
+    count[0][1][( a >> 16 ) & 0xFF]++;
+    count[0][2][( a >> 8 ) & 0xFF]++;
+    count[0][3][a & 0xFF]++;
+    count[1][0][b >> 24]++;
+    count[1][1][( b >> 16 ) & 0xFF]++;
+    count[1][2][( b >> 8 ) & 0xFF]++;
+    count[1][3][b & 0xFF]++;
+  }
+  if ( i < end ) {
+    uint32_t a = p[i];
+    count[0][0][a >> 24]++;
+    count[0][1][( a >> 16 ) & 0xFF]++;
+    count[0][2][( a >> 8 ) & 0xFF]++;
+    count[0][3][a & 0xFF]++;
+  }
+
+  struct Histogram *out = &job->partial[begin / job->band_pixels];
+  for ( int c = 0; c < 4; c++ )
+    for ( int v = 0; v < 256; v++ )
+      out->count[c][v] = count[0][c][v] + count[1][c][v];
+}
+
+int imgproc_histogram( struct Image *img, struct Histogram *hist ) {
+  int num_pixels = img->width * img->height;
+  // the bands imgproc_parallel_for will use, each with its own partial
+  // histogram
+  int band_pixels = imgproc_band_size( HISTOGRAM_BAND_PIXELS );
+  int num_bands = ( num_pixels + band_pixels - 1 ) / band_pixels;
+
+  memset( hist, 0, sizeof( *hist ) );
+  if ( num_bands == 0 )
+    return 1;
+
+  struct HistogramJob job = { img->data, band_pixels,
+                              malloc( num_bands * sizeof( struct Histogram ) ) };
+  if ( job.partial == NULL )
+    return 0;
+
+  imgproc_parallel_for( num_pixels, HISTOGRAM_BAND_PIXELS, histogram_band, &job );
+
+  for ( int b = 0; b < num_bands; b++ )
+    for ( int c = 0; c < 4; c++ )
+      for ( int v = 0; v < 256; v++ )
+        hist->count[c][v] += job.partial[b].count[c][v];
+
+  free( job.partial );
+  return 1;
+}
+
+// Alpha is never changed by equalize or autolevel
+static void identity_lut( uint8_t lut[256] ) {
+  for ( int v = 0; v < 256; v++ )
+    lut[v] = v;
+}
+
+int imgproc_equalize( struct Image *input_img, struct Image *output_img ) {
+  struct Histogram hist;
+  if ( !imgproc_histogram( input_img, &hist ) )
+    return 0;
+
+  uint8_t lut[4][256];
+  uint32_t total = (uint32_t) input_img->width * input_img->height;
+
+  for ( int c = 0; c < 3; c++ ) {
+    // map each value to its position in the cumulative distribution,
+    // so that the darkest value present becomes 0 and the brightest 255
+    uint32_t cdf_min = 0;
+    for ( int v = 0; v < 256 && cdf_min == 0; v++ )
+      cdf_min = hist.count[c][v];
+
+    if ( total == cdf_min ) {
+      identity_lut( lut[c] ); // only one value, nothing to spread out
+      continue;
+    }
+
+    uint64_t cdf = 0;
+    for ( int v = 0; v < 256; v++ ) {
+      cdf += hist.count[c][v];
+      uint64_t above = cdf > cdf_min ? cdf - cdf_min : 0;
+      lut[c][v] = (uint8_t) ( ( above * 255 + ( total - cdf_min ) / 2 ) / ( total - cdf_min ) );
+    }
+  }
+  identity_lut( lut[3] );
+
+  imgproc_apply_lut( input_img, (const uint8_t (*)[256]) lut, output_img );
+  return 1;
+}
+
+int imgproc_autolevel( struct Image *input_img, double clip, struct Image *output_img ) {
+  if ( clip < 0.0 || clip >= 0.5 )
+    return 0;
+
+  struct Histogram hist;
+  if ( !imgproc_histogram( input_img, &hist ) )
+    return 0;
+
+  uint8_t lut[4][256];
+  uint32_t total = (uint32_t) input_img->width * input_img->height;
+  uint32_t clip_count = (uint32_t) ( clip * total );
+
+  for ( int c = 0; c < 3; c++ ) {
+    // find the darkest and brightest values once clip_count pixels
+    // have been ignored at either end
+    int lo = 0, hi = 255;
+    uint32_t seen = 0;
+    while ( lo < 255 && seen + hist.count[c][lo] <= clip_count )
+      seen += hist.count[c][lo++];
+    seen = 0;
+    while ( hi > 0 && seen + hist.count[c][hi] <= clip_count )
+      seen += hist.count[c][hi--];
+
+    if ( hi <= lo ) {
+      identity_lut( lut[c] );
+      continue;
+    }
+
+    // stretch [lo, hi] linearly onto [0, 255]
+    for ( int v = 0; v < 256; v++ ) {
+      if ( v <= lo )
+        lut[c][v] = 0;
+      else if ( v >= hi )
+        lut[c][v] = 255;
+      else
+        lut[c][v] = (uint8_t) ( ( ( v - lo ) * 255 + ( hi - lo ) / 2 ) / ( hi - lo ) );
+    }
+  }
+  identity_lut( lut[3] );
+
+  imgproc_apply_lut( input_img, (const uint8_t (*)[256]) lut, output_img );
+  return 1;
+}
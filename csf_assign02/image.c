@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "pnglite.h"
 #include "image.h"
 
@@ -36,120 +37,464 @@ int img_init(struct Image *img, int32_t width, int32_t height) {
   return IMG_SUCCESS;
 }
 
-int img_read(const char *filename, struct Image *img) {
-  if (!png_init_called) {
-    png_init(0, 0);
-    png_init_called = 1;
+// Expand the raw pixel data of an 8 bit PNG, stored at the start of
+// pixel_data, into RGBA pixels in place. Working backwards from the last
+// pixel means no pixel is overwritten before it has been expanded.
+static void expand_pixels(png_t *png, uint32_t *pixel_data, int num_pixels) {
+  const unsigned char *raw = (const unsigned char *) pixel_data;
+
+  switch (png->color_type) {
+  case PNG_GREYSCALE:
+    for (int i = num_pixels - 1; i >= 0; i--) {
+      uint32_t v = raw[i];
+      pixel_data[i] = (v << 24) | (v << 16) | (v << 8) | 0xFF;
+    }
+    break;
+
+  case PNG_GREYSCALE_ALPHA:
+    for (int i = num_pixels - 1; i >= 0; i--) {
+      uint32_t v = raw[i*2];
+      pixel_data[i] = (v << 24) | (v << 16) | (v << 8) | raw[i*2 + 1];
+    }
+    break;
+
+  case PNG_INDEXED: {
+    // entries missing from the palette are opaque black
+    uint32_t palette[256];
+    for (unsigned i = 0; i < 256; i++) {
+      uint32_t a = (i < png->trns_len) ? png->trns[i] : 255;
+      if (i < png->palette_len) {
+        const unsigned char *rgb = png->palette + i*3;
+        palette[i] = (rgb[0] << 24) | (rgb[1] << 16) | (rgb[2] << 8) | a;
+      } else {
+        palette[i] = 0x000000FFU;
+      }
+    }
+    for (int i = num_pixels - 1; i >= 0; i--) {
+      pixel_data[i] = palette[raw[i]];
+    }
+    break;
   }
 
-  png_t png;
+  case PNG_TRUECOLOR:
+    for (int i = num_pixels - 1; i >= 0; i--) {
+      unsigned char r = raw[i*3 + 0];
+      unsigned char g = raw[i*3 + 1];
+      unsigned char b = raw[i*3 + 2];
+      pixel_data[i] = (r << 24) | (g << 16) | (b << 8) | 0xFF;
+    }
+    break;
 
-  if (png_open_file_read(&png, filename) != PNG_NO_ERROR) {
-    return IMG_ERR_COULD_NOT_OPEN;
+  default:
+    // PNG pixel data is already in the correct format,
+    // except that the RGBA data is in big-endian form, so we
+    // need to byteswap if on a little endian system
+    if (is_little_endian()) {
+      for (int i = 0; i < num_pixels; i++) {
+        pixel_data[i] = byteswap(pixel_data[i]);
+      }
+    }
+    break;
+  }
+}
+
+static void init_png(void) {
+  if (!png_init_called) {
+    png_init(0, 0);
+    png_init_called = 1;
   }
+}
 
-  // only allow truecolor 8bpp images
-  if (!(png.color_type == PNG_TRUECOLOR && png.bpp == 3) &&
-      !(png.color_type == PNG_TRUECOLOR_ALPHA && png.bpp == 4)) {
-    png_close_file(&png);
+// Decode the image of a png_t that has been opened for reading
+static int read_png(png_t *png, struct Image *img) {
+  // only allow 8 bits per channel (grayscale, palette, or truecolor,
+  // with or without alpha)
+  if (png->depth != 8) {
     return IMG_ERR_NOT_TRUECOLOR;
   }
 
-  int num_pixels = png.width * png.height;
+  int num_pixels = png->width * png->height;
 
-  // allocate buffer for pixel data in truecolor RGBA format
+  // allocate buffer for pixel data in truecolor RGBA format, which is
+  // also large enough for the raw data in any of the other formats
   uint32_t *pixel_data = (uint32_t *) malloc(num_pixels * sizeof(uint32_t));
+  if (pixel_data == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
 
-  if (png.color_type == PNG_TRUECOLOR) {
-    // PNG pixel data is in RGB form, expand it to add the alpha channel
+  if (png_get_data(png, (unsigned char *) pixel_data) != PNG_NO_ERROR) {
+    free(pixel_data);
+    return IMG_ERR_MALLOC_FAILED;
+  }
 
-    unsigned char *pixel_data_raw = (unsigned char *) malloc(num_pixels * 3);
-    if (png_get_data(&png, pixel_data_raw) != PNG_NO_ERROR) {
-      png_close_file(&png);
-      free(pixel_data);
-      return IMG_ERR_MALLOC_FAILED;
-    }
+  expand_pixels(png, pixel_data, num_pixels);
 
-    for (int i = 0; i < num_pixels; i++) {
-      unsigned char r = pixel_data_raw[i*3 + 0];
-      unsigned char g = pixel_data_raw[i*3 + 1];
-      unsigned char b = pixel_data_raw[i*3 + 2];
-      unsigned char a = 255;
+  // communicate pixel data and image dimensions to caller
+  img->data = pixel_data;
+  img->width = png->width;
+  img->height = png->height;
 
-      pixel_data[i] = (r << 24) | (g << 16) | (b << 8) | a;
-    }
+  return IMG_SUCCESS;
+}
 
-    free(pixel_data_raw);
-  } else {
-    // PNG pixel data is already in the correct format,
-    // except that the RGBA data is in big-endian form, so we
-    // need to byteswap if on a little endian system
-    if (png_get_data(&png, (unsigned char *) pixel_data) != PNG_NO_ERROR) {
-      png_close_file(&png);
-      free(pixel_data);
-      return IMG_ERR_MALLOC_FAILED;
-    }
+// pnglite read callback for streams. pnglite skips unknown chunks by
+// asking for data with a null output buffer, which it would otherwise do
+// with fseek, and pipes can't seek.
+static unsigned stream_read(void *output, size_t size, size_t numel, void *user_pointer) {
+  FILE *in = (FILE *) user_pointer;
+  if (output != NULL) {
+    return (unsigned) fread(output, size, numel, in);
+  }
 
-    if (is_little_endian()) {
-      for (int i = 0; i < num_pixels; i++) {
-        pixel_data[i] = byteswap(pixel_data[i]);
-      }
+  unsigned char discard[4096];
+  size_t remaining = size * numel;
+  while (remaining > 0) {
+    size_t n = remaining < sizeof(discard) ? remaining : sizeof(discard);
+    if (fread(discard, 1, n, in) != n) {
+      return 0;
     }
+    remaining -= n;
   }
+  return (unsigned) numel;
+}
 
-  // communicate pixel data and image dimensions to caller
-  img->data = pixel_data;
-  img->width = png.width;
-  img->height = png.height;
+// Current position in PNG data being read from memory
+struct MemReader {
+  const unsigned char *data;
+  size_t size;
+  size_t pos;
+};
 
-  png_close_file(&png);
+static unsigned mem_read(void *output, size_t size, size_t numel, void *user_pointer) {
+  struct MemReader *reader = (struct MemReader *) user_pointer;
 
-  return IMG_SUCCESS;
+  // like fread, only whole elements are read
+  size_t available = (reader->size - reader->pos) / size;
+  if (numel > available) {
+    numel = available;
+  }
+  if (output != NULL) {
+    memcpy(output, reader->data + reader->pos, size * numel);
+  }
+  reader->pos += size * numel;
+  return (unsigned) numel;
 }
 
-int img_write(const char *filename, struct Image *img) {
-  if (!png_init_called) {
-    png_init(0, 0);
-    png_init_called = 1;
+int img_read(const char *filename, struct Image *img) {
+  FILE *in = fopen(filename, "rb");
+  if (in == NULL) {
+    return IMG_ERR_COULD_NOT_OPEN;
   }
 
+  int rc = img_read_file(in, img);
+  fclose(in);
+  return rc;
+}
+
+int img_read_file(FILE *in, struct Image *img) {
+  init_png();
+
   png_t png;
 
-  if (png_open_file_write(&png, filename) != PNG_NO_ERROR) {
+  if (png_open_read(&png, stream_read, in) != PNG_NO_ERROR) {
     return IMG_ERR_COULD_NOT_OPEN;
   }
 
-  // if this is a little endian system, we need to byteswap
-  // every uint32_t so that it can be written in big-endian order
-  // (which is what PNG requires)
+  return read_png(&png, img);
+}
+
+int img_read_mem(const void *data, size_t size, struct Image *img) {
+  init_png();
+
+  png_t png;
+  struct MemReader reader = { (const unsigned char *) data, size, 0 };
 
-  uint32_t *data_to_write = img->data;
+  if (png_open_read(&png, mem_read, &reader) != PNG_NO_ERROR) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  return read_png(&png, img);
+}
+
+// number of slots in the hash table used to build a palette
+// (at least twice the 256 colors it can hold, to keep probe chains short)
+#define PALETTE_SLOTS 1024
+
+// What is known about an image's pixels, gathered while converting
+// them to big-endian order for writing
+struct PixelStats {
+  int opaque;            // every pixel has alpha 255
+  int gray;              // every pixel has r == g == b
+  int num_colors;        // number of distinct pixels, or 257 if more than 256
+  uint32_t colors[256];  // the distinct pixels, in order of first appearance
+  int16_t slot[PALETTE_SLOTS]; // hash table of indices into colors, -1 if empty
+};
+
+static unsigned palette_hash(uint32_t pixel) {
+  return (pixel * 2654435761U) >> 22; // top 10 bits, one of PALETTE_SLOTS
+}
+
+// Find the palette index of a pixel, adding it to the palette if there
+// is room. Returns -1 if the palette is full.
+static int palette_index(struct PixelStats *stats, uint32_t pixel) {
+  unsigned h = palette_hash(pixel);
+  for (;;) {
+    int index = stats->slot[h];
+    if (index < 0) {
+      if (stats->num_colors == 256) {
+        stats->num_colors = 257;
+        return -1;
+      }
+      stats->slot[h] = (int16_t) stats->num_colors;
+      stats->colors[stats->num_colors] = pixel;
+      return stats->num_colors++;
+    }
+    if (stats->colors[index] == pixel) {
+      return index;
+    }
+    h = (h + 1) % PALETTE_SLOTS;
+  }
+}
+
+// Copy pixels to out in big-endian (PNG) byte order, finding out along
+// the way whether they are opaque, gray, and how many colors they use
+// (if track_colors is set), so that choosing the most compact format
+// costs no extra pass over the image.
+static void convert_pixels(const uint32_t *pixels, int32_t num_pixels, uint32_t *out,
+                           struct PixelStats *stats, int track_colors) {
   int need_byteswap = is_little_endian();
+  uint32_t alpha_and = 0xFF, gray_diff = 0;
+  uint32_t last = 0;
+  int last_known = 0;
+
+  memset(stats->slot, -1, sizeof(stats->slot));
+  stats->num_colors = 0;
+
+  for (int32_t i = 0; i < num_pixels; i++) {
+    uint32_t p = pixels[i];
+    alpha_and &= p;
+    // (p >> 8) ^ (p >> 16) has r^g and g^b in its low two bytes
+    gray_diff |= ((p >> 8) ^ (p >> 16)) & 0xFFFF;
+    if (track_colors && (!last_known || p != last)) {
+      last = p;
+      last_known = 1;
+      if (palette_index(stats, p) < 0) {
+        track_colors = 0; // too many colors, stop looking
+      }
+    }
+    out[i] = need_byteswap ? byteswap(p) : p;
+  }
+
+  stats->opaque = (alpha_and == 0xFF);
+  stats->gray = (gray_diff == 0);
+}
+
+// Choose the smallest format that represents the image exactly
+static int choose_format(const struct PixelStats *stats, int32_t num_pixels) {
+  int format, bytes_per_pixel;
+  if (stats->gray) {
+    format = stats->opaque ? IMG_FORMAT_GRAY : IMG_FORMAT_GRAY_ALPHA;
+    bytes_per_pixel = stats->opaque ? 1 : 2;
+  } else {
+    format = stats->opaque ? IMG_FORMAT_RGB : IMG_FORMAT_RGBA;
+    bytes_per_pixel = stats->opaque ? 3 : 4;
+  }
+
+  // a palette saves bytes_per_pixel - 1 bytes per pixel, but costs up
+  // to 4 bytes per color to store
+  if (stats->num_colors <= 256 &&
+      (int64_t) num_pixels * (bytes_per_pixel - 1) > (int64_t) stats->num_colors * 4) {
+    format = IMG_FORMAT_PALETTE;
+  }
+  return format;
+}
+
+// Pack big-endian RGBA pixels in place into the given format, returning
+// the matching PNG color type. Every pixel is packed into no more bytes
+// than it started with, so nothing is overwritten before it has been read.
+static int pack_pixels(uint32_t *pixels, int32_t num_pixels, int format, struct PixelStats *stats) {
+  unsigned char *buf = (unsigned char *) pixels;
 
-  if (need_byteswap) {
-    data_to_write = (uint32_t *) malloc(img->width * img->height * sizeof(uint32_t));
-    if (data_to_write == NULL) {
-      png_close_file(&png);
-      return IMG_ERR_MALLOC_FAILED;
+  switch (format) {
+  case IMG_FORMAT_RGB:
+    for (int32_t i = 0; i < num_pixels; i++) {
+      unsigned char r = buf[i*4], g = buf[i*4 + 1], b = buf[i*4 + 2];
+      buf[i*3] = r;
+      buf[i*3 + 1] = g;
+      buf[i*3 + 2] = b;
+    }
+    return PNG_TRUECOLOR;
+
+  case IMG_FORMAT_GRAY:
+    for (int32_t i = 0; i < num_pixels; i++) {
+      buf[i] = buf[i*4];
+    }
+    return PNG_GREYSCALE;
+
+  case IMG_FORMAT_GRAY_ALPHA:
+    for (int32_t i = 0; i < num_pixels; i++) {
+      unsigned char v = buf[i*4], a = buf[i*4 + 3];
+      buf[i*2] = v;
+      buf[i*2 + 1] = a;
     }
+    return PNG_GREYSCALE_ALPHA;
 
-    int32_t num_pixels = img->width * img->height;
+  case IMG_FORMAT_PALETTE:
     for (int32_t i = 0; i < num_pixels; i++) {
-      data_to_write[i] = byteswap(img->data[i]);
+      uint32_t p = is_little_endian() ? byteswap(pixels[i]) : pixels[i];
+      buf[i] = (unsigned char) palette_index(stats, p);
     }
+    return PNG_INDEXED;
+
+  default:
+    return PNG_TRUECOLOR_ALPHA;
+  }
+}
+
+// Encode an image as PNG in the given format, writing it through the
+// pnglite write callback (or with fwrite, if write_fun is null and
+// user_pointer is a FILE *)
+static int write_png(png_write_callback_t write_fun, void *user_pointer,
+                     struct Image *img, int format) {
+  init_png();
+
+  if (format < IMG_FORMAT_AUTO || format > IMG_FORMAT_PALETTE) {
+    return IMG_ERR_COULD_NOT_WRITE;
+  }
+
+  int32_t num_pixels = img->width * img->height;
+  uint32_t *data_to_write = (uint32_t *) malloc(num_pixels * sizeof(uint32_t));
+  struct PixelStats *stats = (struct PixelStats *) malloc(sizeof(struct PixelStats));
+  if (data_to_write == NULL || stats == NULL) {
+    free(data_to_write);
+    free(stats);
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  // PNG requires every pixel in big-endian order, so they're always
+  // converted (and examined) before being packed into the output format
+  int track_colors = (format == IMG_FORMAT_AUTO || format == IMG_FORMAT_PALETTE);
+  convert_pixels(img->data, num_pixels, data_to_write, stats, track_colors);
+
+  if (format == IMG_FORMAT_AUTO) {
+    format = choose_format(stats, num_pixels);
+  } else if (format == IMG_FORMAT_PALETTE && stats->num_colors > 256) {
+    free(data_to_write);
+    free(stats);
+    return IMG_ERR_TOO_MANY_COLORS;
   }
 
-  int rc = png_set_data(&png, img->width, img->height, 8, PNG_TRUECOLOR_ALPHA, (unsigned char *) data_to_write);
-  int success = (rc == PNG_NO_ERROR);
+  int color_type = pack_pixels(data_to_write, num_pixels, format, stats);
+
+  png_t png;
+  int success = 0;
 
-  png_close_file(&png);
-  if (need_byteswap) {
+  if (png_open_write(&png, write_fun, user_pointer) != PNG_NO_ERROR) {
     free(data_to_write);
+    free(stats);
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  if (color_type == PNG_INDEXED) {
+    unsigned char rgb[256*3], alpha[256];
+    for (int i = 0; i < stats->num_colors; i++) {
+      uint32_t p = stats->colors[i];
+      rgb[i*3] = p >> 24;
+      rgb[i*3 + 1] = (p >> 16) & 0xFF;
+      rgb[i*3 + 2] = (p >> 8) & 0xFF;
+      alpha[i] = p & 0xFF;
+    }
+    success = (num_pixels == 0 ||
+               png_set_palette(&png, rgb, stats->opaque ? NULL : alpha, stats->num_colors) == PNG_NO_ERROR);
+  } else {
+    success = 1;
+  }
+
+  if (success) {
+    int rc = png_set_data(&png, img->width, img->height, 8, color_type, (unsigned char *) data_to_write);
+    success = (rc == PNG_NO_ERROR);
   }
 
+  free(data_to_write);
+  free(stats);
+
   return success ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
 }
 
+// pnglite write callback appending to an ImgBuffer
+static unsigned mem_write(void *input, size_t size, size_t numel, void *user_pointer) {
+  struct ImgBuffer *buf = (struct ImgBuffer *) user_pointer;
+  size_t len = size * numel;
+
+  if (buf->size + len > buf->capacity) {
+    // grow geometrically, so appending n bytes costs O(n) overall
+    size_t capacity = buf->capacity > 0 ? buf->capacity : 4096;
+    while (capacity < buf->size + len) {
+      capacity *= 2;
+    }
+    unsigned char *data = (unsigned char *) realloc(buf->data, capacity);
+    if (data == NULL) {
+      buf->failed = 1;
+      return 0;
+    }
+    buf->data = data;
+    buf->capacity = capacity;
+  }
+
+  memcpy(buf->data + buf->size, input, len);
+  buf->size += len;
+  return (unsigned) numel;
+}
+
+int img_write(const char *filename, struct Image *img) {
+  return img_write_format(filename, img, IMG_FORMAT_AUTO);
+}
+
+int img_write_format(const char *filename, struct Image *img, int format) {
+  FILE *out = fopen(filename, "wb");
+  if (out == NULL) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  int rc = img_write_file(out, img, format);
+  if (fclose(out) != 0 && rc == IMG_SUCCESS) {
+    rc = IMG_ERR_COULD_NOT_WRITE;
+  }
+  return rc;
+}
+
+int img_write_file(FILE *out, struct Image *img, int format) {
+  int rc = write_png(NULL, out, img, format);
+  if (fflush(out) != 0 || ferror(out)) {
+    rc = (rc == IMG_SUCCESS) ? IMG_ERR_COULD_NOT_WRITE : rc;
+  }
+  return rc;
+}
+
+void img_buffer_init(struct ImgBuffer *buf) {
+  buf->data = NULL;
+  buf->size = 0;
+  buf->capacity = 0;
+  buf->failed = 0;
+}
+
+void img_buffer_cleanup(struct ImgBuffer *buf) {
+  free(buf->data);
+  img_buffer_init(buf);
+}
+
+int img_write_mem(struct ImgBuffer *buf, struct Image *img, int format) {
+  // reuse whatever memory the buffer already has
+  buf->size = 0;
+  buf->failed = 0;
+
+  int rc = write_png(mem_write, buf, img, format);
+  if (buf->failed) {
+    rc = IMG_ERR_MALLOC_FAILED;
+  }
+  return rc;
+}
+
 void img_cleanup( struct Image *img ) {
   // The data array is the only dynamically-allocated
   // part of the representation of a struct Image
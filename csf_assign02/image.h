@@ -7,9 +7,24 @@
 #define IMG_ERR_NOT_TRUECOLOR    -2
 #define IMG_ERR_MALLOC_FAILED    -3
 #define IMG_ERR_COULD_NOT_WRITE  -4
+#define IMG_ERR_TOO_MANY_COLORS  -5
+
+// output formats for img_write_format
+#define IMG_FORMAT_AUTO          0  // most compact format that loses nothing
+#define IMG_FORMAT_RGBA          1
+#define IMG_FORMAT_RGB           2  // alpha is dropped
+#define IMG_FORMAT_GRAY          3  // only the red channel is kept
+#define IMG_FORMAT_GRAY_ALPHA    4  // only the red and alpha channels are kept
+#define IMG_FORMAT_PALETTE       5  // at most 256 distinct pixels
 
 #ifndef ASM_SOURCE
 #include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 struct Image {
   int32_t width;
@@ -35,7 +50,9 @@ struct Image {
 int img_init(struct Image *img, int32_t width, int32_t height);
 
 // Read PNG image data from a file and initialize the specified
-// Image struct instance.
+// Image struct instance. Images with 8 bits per channel in any of the
+// PNG color types (grayscale, palette, or truecolor, with or without
+// alpha) are converted to RGBA pixels.
 //
 // Parameters:
 //   filename - name of PNG file to read
@@ -47,6 +64,23 @@ int img_init(struct Image *img, int32_t width, int32_t height);
 //   IMG_ERR_* values
 int img_read(const char *filename, struct Image *img);
 
+// Read PNG image data from an open stream (which may be a pipe, such
+// as stdin) or from memory, and initialize the specified Image struct
+// instance. The stream is left open.
+//
+// Parameters:
+//   in - stream positioned at the start of the PNG data
+//   data - pointer to the PNG data in memory
+//   size - number of bytes of PNG data
+//   img - pointer to Image struct to initialize with the loaded
+//         image data
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int img_read_file(FILE *in, struct Image *img);
+int img_read_mem(const void *data, size_t size, struct Image *img);
+
 // Write pixel data from specified Image struct instance to the
 // named PNG output file.
 //
@@ -60,6 +94,55 @@ int img_read(const char *filename, struct Image *img);
 //   IMG_ERR_* values
 int img_write(const char *filename, struct Image *img);
 
+// Write pixel data to the named PNG output file in the specified
+// format. img_write is the same as img_write_format with IMG_FORMAT_AUTO,
+// which examines the pixels and writes the smallest of grayscale,
+// grayscale with alpha, palette, RGB, or RGBA that preserves them all.
+// The other formats let a caller that knows what the image contains
+// choose directly (channels not in the format are discarded).
+//
+// Parameters:
+//   filename - name of PNG file to write
+//   img - pointer to Image struct with the pixel data to write
+//         to a PNG file
+//   format - one of the IMG_FORMAT_* values
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values (IMG_ERR_TOO_MANY_COLORS if IMG_FORMAT_PALETTE
+//   was requested for an image with more than 256 distinct pixels)
+int img_write_format(const char *filename, struct Image *img, int format);
+
+// A growable memory buffer that encoded PNG data can be written to.
+// The memory is kept between writes, so a buffer that is reused for
+// a series of similar images only needs to grow once.
+struct ImgBuffer {
+  unsigned char *data;
+  size_t size;      // number of bytes of PNG data
+  size_t capacity;  // number of bytes allocated
+  int failed;       // set if growing the buffer failed
+};
+
+// Initialize an empty ImgBuffer, or free the memory of one
+void img_buffer_init(struct ImgBuffer *buf);
+void img_buffer_cleanup(struct ImgBuffer *buf);
+
+// Write pixel data in the specified format as PNG data to an open
+// stream (which may be a pipe, such as stdout; it is flushed but left
+// open), or to a memory buffer, replacing whatever data it held.
+//
+// Parameters:
+//   out - stream to write to
+//   buf - pointer to the ImgBuffer to write to
+//   img - pointer to Image struct with the pixel data to write
+//   format - one of the IMG_FORMAT_* values
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int img_write_file(FILE *out, struct Image *img, int format);
+int img_write_mem(struct ImgBuffer *buf, struct Image *img, int format);
+
 // De-allocate the dynamically-allocated memory used in the internal
 // representation of the given Image struct. Note that this function
 // does NOT de-allocate the struct Image instance itself (since allocating
@@ -68,6 +151,10 @@ int img_write(const char *filename, struct Image *img);
 // Parameters:
 //   img - pointer to Image object to clean up
 void img_cleanup( struct Image *img );
+
+#ifdef __cplusplus
+}
+#endif
 #endif // ASM_SOURCE
 
 #endif
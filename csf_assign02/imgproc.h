@@ -6,6 +6,10 @@
 
 #include "image.h" // for struct Image and related functions
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 // Mirror input image horizontally.
 // This transformation always succeeds.
 //
@@ -62,6 +66,290 @@ void imgproc_grayscale( struct Image *input_img, struct Image *output_img );
 //   and overlay image do not have the same dimensions
 int imgproc_composite( struct Image *base_img, struct Image *overlay_img, struct Image *output_img );
 
+// Filters available for imgproc_resize
+#define IMGPROC_FILTER_BOX       0
+#define IMGPROC_FILTER_BILINEAR  1
+#define IMGPROC_FILTER_LANCZOS3  2
+
+// Resample input image to the dimensions of the output image, using
+// a separable filter (applied to rows, then to columns). Filter
+// weights are precomputed once per output row and column, and both
+// passes are split into bands of rows processed by multiple threads.
+//
+// Parameters:
+//   input_img  - pointer to the input Image
+//   filter     - one of the IMGPROC_FILTER_* values
+//   output_img - pointer to the output Image; its width and height
+//                determine the size of the resampled image
+//
+// Returns:
+//   1 if successful, or 0 if the filter is unknown, either image
+//   is empty, or memory couldn't be allocated
+int imgproc_resize( struct Image *input_img, int filter, struct Image *output_img );
+
+// Transpose input image (swap rows and columns), rotate it clockwise by
+// 90 degrees, or rotate it counterclockwise by 90 degrees. The output image
+// must already have the input image's width as its height and vice versa.
+// The image is split into bands of columns processed by multiple threads;
+// each band is transposed by recursively halving it into blocks small
+// enough to stay in cache, which are copied by imgproc_transpose_block.
+//
+// Parameters:
+//   input_img  - pointer to the input Image
+//   output_img - pointer to the output Image (in which the transformed
+//                pixels should be stored)
+//
+// Returns:
+//   1 if successful, or 0 if the output image dimensions are wrong
+int imgproc_transpose( struct Image *input_img, struct Image *output_img );
+int imgproc_rotate90( struct Image *input_img, struct Image *output_img );
+int imgproc_rotate270( struct Image *input_img, struct Image *output_img );
+
+// Rotate input image by 180 degrees. The output image must have the same
+// dimensions as the input image.
+//
+// Parameters:
+//   input_img  - pointer to the input Image
+//   output_img - pointer to the output Image (in which the transformed
+//                pixels should be stored)
+//
+// Returns:
+//   1 if successful, or 0 if the output image dimensions are wrong
+int imgproc_rotate180( struct Image *input_img, struct Image *output_img );
+
+// Per-channel histograms of an image, indexed [channel][value],
+// with the channels in the order r, g, b, a
+struct Histogram {
+  uint32_t count[4][256];
+};
+
+// Count how often each value of each channel occurs in an image.
+// Bands of pixels are counted by multiple threads, each into its own
+// private histograms, which are added together at the end.
+//
+// Parameters:
+//   img  - pointer to the Image
+//   hist - pointer to the Histogram to fill in
+//
+// Returns:
+//   1 if successful, or 0 if memory couldn't be allocated
+int imgproc_histogram( struct Image *img, struct Histogram *hist );
+
+// Replace every channel value of every pixel using a per-channel lookup
+// table indexed [channel][value] (channels in the order r, g, b, a).
+// This transformation always succeeds.
+//
+// Parameters:
+//   input_img  - pointer to the input Image
+//   lut        - the lookup tables
+//   output_img - pointer to the output Image (may be the same as input_img)
+void imgproc_apply_lut( struct Image *input_img, const uint8_t lut[4][256], struct Image *output_img );
+
+// Equalize the histogram of each color channel, so that the channel's
+// values are spread as evenly as possible over 0..255. Alpha is unchanged.
+//
+// Parameters:
+//   input_img  - pointer to the input Image
+//   output_img - pointer to the output Image
+//
+// Returns:
+//   1 if successful, or 0 if memory couldn't be allocated
+int imgproc_equalize( struct Image *input_img, struct Image *output_img );
+
+// Stretch each color channel linearly so that its darkest value becomes
+// 0 and its brightest value becomes 255, after ignoring the given fraction
+// of outlying pixels at each end. Alpha is unchanged.
+//
+// Parameters:
+//   input_img  - pointer to the input Image
+//   clip       - fraction of pixels to ignore at each end (0 <= clip < 0.5)
+//   output_img - pointer to the output Image
+//
+// Returns:
+//   1 if successful, or 0 if clip is out of range or memory
+//   couldn't be allocated
+int imgproc_autolevel( struct Image *input_img, double clip, struct Image *output_img );
+
+// Channel masks selecting which channels a color adjustment applies to
+#define IMGPROC_CHANNEL_R 1
+#define IMGPROC_CHANNEL_G 2
+#define IMGPROC_CHANNEL_B 4
+#define IMGPROC_CHANNEL_A 8
+#define IMGPROC_CHANNELS_RGB ( IMGPROC_CHANNEL_R | IMGPROC_CHANNEL_G | IMGPROC_CHANNEL_B )
+
+// A chain of color adjustments, applied to each pixel as
+//   post_lut( matrix( pre_lut( pixel ) ) )
+// Per-channel adjustments (gamma, brightness, contrast, invert, curves)
+// are folded into pre_lut until a mixing matrix (channel swaps,
+// grayscale) is added, and into post_lut after that, so however many
+// adjustments are chained the image is only processed once.
+// Lookup tables are indexed [channel][value] with the channels in the
+// order r, g, b, a; the matrix mixes r, g, b and leaves alpha alone.
+struct ColorPipeline {
+  uint8_t pre_lut[4][256];
+  int has_matrix;
+  double matrix[3][3];
+  uint8_t post_lut[4][256];
+};
+
+// Start an empty pipeline (which leaves every pixel unchanged)
+void color_pipeline_init( struct ColorPipeline *pipeline );
+
+// Append a per-channel adjustment to a pipeline. channels is a mask of
+// IMGPROC_CHANNEL_* values. Functions returning int return 1 if
+// successful, or 0 if a parameter is out of range (gamma must be
+// positive, contrast factors non-negative, and curve points given in
+// order of increasing input value).
+int color_pipeline_gamma( struct ColorPipeline *pipeline, int channels, double gamma );
+void color_pipeline_brightness( struct ColorPipeline *pipeline, int channels, int delta );
+int color_pipeline_contrast( struct ColorPipeline *pipeline, int channels, double factor );
+void color_pipeline_invert( struct ColorPipeline *pipeline, int channels );
+int color_pipeline_curve( struct ColorPipeline *pipeline, int channels,
+                          const uint8_t points[][2], int num_points );
+
+// Append a mixing matrix to a pipeline, so that output channel o is
+// the sum over c of mix[o][c] times input channel c (r, g, b order).
+// swap takes the new channel order as a string such as "bgr", and
+// grayscale uses the same weights as the grayscale transformation.
+//
+// Returns:
+//   1 if successful, or 0 if the pipeline already has per-channel
+//   adjustments after a matrix, or the combined coefficients are too
+//   large (|coefficient| must be less than 127)
+int color_pipeline_mix( struct ColorPipeline *pipeline, const double mix[3][3] );
+int color_pipeline_swap( struct ColorPipeline *pipeline, const char *order );
+int color_pipeline_grayscale( struct ColorPipeline *pipeline );
+
+// Append the steps described by a comma-separated specification such as
+// "gamma=2.2,r:brightness=-10,contrast=1.2,swap=bgr,gray,invert,
+// g:curve=0:0/128:160/255:255". Each step may be prefixed with the
+// channels it applies to ("rg:invert"); the default is r, g and b.
+//
+// Returns:
+//   1 if successful, or 0 if the specification is invalid
+int color_pipeline_parse( struct ColorPipeline *pipeline, const char *spec );
+
+// Apply a color pipeline to every pixel of an image. Pixels are run
+// through all of the pipeline's stages in small chunks, by multiple
+// threads.
+//
+// Parameters:
+//   pipeline   - pointer to the ColorPipeline
+//   input_img  - pointer to the input Image
+//   output_img - pointer to the output Image (may be the same as input_img)
+//
+// Returns:
+//   1 if successful, or 0 if memory couldn't be allocated
+int imgproc_color_pipeline( const struct ColorPipeline *pipeline, struct Image *input_img,
+                            struct Image *output_img );
+
+// A rectangle of pixels within an image
+struct ImgRect {
+  int32_t x, y;
+  int32_t width, height;
+};
+
+// State for compositing a series of overlays onto the same base image,
+// where each overlay differs from the previous one in only a few places
+// (for example a changing timestamp). The cache keeps copies of the base
+// image and of the last overlay, and the composited output, which is
+// only recomputed where the overlay changed.
+struct CompositeCache {
+  struct Image base;
+  struct Image overlay;          // overlay the output was computed from
+  struct Image output;           // current composited image
+  int has_overlay;               // set once the first overlay is composited
+  int tiles_x, tiles_y;          // number of tiles compared per row / column
+  uint8_t *dirty;                // which tiles changed in the last update
+  struct ImgRect *dirty_rects;   // rectangles of pixels changed by the last update
+  int num_dirty_rects;
+  int32_t dirty_row_begin;       // rows [dirty_row_begin, dirty_row_end) of the
+  int32_t dirty_row_end;         // output contain every changed pixel
+  int *open_rects;               // scratch space for merging tiles into rectangles
+};
+
+// Start compositing onto a copy of the given base image.
+//
+// Returns:
+//   1 if successful, or 0 if memory couldn't be allocated
+int composite_cache_init( struct CompositeCache *cache, struct Image *base_img );
+
+// Free the memory used by a CompositeCache
+void composite_cache_cleanup( struct CompositeCache *cache );
+
+// Composite an overlay onto the cached base image, updating cache->output.
+// The overlay is compared with the previous one in blocks of 16 pixels
+// (one cache line) by 16 rows, and only blocks that differ are
+// recomposited. Afterwards dirty_rects lists the rectangles of the output
+// that changed, and dirty_row_begin/dirty_row_end the range of rows that
+// contains them (an empty range if nothing changed), so that a consumer
+// of the output can resend or re-encode just those parts.
+//
+// Parameters:
+//   cache       - pointer to the CompositeCache
+//   overlay_img - pointer to the overlay (foreground) image
+//
+// Returns:
+//   1 if successful, or 0 if the overlay's dimensions don't match the
+//   base image's
+int imgproc_composite_update( struct CompositeCache *cache, struct Image *overlay_img );
+
+// An image stored as one plane of bytes per channel instead of one
+// uint32_t per pixel, so that vector code can load 16 values of the same
+// channel at once. Each plane is 64 byte aligned and padded, and pixel
+// (x, y) of channel c is plane[c][y * width + x].
+struct PlanarImage {
+  int32_t width, height;
+  uint8_t *plane[4];   // r, g, b, a
+};
+
+// Allocate the planes of a PlanarImage (initialized to 0).
+//
+// Returns:
+//   IMG_SUCCESS if successful, or IMG_ERR_MALLOC_FAILED
+int planar_init( struct PlanarImage *img, int32_t width, int32_t height );
+
+// Free the planes of a PlanarImage
+void planar_cleanup( struct PlanarImage *img );
+
+// Convert between packed and planar images, which must be the same size.
+// A pipeline of planar transformations converts once at each end.
+//
+// Returns:
+//   1 if successful, or 0 if the images' dimensions differ
+int planar_from_image( struct Image *input_img, struct PlanarImage *output_img );
+int planar_to_image( struct PlanarImage *input_img, struct Image *output_img );
+
+// Planar versions of imgproc_grayscale, imgproc_composite and
+// imgproc_apply_lut, with the same results. Output may be the same as
+// an input.
+//
+// Returns:
+//   1 if successful, or 0 if the images' dimensions differ
+int planar_grayscale( struct PlanarImage *input_img, struct PlanarImage *output_img );
+int planar_composite( struct PlanarImage *base_img, struct PlanarImage *overlay_img,
+                      struct PlanarImage *output_img );
+int planar_apply_lut( struct PlanarImage *input_img, const uint8_t lut[4][256],
+                      struct PlanarImage *output_img );
+
+// Convolve the color channels with a 3x3 kernel: each output value is
+// the sum of kernel[dy][dx] times the input at (x + dx - 1, y + dy - 1),
+// with coordinates clamped to the edges, divided by 2^shift (rounding)
+// and clamped to 0..255. Alpha is copied unchanged.
+//
+// Parameters:
+//   input_img  - pointer to the input image
+//   kernel     - the kernel; the sum of its absolute values must be at
+//                most 128
+//   shift      - 0 to 7
+//   output_img - pointer to the output image (not the input image)
+//
+// Returns:
+//   1 if successful, or 0 if the images' dimensions differ or the
+//   parameters are out of range
+int planar_convolve3x3( struct PlanarImage *input_img, const int kernel[3][3], int shift,
+                        struct PlanarImage *output_img );
+
 // prototypes for your helper functions
 int custom_ceil(int numerator, int denominator);
 int custom_floor(int numerator, int denominator);
@@ -72,5 +360,12 @@ uint32_t get_a( uint32_t pixel );
 uint32_t make_pixel( uint32_t r, uint32_t g, uint32_t b, uint32_t a );
 uint32_t to_grayscale(uint32_t pixel);
 uint32_t create_composite_pixel(uint32_t bg_pixel, uint32_t fg_pixel);
+void imgproc_transpose_block( const uint32_t *src, long src_stride,
+                              uint32_t *dst, long dst_stride, int width, int height );
+void imgproc_reverse_row( const uint32_t *src, uint32_t *dst, int width );
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif // IMGPROC_H
@@ -0,0 +1,115 @@
+// Unit tests for the C++ pixel pipelines in imgproc.hpp
+
+#include <cstdlib>
+#include "tctest.h"
+#include "imgproc.hpp"
+
+using namespace imgproc::ops;
+
+// Pipelines are plain function objects, so they can run at compile time
+static_assert( ( Invert() | Invert() )( 0x12345678U ) == 0x12345678U, "invert twice" );
+static_assert( Swizzle<2, 1, 0>()( 0x11223344U ) == 0x33221144U, "swap red and blue" );
+static_assert( Brightness( 100 )( 0xC0100080U ) == 0xFF746480U, "saturate" );
+
+// a pipeline exported for C code
+IMGPROC_C_PIPELINE( swap_and_invert, Swizzle<2, 1, 0>() | Invert() )
+
+typedef struct {
+  imgproc::OwnedImage *img;
+} TestObjs;
+
+TestObjs *setup( void ) {
+  TestObjs *objs = new TestObjs;
+
+  // an odd number of pixels, covering every channel value
+  objs->img = new imgproc::OwnedImage( 37, 29 );
+  uint32_t seed = 12345;
+  for ( int i = 0; i < 37 * 29; i++ ) {
+    seed = seed * 1103515245 + 12345;
+    objs->img->data()[i] = seed;
+  }
+  return objs;
+}
+
+void cleanup( TestObjs *objs ) {
+  delete objs->img;
+  delete objs;
+}
+
+bool images_equal( const struct Image *a, const struct Image *b ) {
+  if ( a->width != b->width || a->height != b->height )
+    return false;
+  for ( int i = 0; i < a->width * a->height; i++ )
+    if ( a->data[i] != b->data[i] )
+      return false;
+  return true;
+}
+
+void test_grayscale_matches_c( TestObjs *objs ) {
+  imgproc::OwnedImage out( objs->img->width(), objs->img->height() );
+  ASSERT( imgproc::run( Grayscale(), *objs->img, out ) );
+  for ( int i = 0; i < out.width() * out.height(); i++ )
+    ASSERT( out.data()[i] == to_grayscale( objs->img->data()[i] ) );
+}
+
+void test_chain( TestObjs *objs ) {
+  imgproc::OwnedImage out( objs->img->width(), objs->img->height() );
+  auto pipeline = Swizzle<2, 1, 0>() | Brightness( -40, IMGPROC_CHANNEL_G ) | Invert( IMGPROC_CHANNEL_R );
+  ASSERT( imgproc::run( pipeline, *objs->img, out ) );
+
+  for ( int i = 0; i < out.width() * out.height(); i++ ) {
+    uint32_t p = objs->img->data()[i];
+    int g = (int) get_g( p ) - 40;
+    ASSERT( out.data()[i] == make_pixel( 255 - get_b( p ), g < 0 ? 0 : g, get_r( p ), get_a( p ) ) );
+  }
+
+  // running in place gives the same result
+  ASSERT( imgproc::run( pipeline, *objs->img, *objs->img ) );
+  ASSERT( images_equal( objs->img->get(), out.get() ) );
+}
+
+void test_lut_and_per_channel( TestObjs *objs ) {
+  uint8_t lut[4][256];
+  for ( int c = 0; c < 4; c++ )
+    for ( int v = 0; v < 256; v++ )
+      lut[c][v] = (uint8_t) ( c == 3 ? v : v / 2 + 10 );
+
+  imgproc::OwnedImage expected( objs->img->width(), objs->img->height() );
+  imgproc::OwnedImage out( objs->img->width(), objs->img->height() );
+  imgproc_apply_lut( *objs->img, lut, expected );
+
+  ASSERT( imgproc::run( Lut( lut ), *objs->img, out ) );
+  ASSERT( images_equal( expected.get(), out.get() ) );
+
+  ASSERT( imgproc::run( per_channel( []( int v ) { return v / 2 + 10; } ), *objs->img, out ) );
+  ASSERT( images_equal( expected.get(), out.get() ) );
+}
+
+void test_c_wrapper( TestObjs *objs ) {
+  // call through a plain C function pointer
+  int (*fn)( struct Image *, struct Image * ) = swap_and_invert;
+
+  imgproc::OwnedImage out( objs->img->width(), objs->img->height() );
+  ASSERT( fn( *objs->img, out ) == 1 );
+  for ( int i = 0; i < out.width() * out.height(); i++ ) {
+    uint32_t p = objs->img->data()[i];
+    ASSERT( out.data()[i] == make_pixel( 255 - get_b( p ), 255 - get_g( p ), 255 - get_r( p ), get_a( p ) ) );
+  }
+
+  imgproc::OwnedImage wrong_size( 1, 1 );
+  ASSERT( fn( *objs->img, wrong_size ) == 0 );
+}
+
+int main( int argc, char **argv ) {
+  if ( argc > 1 )
+    tctest_testname_to_execute = argv[1];
+
+  TEST_INIT();
+
+  TEST( test_grayscale_matches_c );
+  TEST( test_chain );
+  TEST( test_lut_and_per_channel );
+  TEST( test_c_wrapper );
+
+  TEST_FINI();
+}
@@ -1,8 +1,12 @@
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include "tctest.h"
 #include "imgproc.h"
+#include "parallel.h"
+#include "tune.h"
 
 // An expected color identified by a (non-zero) character code.
 // Used in the "Picture" data type.
@@ -109,6 +113,25 @@ void test_get_a(TestObjs *objs);
 void test_make_pixel(TestObjs *objs);
 void test_to_grayscale(TestObjs *objs);
 void test_create_composite_pixel(TestObjs *objs);
+void test_resize_identity(TestObjs *objs);
+void test_resize_box_downscale(TestObjs *objs);
+void test_resize_lanczos_flat(TestObjs *objs);
+void test_transpose_block(TestObjs *objs);
+void test_reverse_row(TestObjs *objs);
+void test_transpose_basic(TestObjs *objs);
+void test_rotate_basic(TestObjs *objs);
+void test_histogram_basic(TestObjs *objs);
+void test_equalize_basic(TestObjs *objs);
+void test_autolevel_basic(TestObjs *objs);
+void test_color_pipeline_grayscale(TestObjs *objs);
+void test_color_pipeline_adjust(TestObjs *objs);
+void test_color_pipeline_parse(TestObjs *objs);
+void test_write_compact_formats(TestObjs *objs);
+void test_read_write_mem(TestObjs *objs);
+void test_composite_update(TestObjs *objs);
+void test_planar_basic(TestObjs *objs);
+void test_band_shift(TestObjs *objs);
+void test_tune_profile(TestObjs *objs);
 // end prototypes for addition unit tests
 
 int main( int argc, char **argv ) {
@@ -139,6 +162,25 @@ int main( int argc, char **argv ) {
   TEST(test_make_pixel);
   TEST(test_to_grayscale);
   TEST(test_create_composite_pixel);
+  TEST(test_resize_identity);
+  TEST(test_resize_box_downscale);
+  TEST(test_resize_lanczos_flat);
+  TEST(test_transpose_block);
+  TEST(test_reverse_row);
+  TEST(test_transpose_basic);
+  TEST(test_rotate_basic);
+  TEST(test_histogram_basic);
+  TEST(test_equalize_basic);
+  TEST(test_autolevel_basic);
+  TEST(test_color_pipeline_grayscale);
+  TEST(test_color_pipeline_adjust);
+  TEST(test_color_pipeline_parse);
+  TEST(test_write_compact_formats);
+  TEST(test_read_write_mem);
+  TEST(test_composite_update);
+  TEST(test_planar_basic);
+  TEST(test_band_shift);
+  TEST(test_tune_profile);
 
   TEST_FINI();
 }
@@ -494,4 +536,637 @@ void test_create_composite_pixel(TestObjs *objs) {
     uint32_t fg_pixel3 = make_pixel(200, 200, 200, 0);
     uint32_t result3 = create_composite_pixel(bg_pixel3, fg_pixel3);
     ASSERT(result3 == make_pixel(50, 100, 150, 255));
-}
\ No newline at end of file
+}
+
+void test_resize_identity(TestObjs *objs) {
+  // resampling to the same size must reproduce the input exactly,
+  // whichever filter is used
+  int filters[] = { IMGPROC_FILTER_BOX, IMGPROC_FILTER_BILINEAR, IMGPROC_FILTER_LANCZOS3 };
+  for (int i = 0; i < 3; i++) {
+    ASSERT(imgproc_resize(objs->smiley, filters[i], objs->smiley_out));
+    ASSERT(images_equal(objs->smiley, objs->smiley_out));
+  }
+}
+
+void test_resize_box_downscale(TestObjs *objs) {
+  Picture quads_pic = {
+    { { 'r', 0xFF0000FF }, { 'b', 0x0000FFFF }, { 'w', 0xFFFFFFFF }, { 'k', 0x000000FF } },
+    4, 2,
+    "rbww"
+    "brkk"
+  };
+  struct Image *quads = picture_to_img(&quads_pic);
+
+  struct Image out;
+  img_init(&out, 2, 1);
+
+  // each output pixel is the average of a 2x2 block
+  ASSERT(imgproc_resize(quads, IMGPROC_FILTER_BOX, &out));
+  ASSERT(out.data[0] == 0x800080FF);
+  ASSERT(out.data[1] == 0x808080FF);
+
+  img_cleanup(&out);
+  destroy_img(quads);
+}
+
+void test_resize_lanczos_flat(TestObjs *objs) {
+  struct Image flat, out;
+  img_init(&flat, 37, 23);
+  for (int i = 0; i < 37 * 23; i++)
+    flat.data[i] = 0x336699C0;
+
+  // a flat image stays flat when shrinking or enlarging
+  img_init(&out, 11, 7);
+  ASSERT(imgproc_resize(&flat, IMGPROC_FILTER_LANCZOS3, &out));
+  for (int i = 0; i < 11 * 7; i++)
+    ASSERT(out.data[i] == 0x336699C0);
+  img_cleanup(&out);
+
+  img_init(&out, 80, 50);
+  ASSERT(imgproc_resize(&flat, IMGPROC_FILTER_LANCZOS3, &out));
+  for (int i = 0; i < 80 * 50; i++)
+    ASSERT(out.data[i] == 0x336699C0);
+  img_cleanup(&out);
+
+  img_cleanup(&flat);
+}
+
+void test_transpose_block(TestObjs *objs) {
+  // sizes that aren't multiples of 4 exercise the scalar edges
+  uint32_t src[7 * 9], dst[9 * 7];
+  for (int i = 0; i < 7 * 9; i++)
+    src[i] = i;
+
+  // 7 rows of 9 pixels
+  imgproc_transpose_block(src, 9, dst, 7, 9, 7);
+  for (int r = 0; r < 7; r++)
+    for (int c = 0; c < 9; c++)
+      ASSERT(dst[c * 7 + r] == src[r * 9 + c]);
+
+  // negative source stride: read rows bottom to top
+  imgproc_transpose_block(src + 6 * 9, -9, dst, 7, 9, 7);
+  for (int r = 0; r < 7; r++)
+    for (int c = 0; c < 9; c++)
+      ASSERT(dst[c * 7 + r] == src[(6 - r) * 9 + c]);
+
+  // negative destination stride: write rows bottom to top
+  imgproc_transpose_block(src, 9, dst + 8 * 7, -7, 9, 7);
+  for (int r = 0; r < 7; r++)
+    for (int c = 0; c < 9; c++)
+      ASSERT(dst[(8 - c) * 7 + r] == src[r * 9 + c]);
+}
+
+void test_reverse_row(TestObjs *objs) {
+  uint32_t src[11], dst[11];
+  for (int i = 0; i < 11; i++)
+    src[i] = i * 3;
+
+  for (int w = 0; w <= 11; w++) {
+    imgproc_reverse_row(src, dst, w);
+    for (int i = 0; i < w; i++)
+      ASSERT(dst[i] == src[w - 1 - i]);
+  }
+}
+
+void test_transpose_basic(TestObjs *objs) {
+  // large enough for the recursion to split the image into several blocks
+  struct Image big, out;
+  img_init(&big, 101, 67);
+  for (int i = 0; i < 101 * 67; i++)
+    big.data[i] = i;
+  img_init(&out, 67, 101);
+
+  ASSERT(imgproc_transpose(&big, &out));
+  for (int r = 0; r < 67; r++)
+    for (int c = 0; c < 101; c++)
+      ASSERT(out.data[c * 67 + r] == big.data[r * 101 + c]);
+
+  // output dimensions must be swapped
+  ASSERT(!imgproc_transpose(&big, &big));
+
+  img_cleanup(&out);
+  img_cleanup(&big);
+}
+
+void test_rotate_basic(TestObjs *objs) {
+  struct Image *smiley = objs->smiley;
+  int w = smiley->width, h = smiley->height;
+  struct Image out;
+  img_init(&out, h, w);
+
+  // clockwise: top row becomes rightmost column
+  ASSERT(imgproc_rotate90(smiley, &out));
+  for (int r = 0; r < h; r++)
+    for (int c = 0; c < w; c++)
+      ASSERT(out.data[c * h + (h - 1 - r)] == smiley->data[r * w + c]);
+
+  // counterclockwise: top row becomes leftmost column
+  ASSERT(imgproc_rotate270(smiley, &out));
+  for (int r = 0; r < h; r++)
+    for (int c = 0; c < w; c++)
+      ASSERT(out.data[(w - 1 - c) * h + r] == smiley->data[r * w + c]);
+
+  // 180 degrees is mirroring both ways
+  struct Image mirrored;
+  img_init(&mirrored, w, h);
+  imgproc_mirror_h(smiley, &mirrored);
+  imgproc_mirror_v(&mirrored, objs->smiley_out);
+  img_cleanup(&mirrored);
+  img_init(&mirrored, w, h);
+  ASSERT(imgproc_rotate180(smiley, &mirrored));
+  ASSERT(images_equal(&mirrored, objs->smiley_out));
+
+  img_cleanup(&mirrored);
+  img_cleanup(&out);
+}
+
+void test_histogram_basic(TestObjs *objs) {
+  struct Histogram hist;
+  ASSERT(imgproc_histogram(objs->smiley, &hist));
+
+  // smiley has 13 pixels with full red ('r' and 'm'), 15 with full
+  // green ('g' and 'c'), and 20 with full blue ('b', 'c', and 'm'),
+  // out of 160; all are opaque
+  ASSERT(hist.count[0][255] == 13 && hist.count[0][0] == 147);
+  ASSERT(hist.count[1][255] == 15 && hist.count[1][0] == 145);
+  ASSERT(hist.count[2][255] == 20 && hist.count[2][0] == 140);
+  ASSERT(hist.count[3][255] == 160);
+
+  // more pixels than fit in one band, so partial histograms get merged
+  struct Image big;
+  img_init(&big, 700, 300);
+  for (int i = 0; i < 700 * 300; i++)
+    big.data[i] = make_pixel(i & 0xFF, 7, 0, 255);
+  ASSERT(imgproc_histogram(&big, &hist));
+  for (int v = 0; v < 256; v++)
+    ASSERT(hist.count[0][v] == 700 * 300 / 256 + (v < (700 * 300) % 256));
+  ASSERT(hist.count[1][7] == 700 * 300);
+  img_cleanup(&big);
+}
+
+void test_equalize_basic(TestObjs *objs) {
+  struct Image img;
+  img_init(&img, 4, 1);
+  img.data[0] = make_pixel(100, 10, 0, 128);
+  img.data[1] = make_pixel(100, 20, 0, 128);
+  img.data[2] = make_pixel(110, 30, 0, 128);
+  img.data[3] = make_pixel(120, 40, 0, 128);
+
+  ASSERT(imgproc_equalize(&img, &img));
+
+  // values spread out to cover 0..255, a single value is left alone,
+  // and alpha is untouched
+  ASSERT(img.data[0] == make_pixel(0, 0, 0, 128));
+  ASSERT(img.data[1] == make_pixel(0, 85, 0, 128));
+  ASSERT(img.data[2] == make_pixel(128, 170, 0, 128));
+  ASSERT(img.data[3] == make_pixel(255, 255, 0, 128));
+
+  img_cleanup(&img);
+}
+
+void test_autolevel_basic(TestObjs *objs) {
+  struct Image img;
+  img_init(&img, 100, 1);
+  for (int i = 0; i < 100; i++)
+    img.data[i] = make_pixel(50 + i, 200, 0, 255);
+  img.data[0] = make_pixel(0, 200, 0, 255);
+
+  // without clipping the outlier at 0 limits the stretch
+  struct Image out;
+  img_init(&out, 100, 1);
+  ASSERT(imgproc_autolevel(&img, 0.0, &out));
+  ASSERT(get_r(out.data[0]) == 0 && get_r(out.data[99]) == 255);
+  ASSERT(get_r(out.data[1]) == (51 * 255 + 74) / 149);
+
+  // ignoring 1% at each end drops the outlier and the brightest value
+  ASSERT(imgproc_autolevel(&img, 0.01, &out));
+  ASSERT(get_r(out.data[1]) == 0 && get_r(out.data[98]) == 255);
+  ASSERT(get_g(out.data[50]) == 200);
+
+  ASSERT(!imgproc_autolevel(&img, 0.5, &out));
+
+  img_cleanup(&out);
+  img_cleanup(&img);
+}
+
+void test_color_pipeline_grayscale(TestObjs *objs) {
+  // an odd number of pixels, so both the vector and scalar paths run
+  struct Image img, out;
+  img_init(&img, 37, 5);
+  img_init(&out, 37, 5);
+  uint32_t seed = 12345;
+  for (int i = 0; i < 37 * 5; i++) {
+    seed = seed * 1103515245 + 12345;
+    img.data[i] = seed;
+  }
+
+  struct ColorPipeline pipeline;
+  color_pipeline_init(&pipeline);
+  ASSERT(color_pipeline_grayscale(&pipeline));
+  ASSERT(imgproc_color_pipeline(&pipeline, &img, &out));
+  for (int i = 0; i < 37 * 5; i++)
+    ASSERT(out.data[i] == to_grayscale(img.data[i]));
+
+  imgproc_grayscale(objs->smiley, objs->smiley_out);
+  for (int i = 0; i < objs->smiley->width * objs->smiley->height; i++)
+    ASSERT(objs->smiley_out->data[i] == to_grayscale(objs->smiley->data[i]));
+
+  img_cleanup(&out);
+  img_cleanup(&img);
+}
+
+void test_color_pipeline_adjust(TestObjs *objs) {
+  struct ColorPipeline pipeline;
+  struct Image *out = objs->smiley_out;
+  int num_pixels = objs->smiley->width * objs->smiley->height;
+
+  // inverting twice changes nothing
+  color_pipeline_init(&pipeline);
+  color_pipeline_invert(&pipeline, IMGPROC_CHANNELS_RGB | IMGPROC_CHANNEL_A);
+  color_pipeline_invert(&pipeline, IMGPROC_CHANNELS_RGB | IMGPROC_CHANNEL_A);
+  ASSERT(imgproc_color_pipeline(&pipeline, objs->smiley, out));
+  ASSERT(images_equal(objs->smiley, out));
+
+  // swap channels, then invert only the (new) red channel
+  color_pipeline_init(&pipeline);
+  ASSERT(color_pipeline_swap(&pipeline, "bgr"));
+  color_pipeline_invert(&pipeline, IMGPROC_CHANNEL_R);
+  ASSERT(imgproc_color_pipeline(&pipeline, objs->smiley, out));
+  for (int i = 0; i < num_pixels; i++) {
+    uint32_t p = objs->smiley->data[i];
+    ASSERT(out->data[i] == make_pixel(255 - get_b(p), get_g(p), get_r(p), get_a(p)));
+  }
+
+  // a matrix can't follow adjustments made after another matrix
+  ASSERT(!color_pipeline_grayscale(&pipeline));
+  ASSERT(!color_pipeline_swap(&pipeline, "rgx"));
+  ASSERT(!color_pipeline_gamma(&pipeline, IMGPROC_CHANNEL_R, 0.0));
+
+  // curves interpolate linearly between their points
+  static const uint8_t points[][2] = { { 0, 0 }, { 100, 200 }, { 255, 255 } };
+  color_pipeline_init(&pipeline);
+  ASSERT(color_pipeline_curve(&pipeline, IMGPROC_CHANNEL_G, points, 3));
+  ASSERT(pipeline.pre_lut[1][50] == 100 && pipeline.pre_lut[1][100] == 200);
+  ASSERT(pipeline.pre_lut[0][50] == 50);
+}
+
+void test_color_pipeline_parse(TestObjs *objs) {
+  struct ColorPipeline expected, parsed;
+  struct Image expected_img;
+  img_init(&expected_img, objs->smiley->width, objs->smiley->height);
+
+  color_pipeline_init(&expected);
+  ASSERT(color_pipeline_gamma(&expected, IMGPROC_CHANNELS_RGB, 2.2));
+  color_pipeline_brightness(&expected, IMGPROC_CHANNEL_R | IMGPROC_CHANNEL_B, -10);
+  ASSERT(color_pipeline_swap(&expected, "gbr"));
+  ASSERT(color_pipeline_contrast(&expected, IMGPROC_CHANNEL_A, 1.5));
+
+  color_pipeline_init(&parsed);
+  ASSERT(color_pipeline_parse(&parsed, "gamma=2.2,rb:brightness=-10,swap=gbr,a:contrast=1.5"));
+  ASSERT(imgproc_color_pipeline(&expected, objs->smiley, &expected_img));
+  ASSERT(imgproc_color_pipeline(&parsed, objs->smiley, objs->smiley_out));
+  ASSERT(images_equal(&expected_img, objs->smiley_out));
+
+  // channel prefixes on steps without an argument
+  color_pipeline_init(&expected);
+  color_pipeline_invert(&expected, IMGPROC_CHANNEL_R | IMGPROC_CHANNEL_G);
+  color_pipeline_invert(&expected, IMGPROC_CHANNEL_A);
+  color_pipeline_init(&parsed);
+  ASSERT(color_pipeline_parse(&parsed, "rg:invert,a:invert"));
+  ASSERT(imgproc_color_pipeline(&expected, objs->smiley, &expected_img));
+  ASSERT(imgproc_color_pipeline(&parsed, objs->smiley, objs->smiley_out));
+  ASSERT(images_equal(&expected_img, objs->smiley_out));
+  color_pipeline_init(&parsed);
+  ASSERT(color_pipeline_parse(&parsed, "rg:invert"));
+  color_pipeline_init(&parsed);
+  ASSERT(color_pipeline_parse(&parsed, "a:invert"));
+
+  color_pipeline_init(&parsed);
+  ASSERT(color_pipeline_parse(&parsed, "gray,invert,g:curve=0:10/255:245"));
+  ASSERT(!color_pipeline_parse(&parsed, "gamma"));
+  ASSERT(!color_pipeline_parse(&parsed, "gamma=2x"));
+  ASSERT(!color_pipeline_parse(&parsed, "x:invert"));
+  ASSERT(!color_pipeline_parse(&parsed, "invert,,invert"));
+  ASSERT(!color_pipeline_parse(&parsed, "curve=10:0/5:0"));
+  ASSERT(!color_pipeline_parse(&parsed, "sharpen=1"));
+
+  img_cleanup(&expected_img);
+}
+
+// Write an image, read it back, and return the PNG color type it was
+// written with (or -1 if the image didn't survive the round trip)
+int write_and_reread(struct Image *img, int format) {
+  const char *filename = "test_write_tmp.png";
+  struct Image reread;
+  int color_type = -1;
+
+  if (img_write_format(filename, img, format) == IMG_SUCCESS &&
+      img_read(filename, &reread) == IMG_SUCCESS) {
+    if (images_equal(img, &reread)) {
+      // the color type is byte 25 of the file, in the IHDR chunk
+      FILE *in = fopen(filename, "rb");
+      if (in != NULL && fseek(in, 25, SEEK_SET) == 0)
+        color_type = fgetc(in);
+      if (in != NULL)
+        fclose(in);
+    }
+    img_cleanup(&reread);
+  }
+  remove(filename);
+  return color_type;
+}
+
+void test_write_compact_formats(TestObjs *objs) {
+  // few colors: palette (3)
+  ASSERT(write_and_reread(objs->smiley, IMG_FORMAT_AUTO) == 3);
+  ASSERT(write_and_reread(objs->smiley, IMG_FORMAT_RGBA) == 6);
+
+  struct Image img;
+  img_init(&img, 20, 20);
+
+  // opaque gray: grayscale (0)
+  for (int i = 0; i < 400; i++)
+    img.data[i] = make_pixel(i / 2, i / 2, i / 2, 255);
+  ASSERT(write_and_reread(&img, IMG_FORMAT_AUTO) == 0);
+
+  // gray with more than 256 combinations of value and alpha (4)
+  for (int i = 0; i < 400; i++)
+    img.data[i] = make_pixel(i % 20 * 12, i % 20 * 12, i % 20 * 12, i / 20 * 12);
+  ASSERT(write_and_reread(&img, IMG_FORMAT_AUTO) == 4);
+  ASSERT(img_write_format("test_write_tmp.png", &img, IMG_FORMAT_PALETTE) == IMG_ERR_TOO_MANY_COLORS);
+
+  // opaque color: RGB (2), then translucent: RGBA (6)
+  for (int i = 0; i < 400; i++)
+    img.data[i] = make_pixel(i % 20 * 12, i / 20 * 12, 7, 255);
+  ASSERT(write_and_reread(&img, IMG_FORMAT_AUTO) == 2);
+  img.data[399] = make_pixel(1, 2, 3, 4);
+  ASSERT(write_and_reread(&img, IMG_FORMAT_AUTO) == 6);
+
+  // translucent palette entries need a tRNS chunk
+  for (int i = 0; i < 400; i++)
+    img.data[i] = make_pixel(i % 7, 0, 200, i % 5 * 60);
+  ASSERT(write_and_reread(&img, IMG_FORMAT_AUTO) == 3);
+
+  img_cleanup(&img);
+}
+
+void test_read_write_mem(TestObjs *objs) {
+  struct ImgBuffer buf;
+  struct Image reread;
+  img_buffer_init(&buf);
+
+  ASSERT(img_write_mem(&buf, objs->smiley, IMG_FORMAT_RGBA) == IMG_SUCCESS);
+  ASSERT(buf.size > 8 && memcmp(buf.data, "\x89PNG", 4) == 0);
+  ASSERT(img_read_mem(buf.data, buf.size, &reread) == IMG_SUCCESS);
+  ASSERT(images_equal(objs->smiley, &reread));
+  img_cleanup(&reread);
+
+  // writing again replaces the data, reusing the memory
+  unsigned char *data = buf.data;
+  ASSERT(img_write_mem(&buf, objs->smiley, IMG_FORMAT_AUTO) == IMG_SUCCESS);
+  ASSERT(buf.data == data && buf.size <= buf.capacity);
+  ASSERT(img_read_mem(buf.data, buf.size, &reread) == IMG_SUCCESS);
+  ASSERT(images_equal(objs->smiley, &reread));
+  img_cleanup(&reread);
+
+  // truncated data can't be read
+  ASSERT(img_read_mem(buf.data, buf.size / 2, &reread) != IMG_SUCCESS);
+  ASSERT(img_read_mem(buf.data, 4, &reread) != IMG_SUCCESS);
+
+  img_buffer_cleanup(&buf);
+  ASSERT(buf.data == NULL && buf.size == 0);
+}
+
+void test_composite_update(TestObjs *objs) {
+  (void) objs;
+
+  // a size that isn't a multiple of the 16x16 tiles
+  struct Image base, overlay, expected;
+  img_init(&base, 50, 40);
+  img_init(&overlay, 50, 40);
+  img_init(&expected, 50, 40);
+  for (int i = 0; i < 50 * 40; i++) {
+    base.data[i] = make_pixel(i % 251, i % 13 * 19, 77, 255);
+    overlay.data[i] = make_pixel(200, i % 7 * 30, i % 50, i % 3 * 100);
+  }
+
+  struct CompositeCache cache;
+  ASSERT(composite_cache_init(&cache, &base));
+
+  // the first update composites everything
+  ASSERT(imgproc_composite_update(&cache, &overlay));
+  ASSERT(imgproc_composite(&base, &overlay, &expected));
+  ASSERT(images_equal(&expected, &cache.output));
+  ASSERT(cache.num_dirty_rects == 1);
+  ASSERT(cache.dirty_rects[0].width == 50 && cache.dirty_rects[0].height == 40);
+
+  // an unchanged overlay changes nothing
+  ASSERT(imgproc_composite_update(&cache, &overlay));
+  ASSERT(cache.num_dirty_rects == 0);
+  ASSERT(cache.dirty_row_begin == cache.dirty_row_end);
+
+  // change a small badge straddling two tiles, and one pixel elsewhere
+  for (int y = 20; y < 23; y++)
+    for (int x = 14; x < 18; x++)
+      overlay.data[y * 50 + x] = make_pixel(255, 0, 0, 255);
+  overlay.data[39 * 50 + 49] = make_pixel(0, 0, 255, 128);
+  ASSERT(imgproc_composite_update(&cache, &overlay));
+  ASSERT(imgproc_composite(&base, &overlay, &expected));
+  ASSERT(images_equal(&expected, &cache.output));
+
+  ASSERT(cache.num_dirty_rects == 2);
+  ASSERT(cache.dirty_rects[0].x == 0 && cache.dirty_rects[0].y == 16);
+  ASSERT(cache.dirty_rects[0].width == 32 && cache.dirty_rects[0].height == 16);
+  ASSERT(cache.dirty_rects[1].x == 48 && cache.dirty_rects[1].y == 32);
+  ASSERT(cache.dirty_rects[1].width == 2 && cache.dirty_rects[1].height == 8);
+  ASSERT(cache.dirty_row_begin == 16 && cache.dirty_row_end == 40);
+
+  // overlays must match the base image's dimensions
+  struct Image small;
+  img_init(&small, 40, 50);
+  ASSERT(!imgproc_composite_update(&cache, &small));
+
+  img_cleanup(&small);
+  composite_cache_cleanup(&cache);
+  img_cleanup(&expected);
+  img_cleanup(&overlay);
+  img_cleanup(&base);
+}
+
+void test_planar_basic(TestObjs *objs) {
+  (void) objs;
+
+  // odd dimensions, so every loop has a scalar tail
+  int w = 37, h = 23, n = 37 * 23;
+  struct Image base, overlay, out;
+  img_init(&base, w, h);
+  img_init(&overlay, w, h);
+  img_init(&out, w, h);
+  for (int i = 0; i < n; i++) {
+    base.data[i] = make_pixel(i % 251, i % 13 * 19, (i * 7) % 256, i % 256);
+    overlay.data[i] = make_pixel(200, i % 7 * 30, i % 50, (i * 11) % 256);
+  }
+
+  struct PlanarImage pb, po, pout;
+  ASSERT(planar_init(&pb, w, h) == IMG_SUCCESS);
+  ASSERT(planar_init(&po, w, h) == IMG_SUCCESS);
+  ASSERT(planar_init(&pout, w, h) == IMG_SUCCESS);
+  ASSERT(((uintptr_t) pb.plane[1] & 63) == 0);
+
+  // round trip
+  ASSERT(planar_from_image(&base, &pb));
+  ASSERT(planar_from_image(&overlay, &po));
+  for (int i = 0; i < n; i++) {
+    ASSERT(pb.plane[0][i] == get_r(base.data[i]));
+    ASSERT(pb.plane[3][i] == get_a(base.data[i]));
+  }
+  ASSERT(planar_to_image(&pb, &out));
+  ASSERT(memcmp(out.data, base.data, n * sizeof(uint32_t)) == 0);
+
+  // grayscale
+  ASSERT(planar_grayscale(&pb, &pout));
+  ASSERT(planar_to_image(&pout, &out));
+  for (int i = 0; i < n; i++)
+    ASSERT(out.data[i] == to_grayscale(base.data[i]));
+
+  // composite
+  ASSERT(planar_composite(&pb, &po, &pout));
+  ASSERT(planar_to_image(&pout, &out));
+  for (int i = 0; i < n; i++)
+    ASSERT(out.data[i] == create_composite_pixel(base.data[i], overlay.data[i]));
+
+  // lookup table
+  uint8_t lut[4][256];
+  for (int v = 0; v < 256; v++) {
+    lut[0][v] = 255 - v;
+    lut[1][v] = v / 2;
+    lut[2][v] = v;
+    lut[3][v] = v * v / 255;
+  }
+  struct Image expected;
+  img_init(&expected, w, h);
+  imgproc_apply_lut(&base, lut, &expected);
+  ASSERT(planar_apply_lut(&pb, lut, &pout));
+  ASSERT(planar_to_image(&pout, &out));
+  ASSERT(memcmp(out.data, expected.data, n * sizeof(uint32_t)) == 0);
+
+  // convolution: the identity kernel copies, a blur matches a direct sum
+  const int identity[3][3] = { { 0, 0, 0 }, { 0, 1, 0 }, { 0, 0, 0 } };
+  ASSERT(planar_convolve3x3(&pb, identity, 0, &pout));
+  ASSERT(planar_to_image(&pout, &out));
+  ASSERT(memcmp(out.data, base.data, n * sizeof(uint32_t)) == 0);
+
+  const int blur[3][3] = { { 1, 2, 1 }, { 2, 4, 2 }, { 1, 2, 1 } };
+  ASSERT(planar_convolve3x3(&pb, blur, 4, &pout));
+  for (int c = 0; c < 3; c++) {
+    for (int y = 0; y < h; y++) {
+      for (int x = 0; x < w; x++) {
+        int sum = 0;
+        for (int dy = -1; dy <= 1; dy++) {
+          for (int dx = -1; dx <= 1; dx++) {
+            int yy = y + dy < 0 ? 0 : y + dy >= h ? h - 1 : y + dy;
+            int xx = x + dx < 0 ? 0 : x + dx >= w ? w - 1 : x + dx;
+            sum += blur[dy + 1][dx + 1] * pb.plane[c][yy * w + xx];
+          }
+        }
+        ASSERT(pout.plane[c][y * w + x] == (sum + 8) >> 4);
+      }
+    }
+  }
+  ASSERT(memcmp(pout.plane[3], pb.plane[3], n) == 0);
+
+  // out of range kernels, and in place convolution, are rejected
+  const int big[3][3] = { { 100, 0, 0 }, { 0, 100, 0 }, { 0, 0, 0 } };
+  ASSERT(!planar_convolve3x3(&pb, big, 7, &pout));
+  ASSERT(!planar_convolve3x3(&pb, blur, 4, &pb));
+
+  planar_cleanup(&pb);
+  planar_cleanup(&po);
+  planar_cleanup(&pout);
+  img_cleanup(&base);
+  img_cleanup(&overlay);
+  img_cleanup(&out);
+  img_cleanup(&expected);
+}
+
+void test_band_shift(TestObjs *objs) {
+  (void) objs;
+
+  ASSERT(imgproc_band_size(64) == 64);
+  imgproc_set_band_shift(2);
+  ASSERT(imgproc_band_size(64) == 256);
+  imgproc_set_band_shift(-3);
+  ASSERT(imgproc_band_size(64) == 8);
+  ASSERT(imgproc_band_size(4) == 1);
+  imgproc_set_band_shift(-100);
+  ASSERT(imgproc_band_shift() == -IMGPROC_MAX_BAND_SHIFT);
+
+  // results don't depend on the band size, including for histograms,
+  // which keep one partial histogram per band
+  struct Image img, expected, actual;
+  img_init(&img, 300, 500);
+  img_init(&expected, 300, 500);
+  img_init(&actual, 300, 500);
+  for (int i = 0; i < 300 * 500; i++)
+    img.data[i] = make_pixel(i % 200, i % 77 + 40, i % 13 * 9, 255);
+
+  imgproc_set_band_shift(0);
+  struct Histogram hist0, hist1;
+  ASSERT(imgproc_histogram(&img, &hist0));
+  ASSERT(imgproc_equalize(&img, &expected));
+  for (int shift = -IMGPROC_MAX_BAND_SHIFT; shift <= IMGPROC_MAX_BAND_SHIFT; shift += 2) {
+    imgproc_set_band_shift(shift);
+    ASSERT(imgproc_histogram(&img, &hist1));
+    ASSERT(memcmp(&hist0, &hist1, sizeof(hist0)) == 0);
+    ASSERT(imgproc_equalize(&img, &actual));
+    ASSERT(images_equal(&expected, &actual));
+  }
+  imgproc_set_band_shift(0);
+
+  img_cleanup(&img);
+  img_cleanup(&expected);
+  img_cleanup(&actual);
+}
+
+void test_tune_profile(TestObjs *objs) {
+  (void) objs;
+
+  struct TuneProfile profile, loaded;
+  tune_profile_init(&profile);
+  ASSERT(tune_profile_add(&profile, "grayscale", 0, 1, 0));
+  ASSERT(tune_profile_add(&profile, "grayscale", 500000, 4, -1));
+  ASSERT(tune_profile_add(&profile, "resize", 1000, 2, 3));
+  ASSERT(!tune_profile_add(&profile, "resize", 0, 0, 0));
+  ASSERT(!tune_profile_add(&profile, "resize", 0, 1, IMGPROC_MAX_BAND_SHIFT + 1));
+
+  // save and reload
+  const char *filename = "test_tune_tmp.profile";
+  ASSERT(tune_profile_save(&profile, filename));
+  ASSERT(tune_profile_load(&loaded, filename));
+  ASSERT(loaded.num_entries == 3);
+
+  // lookup picks the largest threshold not exceeding the job size
+  const struct TuneEntry *entry = tune_profile_lookup(&loaded, "grayscale", 100);
+  ASSERT(entry != NULL && entry->num_threads == 1);
+  entry = tune_profile_lookup(&loaded, "grayscale", 2000000);
+  ASSERT(entry != NULL && entry->num_threads == 4 && entry->band_shift == -1);
+  ASSERT(tune_profile_lookup(&loaded, "resize", 999) == NULL);
+  ASSERT(tune_profile_lookup(&loaded, "rotate90", 1000000) == NULL);
+
+  ASSERT(tune_profile_apply(&loaded, "resize", 5000));
+  ASSERT(imgproc_band_shift() == 3);
+  ASSERT(!tune_profile_apply(&loaded, "mirror_h", 5000));
+  imgproc_set_num_threads(0);
+  imgproc_set_band_shift(0);
+
+  // malformed profiles are rejected
+  FILE *out = fopen(filename, "w");
+  ASSERT(out != NULL);
+  fprintf(out, "# comment\n\ngrayscale 0 2\n");
+  fclose(out);
+  ASSERT(!tune_profile_load(&loaded, filename));
+  ASSERT(loaded.num_entries == 0);
+  ASSERT(!tune_profile_load(&loaded, "no_such_tmp.profile"));
+
+  remove(filename);
+}
@@ -0,0 +1,258 @@
+// imgproc_tune.c
+
+// Measure how fast each parallel transformation runs on this machine
+// with each combination of thread count and band size, at a few image
+// sizes, and write the fastest combinations to a tuning profile that
+// c_imgproc loads at startup (see tune.h).
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "imgproc.h"
+#include "parallel.h"
+#include "tune.h"
+
+#define MAX_SIZES 16
+
+// fraction by which a configuration must beat the default to be chosen
+#define TUNE_MIN_GAIN 0.03
+
+// A transformation to benchmark, named as on the c_imgproc command line
+struct Benchmark {
+  const char *name;
+  int (*run)( struct Image *input_img, struct Image *output_img );
+  int transposes;   // output has the input's dimensions swapped
+};
+
+static int run_grayscale( struct Image *input_img, struct Image *output_img ) {
+  imgproc_grayscale( input_img, output_img );
+  return 1;
+}
+
+static int run_color( struct Image *input_img, struct Image *output_img ) {
+  struct ColorPipeline pipeline;
+  color_pipeline_init( &pipeline );
+  color_pipeline_parse( &pipeline, "gamma=2.2,contrast=1.2,swap=bgr" );
+  return imgproc_color_pipeline( &pipeline, input_img, output_img );
+}
+
+static int run_equalize( struct Image *input_img, struct Image *output_img ) {
+  return imgproc_equalize( input_img, output_img );
+}
+
+static int run_autolevel( struct Image *input_img, struct Image *output_img ) {
+  return imgproc_autolevel( input_img, 0.01, output_img );
+}
+
+// resize benchmarks a 2/3 downscale; the output image is only used for
+// its pixel buffer, which is big enough
+static int run_resize( struct Image *input_img, struct Image *output_img ) {
+  struct Image out = { input_img->width * 2 / 3, input_img->height * 2 / 3, output_img->data };
+  return imgproc_resize( input_img, IMGPROC_FILTER_LANCZOS3, &out );
+}
+
+static const struct Benchmark benchmarks[] = {
+  { "grayscale", run_grayscale, 0 },
+  { "color", run_color, 0 },
+  { "equalize", run_equalize, 0 },
+  { "autolevel", run_autolevel, 0 },
+  { "resize", run_resize, 0 },
+  { "transpose", imgproc_transpose, 1 },
+  { "rotate90", imgproc_rotate90, 1 },
+  { "rotate270", imgproc_rotate270, 1 },
+  { "rotate180", imgproc_rotate180, 0 },
+};
+
+#define NUM_BENCHMARKS ( (int) ( sizeof( benchmarks ) / sizeof( benchmarks[0] ) ) )
+
+static double now( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Return the fastest of reps runs of a benchmark, in seconds, after one
+// untimed run to warm up the caches and page in the output
+static double time_benchmark( const struct Benchmark *bench, struct Image *input_img,
+                              struct Image *output_img, int reps ) {
+  double best = -1.0;
+
+  bench->run( input_img, output_img );
+  for ( int r = 0; r < reps; r++ ) {
+    double start = now();
+    bench->run( input_img, output_img );
+    double elapsed = now() - start;
+    if ( best < 0.0 || elapsed < best )
+      best = elapsed;
+  }
+  return best;
+}
+
+// Fill an image with pseudo-random pixels (a fixed sequence, so runs
+// are comparable)
+static void fill_img( struct Image *img ) {
+  uint32_t state = 12345;
+  long n = (long) img->width * img->height;
+  for ( long i = 0; i < n; i++ ) {
+    state = state * 1664525u + 1013904223u;
+    img->data[i] = state | 0xFF;
+  }
+}
+
+static void usage( const char *progname ) {
+  fprintf( stderr, "Usage: %s [-o profile] [-r reps] [-b max band shift] [-s WxH]...\n", progname );
+  fprintf( stderr, "  -o  profile to write (default $IMGPROC_PROFILE or %s)\n", TUNE_DEFAULT_PROFILE );
+  fprintf( stderr, "  -r  timed runs per configuration, the fastest counts (default 3)\n" );
+  fprintf( stderr, "  -b  try band shifts -b..b (default 2, at most %d)\n", IMGPROC_MAX_BAND_SHIFT );
+  fprintf( stderr, "  -s  image size to benchmark (may be repeated; default 256x256,\n" );
+  fprintf( stderr, "      1024x1024 and 3072x2048)\n" );
+  exit( 1 );
+}
+
+int main( int argc, char **argv ) {
+  const char *profile_filename = getenv( "IMGPROC_PROFILE" );
+  int reps = 3, max_shift = 2;
+  int widths[MAX_SIZES], heights[MAX_SIZES], num_sizes = 0;
+  int opt;
+
+  if ( profile_filename == NULL )
+    profile_filename = TUNE_DEFAULT_PROFILE;
+
+  while ( ( opt = getopt( argc, argv, "o:r:b:s:" ) ) != -1 ) {
+    switch ( opt ) {
+    case 'o':
+      profile_filename = optarg;
+      break;
+    case 'r':
+      if ( sscanf( optarg, "%d", &reps ) != 1 || reps < 1 )
+        usage( argv[0] );
+      break;
+    case 'b':
+      if ( sscanf( optarg, "%d", &max_shift ) != 1 || max_shift < 0 || max_shift > IMGPROC_MAX_BAND_SHIFT )
+        usage( argv[0] );
+      break;
+    case 's':
+      if ( num_sizes == MAX_SIZES ||
+           sscanf( optarg, "%dx%d", &widths[num_sizes], &heights[num_sizes] ) != 2 ||
+           widths[num_sizes] < 1 || heights[num_sizes] < 1 )
+        usage( argv[0] );
+      num_sizes++;
+      break;
+    default:
+      usage( argv[0] );
+    }
+  }
+  if ( optind != argc )
+    usage( argv[0] );
+
+  if ( num_sizes == 0 ) {
+    static const int default_sizes[][2] = { { 256, 256 }, { 1024, 1024 }, { 3072, 2048 } };
+    for ( ; num_sizes < 3; num_sizes++ ) {
+      widths[num_sizes] = default_sizes[num_sizes][0];
+      heights[num_sizes] = default_sizes[num_sizes][1];
+    }
+  }
+
+  // sort sizes by number of pixels, so each one's entry covers the
+  // images between it and the next smaller size
+  for ( int i = 1; i < num_sizes; i++ ) {
+    for ( int j = i; j > 0 && (long) widths[j] * heights[j] < (long) widths[j - 1] * heights[j - 1]; j-- ) {
+      int w = widths[j], h = heights[j];
+      widths[j] = widths[j - 1];
+      heights[j] = heights[j - 1];
+      widths[j - 1] = w;
+      heights[j - 1] = h;
+    }
+  }
+
+  // try 1 thread, powers of two, and one thread per CPU
+  imgproc_set_num_threads( 0 );
+  int max_threads = imgproc_num_threads();
+  int thread_counts[16], num_thread_counts = 0;
+  for ( int t = 1; t < max_threads; t *= 2 )
+    thread_counts[num_thread_counts++] = t;
+  thread_counts[num_thread_counts++] = max_threads;
+
+  struct TuneProfile profile;
+  tune_profile_init( &profile );
+
+  printf( "%-10s %11s %8s %6s %10s %10s\n", "transform", "size", "threads", "shift", "time (ms)", "default" );
+  for ( int s = 0; s < num_sizes; s++ ) {
+    long num_pixels = (long) widths[s] * heights[s];
+    struct Image input_img, output_img;
+
+    if ( img_init( &input_img, widths[s], heights[s] ) != IMG_SUCCESS ) {
+      fprintf( stderr, "Error: couldn't allocate %dx%d image\n", widths[s], heights[s] );
+      return 1;
+    }
+    if ( img_init( &output_img, widths[s], heights[s] ) != IMG_SUCCESS ) {
+      fprintf( stderr, "Error: couldn't allocate %dx%d image\n", widths[s], heights[s] );
+      img_cleanup( &input_img );
+      return 1;
+    }
+    fill_img( &input_img );
+
+    // this size's entries apply from halfway (geometrically) between it
+    // and the next smaller size
+    long min_pixels = s == 0 ? 0 : (long) sqrt( (double) num_pixels * widths[s - 1] * heights[s - 1] );
+
+    for ( int b = 0; b < NUM_BENCHMARKS; b++ ) {
+      const struct Benchmark *bench = &benchmarks[b];
+      double best_time = -1.0, default_time = -1.0;
+      int best_threads = 1, best_shift = 0;
+
+      if ( bench->transposes ) {
+        output_img.width = heights[s];
+        output_img.height = widths[s];
+      } else {
+        output_img.width = widths[s];
+        output_img.height = heights[s];
+      }
+
+      for ( int i = 0; i < num_thread_counts; i++ ) {
+        int t = thread_counts[i];
+        for ( int shift = -max_shift; shift <= max_shift; shift++ ) {
+          imgproc_set_num_threads( t );
+          imgproc_set_band_shift( shift );
+          double elapsed = time_benchmark( bench, &input_img, &output_img, reps );
+          if ( best_time < 0.0 || elapsed < best_time ) {
+            best_time = elapsed;
+            best_threads = t;
+            best_shift = shift;
+          }
+          if ( t == max_threads && shift == 0 )
+            default_time = elapsed;
+        }
+      }
+
+      // stick with the defaults unless another configuration is clearly
+      // faster, rather than recording timing noise
+      if ( default_time <= best_time * ( 1.0 + TUNE_MIN_GAIN ) ) {
+        best_time = default_time;
+        best_threads = max_threads;
+        best_shift = 0;
+      }
+
+      printf( "%-10s %5dx%-5d %8d %6d %10.3f %10.3f\n", bench->name, widths[s], heights[s],
+              best_threads, best_shift, best_time * 1e3, default_time * 1e3 );
+      fflush( stdout );
+      tune_profile_add( &profile, bench->name, min_pixels, best_threads, best_shift );
+    }
+
+    img_cleanup( &input_img );
+    img_cleanup( &output_img );
+  }
+
+  imgproc_set_num_threads( 0 );
+  imgproc_set_band_shift( 0 );
+
+  if ( !tune_profile_save( &profile, profile_filename ) ) {
+    fprintf( stderr, "Error: couldn't write profile %s\n", profile_filename );
+    return 1;
+  }
+  printf( "Wrote %s\n", profile_filename );
+  return 0;
+}
@@ -0,0 +1,115 @@
+// parallel.c
+
+// Band-level threading used by the image transformations
+
+#include <limits.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "parallel.h"
+
+// upper limit on threads started for a single parallel loop
+#define MAX_THREADS 64
+
+static int num_threads_override;
+static int band_shift;
+
+// Shared state of one imgproc_parallel_for call
+struct ParallelLoop {
+  int count;
+  int grain;
+  int next_band;   // index of next band to hand out (updated atomically)
+  imgproc_band_fn fn;
+  void *arg;
+};
+
+int imgproc_num_threads( void ) {
+  if ( num_threads_override > 0 )
+    return num_threads_override;
+
+  const char *env = getenv( "IMGPROC_THREADS" );
+  if ( env != NULL ) {
+    int n = atoi( env );
+    if ( n > 0 )
+      return n > MAX_THREADS ? MAX_THREADS : n;
+  }
+
+  long ncpus = sysconf( _SC_NPROCESSORS_ONLN );
+  if ( ncpus < 1 )
+    return 1;
+  return ncpus > MAX_THREADS ? MAX_THREADS : (int) ncpus;
+}
+
+void imgproc_set_num_threads( int num_threads ) {
+  num_threads_override = num_threads > MAX_THREADS ? MAX_THREADS : num_threads;
+}
+
+int imgproc_band_shift( void ) {
+  return band_shift;
+}
+
+void imgproc_set_band_shift( int shift ) {
+  if ( shift > IMGPROC_MAX_BAND_SHIFT )
+    shift = IMGPROC_MAX_BAND_SHIFT;
+  if ( shift < -IMGPROC_MAX_BAND_SHIFT )
+    shift = -IMGPROC_MAX_BAND_SHIFT;
+  band_shift = shift;
+}
+
+int imgproc_band_size( int grain ) {
+  if ( grain < 1 )
+    grain = 1;
+  if ( band_shift < 0 )
+    grain >>= -band_shift;
+  else if ( grain <= INT_MAX >> band_shift )
+    grain <<= band_shift;
+  else
+    grain = INT_MAX;
+  return grain < 1 ? 1 : grain;
+}
+
+// Repeatedly claim the next unprocessed band and process it,
+// until there are no bands left
+static void *parallel_worker( void *p ) {
+  struct ParallelLoop *loop = p;
+
+  for ( ;; ) {
+    int band = __atomic_fetch_add( &loop->next_band, 1, __ATOMIC_RELAXED );
+    long begin = (long) band * loop->grain;
+    if ( begin >= loop->count )
+      break;
+    long end = begin + loop->grain;
+    if ( end > loop->count )
+      end = loop->count;
+    loop->fn( loop->arg, (int) begin, (int) end );
+  }
+
+  return NULL;
+}
+
+void imgproc_parallel_for( int count, int grain, imgproc_band_fn fn, void *arg ) {
+  if ( count <= 0 )
+    return;
+  grain = imgproc_band_size( grain );
+
+  struct ParallelLoop loop = { count, grain, 0, fn, arg };
+
+  // never start more threads than there are bands
+  int num_bands = (int) ( ( (long) count + grain - 1 ) / grain );
+  int num_threads = imgproc_num_threads();
+  if ( num_threads > num_bands )
+    num_threads = num_bands;
+
+  pthread_t threads[MAX_THREADS];
+  int num_started = 0;
+  for ( int i = 1; i < num_threads; i++ ) {
+    if ( pthread_create( &threads[num_started], NULL, parallel_worker, &loop ) != 0 )
+      break; // the calling thread picks up the slack
+    num_started++;
+  }
+
+  parallel_worker( &loop );
+
+  for ( int i = 0; i < num_started; i++ )
+    pthread_join( threads[i], NULL );
+}
@@ -0,0 +1,61 @@
+// Helpers for splitting image transformations into bands of rows
+// (or other independent units of work) that are processed concurrently
+// by a small group of threads.
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Function called to process items [begin, end) of a parallel loop.
+// arg is the pointer that was passed to imgproc_parallel_for.
+typedef void (*imgproc_band_fn)( void *arg, int begin, int end );
+
+// Return the number of threads parallel transformations will use.
+// This is the value set by imgproc_set_num_threads if it was called,
+// otherwise the IMGPROC_THREADS environment variable if it is set,
+// otherwise the number of online CPUs.
+int imgproc_num_threads( void );
+
+// Override the number of threads parallel transformations will use.
+// Passing a value less than 1 restores the default.
+void imgproc_set_num_threads( int num_threads );
+
+// Return the band size scaling set by imgproc_set_band_shift (0 unless
+// it was called).
+int imgproc_band_shift( void );
+
+// Scale the bands of every parallel loop by 2^shift: each loop's grain
+// is multiplied by 2^shift if shift is positive, or divided by 2^-shift
+// (but not below 1) if it is negative. Values are limited to
+// -IMGPROC_MAX_BAND_SHIFT..IMGPROC_MAX_BAND_SHIFT, so grains that are
+// multiples of 2^IMGPROC_MAX_BAND_SHIFT stay multiples of 16.
+void imgproc_set_band_shift( int shift );
+
+#define IMGPROC_MAX_BAND_SHIFT 4
+
+// Return the number of items per band imgproc_parallel_for uses for the
+// given grain, with the band shift applied.
+int imgproc_band_size( int grain );
+
+// Process items [0, count) by calling fn on consecutive bands of (at most)
+// imgproc_band_size( grain ) items. Bands are handed out dynamically to up to
+// imgproc_num_threads() threads, one of which is the calling thread.
+// Returns once every band has been processed. If threads can't be
+// created, the remaining bands are processed by the calling thread.
+//
+// Parameters:
+//   count - number of items to process
+//   grain - default number of items per band (values less than 1 are
+//           treated as 1)
+//   fn    - function processing one band
+//   arg   - pointer passed through to fn
+void imgproc_parallel_for( int count, int grain, imgproc_band_fn fn, void *arg );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PARALLEL_H
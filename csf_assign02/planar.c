@@ -0,0 +1,384 @@
+// planar.c
+
+// Planar (structure of arrays) images, with one plane of bytes per
+// channel, and transformations working on them a vector of bytes at a
+// time instead of unpacking each pixel with shifts and masks
+
+#include <stdlib.h>
+#include <string.h>
+#include "imgproc.h"
+#include "parallel.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// planes start on cache line boundaries
+#define PLANE_ALIGN 64
+
+// number of pixels per band handed to a thread (a multiple of the 16
+// pixels the vector loops handle at once, so bands start aligned)
+#define PLANAR_BAND_PIXELS 65536
+
+// number of rows per band for convolution
+#define CONVOLVE_BAND_ROWS 16
+
+int planar_init( struct PlanarImage *img, int32_t width, int32_t height ) {
+  size_t num_pixels = (size_t) width * height;
+
+  // round each plane up to whole cache lines, plus one spare line, so
+  // vector loops may read (but not use) a little past the last pixel
+  size_t plane_size = ( num_pixels + PLANE_ALIGN - 1 ) / PLANE_ALIGN * PLANE_ALIGN + PLANE_ALIGN;
+  void *storage;
+  if ( posix_memalign( &storage, PLANE_ALIGN, 4 * plane_size ) != 0 )
+    return IMG_ERR_MALLOC_FAILED;
+  memset( storage, 0, 4 * plane_size );
+
+  img->width = width;
+  img->height = height;
+  for ( int c = 0; c < 4; c++ )
+    img->plane[c] = (uint8_t *) storage + c * plane_size;
+  return IMG_SUCCESS;
+}
+
+void planar_cleanup( struct PlanarImage *img ) {
+  // all four planes share the allocation starting at the red plane
+  free( img->plane[0] );
+  for ( int c = 0; c < 4; c++ )
+    img->plane[c] = NULL;
+}
+
+static int same_size( int32_t w1, int32_t h1, int32_t w2, int32_t h2 ) {
+  return w1 == w2 && h1 == h2;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Layout conversion
+////////////////////////////////////////////////////////////////////////
+
+struct ConvertJob {
+  struct Image *packed;
+  struct PlanarImage *planar;
+};
+
+// Packed pixels are stored as bytes a, b, g, r (little endian r<<24 |
+// g<<16 | b<<8 | a), so splitting 16 of them into planes is three rounds
+// of interleaving bytes from pairs of vectors
+static void unpack_band( void *arg, int begin, int end ) {
+  struct ConvertJob *job = arg;
+  const uint32_t *src = job->packed->data;
+  uint8_t *r = job->planar->plane[0], *g = job->planar->plane[1];
+  uint8_t *b = job->planar->plane[2], *a = job->planar->plane[3];
+  int i = begin;
+
+#ifdef __SSE2__
+  for ( ; i + 15 < end; i += 16 ) {
+    __m128i v0 = _mm_loadu_si128( (const __m128i *) ( src + i ) );
+    __m128i v1 = _mm_loadu_si128( (const __m128i *) ( src + i + 4 ) );
+    __m128i v2 = _mm_loadu_si128( (const __m128i *) ( src + i + 8 ) );
+    __m128i v3 = _mm_loadu_si128( (const __m128i *) ( src + i + 12 ) );
+
+    __m128i t0 = _mm_unpacklo_epi8( v0, v1 ), t1 = _mm_unpackhi_epi8( v0, v1 );
+    __m128i t2 = _mm_unpacklo_epi8( v2, v3 ), t3 = _mm_unpackhi_epi8( v2, v3 );
+    __m128i u0 = _mm_unpacklo_epi8( t0, t1 ), u1 = _mm_unpackhi_epi8( t0, t1 );
+    __m128i u2 = _mm_unpacklo_epi8( t2, t3 ), u3 = _mm_unpackhi_epi8( t2, t3 );
+    __m128i w0 = _mm_unpacklo_epi8( u0, u1 ); // a0..a7 b0..b7
+    __m128i w1 = _mm_unpackhi_epi8( u0, u1 ); // g0..g7 r0..r7
+    __m128i w2 = _mm_unpacklo_epi8( u2, u3 ); // a8..a15 b8..b15
+    __m128i w3 = _mm_unpackhi_epi8( u2, u3 ); // g8..g15 r8..r15
+
+    _mm_store_si128( (__m128i *) ( a + i ), _mm_unpacklo_epi64( w0, w2 ) );
+    _mm_store_si128( (__m128i *) ( b + i ), _mm_unpackhi_epi64( w0, w2 ) );
+    _mm_store_si128( (__m128i *) ( g + i ), _mm_unpacklo_epi64( w1, w3 ) );
+    _mm_store_si128( (__m128i *) ( r + i ), _mm_unpackhi_epi64( w1, w3 ) );
+  }
+#endif
+
+  for ( ; i < end; i++ ) {
+    uint32_t p = src[i];
+    r[i] = p >> 24;
+    g[i] = p >> 16;
+    b[i] = p >> 8;
+    a[i] = p;
+  }
+}
+
+// The reverse of unpack_band: interleave the planes back into pixels
+static void pack_band( void *arg, int begin, int end ) {
+  struct ConvertJob *job = arg;
+  uint32_t *dst = job->packed->data;
+  const uint8_t *r = job->planar->plane[0], *g = job->planar->plane[1];
+  const uint8_t *b = job->planar->plane[2], *a = job->planar->plane[3];
+  int i = begin;
+
+#ifdef __SSE2__
+  for ( ; i + 15 < end; i += 16 ) {
+    __m128i va = _mm_load_si128( (const __m128i *) ( a + i ) );
+    __m128i vb = _mm_load_si128( (const __m128i *) ( b + i ) );
+    __m128i vg = _mm_load_si128( (const __m128i *) ( g + i ) );
+    __m128i vr = _mm_load_si128( (const __m128i *) ( r + i ) );
+
+    __m128i ab_lo = _mm_unpacklo_epi8( va, vb ), ab_hi = _mm_unpackhi_epi8( va, vb );
+    __m128i gr_lo = _mm_unpacklo_epi8( vg, vr ), gr_hi = _mm_unpackhi_epi8( vg, vr );
+
+    _mm_storeu_si128( (__m128i *) ( dst + i ), _mm_unpacklo_epi16( ab_lo, gr_lo ) );
+    _mm_storeu_si128( (__m128i *) ( dst + i + 4 ), _mm_unpackhi_epi16( ab_lo, gr_lo ) );
+    _mm_storeu_si128( (__m128i *) ( dst + i + 8 ), _mm_unpacklo_epi16( ab_hi, gr_hi ) );
+    _mm_storeu_si128( (__m128i *) ( dst + i + 12 ), _mm_unpackhi_epi16( ab_hi, gr_hi ) );
+  }
+#endif
+
+  for ( ; i < end; i++ )
+    dst[i] = ( (uint32_t) r[i] << 24 ) | ( (uint32_t) g[i] << 16 ) | ( (uint32_t) b[i] << 8 ) | a[i];
+}
+
+int planar_from_image( struct Image *input_img, struct PlanarImage *output_img ) {
+  if ( !same_size( input_img->width, input_img->height, output_img->width, output_img->height ) )
+    return 0;
+
+  struct ConvertJob job = { input_img, output_img };
+  imgproc_parallel_for( input_img->width * input_img->height, PLANAR_BAND_PIXELS, unpack_band, &job );
+  return 1;
+}
+
+int planar_to_image( struct PlanarImage *input_img, struct Image *output_img ) {
+  if ( !same_size( input_img->width, input_img->height, output_img->width, output_img->height ) )
+    return 0;
+
+  struct ConvertJob job = { output_img, input_img };
+  imgproc_parallel_for( input_img->width * input_img->height, PLANAR_BAND_PIXELS, pack_band, &job );
+  return 1;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Transformations
+////////////////////////////////////////////////////////////////////////
+
+// Input and output images of a planar transformation
+struct PlanarJob {
+  const struct PlanarImage *in;
+  const struct PlanarImage *in2;   // overlay, for composite
+  struct PlanarImage *out;
+  const void *param;
+};
+
+static void grayscale_band( void *arg, int begin, int end ) {
+  struct PlanarJob *job = arg;
+  const uint8_t *r = job->in->plane[0], *g = job->in->plane[1], *b = job->in->plane[2];
+  uint8_t *out = job->out->plane[0];
+  int i = begin;
+
+#ifdef __SSE2__
+  // 79 * 255 + 128 * 255 + 49 * 255 < 65536, so 16 bit lanes are enough
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i kr = _mm_set1_epi16( 79 ), kg = _mm_set1_epi16( 128 ), kb = _mm_set1_epi16( 49 );
+  for ( ; i + 15 < end; i += 16 ) {
+    __m128i vr = _mm_load_si128( (const __m128i *) ( r + i ) );
+    __m128i vg = _mm_load_si128( (const __m128i *) ( g + i ) );
+    __m128i vb = _mm_load_si128( (const __m128i *) ( b + i ) );
+
+    __m128i lo = _mm_add_epi16( _mm_mullo_epi16( _mm_unpacklo_epi8( vr, zero ), kr ),
+                                _mm_mullo_epi16( _mm_unpacklo_epi8( vg, zero ), kg ) );
+    lo = _mm_srli_epi16( _mm_add_epi16( lo, _mm_mullo_epi16( _mm_unpacklo_epi8( vb, zero ), kb ) ), 8 );
+    __m128i hi = _mm_add_epi16( _mm_mullo_epi16( _mm_unpackhi_epi8( vr, zero ), kr ),
+                                _mm_mullo_epi16( _mm_unpackhi_epi8( vg, zero ), kg ) );
+    hi = _mm_srli_epi16( _mm_add_epi16( hi, _mm_mullo_epi16( _mm_unpackhi_epi8( vb, zero ), kb ) ), 8 );
+
+    _mm_store_si128( (__m128i *) ( out + i ), _mm_packus_epi16( lo, hi ) );
+  }
+#endif
+
+  for ( ; i < end; i++ )
+    out[i] = ( 79 * r[i] + 128 * g[i] + 49 * b[i] ) / 256;
+
+  // the gray value goes in all three color planes, alpha is unchanged
+  memcpy( job->out->plane[1] + begin, out + begin, end - begin );
+  memcpy( job->out->plane[2] + begin, out + begin, end - begin );
+  if ( job->out != job->in )
+    memcpy( job->out->plane[3] + begin, job->in->plane[3] + begin, end - begin );
+}
+
+int planar_grayscale( struct PlanarImage *input_img, struct PlanarImage *output_img ) {
+  if ( !same_size( input_img->width, input_img->height, output_img->width, output_img->height ) )
+    return 0;
+
+  struct PlanarJob job = { input_img, NULL, output_img, NULL };
+  imgproc_parallel_for( input_img->width * input_img->height, PLANAR_BAND_PIXELS, grayscale_band, &job );
+  return 1;
+}
+
+#ifdef __SSE2__
+// (fa * fg + (255 - fa) * bg) / 255 for 8 16 bit lanes, dividing by 255
+// exactly as (x * 0x8081) >> 23, which holds for every 16 bit x
+static inline __m128i blend_epi16( __m128i fg, __m128i bg, __m128i fa ) {
+  const __m128i k255 = _mm_set1_epi16( 255 ), kdiv = _mm_set1_epi16( (short) 0x8081 );
+  __m128i x = _mm_add_epi16( _mm_mullo_epi16( fa, fg ), _mm_mullo_epi16( _mm_sub_epi16( k255, fa ), bg ) );
+  return _mm_srli_epi16( _mm_mulhi_epu16( x, kdiv ), 7 );
+}
+#endif
+
+static void composite_band( void *arg, int begin, int end ) {
+  struct PlanarJob *job = arg;
+  const uint8_t *fa = job->in2->plane[3];
+
+  for ( int c = 0; c < 3; c++ ) {
+    const uint8_t *bg = job->in->plane[c], *fg = job->in2->plane[c];
+    uint8_t *out = job->out->plane[c];
+    int i = begin;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for ( ; i + 15 < end; i += 16 ) {
+      __m128i vbg = _mm_load_si128( (const __m128i *) ( bg + i ) );
+      __m128i vfg = _mm_load_si128( (const __m128i *) ( fg + i ) );
+      __m128i vfa = _mm_load_si128( (const __m128i *) ( fa + i ) );
+      __m128i lo = blend_epi16( _mm_unpacklo_epi8( vfg, zero ), _mm_unpacklo_epi8( vbg, zero ),
+                                _mm_unpacklo_epi8( vfa, zero ) );
+      __m128i hi = blend_epi16( _mm_unpackhi_epi8( vfg, zero ), _mm_unpackhi_epi8( vbg, zero ),
+                                _mm_unpackhi_epi8( vfa, zero ) );
+      _mm_store_si128( (__m128i *) ( out + i ), _mm_packus_epi16( lo, hi ) );
+    }
+#endif
+
+    for ( ; i < end; i++ )
+      out[i] = ( fa[i] * fg[i] + ( 255 - fa[i] ) * bg[i] ) / 255;
+  }
+
+  memset( job->out->plane[3] + begin, 255, end - begin );
+}
+
+int planar_composite( struct PlanarImage *base_img, struct PlanarImage *overlay_img,
+                      struct PlanarImage *output_img ) {
+  if ( !same_size( base_img->width, base_img->height, overlay_img->width, overlay_img->height ) ||
+       !same_size( base_img->width, base_img->height, output_img->width, output_img->height ) )
+    return 0;
+
+  struct PlanarJob job = { base_img, overlay_img, output_img, NULL };
+  imgproc_parallel_for( base_img->width * base_img->height, PLANAR_BAND_PIXELS, composite_band, &job );
+  return 1;
+}
+
+static void lut_band( void *arg, int begin, int end ) {
+  struct PlanarJob *job = arg;
+  const uint8_t (*lut)[256] = job->param;
+
+  for ( int c = 0; c < 4; c++ ) {
+    const uint8_t *in = job->in->plane[c];
+    const uint8_t *table = lut[c];
+    uint8_t *out = job->out->plane[c];
+
+    // one table per plane, so the inner loop is a plain byte lookup
+    for ( int i = begin; i < end; i++ )
+      out[i] = table[in[i]];
+  }
+}
+
+int planar_apply_lut( struct PlanarImage *input_img, const uint8_t lut[4][256],
+                      struct PlanarImage *output_img ) {
+  if ( !same_size( input_img->width, input_img->height, output_img->width, output_img->height ) )
+    return 0;
+
+  struct PlanarJob job = { input_img, NULL, output_img, lut };
+  imgproc_parallel_for( input_img->width * input_img->height, PLANAR_BAND_PIXELS, lut_band, &job );
+  return 1;
+}
+
+// Parameters of a 3x3 convolution
+struct ConvolveParams {
+  int kernel[3][3];
+  int shift;
+};
+
+static inline uint8_t convolve_clamp( int sum, int shift ) {
+  int v = ( sum + ( ( 1 << shift ) >> 1 ) ) >> shift;
+  return v < 0 ? 0 : v > 255 ? 255 : (uint8_t) v;
+}
+
+// Convolve pixel x of a row, reading neighbors with coordinates clamped
+// to the edges of the image
+static inline uint8_t convolve_pixel( const uint8_t *rows[3], int x, int w,
+                                      const struct ConvolveParams *p ) {
+  int sum = 0;
+  for ( int dy = 0; dy < 3; dy++ ) {
+    for ( int dx = 0; dx < 3; dx++ ) {
+      int xx = x + dx - 1;
+      xx = xx < 0 ? 0 : xx >= w ? w - 1 : xx;
+      sum += p->kernel[dy][dx] * rows[dy][xx];
+    }
+  }
+  return convolve_clamp( sum, p->shift );
+}
+
+static void convolve_band( void *arg, int begin, int end ) {
+  struct PlanarJob *job = arg;
+  const struct ConvolveParams *p = job->param;
+  int w = job->in->width, h = job->in->height;
+
+  for ( int c = 0; c < 3; c++ ) {
+    const uint8_t *in = job->in->plane[c];
+    uint8_t *out = job->out->plane[c];
+
+    for ( int y = begin; y < end; y++ ) {
+      const uint8_t *rows[3] = {
+        in + (long) ( y > 0 ? y - 1 : 0 ) * w,
+        in + (long) y * w,
+        in + (long) ( y < h - 1 ? y + 1 : h - 1 ) * w,
+      };
+      uint8_t *dst = out + (long) y * w;
+      int x = 1;
+
+      dst[0] = convolve_pixel( rows, 0, w, p );
+
+#ifdef __SSE2__
+      // 8 pixels at a time in 16 bit lanes; the kernel's coefficients are
+      // small enough (checked by planar_convolve3x3) that sums can't overflow
+      const __m128i zero = _mm_setzero_si128();
+      const __m128i round = _mm_set1_epi16( (short) ( ( 1 << p->shift ) >> 1 ) );
+      __m128i k[3][3];
+      for ( int dy = 0; dy < 3; dy++ )
+        for ( int dx = 0; dx < 3; dx++ )
+          k[dy][dx] = _mm_set1_epi16( (short) p->kernel[dy][dx] );
+
+      for ( ; x + 8 < w; x += 8 ) {
+        __m128i sum = round;
+        for ( int dy = 0; dy < 3; dy++ ) {
+          for ( int dx = 0; dx < 3; dx++ ) {
+            __m128i v = _mm_loadl_epi64( (const __m128i *) ( rows[dy] + x + dx - 1 ) );
+            sum = _mm_add_epi16( sum, _mm_mullo_epi16( _mm_unpacklo_epi8( v, zero ), k[dy][dx] ) );
+          }
+        }
+        sum = _mm_sra_epi16( sum, _mm_cvtsi32_si128( p->shift ) );
+        _mm_storel_epi64( (__m128i *) ( dst + x ), _mm_packus_epi16( sum, sum ) );
+      }
+#endif
+
+      for ( ; x < w; x++ )
+        dst[x] = convolve_pixel( rows, x, w, p );
+    }
+  }
+}
+
+int planar_convolve3x3( struct PlanarImage *input_img, const int kernel[3][3], int shift,
+                        struct PlanarImage *output_img ) {
+  if ( !same_size( input_img->width, input_img->height, output_img->width, output_img->height ) ||
+       input_img == output_img || shift < 0 || shift > 7 )
+    return 0;
+
+  struct ConvolveParams params;
+  int total = 0;
+  for ( int dy = 0; dy < 3; dy++ ) {
+    for ( int dx = 0; dx < 3; dx++ ) {
+      params.kernel[dy][dx] = kernel[dy][dx];
+      total += abs( kernel[dy][dx] );
+    }
+  }
+  // keeps every sum within 16 bits: 128 * 255 + rounding < 32768
+  if ( total > 128 )
+    return 0;
+  params.shift = shift;
+
+  struct PlanarJob job = { input_img, NULL, output_img, &params };
+  imgproc_parallel_for( input_img->height, CONVOLVE_BAND_ROWS, convolve_band, &job );
+  memcpy( output_img->plane[3], input_img->plane[3], (size_t) input_img->width * input_img->height );
+  return 1;
+}
@@ -184,7 +184,7 @@ static int png_read_ihdr(png_t* png)
 	png->filter_method = ihdr[15];
 	png->interlace_method = ihdr[16];
 
-	if(png->color_type == PNG_INDEXED)
+	if(png->color_type == PNG_INDEXED && png->depth != 8)
 		return PNG_NOT_SUPPORTED;
 
 	if(png->depth != 8 && png->depth != 16)
@@ -259,6 +259,8 @@ int png_open_read(png_t* png, png_read_callback_t read_fun, void* user_pointer)
 	png->read_fun = read_fun;
 	png->write_fun = 0;
 	png->user_pointer = user_pointer;
+	png->palette_len = 0;
+	png->trns_len = 0;
 
 	if(!read_fun && !user_pointer)
 		return PNG_WRONG_ARGUMENTS;
@@ -281,6 +283,8 @@ int png_open_write(png_t* png, png_write_callback_t write_fun, void* user_pointe
 	png->write_fun = write_fun;
 	png->read_fun = 0;
 	png->user_pointer = user_pointer;
+	png->palette_len = 0;
+	png->trns_len = 0;
 
 	if(!write_fun && !user_pointer)
 		return PNG_WRONG_ARGUMENTS;
@@ -553,6 +557,55 @@ static int png_read_idat(png_t* png, unsigned length)
 	return png_inflate(png, png->readbuf, length);
 }
 
+static int png_read_palette_chunk(png_t* png, unsigned type, unsigned length)
+{
+	unsigned char chunk[4+256*3];
+	unsigned char* dest;
+	unsigned max_len;
+#if DO_CRC_CHECKS
+	unsigned orig_crc;
+	unsigned calc_crc;
+#endif
+
+	if(type == *(unsigned int*)"PLTE")
+	{
+		if(length % 3 != 0)
+			return PNG_HEADER_ERROR;
+		dest = png->palette;
+		max_len = 256*3;
+		png->palette_len = length / 3;
+	}
+	else
+	{
+		dest = png->trns;
+		max_len = 256;
+		png->trns_len = length;
+	}
+
+	if(length > max_len)
+		return PNG_HEADER_ERROR;
+
+	memcpy(chunk, &type, 4);
+	if(file_read(png, chunk+4, 1, length) != length)
+		return PNG_FILE_ERROR;
+
+#if DO_CRC_CHECKS
+	calc_crc = crc32(0L, Z_NULL, 0);
+	calc_crc = crc32(calc_crc, chunk, length+4);
+
+	file_read_ul(png, &orig_crc);
+
+	if(orig_crc != calc_crc)
+		return PNG_CRC_ERROR;
+#else
+	file_read_ul(png);
+#endif
+
+	memcpy(dest, chunk+4, length);
+
+	return PNG_NO_ERROR;
+}
+
 static int png_process_chunk(png_t* png)
 {
 	int result = PNG_NO_ERROR;
@@ -588,6 +641,11 @@ static int png_process_chunk(png_t* png)
 	{
 		return PNG_DONE;
 	}
+	else if(png->color_type == PNG_INDEXED &&
+		(type == *(unsigned int*)"PLTE" || type == *(unsigned int*)"tRNS"))
+	{
+		return png_read_palette_chunk(png, type, length);
+	}
 	else
 	{
 		file_read(png, 0, 1, length + 4); /* unknown chunk */
@@ -596,6 +654,22 @@ static int png_process_chunk(png_t* png)
 	return result;
 }
 
+static int png_write_chunk(png_t* png, const char* type, const unsigned char* data, unsigned length)
+{
+	unsigned crc;
+
+	crc = crc32(0L, Z_NULL, 0);
+	crc = crc32(crc, (const unsigned char*)type, 4);
+	crc = crc32(crc, data, length);
+
+	file_write_ul(png, length);
+	file_write(png, (void*)type, 1, 4);
+	file_write(png, (void*)data, 1, length);
+	file_write_ul(png, crc);
+
+	return PNG_NO_ERROR;
+}
+
 static void png_filter_sub(int stride, unsigned char* in, unsigned char* out, int len)
 {
 	int i;
@@ -826,6 +900,12 @@ int png_set_data(png_t* png, unsigned width, unsigned height, char depth, int co
 
 	png_filter(png, filtered);
 	png_write_ihdr(png);
+	if(color == PNG_INDEXED)
+	{
+		png_write_chunk(png, "PLTE", png->palette, png->palette_len*3);
+		if(png->trns_len)
+			png_write_chunk(png, "tRNS", png->trns, png->trns_len);
+	}
 	png_write_idats(png, filtered);
 
 	png_free(filtered);
@@ -833,6 +913,31 @@ int png_set_data(png_t* png, unsigned width, unsigned height, char depth, int co
 	return PNG_NO_ERROR;
 }
 
+int png_set_palette(png_t* png, const unsigned char* rgb, const unsigned char* alpha, unsigned count)
+{
+	unsigned i;
+
+	if(count < 1 || count > 256)
+		return PNG_WRONG_ARGUMENTS;
+
+	memcpy(png->palette, rgb, count*3);
+	png->palette_len = count;
+	png->trns_len = 0;
+
+	if(alpha)
+	{
+		/* only entries up to the last non-opaque one need to be stored */
+		for(i = 0; i < count; i++)
+		{
+			png->trns[i] = alpha[i];
+			if(alpha[i] != 255)
+				png->trns_len = i + 1;
+		}
+	}
+
+	return PNG_NO_ERROR;
+}
+
 char* png_error_string(int error)
 {
 	switch(error)
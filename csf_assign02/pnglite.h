@@ -27,6 +27,9 @@
 /*
  * This file was modified 22-Mar-2020 by David Hovemeyer
  * to eliminate compiler warnings.
+ *
+ * Also modified to read and write 8-bit palette images
+ * (PLTE and tRNS chunks).
  */
 
 
@@ -103,6 +106,11 @@ typedef struct
 
 	unsigned char*			readbuf;
 	unsigned			readbuflen;
+
+	unsigned char			palette[256*3];	/* PLTE entries, as r, g, b triples */
+	unsigned			palette_len;	/* number of PLTE entries */
+	unsigned char			trns[256];	/* alpha of the first trns_len PLTE entries */
+	unsigned			trns_len;
 } png_t;
 
 /*
@@ -217,6 +225,24 @@ int png_get_data(png_t* png, unsigned char* data);
 
 int png_set_data(png_t* png, unsigned width, unsigned height, char depth, int color, unsigned char* data);
 
+/*
+	Function: png_set_palette
+
+	This function sets the palette written by png_set_data for PNG_INDEXED images. After png_get_data has read a
+	PNG_INDEXED image, the palette read from the file is in the palette and trns fields of the png_t.
+
+	Parameters:
+		png - png_t struct opened for writing.
+		rgb - count palette entries, as r, g, b triples.
+		alpha - alpha value of each palette entry, or a null-pointer if all entries are opaque.
+		count - number of palette entries (1 to 256).
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_set_palette(png_t* png, const unsigned char* rgb, const unsigned char* alpha, unsigned count);
+
 /*
 	Function: png_close_file
 
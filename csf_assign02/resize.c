@@ -0,0 +1,345 @@
+// resize.c
+
+// Resampling of images to arbitrary dimensions using a separable
+// box, bilinear, or Lanczos-3 filter
+
+#include <stdlib.h>
+#include <math.h>
+#include "imgproc.h"
+#include "parallel.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// number of rows processed per band in each pass
+#define RESIZE_BAND_ROWS 16
+
+// filter weights are fixed point numbers with this many fraction bits
+#define WEIGHT_BITS 14
+
+// Filter taps contributing to each sample of one output dimension.
+// Weights are stored in pairs so that the vector kernels can
+// multiply-add two taps at a time; an odd number of taps is
+// padded with a zero weight.
+struct ResampleWeights {
+  int max_taps;    // stride of the weights array (always even)
+  int *first;      // index of first source sample for each output sample
+  int *num_taps;   // number of source samples for each output sample
+  int16_t *weights; // fixed point weights (summing to 1) per output sample
+  int32_t *pairs;  // each pair of weights, repeated 4 times (vector ready)
+};
+
+// Everything the two passes need, shared by all of the worker threads
+struct ResizeJob {
+  struct Image *input_img;
+  struct Image *output_img;
+  struct ResampleWeights horiz;
+  struct ResampleWeights vert;
+  int first_row;   // first input row read by the vertical pass
+  uint32_t *tmp;   // horizontally resampled rows
+};
+
+static double filter_support( int filter ) {
+  switch ( filter ) {
+  case IMGPROC_FILTER_BOX:      return 0.5;
+  case IMGPROC_FILTER_BILINEAR: return 1.0;
+  default:                      return 3.0;
+  }
+}
+
+static double sinc( double x ) {
+  if ( x == 0.0 )
+    return 1.0;
+  x *= M_PI;
+  return sin( x ) / x;
+}
+
+static double filter_eval( int filter, double x ) {
+  switch ( filter ) {
+  case IMGPROC_FILTER_BOX:
+    return ( x >= -0.5 && x < 0.5 ) ? 1.0 : 0.0;
+  case IMGPROC_FILTER_BILINEAR:
+    x = fabs( x );
+    return x < 1.0 ? 1.0 - x : 0.0;
+  default:
+    x = fabs( x );
+    return x < 3.0 ? sinc( x ) * sinc( x / 3.0 ) : 0.0;
+  }
+}
+
+static void free_weights( struct ResampleWeights *w ) {
+  free( w->first );
+  free( w->num_taps );
+  free( w->weights );
+  free( w->pairs );
+}
+
+// Precompute the filter taps mapping in_size source samples onto
+// out_size output samples. When shrinking, the filter is stretched
+// by the scale factor so that every source sample contributes.
+//
+// Returns:
+//   1 if successful, 0 if memory couldn't be allocated
+static int compute_weights( int in_size, int out_size, int filter, struct ResampleWeights *w ) {
+  double scale = (double) in_size / out_size;
+  double filter_scale = scale > 1.0 ? scale : 1.0;
+  double support = filter_support( filter ) * filter_scale;
+
+  w->max_taps = (int) ceil( support ) * 2 + 2;
+  w->first = malloc( out_size * sizeof( int ) );
+  w->num_taps = malloc( out_size * sizeof( int ) );
+  w->weights = calloc( (size_t) out_size * w->max_taps, sizeof( int16_t ) );
+  w->pairs = malloc( (size_t) out_size * w->max_taps * 2 * sizeof( int32_t ) );
+  double *k = malloc( w->max_taps * sizeof( double ) );
+  if ( w->first == NULL || w->num_taps == NULL || w->weights == NULL ||
+       w->pairs == NULL || k == NULL ) {
+    free_weights( w );
+    free( k );
+    return 0;
+  }
+
+  for ( int i = 0; i < out_size; i++ ) {
+    double center = ( i + 0.5 ) * scale;
+    int lo = (int) ( center - support + 0.5 );
+    int hi = (int) ( center + support + 0.5 );
+    if ( lo < 0 )
+      lo = 0;
+    if ( hi > in_size )
+      hi = in_size;
+    if ( hi - lo > w->max_taps )
+      hi = lo + w->max_taps;
+
+    double total = 0.0;
+    for ( int x = lo; x < hi; x++ ) {
+      k[x - lo] = filter_eval( filter, ( x - center + 0.5 ) / filter_scale );
+      total += k[x - lo];
+    }
+
+    // drop zero-weight taps at either end
+    int skip = 0;
+    while ( lo + skip < hi && k[skip] == 0.0 )
+      skip++;
+    while ( hi > lo + skip && k[hi - lo - 1] == 0.0 )
+      hi--;
+
+    int16_t *row = w->weights + (size_t) i * w->max_taps;
+    if ( hi <= lo + skip || total == 0.0 ) {
+      // a degenerate filter still has to pick some source sample
+      lo = (int) center < in_size ? (int) center : in_size - 1;
+      hi = lo + 1;
+      row[0] = 1 << WEIGHT_BITS;
+    } else {
+      // normalize so that a flat input stays flat; rounding errors
+      // are folded into the largest weight so that the fixed point
+      // weights sum to exactly 1
+      int sum = 0, largest = 0;
+      for ( int x = 0; x < hi - lo - skip; x++ ) {
+        row[x] = (int16_t) lrint( k[x + skip] / total * ( 1 << WEIGHT_BITS ) );
+        sum += row[x];
+        if ( row[x] > row[largest] )
+          largest = x;
+      }
+      row[largest] += ( 1 << WEIGHT_BITS ) - sum;
+      lo += skip;
+    }
+
+    w->first[i] = lo;
+    w->num_taps[i] = hi - lo;
+
+    int32_t *pair = w->pairs + (size_t) i * w->max_taps * 2;
+    for ( int t = 0; t < w->max_taps; t += 2 ) {
+      int32_t kk = (uint16_t) row[t] | ( (uint32_t) (uint16_t) row[t + 1] << 16 );
+      for ( int j = 0; j < 4; j++ )
+        pair[t * 2 + j] = kk;
+    }
+  }
+
+  free( k );
+  return 1;
+}
+
+#ifdef __SSE2__
+// Interleave the channels of two pixels as 16 bit values
+// (a0 b0 a1 b1 a2 b2 a3 b3), ready to be multiplied by a pair of weights
+static inline __m128i interleave_pixels( __m128i two_pixels ) {
+  __m128i v = _mm_unpacklo_epi8( two_pixels, _mm_srli_si128( two_pixels, 4 ) );
+  return _mm_unpacklo_epi8( v, _mm_setzero_si128() );
+}
+
+// Round four 32 bit fixed point channel sums, clamp them to 0..255,
+// and pack them into a pixel
+static inline uint32_t pack_pixel( __m128i acc ) {
+  __m128i v = _mm_srai_epi32( acc, WEIGHT_BITS );
+  v = _mm_packs_epi32( v, v );
+  v = _mm_packus_epi16( v, v );
+  return (uint32_t) _mm_cvtsi128_si32( v );
+}
+#endif
+
+// Round a fixed point channel sum and clamp it to 0..255
+static inline uint32_t clamp_channel( int32_t acc ) {
+  acc >>= WEIGHT_BITS;
+  if ( acc < 0 )
+    return 0;
+  return acc > 255 ? 255 : (uint32_t) acc;
+}
+
+// Compute one resampled pixel from n consecutive pixels (separated
+// by stride) and their weights
+static inline uint32_t filter_pixel( const uint32_t *src, long stride, const int16_t *k, int n ) {
+  int32_t acc[4] = { 1 << ( WEIGHT_BITS - 1 ), 1 << ( WEIGHT_BITS - 1 ),
+                     1 << ( WEIGHT_BITS - 1 ), 1 << ( WEIGHT_BITS - 1 ) };
+  for ( int t = 0; t < n; t++ ) {
+    uint32_t p = src[t * stride];
+    for ( int c = 0; c < 4; c++ )
+      acc[c] += k[t] * (int32_t) ( ( p >> ( c * 8 ) ) & 0xFF );
+  }
+  return clamp_channel( acc[0] ) | ( clamp_channel( acc[1] ) << 8 )
+       | ( clamp_channel( acc[2] ) << 16 ) | ( clamp_channel( acc[3] ) << 24 );
+}
+
+// Horizontal pass: resample input rows [begin, end) (relative to
+// job->first_row) into job->tmp
+static void resize_horiz_band( void *arg, int begin, int end ) {
+  struct ResizeJob *job = arg;
+  const struct ResampleWeights *w = &job->horiz;
+  int in_w = job->input_img->width;
+  int out_w = job->output_img->width;
+
+  for ( int r = begin; r < end; r++ ) {
+    const uint32_t *src = job->input_img->data + (size_t) ( job->first_row + r ) * in_w;
+    uint32_t *dst = job->tmp + (size_t) r * out_w;
+
+    for ( int x = 0; x < out_w; x++ ) {
+      const uint32_t *s = src + w->first[x];
+      int n = w->num_taps[x];
+#ifdef __SSE2__
+      // four taps per iteration, two taps per multiply-add
+      const __m128i *kk = (const __m128i *) ( w->pairs + (size_t) x * w->max_taps * 2 );
+      __m128i zero = _mm_setzero_si128();
+      __m128i acc = _mm_set1_epi32( 1 << ( WEIGHT_BITS - 1 ) );
+      int t = 0;
+      for ( ; t + 3 < n; t += 4 ) {
+        __m128i v = _mm_loadu_si128( (const __m128i *) ( s + t ) );
+        v = _mm_shuffle_epi32( v, _MM_SHUFFLE( 3, 1, 2, 0 ) );
+        v = _mm_unpacklo_epi8( v, _mm_unpackhi_epi64( v, v ) );
+        acc = _mm_add_epi32( acc, _mm_madd_epi16( _mm_unpacklo_epi8( v, zero ), _mm_loadu_si128( kk + t / 2 ) ) );
+        acc = _mm_add_epi32( acc, _mm_madd_epi16( _mm_unpackhi_epi8( v, zero ), _mm_loadu_si128( kk + t / 2 + 1 ) ) );
+      }
+      for ( ; t < n; t += 2 ) {
+        __m128i v = t + 1 < n ? _mm_loadl_epi64( (const __m128i *) ( s + t ) )
+                              : _mm_cvtsi32_si128( (int) s[t] );
+        acc = _mm_add_epi32( acc, _mm_madd_epi16( interleave_pixels( v ), _mm_loadu_si128( kk + t / 2 ) ) );
+      }
+      dst[x] = pack_pixel( acc );
+#else
+      const int16_t *k = w->weights + (size_t) x * w->max_taps;
+      dst[x] = filter_pixel( s, 1, k, n );
+#endif
+    }
+  }
+}
+
+// Vertical pass: produce output rows [begin, end) from job->tmp
+static void resize_vert_band( void *arg, int begin, int end ) {
+  struct ResizeJob *job = arg;
+  const struct ResampleWeights *w = &job->vert;
+  int out_w = job->output_img->width;
+
+  for ( int y = begin; y < end; y++ ) {
+    const int16_t *k = w->weights + (size_t) y * w->max_taps;
+    int n = w->num_taps[y];
+    const uint32_t *src = job->tmp + (size_t) ( w->first[y] - job->first_row ) * out_w;
+    uint32_t *dst = job->output_img->data + (size_t) y * out_w;
+    int x = 0;
+
+#ifdef __SSE2__
+    // four output pixels at a time, two source rows per multiply-add
+    __m128i zero = _mm_setzero_si128();
+    for ( ; x + 3 < out_w; x += 4 ) {
+      __m128i acc0 = _mm_set1_epi32( 1 << ( WEIGHT_BITS - 1 ) );
+      __m128i acc1 = acc0, acc2 = acc0, acc3 = acc0;
+      for ( int t = 0; t < n; t += 2 ) {
+        __m128i r0 = _mm_loadu_si128( (const __m128i *) ( src + (size_t) t * out_w + x ) );
+        __m128i r1 = t + 1 < n ? _mm_loadu_si128( (const __m128i *) ( src + (size_t) ( t + 1 ) * out_w + x ) ) : zero;
+        __m128i kk = _mm_set1_epi32( (int) ( (uint16_t) k[t] | ( (uint32_t) (uint16_t) k[t + 1] << 16 ) ) );
+        __m128i lo = _mm_unpacklo_epi8( r0, r1 );
+        __m128i hi = _mm_unpackhi_epi8( r0, r1 );
+        acc0 = _mm_add_epi32( acc0, _mm_madd_epi16( _mm_unpacklo_epi8( lo, zero ), kk ) );
+        acc1 = _mm_add_epi32( acc1, _mm_madd_epi16( _mm_unpackhi_epi8( lo, zero ), kk ) );
+        acc2 = _mm_add_epi32( acc2, _mm_madd_epi16( _mm_unpacklo_epi8( hi, zero ), kk ) );
+        acc3 = _mm_add_epi32( acc3, _mm_madd_epi16( _mm_unpackhi_epi8( hi, zero ), kk ) );
+      }
+      dst[x + 0] = pack_pixel( acc0 );
+      dst[x + 1] = pack_pixel( acc1 );
+      dst[x + 2] = pack_pixel( acc2 );
+      dst[x + 3] = pack_pixel( acc3 );
+    }
+#endif
+    for ( ; x < out_w; x++ )
+      dst[x] = filter_pixel( src + x, out_w, k, n );
+  }
+}
+
+// Resample input image to the dimensions of the output image.
+//
+// Parameters:
+//   input_img  - pointer to the input Image
+//   filter     - one of the IMGPROC_FILTER_* values
+//   output_img - pointer to the output Image; its width and height
+//                determine the size of the resampled image
+//
+// Returns:
+//   1 if successful, or 0 if the filter is unknown, either image
+//   is empty, or memory couldn't be allocated
+int imgproc_resize( struct Image *input_img, int filter, struct Image *output_img ) {
+  if ( filter != IMGPROC_FILTER_BOX && filter != IMGPROC_FILTER_BILINEAR &&
+       filter != IMGPROC_FILTER_LANCZOS3 )
+    return 0;
+  if ( input_img->width < 1 || input_img->height < 1 ||
+       output_img->width < 1 || output_img->height < 1 )
+    return 0;
+
+  struct ResizeJob job;
+  job.input_img = input_img;
+  job.output_img = output_img;
+
+  if ( !compute_weights( input_img->width, output_img->width, filter, &job.horiz ) )
+    return 0;
+  if ( !compute_weights( input_img->height, output_img->height, filter, &job.vert ) ) {
+    free_weights( &job.horiz );
+    return 0;
+  }
+
+  // only the input rows the vertical filter actually reads need
+  // to be resampled horizontally
+  int end_row = 0;
+  job.first_row = input_img->height;
+  for ( int y = 0; y < output_img->height; y++ ) {
+    if ( job.vert.first[y] < job.first_row )
+      job.first_row = job.vert.first[y];
+    if ( job.vert.first[y] + job.vert.num_taps[y] > end_row )
+      end_row = job.vert.first[y] + job.vert.num_taps[y];
+  }
+  int num_rows = end_row - job.first_row;
+
+  job.tmp = malloc( (size_t) num_rows * output_img->width * sizeof( uint32_t ) );
+  if ( job.tmp == NULL ) {
+    free_weights( &job.horiz );
+    free_weights( &job.vert );
+    return 0;
+  }
+
+  imgproc_parallel_for( num_rows, RESIZE_BAND_ROWS, resize_horiz_band, &job );
+  imgproc_parallel_for( output_img->height, RESIZE_BAND_ROWS, resize_vert_band, &job );
+
+  free( job.tmp );
+  free_weights( &job.horiz );
+  free_weights( &job.vert );
+  return 1;
+}
@@ -0,0 +1,119 @@
+// rotate.c
+
+// Transpose and rotation transformations. These are shared by the C and
+// assembly builds: the block kernels they rely on (imgproc_transpose_block
+// and imgproc_reverse_row) are implemented in both c_imgproc_fns.c and
+// asm_imgproc_fns.S.
+
+#include "imgproc.h"
+#include "parallel.h"
+
+// blocks at most this many pixels wide and high are copied directly
+// (two 32x32 blocks of pixels fit comfortably in L1 cache)
+#define TRANSPOSE_LEAF 32
+
+// number of source columns per band handed to a thread
+#define TRANSPOSE_BAND_COLS 64
+
+// number of rows per band for rotate180
+#define ROTATE_BAND_ROWS 32
+
+// Parameters of a (possibly flipped) transpose of a whole image
+struct TransposeJob {
+  const uint32_t *src;
+  long src_stride;
+  uint32_t *dst;
+  long dst_stride;
+  int height;
+};
+
+// Cache-oblivious transpose: split the larger dimension in half until
+// the block is small enough, so that at every level of the memory
+// hierarchy some level of the recursion works on blocks that fit.
+// Splits are kept at multiples of 4 so that the vector kernel sees
+// whole 4x4 tiles wherever possible.
+static void transpose_rec( const uint32_t *src, long src_stride,
+                           uint32_t *dst, long dst_stride, int width, int height ) {
+  if ( width <= TRANSPOSE_LEAF && height <= TRANSPOSE_LEAF ) {
+    imgproc_transpose_block( src, src_stride, dst, dst_stride, width, height );
+  } else if ( width >= height ) {
+    int half = ( width / 2 + 3 ) & ~3;
+    transpose_rec( src, src_stride, dst, dst_stride, half, height );
+    transpose_rec( src + half, src_stride, dst + half * dst_stride, dst_stride,
+                   width - half, height );
+  } else {
+    int half = ( height / 2 + 3 ) & ~3;
+    transpose_rec( src, src_stride, dst, dst_stride, width, half );
+    transpose_rec( src + half * src_stride, src_stride, dst + half, dst_stride,
+                   width, height - half );
+  }
+}
+
+// Transpose source columns [begin, end), which become destination rows
+// [begin, end), so that different bands never write the same cache lines
+static void transpose_band( void *arg, int begin, int end ) {
+  struct TransposeJob *job = arg;
+  transpose_rec( job->src + begin, job->src_stride,
+                 job->dst + begin * job->dst_stride, job->dst_stride,
+                 end - begin, job->height );
+}
+
+static void transpose_image( const uint32_t *src, long src_stride,
+                             uint32_t *dst, long dst_stride, int width, int height ) {
+  struct TransposeJob job = { src, src_stride, dst, dst_stride, height };
+  imgproc_parallel_for( width, TRANSPOSE_BAND_COLS, transpose_band, &job );
+}
+
+static int has_transposed_dims( struct Image *input_img, struct Image *output_img ) {
+  return output_img->width == input_img->height && output_img->height == input_img->width;
+}
+
+int imgproc_transpose( struct Image *input_img, struct Image *output_img ) {
+  if ( !has_transposed_dims( input_img, output_img ) )
+    return 0;
+
+  int w = input_img->width, h = input_img->height;
+  transpose_image( input_img->data, w, output_img->data, h, w, h );
+  return 1;
+}
+
+// Rotating clockwise is transposing the input with its rows in reverse
+// order, which is just a transpose reading from the last row upwards.
+int imgproc_rotate90( struct Image *input_img, struct Image *output_img ) {
+  if ( !has_transposed_dims( input_img, output_img ) )
+    return 0;
+
+  int w = input_img->width, h = input_img->height;
+  transpose_image( input_img->data + (long) ( h - 1 ) * w, -w, output_img->data, h, w, h );
+  return 1;
+}
+
+// Rotating counterclockwise is transposing into the output with its rows
+// in reverse order, which is just a transpose writing from the last row up.
+int imgproc_rotate270( struct Image *input_img, struct Image *output_img ) {
+  if ( !has_transposed_dims( input_img, output_img ) )
+    return 0;
+
+  int w = input_img->width, h = input_img->height;
+  transpose_image( input_img->data, w, output_img->data + (long) ( w - 1 ) * h, -h, w, h );
+  return 1;
+}
+
+// Output rows [begin, end) of a 180 degree rotation are the reversed
+// input rows counting up from the bottom
+static void rotate180_band( void *arg, int begin, int end ) {
+  struct Image **imgs = arg;
+  int w = imgs[0]->width, h = imgs[0]->height;
+
+  for ( int y = begin; y < end; y++ )
+    imgproc_reverse_row( imgs[0]->data + (long) ( h - 1 - y ) * w, imgs[1]->data + (long) y * w, w );
+}
+
+int imgproc_rotate180( struct Image *input_img, struct Image *output_img ) {
+  if ( output_img->width != input_img->width || output_img->height != input_img->height )
+    return 0;
+
+  struct Image *imgs[2] = { input_img, output_img };
+  imgproc_parallel_for( input_img->height, ROTATE_BAND_ROWS, rotate180_band, imgs );
+  return 1;
+}
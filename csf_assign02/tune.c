@@ -0,0 +1,114 @@
+// tune.c
+
+// Reading, writing and applying tuning profiles (see tune.h)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "parallel.h"
+#include "tune.h"
+
+void tune_profile_init( struct TuneProfile *profile ) {
+  profile->num_entries = 0;
+}
+
+int tune_profile_add( struct TuneProfile *profile, const char *transform,
+                      long min_pixels, int num_threads, int band_shift ) {
+  if ( profile->num_entries >= TUNE_MAX_ENTRIES || strlen( transform ) >= TUNE_MAX_NAME ||
+       transform[0] == '\0' || min_pixels < 0 || num_threads < 1 ||
+       band_shift < -IMGPROC_MAX_BAND_SHIFT || band_shift > IMGPROC_MAX_BAND_SHIFT )
+    return 0;
+
+  struct TuneEntry *entry = &profile->entries[profile->num_entries++];
+  strcpy( entry->transform, transform );
+  entry->min_pixels = min_pixels;
+  entry->num_threads = num_threads;
+  entry->band_shift = band_shift;
+  return 1;
+}
+
+// Parse one line of a profile into an entry.
+//
+// Returns:
+//   1 if the line held an entry, 0 if it was blank or a comment, or -1
+//   if it is malformed
+static int parse_line( struct TuneProfile *profile, const char *line ) {
+  char name[TUNE_MAX_NAME];
+  long min_pixels;
+  int num_threads, band_shift;
+  char extra;
+
+  const char *p = line + strspn( line, " \t\r\n" );
+  if ( *p == '\0' || *p == '#' )
+    return 0;
+
+  // %31s matches TUNE_MAX_NAME - 1
+  if ( sscanf( p, "%31s %ld %d %d %c", name, &min_pixels, &num_threads, &band_shift, &extra ) != 4 )
+    return -1;
+  return tune_profile_add( profile, name, min_pixels, num_threads, band_shift ) ? 1 : -1;
+}
+
+int tune_profile_load( struct TuneProfile *profile, const char *filename ) {
+  tune_profile_init( profile );
+
+  FILE *in = fopen( filename, "r" );
+  if ( in == NULL )
+    return 0;
+
+  char line[256];
+  int ok = 1;
+  while ( ok && fgets( line, sizeof( line ), in ) != NULL ) {
+    if ( strchr( line, '\n' ) == NULL && !feof( in ) )
+      ok = 0;   // line too long
+    else if ( parse_line( profile, line ) < 0 )
+      ok = 0;
+  }
+  if ( ferror( in ) )
+    ok = 0;
+  fclose( in );
+
+  if ( !ok )
+    tune_profile_init( profile );
+  return ok;
+}
+
+int tune_profile_save( const struct TuneProfile *profile, const char *filename ) {
+  FILE *out = fopen( filename, "w" );
+  if ( out == NULL )
+    return 0;
+
+  fprintf( out, "# imgproc tuning profile, written by imgproc_tune\n" );
+  fprintf( out, "# transformation, min pixels, threads, band shift\n" );
+  for ( int i = 0; i < profile->num_entries; i++ ) {
+    const struct TuneEntry *entry = &profile->entries[i];
+    fprintf( out, "%s %ld %d %d\n", entry->transform, entry->min_pixels,
+             entry->num_threads, entry->band_shift );
+  }
+
+  int ok = fflush( out ) == 0 && !ferror( out );
+  return fclose( out ) == 0 && ok;
+}
+
+const struct TuneEntry *tune_profile_lookup( const struct TuneProfile *profile,
+                                             const char *transform, long num_pixels ) {
+  const struct TuneEntry *best = NULL;
+
+  for ( int i = 0; i < profile->num_entries; i++ ) {
+    const struct TuneEntry *entry = &profile->entries[i];
+    if ( strcmp( entry->transform, transform ) == 0 && entry->min_pixels <= num_pixels &&
+         ( best == NULL || entry->min_pixels > best->min_pixels ) )
+      best = entry;
+  }
+  return best;
+}
+
+int tune_profile_apply( const struct TuneProfile *profile, const char *transform, long num_pixels ) {
+  const struct TuneEntry *entry = tune_profile_lookup( profile, transform, num_pixels );
+  if ( entry == NULL )
+    return 0;
+
+  if ( getenv( "IMGPROC_THREADS" ) == NULL )
+    imgproc_set_num_threads( entry->num_threads );
+  imgproc_set_band_shift( entry->band_shift );
+  return 1;
+}
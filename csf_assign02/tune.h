@@ -0,0 +1,87 @@
+// Tuning profiles: the thread count and band size that worked best for
+// each transformation at each image size on a particular machine, as
+// measured by imgproc_tune, and applied by c_imgproc before it runs a
+// transformation.
+//
+// A profile is a text file with one entry per line:
+//
+//   <transformation> <min pixels> <threads> <band shift>
+//
+// meaning that the transformation, on an image of at least min pixels
+// (and fewer than the next entry's), should use that many threads and
+// band shift (see imgproc_set_band_shift). Blank lines and lines
+// starting with # are ignored.
+
+#ifndef TUNE_H
+#define TUNE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// default profile file, used when IMGPROC_PROFILE isn't set
+#define TUNE_DEFAULT_PROFILE "imgproc_tune.profile"
+
+#define TUNE_MAX_ENTRIES 256
+#define TUNE_MAX_NAME 32
+
+struct TuneEntry {
+  char transform[TUNE_MAX_NAME];
+  long min_pixels;
+  int num_threads;
+  int band_shift;
+};
+
+struct TuneProfile {
+  int num_entries;
+  struct TuneEntry entries[TUNE_MAX_ENTRIES];
+};
+
+// Initialize an empty profile
+void tune_profile_init( struct TuneProfile *profile );
+
+// Add an entry to a profile.
+//
+// Returns:
+//   1 if successful, or 0 if the profile is full or an argument is
+//   out of range
+int tune_profile_add( struct TuneProfile *profile, const char *transform,
+                      long min_pixels, int num_threads, int band_shift );
+
+// Read a profile from the named file, replacing the profile's entries.
+//
+// Returns:
+//   1 if successful, or 0 if the file couldn't be opened or is malformed
+//   (in which case the profile is left empty)
+int tune_profile_load( struct TuneProfile *profile, const char *filename );
+
+// Write a profile to the named file.
+//
+// Returns:
+//   1 if successful, or 0 if the file couldn't be written
+int tune_profile_save( const struct TuneProfile *profile, const char *filename );
+
+// Find the entry for a transformation applied to an image of the given
+// number of pixels: the one for that transformation with the largest
+// min_pixels not exceeding num_pixels.
+//
+// Returns:
+//   pointer to the entry, or NULL if there is none
+const struct TuneEntry *tune_profile_lookup( const struct TuneProfile *profile,
+                                             const char *transform, long num_pixels );
+
+// Configure the parallel loops (imgproc_set_num_threads and
+// imgproc_set_band_shift) for a transformation of an image of the given
+// number of pixels. Setting IMGPROC_THREADS takes precedence over the
+// profile's thread count.
+//
+// Returns:
+//   1 if the profile has an entry for the job, or 0 if not (in which
+//   case the configuration is left unchanged)
+int tune_profile_apply( const struct TuneProfile *profile, const char *transform, long num_pixels );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TUNE_H
@@ -0,0 +1,572 @@
+// External sorting, for files larger than the memory budget.
+//
+// Run generation: the file is read in chunks, into two buffers in
+// turn, as large as the budget allows after the scratch memory of the
+// sort function. While one chunk is sorted (in parallel, by the sort
+// function parsort was configured with), the next one is read into the
+// other buffer. The sorted chunk is then written out, while waiting
+// for the next read to finish. Each sorted chunk ("run") goes to the
+// same offset in a temporary file.
+//
+// Merging: runs are merged fan_in at a time, where fan_in is as many
+// as the budget has room for (two input buffers per run and two output
+// buffers, per worker, each at least MIN_IO_ELEMENTS long). Each
+// merged group replaces its runs at the same offsets, in a second
+// temporary file. The final merge writes to the original file. A merge
+// is split between the workers by value: splitters chosen from a sample
+// of the runs, and located in each run by binary search, give each
+// worker its own part of every run and of the output. A worker merges
+// its part with a loser tree. Reads and writes are double-buffered with
+// POSIX asynchronous I/O, so the disk works while the worker merges.
+//
+// Temporary files are created next to the input file and unlinked
+// straight away. They need as much disk space as the input, or twice
+// that if more than one merge pass is needed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <aio.h>
+#include <sys/mman.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "parsort.h"
+#include "ws_pool.h"
+
+// smallest read or write worth making during a merge (64 KiB)
+#define MIN_IO_ELEMENTS 8192
+
+// elements sampled from each run to choose the splitters of a merge
+#define SAMPLES_PER_RUN 64
+
+// A sorted run: elements [start, start + len) of a file
+struct Run {
+  unsigned long start, len;
+};
+
+// An asynchronous read or write. If it couldn't be started, it was
+// done synchronously instead.
+struct Io {
+  struct aiocb cb;
+  int done_sync;
+  int ok;
+};
+
+// Read or write all of the given bytes at offset in a file.
+//
+// Return:
+//   1 if successful, 0 on error or end of file
+int transfer_all( int fd, char *buf, size_t bytes, off_t offset, int write ) {
+  while ( bytes > 0 ) {
+    ssize_t n = write ? pwrite( fd, buf, bytes, offset ) : pread( fd, buf, bytes, offset );
+    if ( n < 0 && errno == EINTR )
+      continue;
+    if ( n <= 0 )
+      return 0;
+    buf += n;
+    bytes -= n;
+    offset += n;
+  }
+  return 1;
+}
+
+static void io_start( struct Io *io, int fd, void *buf, unsigned long num_elements,
+                      unsigned long element_offset, int write ) {
+  memset( &io->cb, 0, sizeof( io->cb ) );
+  io->cb.aio_fildes = fd;
+  io->cb.aio_buf = buf;
+  io->cb.aio_nbytes = num_elements * sizeof(int64_t);
+  io->cb.aio_offset = element_offset * sizeof(int64_t);
+  io->done_sync = 0;
+
+  if ( ( write ? aio_write( &io->cb ) : aio_read( &io->cb ) ) != 0 ) {
+    io->done_sync = 1;
+    io->ok = transfer_all( fd, buf, io->cb.aio_nbytes, io->cb.aio_offset, write );
+  }
+}
+
+// Wait for an operation to finish (finishing a short transfer
+// synchronously).
+//
+// Return:
+//   1 if all the data was transferred, 0 on error
+static int io_finish( struct Io *io, int write ) {
+  if ( io->done_sync )
+    return io->ok;
+
+  const struct aiocb *list[1] = { &io->cb };
+  while ( aio_error( &io->cb ) == EINPROGRESS )
+    aio_suspend( list, 1, NULL );
+  ssize_t n = aio_return( &io->cb );
+  if ( n < 0 )
+    return 0;
+  return transfer_all( io->cb.aio_fildes, (char *) io->cb.aio_buf + n, io->cb.aio_nbytes - n,
+                       io->cb.aio_offset + n, write );
+}
+
+// Create an unlinked temporary file next to the file at path.
+static int create_temp_file( const char *path ) {
+  char *name = malloc( strlen( path ) + sizeof( ".tmpXXXXXX" ) );
+  if ( name == NULL )
+    return -1;
+  sprintf( name, "%s.tmpXXXXXX", path );
+  int fd = mkstemp( name );
+  if ( fd >= 0 )
+    unlink( name );
+  free( name );
+  return fd;
+}
+
+// Sort the file in chunks of chunk elements, writing each run to the
+// same place in out_fd.
+static int generate_runs( int in_fd, int out_fd, unsigned long n, unsigned long chunk,
+                          sort_fn sort, void *sort_arg ) {
+  // shared mappings, so that sort engines using processes can sort them
+  size_t bytes = chunk * sizeof(int64_t);
+  int64_t *buf[2];
+  buf[0] = mmap( NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+  buf[1] = mmap( NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+  if ( buf[0] == MAP_FAILED || buf[1] == MAP_FAILED ) {
+    if ( buf[0] != MAP_FAILED )
+      munmap( buf[0], bytes );
+    if ( buf[1] != MAP_FAILED )
+      munmap( buf[1], bytes );
+    return 0;
+  }
+
+  unsigned long num_chunks = ( n + chunk - 1 ) / chunk;
+  struct Io read_io, write_io;
+  int ok = 1, writing = 0;
+
+  io_start( &read_io, in_fd, buf[0], n < chunk ? n : chunk, 0, 0 );
+  for ( unsigned long i = 0; i < num_chunks; i++ ) {
+    int cur = i & 1;
+    unsigned long start = i * chunk, len = n - start < chunk ? n - start : chunk;
+
+    ok &= io_finish( &read_io, 0 );
+    if ( writing ) {
+      ok &= io_finish( &write_io, 1 );
+      writing = 0;
+    }
+    if ( !ok )
+      break;
+
+    // read the next chunk while this one is sorted
+    if ( i + 1 < num_chunks ) {
+      unsigned long next = start + chunk;
+      io_start( &read_io, in_fd, buf[!cur], n - next < chunk ? n - next : chunk, next, 0 );
+    }
+
+    if ( !sort( buf[cur], len, sort_arg ) ) {
+      ok = 0;
+      if ( i + 1 < num_chunks )
+        io_finish( &read_io, 0 );
+      break;
+    }
+
+    io_start( &write_io, out_fd, buf[cur], len, start, 1 );
+    writing = 1;
+  }
+  if ( writing )
+    ok &= io_finish( &write_io, 1 );
+
+  munmap( buf[0], bytes );
+  munmap( buf[1], bytes );
+  return ok;
+}
+
+// Reads part of a run, a buffer ahead of the merge
+struct RunReader {
+  int fd;
+  unsigned long next, end;      // elements of the run not requested yet
+  int64_t *buf[2];
+  unsigned long len[2];
+  int cur;                      // buffer being merged
+  unsigned long pos;            // next element in it
+  struct Io io;
+  int pending;                  // a read into buf[!cur] is under way
+  unsigned long pending_len;
+  int ok;
+};
+
+// Start reading the next buffer of the run, if there is any left
+static void reader_request( struct RunReader *r, unsigned long buf_elements ) {
+  if ( r->next >= r->end )
+    return;
+  unsigned long len = r->end - r->next < buf_elements ? r->end - r->next : buf_elements;
+  io_start( &r->io, r->fd, r->buf[!r->cur], len, r->next, 0 );
+  r->next += len;
+  r->pending = 1;
+  r->pending_len = len;
+}
+
+// Switch to the buffer being read, and start reading into the other one.
+//
+// Return:
+//   1 if there was another buffer, 0 if the run is exhausted
+static int reader_advance( struct RunReader *r, unsigned long buf_elements ) {
+  if ( !r->pending )
+    return 0;
+  r->ok &= io_finish( &r->io, 0 );
+  r->pending = 0;
+  r->cur = !r->cur;
+  r->len[r->cur] = r->pending_len;
+  r->pos = 0;
+  reader_request( r, buf_elements );
+  return 1;
+}
+
+// Writes the merged output, a buffer at a time
+struct RunWriter {
+  int fd;
+  unsigned long next;           // element offset of the next write
+  int64_t *buf[2];
+  int cur;
+  unsigned long len;            // elements in buf[cur]
+  struct Io io;
+  int pending;
+  int ok;
+};
+
+static void writer_flush( struct RunWriter *w ) {
+  if ( w->len == 0 )
+    return;
+  if ( w->pending )
+    w->ok &= io_finish( &w->io, 1 );
+  io_start( &w->io, w->fd, w->buf[w->cur], w->len, w->next, 1 );
+  w->pending = 1;
+  w->next += w->len;
+  w->cur = !w->cur;
+  w->len = 0;
+}
+
+// Shared state of one merge of a group of runs
+struct Merge {
+  int src_fd, dst_fd;
+  const struct Run *runs;
+  int num_runs;
+  int num_parts;
+  unsigned long *bounds;        // [part][run]: start of the part in each run
+  unsigned long out_start;      // offset of the merged group
+  int64_t *buffers;             // per part: 2 per run, and 2 for output
+  unsigned long buf_elements;
+  int failed;
+};
+
+// Return whether source a has a smaller next element than source b
+// (exhausted sources are larger than any element)
+static inline int beats( struct RunReader *readers, const int *done, int a, int b ) {
+  if ( done[a] )
+    return 0;
+  if ( done[b] )
+    return 1;
+  return readers[a].buf[readers[a].cur][readers[a].pos] <
+         readers[b].buf[readers[b].cur][readers[b].pos];
+}
+
+// Merge one part of every run into the same part of the output, with a
+// loser tree: each inner node holds the loser of the comparison there,
+// so replacing the winner only replays the games on its path to the
+// root.
+static void merge_part_task( struct ws_worker *self, void *arg,
+                             unsigned long part, unsigned long unused ) {
+  struct Merge *m = arg;
+  int k = m->num_runs;
+  unsigned long B = m->buf_elements;
+  int64_t *buffers = m->buffers + part * ( 2 * k + 2 ) * B;
+  const unsigned long *lo = m->bounds + part * k, *hi = m->bounds + ( part + 1 ) * k;
+  (void) self;
+  (void) unused;
+
+  // a power of 2 number of leaves; the extra ones are always exhausted
+  int leaves = 1;
+  while ( leaves < k )
+    leaves *= 2;
+  struct RunReader *readers = calloc( leaves, sizeof(struct RunReader) );
+  int *done = calloc( leaves, sizeof(int) );
+  int *tree = malloc( 2 * leaves * sizeof(int) );
+  int *winner = malloc( 2 * leaves * sizeof(int) );
+  if ( readers == NULL || done == NULL || tree == NULL || winner == NULL ) {
+    free( readers );
+    free( done );
+    free( tree );
+    free( winner );
+    __atomic_store_n( &m->failed, 1, __ATOMIC_RELAXED );
+    return;
+  }
+
+  struct RunWriter w;
+  w.fd = m->dst_fd;
+  w.next = m->out_start;
+  for ( int r = 0; r < k; r++ )
+    w.next += lo[r];
+  w.buf[0] = buffers + 2 * k * B;
+  w.buf[1] = w.buf[0] + B;
+  w.cur = 0;
+  w.len = 0;
+  w.pending = 0;
+  w.ok = 1;
+
+  for ( int r = 0; r < leaves; r++ ) {
+    done[r] = 1;
+    if ( r >= k )
+      continue;
+    struct RunReader *rd = &readers[r];
+    rd->fd = m->src_fd;
+    rd->next = m->runs[r].start + lo[r];
+    rd->end = m->runs[r].start + hi[r];
+    rd->buf[0] = buffers + 2 * r * B;
+    rd->buf[1] = rd->buf[0] + B;
+    rd->cur = 1;
+    rd->ok = 1;
+    reader_request( rd, B );
+    done[r] = !reader_advance( rd, B );
+  }
+
+  // build the tree bottom up: winner[node] is the winner of the games
+  // below node, and tree[node] the loser of the game at node
+  for ( int r = 0; r < leaves; r++ )
+    winner[leaves + r] = r;
+  for ( int node = leaves - 1; node >= 1; node-- ) {
+    int a = winner[2 * node], b = winner[2 * node + 1];
+    if ( beats( readers, done, b, a ) ) {
+      winner[node] = b;
+      tree[node] = a;
+    } else {
+      winner[node] = a;
+      tree[node] = b;
+    }
+  }
+  int top = winner[1];
+
+  while ( !done[top] ) {
+    struct RunReader *rd = &readers[top];
+    w.buf[w.cur][w.len++] = rd->buf[rd->cur][rd->pos++];
+    if ( w.len == B )
+      writer_flush( &w );
+    if ( rd->pos == rd->len[rd->cur] && !reader_advance( rd, B ) )
+      done[top] = 1;
+
+    // replay the games from the winner's leaf to the root
+    for ( int node = ( leaves + top ) / 2; node >= 1; node /= 2 ) {
+      if ( beats( readers, done, tree[node], top ) ) {
+        int tmp = tree[node];
+        tree[node] = top;
+        top = tmp;
+      }
+    }
+  }
+
+  writer_flush( &w );
+  if ( w.pending )
+    w.ok &= io_finish( &w.io, 1 );
+  int ok = w.ok;
+  for ( int r = 0; r < k; r++ )
+    ok &= readers[r].ok;
+  if ( !ok )
+    __atomic_store_n( &m->failed, 1, __ATOMIC_RELAXED );
+
+  free( readers );
+  free( done );
+  free( tree );
+  free( winner );
+}
+
+static int read_element( int fd, unsigned long index, int64_t *value ) {
+  return transfer_all( fd, (char *) value, sizeof(int64_t), index * sizeof(int64_t), 0 );
+}
+
+// Return the number of elements of a run no greater than value
+static int run_upper_bound( int fd, const struct Run *run, int64_t value, unsigned long *result ) {
+  unsigned long lo = 0, hi = run->len;
+  while ( lo < hi ) {
+    unsigned long mid = lo + ( hi - lo ) / 2;
+    int64_t x;
+    if ( !read_element( fd, run->start + mid, &x ) )
+      return 0;
+    if ( x <= value )
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  *result = lo;
+  return 1;
+}
+
+// Split a merge into parts of about equal size: choose splitters from a
+// sample of every run, and find them in each run
+static int split_merge( struct Merge *m ) {
+  int k = m->num_runs, p = m->num_parts;
+  unsigned long num_samples = (unsigned long) k * SAMPLES_PER_RUN;
+  int64_t *samples = malloc( num_samples * sizeof(int64_t) );
+  if ( samples == NULL )
+    return 0;
+
+  unsigned long count = 0;
+  for ( int r = 0; r < k; r++ ) {
+    const struct Run *run = &m->runs[r];
+    for ( int s = 0; s < SAMPLES_PER_RUN && run->len > 0; s++ ) {
+      unsigned long index = run->start + run->len * ( 2 * s + 1 ) / ( 2 * SAMPLES_PER_RUN );
+      if ( !read_element( m->src_fd, index, &samples[count++] ) ) {
+        free( samples );
+        return 0;
+      }
+    }
+  }
+  pdqsort( samples, count );
+
+  for ( int r = 0; r < k; r++ ) {
+    m->bounds[r] = 0;
+    m->bounds[(unsigned long) p * k + r] = m->runs[r].len;
+  }
+  for ( int j = 1; j < p; j++ ) {
+    int64_t splitter = samples[count * j / p];
+    for ( int r = 0; r < k; r++ ) {
+      if ( !run_upper_bound( m->src_fd, &m->runs[r], splitter, &m->bounds[(unsigned long) j * k + r] ) ) {
+        free( samples );
+        return 0;
+      }
+    }
+  }
+  free( samples );
+  return 1;
+}
+
+static void merge_task( struct ws_worker *self, void *arg, unsigned long start, unsigned long end ) {
+  struct Merge *m = arg;
+  (void) start;
+  (void) end;
+  ws_parallel_for( self, m->num_parts, merge_part_task, m );
+}
+
+// Merge a group of runs from src_fd into the same place in dst_fd.
+static int merge_runs( struct ws_pool *pool, int src_fd, int dst_fd, const struct Run *runs,
+                       int num_runs, int num_parts, int64_t *buffers, unsigned long buf_elements ) {
+  struct Merge m;
+  m.src_fd = src_fd;
+  m.dst_fd = dst_fd;
+  m.runs = runs;
+  m.num_runs = num_runs;
+  m.num_parts = num_parts;
+  m.out_start = runs[0].start;
+  m.buffers = buffers;
+  m.buf_elements = buf_elements;
+  m.failed = 0;
+  m.bounds = malloc( ( num_parts + 1 ) * (unsigned long) num_runs * sizeof(unsigned long) );
+  if ( m.bounds == NULL )
+    return 0;
+
+  if ( !split_merge( &m ) ) {
+    free( m.bounds );
+    return 0;
+  }
+
+  struct ws_group group = { 0 };
+  ws_pool_run( pool, &group, merge_task, &m, 0, num_parts );
+  free( m.bounds );
+  return !m.failed;
+}
+
+// Return how many runs each of num_parts workers can merge at once
+// with buffers of at least MIN_IO_ELEMENTS
+static unsigned long max_fan_in( unsigned long budget, int num_parts ) {
+  unsigned long buffers = budget / ( (unsigned long) num_parts * MIN_IO_ELEMENTS );
+  return buffers < 2 ? 0 : ( buffers - 2 ) / 2;
+}
+
+int external_sort( const char *path, int fd, unsigned long n, unsigned long budget,
+                   int num_workers, unsigned scratch, sort_fn sort, void *sort_arg ) {
+  unsigned long chunk = budget * sizeof(int64_t) / ( 2 * sizeof(int64_t) + scratch );
+  if ( num_workers < 1 )
+    num_workers = 1;
+
+  // use fewer workers for the merge if that avoids an extra pass, or
+  // if the budget can't give each of them buffers for 2 runs
+  unsigned long num_runs = ( n + chunk - 1 ) / chunk;
+  int num_parts = num_workers;
+  while ( num_parts > 1 && max_fan_in( budget, num_parts ) < num_runs &&
+          ( max_fan_in( budget, num_parts ) < 2 ||
+            max_fan_in( budget, num_parts - 1 ) >= num_runs ) )
+    num_parts--;
+  unsigned long fan_in = max_fan_in( budget, num_parts );
+  if ( chunk == 0 || fan_in < 2 ) {
+    fprintf( stderr, "Error: memory budget too small for an external sort\n" );
+    return 0;
+  }
+
+  struct Run *runs = malloc( num_runs * sizeof(struct Run) );
+  if ( runs == NULL )
+    return 0;
+  for ( unsigned long i = 0; i < num_runs; i++ ) {
+    runs[i].start = i * chunk;
+    runs[i].len = n - runs[i].start < chunk ? n - runs[i].start : chunk;
+  }
+
+  int tmp_fd[2] = { create_temp_file( path ), -1 };
+  if ( tmp_fd[0] < 0 ) {
+    perror( "Error: couldn't create a temporary file" );
+    free( runs );
+    return 0;
+  }
+  posix_fadvise( fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+
+  int ok = generate_runs( fd, tmp_fd[0], n, chunk, sort, sort_arg );
+#ifdef __GLIBC__
+  // once a chunk-sized scratch buffer has been freed, glibc serves the
+  // next ones from the heap, and keeps that memory after they are freed
+  // too; give it back before the merge buffers are allocated
+  malloc_trim( 0 );
+#endif
+
+  struct ws_pool *pool = NULL;
+  int64_t *buffers = NULL;
+  if ( ok ) {
+    // buffers as large as the budget allows, for the largest group
+    unsigned long group = num_runs < fan_in ? num_runs : fan_in;
+    unsigned long buf_elements = budget / ( num_parts * ( 2 * group + 2 ) );
+    buffers = malloc( num_parts * ( 2 * group + 2 ) * buf_elements * sizeof(int64_t) );
+    pool = ws_pool_create( num_parts );
+    ok = buffers != NULL && pool != NULL;
+
+    // merge groups of fan_in runs until one group is left, ping-ponging
+    // between the temporary files
+    int src = 0;
+    while ( ok && num_runs > fan_in ) {
+      if ( tmp_fd[1] < 0 && ( tmp_fd[1] = create_temp_file( path ) ) < 0 ) {
+        perror( "Error: couldn't create a temporary file" );
+        ok = 0;
+        break;
+      }
+      unsigned long num_merged = 0;
+      for ( unsigned long i = 0; ok && i < num_runs; i += fan_in ) {
+        int count = num_runs - i < fan_in ? num_runs - i : fan_in;
+        ok = merge_runs( pool, tmp_fd[src], tmp_fd[!src], &runs[i], count, num_parts,
+                         buffers, buf_elements );
+        runs[num_merged].start = runs[i].start;
+        runs[num_merged].len = runs[i + count - 1].start + runs[i + count - 1].len - runs[i].start;
+        num_merged++;
+      }
+      num_runs = num_merged;
+      src = !src;
+    }
+
+    // the last merge writes the result over the input
+    if ( ok )
+      ok = merge_runs( pool, tmp_fd[src], fd, runs, num_runs, num_parts, buffers, buf_elements );
+  }
+
+  if ( pool != NULL )
+    ws_pool_destroy( pool );
+  free( buffers );
+  free( runs );
+  close( tmp_fd[0] );
+  if ( tmp_fd[1] >= 0 )
+    close( tmp_fd[1] );
+  return ok;
+}
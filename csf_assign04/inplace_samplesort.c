@@ -0,0 +1,414 @@
+// In-place parallel samplesort on the thread pool, after Axtmann et al.,
+// "In-place Parallel Super Scalar Samplesort (IPS4o)".
+//
+// samplesort() scatters the elements into a buffer as large as the
+// input. Here the elements are moved in blocks of BLOCK_ELEMENTS
+// instead, so the extra memory is a block per bucket for each worker,
+// whatever the size of the input:
+//
+// 1. Local classification: each worker reads its stripe of the array
+//    and collects the elements in a buffer block per bucket. A full
+//    buffer is written back to the front of the stripe, which has
+//    already been read. Each stripe ends up as full blocks (each of a
+//    single bucket) followed by free space.
+// 2. The counts give the bucket boundaries. Each bucket owns the blocks
+//    that start inside it, and the full ones among them are moved to
+//    the front.
+// 3. Block permutation: workers take full blocks that aren't in place
+//    yet, and write each one at the next write position of its bucket.
+//    If the block there hasn't been placed either, it is picked up
+//    first and placed next.
+// 4. Cleanup: a bucket's last block can run past the end of the bucket.
+//    Those elements, and the ones left in the buffers, are written into
+//    the gaps at the start and end of each bucket.
+//
+// Finally each bucket is sorted sequentially by one worker.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "parsort.h"
+#include "splitters.h"
+#include "ws_pool.h"
+
+// elements per block (2 KiB)
+#define BLOCK_ELEMENTS 256
+
+// smallest array worth distributing into buckets
+#define MIN_INPLACE_ELEMENTS 65536
+
+// Write and read positions of a bucket during the block permutation:
+// the blocks in [write, read) are full and haven't been placed yet
+struct BucketPointers {
+  pthread_mutex_t lock;
+  unsigned long write, read;
+  long pending_reads;   // blocks still being copied out of the bucket
+};
+
+// Shared state of an in-place samplesort
+struct InPlaceSort {
+  int64_t *arr;
+  unsigned long n;
+  struct Splitters sp;
+  int num_stripes;                // also the number of permutation tasks
+  unsigned long *stripe_start;    // [stripe], block aligned, and n at the end
+  unsigned long *full_end;        // [stripe] end of the stripe's full blocks
+  unsigned long *counts;          // [stripe][bucket] elements classified
+  int64_t *buffers;               // [stripe][bucket] partial block
+  int64_t *swap;                  // [task] two blocks for the permutation
+  int64_t *spill;                 // [bucket] elements past the bucket's end
+  unsigned long spill_count[MAX_BUCKETS];
+  unsigned long bucket_start[MAX_BUCKETS + 1];
+  struct BucketPointers ptr[MAX_BUCKETS];
+
+  // the block written at overflow_pos (if any) would have run past the
+  // end of the array, so it was stored here instead
+  int64_t overflow[BLOCK_ELEMENTS];
+  unsigned long overflow_pos;
+  int overflow_used;
+};
+
+static inline unsigned long align_block( unsigned long pos ) {
+  return ( pos + BLOCK_ELEMENTS - 1 ) / BLOCK_ELEMENTS * BLOCK_ELEMENTS;
+}
+
+// Return whether the block at pos (a multiple of BLOCK_ELEMENTS) was
+// filled by the local classification
+static int is_full( const struct InPlaceSort *ips, unsigned long pos ) {
+  // find the last stripe starting at or before pos (empty stripes share
+  // their start with the following one)
+  int lo = 0, hi = ips->num_stripes - 1;
+  while ( lo < hi ) {
+    int mid = ( lo + hi + 1 ) / 2;
+    if ( ips->stripe_start[mid] <= pos )
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return pos < ips->full_end[lo];
+}
+
+// Add an element to its bucket's buffer, writing the buffer back to the
+// array when it becomes full
+static inline void collect( struct InPlaceSort *ips, int64_t *buffers, unsigned long *counts,
+                            unsigned long *write, int bucket, int64_t x ) {
+  int64_t *buf = buffers + bucket * BLOCK_ELEMENTS;
+  buf[counts[bucket] % BLOCK_ELEMENTS] = x;
+  if ( ++counts[bucket] % BLOCK_ELEMENTS == 0 ) {
+    memcpy( ips->arr + *write, buf, BLOCK_ELEMENTS * sizeof(int64_t) );
+    *write += BLOCK_ELEMENTS;
+  }
+}
+
+// Phase 1: classify the elements of one stripe. Blocks are only ever
+// written over elements that have already been read, since the buffers
+// hold whatever has been read and not written.
+static void classify_task( struct ws_worker *self, void *arg,
+                           unsigned long stripe, unsigned long unused ) {
+  struct InPlaceSort *ips = arg;
+  const struct Splitters *sp = &ips->sp;
+  unsigned long *counts = ips->counts + stripe * sp->num_buckets;
+  int64_t *buffers = ips->buffers + stripe * sp->num_buckets * BLOCK_ELEMENTS;
+  int64_t *arr = ips->arr;
+  unsigned long i = ips->stripe_start[stripe], end = ips->stripe_start[stripe + 1];
+  unsigned long write = i;
+  (void) self;
+  (void) unused;
+
+  memset( counts, 0, sp->num_buckets * sizeof(unsigned long) );
+
+  // four elements at a time, so their tree descents overlap
+  for ( ; i + 4 <= end; i += 4 ) {
+    int64_t x0 = arr[i], x1 = arr[i + 1], x2 = arr[i + 2], x3 = arr[i + 3];
+    int b0 = splitters_classify( sp, x0 ), b1 = splitters_classify( sp, x1 );
+    int b2 = splitters_classify( sp, x2 ), b3 = splitters_classify( sp, x3 );
+    collect( ips, buffers, counts, &write, b0, x0 );
+    collect( ips, buffers, counts, &write, b1, x1 );
+    collect( ips, buffers, counts, &write, b2, x2 );
+    collect( ips, buffers, counts, &write, b3, x3 );
+  }
+  for ( ; i < end; i++ ) {
+    int64_t x = arr[i];
+    collect( ips, buffers, counts, &write, splitters_classify( sp, x ), x );
+  }
+  ips->full_end[stripe] = write;
+}
+
+// Phase 2: move the full blocks among the ones a bucket owns to the
+// front, and set up the bucket's pointers
+static void prepare_bucket_task( struct ws_worker *self, void *arg,
+                                 unsigned long bucket, unsigned long unused ) {
+  struct InPlaceSort *ips = arg;
+  unsigned long begin = align_block( ips->bucket_start[bucket] );
+  unsigned long end = align_block( ips->bucket_start[bucket + 1] );
+  (void) self;
+  (void) unused;
+
+  unsigned long read = begin;
+  for ( unsigned long pos = begin; pos < end; pos += BLOCK_ELEMENTS )
+    if ( is_full( ips, pos ) )
+      read += BLOCK_ELEMENTS;
+
+  // fill each free block before read with a full block after it
+  unsigned long from = read;
+  for ( unsigned long pos = begin; pos < read; pos += BLOCK_ELEMENTS ) {
+    if ( is_full( ips, pos ) )
+      continue;
+    while ( !is_full( ips, from ) )
+      from += BLOCK_ELEMENTS;
+    memcpy( ips->arr + pos, ips->arr + from, BLOCK_ELEMENTS * sizeof(int64_t) );
+    from += BLOCK_ELEMENTS;
+  }
+
+  ips->ptr[bucket].write = begin;
+  ips->ptr[bucket].read = read;
+  ips->ptr[bucket].pending_reads = 0;
+}
+
+// Take an unplaced block out of a bucket, if there are any left
+static int take_block( struct InPlaceSort *ips, int bucket, int64_t *block ) {
+  struct BucketPointers *ptr = &ips->ptr[bucket];
+
+  pthread_mutex_lock( &ptr->lock );
+  if ( ptr->read <= ptr->write ) {
+    pthread_mutex_unlock( &ptr->lock );
+    return 0;
+  }
+  ptr->read -= BLOCK_ELEMENTS;
+  unsigned long pos = ptr->read;
+  ptr->pending_reads++;
+  pthread_mutex_unlock( &ptr->lock );
+
+  memcpy( block, ips->arr + pos, BLOCK_ELEMENTS * sizeof(int64_t) );
+  __atomic_sub_fetch( &ptr->pending_reads, 1, __ATOMIC_RELEASE );
+  return 1;
+}
+
+// Write a block at its bucket's next write position. If an unplaced
+// block was there, it is copied to displaced and 1 is returned.
+static int put_block( struct InPlaceSort *ips, const int64_t *block, int64_t *displaced ) {
+  int bucket = splitters_classify( &ips->sp, block[0] );
+  struct BucketPointers *ptr = &ips->ptr[bucket];
+
+  pthread_mutex_lock( &ptr->lock );
+  unsigned long pos = ptr->write;
+  ptr->write += BLOCK_ELEMENTS;
+  int full = pos < ptr->read;
+  pthread_mutex_unlock( &ptr->lock );
+
+  if ( full ) {
+    memcpy( displaced, ips->arr + pos, BLOCK_ELEMENTS * sizeof(int64_t) );
+    memcpy( ips->arr + pos, block, BLOCK_ELEMENTS * sizeof(int64_t) );
+    return 1;
+  }
+
+  // the block may just have been taken, and still be being copied
+  while ( __atomic_load_n( &ptr->pending_reads, __ATOMIC_ACQUIRE ) > 0 )
+    sched_yield();
+
+  if ( pos + BLOCK_ELEMENTS > ips->n ) {
+    memcpy( ips->overflow, block, BLOCK_ELEMENTS * sizeof(int64_t) );
+    ips->overflow_pos = pos;
+    ips->overflow_used = 1;
+  } else {
+    memcpy( ips->arr + pos, block, BLOCK_ELEMENTS * sizeof(int64_t) );
+  }
+  return 0;
+}
+
+// Phase 3: place blocks, starting with a different bucket in each task
+static void permute_task( struct ws_worker *self, void *arg,
+                          unsigned long task, unsigned long unused ) {
+  struct InPlaceSort *ips = arg;
+  int num_buckets = ips->sp.num_buckets;
+  int64_t *block = ips->swap + task * 2 * BLOCK_ELEMENTS;
+  int64_t *displaced = block + BLOCK_ELEMENTS;
+  int first = (int) ( task * num_buckets / ips->num_stripes );
+  (void) self;
+  (void) unused;
+
+  for ( int i = 0; i < num_buckets; i++ ) {
+    int bucket = ( first + i ) % num_buckets;
+    while ( take_block( ips, bucket, block ) ) {
+      while ( put_block( ips, block, displaced ) ) {
+        int64_t *tmp = block;
+        block = displaced;
+        displaced = tmp;
+      }
+    }
+  }
+}
+
+// Phase 4a: save the elements a bucket's last block wrote past the end
+// of the bucket (into the next bucket, or the overflow block)
+static void save_spill_task( struct ws_worker *self, void *arg,
+                             unsigned long bucket, unsigned long unused ) {
+  struct InPlaceSort *ips = arg;
+  unsigned long begin = align_block( ips->bucket_start[bucket] );
+  unsigned long end = ips->bucket_start[bucket + 1];
+  unsigned long written = ips->ptr[bucket].write;
+  int64_t *spill = ips->spill + bucket * BLOCK_ELEMENTS;
+  (void) self;
+  (void) unused;
+
+  unsigned long from = begin > end ? begin : end;
+  unsigned long count = 0;
+  for ( unsigned long pos = from; pos < written; pos++ )
+    spill[count++] = pos < ips->n ? ips->arr[pos] : ips->overflow[pos - ips->overflow_pos];
+  ips->spill_count[bucket] = count;
+}
+
+// Free space in a bucket: a gap at its start, then one at its end
+struct Gaps {
+  unsigned long pos, end;
+  unsigned long next_pos, next_end;
+};
+
+static void fill_gaps( int64_t *arr, struct Gaps *gaps, const int64_t *src, unsigned long count ) {
+  while ( count > 0 ) {
+    if ( gaps->pos == gaps->end ) {
+      gaps->pos = gaps->next_pos;
+      gaps->end = gaps->next_end;
+    }
+    unsigned long len = gaps->end - gaps->pos;
+    if ( len > count )
+      len = count;
+    memcpy( arr + gaps->pos, src, len * sizeof(int64_t) );
+    gaps->pos += len;
+    src += len;
+    count -= len;
+  }
+}
+
+// Phase 4b: fill a bucket's gaps with its spilled and buffered
+// elements, then sort the bucket
+static void cleanup_task( struct ws_worker *self, void *arg,
+                          unsigned long bucket, unsigned long unused ) {
+  struct InPlaceSort *ips = arg;
+  int num_buckets = ips->sp.num_buckets;
+  unsigned long start = ips->bucket_start[bucket], end = ips->bucket_start[bucket + 1];
+  unsigned long begin = align_block( start ), written = ips->ptr[bucket].write;
+  (void) self;
+  (void) unused;
+
+  struct Gaps gaps;
+  gaps.pos = start;
+  gaps.end = begin < end ? begin : end;
+  gaps.next_pos = written;
+  gaps.next_end = written < end ? end : written;
+
+  fill_gaps( ips->arr, &gaps, ips->spill + bucket * BLOCK_ELEMENTS, ips->spill_count[bucket] );
+  for ( int s = 0; s < ips->num_stripes; s++ )
+    fill_gaps( ips->arr, &gaps,
+               ips->buffers + ( (unsigned long) s * num_buckets + bucket ) * BLOCK_ELEMENTS,
+               ips->counts[s * num_buckets + bucket] % BLOCK_ELEMENTS );
+
+  leaf_sort( ips->arr + start, end - start );
+}
+
+// Root task: runs the phases of the sort one after another, each of them
+// in parallel
+static void inplace_samplesort_task( struct ws_worker *self, void *arg,
+                                     unsigned long start, unsigned long end ) {
+  struct InPlaceSort *ips = arg;
+  int num_buckets = ips->sp.num_buckets;
+  (void) start;
+  (void) end;
+
+  ws_parallel_for( self, ips->num_stripes, classify_task, ips );
+
+  unsigned long offset = 0;
+  for ( int b = 0; b < num_buckets; b++ ) {
+    ips->bucket_start[b] = offset;
+    for ( int s = 0; s < ips->num_stripes; s++ )
+      offset += ips->counts[s * num_buckets + b];
+  }
+  ips->bucket_start[num_buckets] = offset;
+
+  ws_parallel_for( self, num_buckets, prepare_bucket_task, ips );
+  ws_parallel_for( self, ips->num_stripes, permute_task, ips );
+
+  // the part of the overflow block that is inside the array
+  if ( ips->overflow_used )
+    memcpy( ips->arr + ips->overflow_pos, ips->overflow,
+            ( ips->n - ips->overflow_pos ) * sizeof(int64_t) );
+
+  ws_parallel_for( self, num_buckets, save_spill_task, ips );
+  ws_parallel_for( self, num_buckets, cleanup_task, ips );
+}
+
+// Sort a region of given array from start (inclusive) to end
+// (exclusive) with an in-place parallel samplesort.
+//
+// Parameters:
+//   arr - pointer to first element of array
+//   start - inclusive lower bound index
+//   end - exclusive upper bound index
+//   par_threshold - ranges this long or shorter are sorted sequentially
+//   num_workers - number of threads to use
+//
+// Return:
+//   1 if the sort succeeded, 0 if memory or threads couldn't be
+//   allocated (in which case the array is unchanged)
+int inplace_samplesort( int64_t *arr, unsigned long start, unsigned long end,
+                        unsigned long par_threshold, int num_workers ) {
+  unsigned long n = end - start;
+
+  if ( n <= par_threshold || n < MIN_INPLACE_ELEMENTS ) {
+    leaf_sort( arr + start, n );
+    return 1;
+  }
+  if ( num_workers < 1 )
+    num_workers = 1;
+
+  struct InPlaceSort *ips = malloc( sizeof(struct InPlaceSort) );
+  if ( ips == NULL )
+    return 0;
+  ips->arr = arr + start;
+  ips->n = n;
+  ips->overflow_used = 0;
+  choose_splitters( &ips->sp, ips->arr, n, num_workers );
+  int num_buckets = ips->sp.num_buckets;
+
+  // one stripe per worker, each a whole number of blocks (except the
+  // last, which takes the rest of the array)
+  int num_stripes = ips->num_stripes = num_workers;
+  unsigned long num_blocks = n / BLOCK_ELEMENTS;
+  ips->stripe_start = malloc( ( num_stripes + 1 ) * sizeof(unsigned long) );
+  ips->full_end = malloc( num_stripes * sizeof(unsigned long) );
+  ips->counts = malloc( (unsigned long) num_stripes * num_buckets * sizeof(unsigned long) );
+  ips->buffers = malloc( (unsigned long) num_stripes * num_buckets * BLOCK_ELEMENTS * sizeof(int64_t) );
+  ips->swap = malloc( (unsigned long) num_stripes * 2 * BLOCK_ELEMENTS * sizeof(int64_t) );
+  ips->spill = malloc( (unsigned long) num_buckets * BLOCK_ELEMENTS * sizeof(int64_t) );
+  struct ws_pool *pool = ws_pool_create( num_workers );
+
+  int success = ips->stripe_start != NULL && ips->full_end != NULL && ips->counts != NULL &&
+                ips->buffers != NULL && ips->swap != NULL && ips->spill != NULL && pool != NULL;
+  if ( success ) {
+    for ( int s = 0; s < num_stripes; s++ )
+      ips->stripe_start[s] = num_blocks * s / num_stripes * BLOCK_ELEMENTS;
+    ips->stripe_start[num_stripes] = n;
+    for ( int b = 0; b < num_buckets; b++ )
+      pthread_mutex_init( &ips->ptr[b].lock, NULL );
+
+    struct ws_group group = { 0 };
+    ws_pool_run( pool, &group, inplace_samplesort_task, ips, 0, n );
+
+    for ( int b = 0; b < num_buckets; b++ )
+      pthread_mutex_destroy( &ips->ptr[b].lock );
+  }
+
+  if ( pool != NULL )
+    ws_pool_destroy( pool );
+  free( ips->stripe_start );
+  free( ips->full_end );
+  free( ips->counts );
+  free( ips->buffers );
+  free( ips->swap );
+  free( ips->spill );
+  free( ips );
+  return success;
+}
@@ -0,0 +1,47 @@
+// Sequential sorting of the ranges that are too small to be worth
+// splitting further (those no longer than par_threshold), shared by
+// every engine and algorithm.
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "parsort.h"
+
+static enum LeafAlgo leaf_algo = LEAF_SIMD;
+
+// Choose the algorithm leaf_sort uses. Worker processes inherit the
+// choice, so it must be made before sorting starts.
+void set_leaf_algo( enum LeafAlgo algo ) {
+  leaf_algo = algo;
+}
+
+// Sort n elements sequentially.
+//
+// Parameters:
+//   arr - pointer to first element to sort
+//   n - number of elements
+void leaf_sort( int64_t *arr, unsigned long n ) {
+  if ( n < 2 )
+    return;
+
+  if ( leaf_algo == LEAF_QSORT ) {
+    qsort( arr, n, sizeof(int64_t), compare );
+    return;
+  }
+
+  if ( leaf_algo == LEAF_SIMD ) {
+    simd_sort( arr, n );
+    return;
+  }
+
+  if ( leaf_algo == LEAF_RADIX ) {
+    int64_t *buf = malloc( n * sizeof(int64_t) );
+    if ( buf != NULL ) {
+      radix_sort_seq( arr, buf, n );
+      free( buf );
+      return;
+    }
+  }
+
+  pdqsort( arr, n );
+}
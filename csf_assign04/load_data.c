@@ -0,0 +1,95 @@
+// Loading the data into anonymous memory, as an alternative to sorting
+// a MAP_SHARED mapping of the file in place (parsort --load copy).
+//
+// A file mapping is faulted in 4 KiB pages as the sort first touches
+// them, each fault copying a page from the page cache, and its pages
+// stay wherever the page cache put them. Here the data is instead read
+// into anonymous memory that is advised to use transparent huge pages,
+// by one task per worker: each reads a stripe of the file with pread,
+// so the stripe's pages are faulted in (and, on a NUMA machine, placed
+// on the node of the worker reading them) up front and in parallel.
+// After sorting, the stripes are written back to the file the same way.
+
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "parsort.h"
+#include "ws_pool.h"
+
+// huge pages are 2 MiB; stripes start on huge page boundaries
+#define HUGE_PAGE_ELEMENTS ( ( 2UL << 20 ) / sizeof(int64_t) )
+
+// State of a parallel load or store
+struct Transfer {
+  int fd;
+  int64_t *arr;
+  unsigned long n;
+  int num_stripes;
+  int write;
+  int failed;
+};
+
+static void transfer_stripe_task( struct ws_worker *self, void *arg,
+                                  unsigned long stripe, unsigned long unused ) {
+  struct Transfer *t = arg;
+  unsigned long pages = ( t->n + HUGE_PAGE_ELEMENTS - 1 ) / HUGE_PAGE_ELEMENTS;
+  unsigned long start = pages * stripe / t->num_stripes * HUGE_PAGE_ELEMENTS;
+  unsigned long end = pages * ( stripe + 1 ) / t->num_stripes * HUGE_PAGE_ELEMENTS;
+  (void) self;
+  (void) unused;
+
+  if ( end > t->n )
+    end = t->n;
+  if ( start < end &&
+       !transfer_all( t->fd, (char *) ( t->arr + start ), ( end - start ) * sizeof(int64_t),
+                      start * sizeof(int64_t), t->write ) )
+    __atomic_store_n( &t->failed, 1, __ATOMIC_RELAXED );
+}
+
+static void transfer_task( struct ws_worker *self, void *arg, unsigned long start, unsigned long end ) {
+  struct Transfer *t = arg;
+  (void) start;
+  (void) end;
+  ws_parallel_for( self, t->num_stripes, transfer_stripe_task, t );
+}
+
+// Read or write the whole array with a task per worker
+static int transfer_array( int fd, int64_t *arr, unsigned long n, int num_workers, int write ) {
+  struct Transfer t = { fd, arr, n, num_workers < 1 ? 1 : num_workers, write, 0 };
+  struct ws_pool *pool = ws_pool_create( t.num_stripes );
+  if ( pool == NULL )
+    return transfer_all( fd, (char *) arr, n * sizeof(int64_t), 0, write );
+
+  struct ws_group group = { 0 };
+  ws_pool_run( pool, &group, transfer_task, &t, 0, n );
+  ws_pool_destroy( pool );
+  return !t.failed;
+}
+
+// Return the size of the mapping load_array makes for n elements
+static size_t mapping_size( unsigned long n ) {
+  unsigned long pages = ( n + HUGE_PAGE_ELEMENTS - 1 ) / HUGE_PAGE_ELEMENTS;
+  return ( pages > 0 ? pages : 1 ) * HUGE_PAGE_ELEMENTS * sizeof(int64_t);
+}
+
+int64_t *load_array( int fd, unsigned long n, int shared, int num_workers ) {
+  size_t size = mapping_size( n );
+  int64_t *arr = mmap( NULL, size, PROT_READ | PROT_WRITE,
+                       ( shared ? MAP_SHARED : MAP_PRIVATE ) | MAP_ANONYMOUS, -1, 0 );
+  if ( arr == MAP_FAILED )
+    return NULL;
+  madvise( arr, size, MADV_HUGEPAGE );
+
+  if ( !transfer_array( fd, arr, n, num_workers, 0 ) ) {
+    munmap( arr, size );
+    return NULL;
+  }
+  return arr;
+}
+
+int store_array( int fd, int64_t *arr, unsigned long n, int num_workers ) {
+  int ok = transfer_array( fd, arr, n, num_workers, 1 );
+  munmap( arr, mapping_size( n ) );
+  return ok;
+}
@@ -0,0 +1,211 @@
+// Parallel partitioning of large ranges on the thread pool, so that the
+// top levels of the quicksort don't run on a single core.
+//
+// The range is split into blocks, one per task. Each task partitions its
+// own block in place. A prefix sum over the blocks' counts of small
+// elements then gives the final boundary. Every large element that
+// ended up left of the boundary is swapped with a small element right
+// of it. These misplaced elements are numbered in order, so the
+// cleanup swaps can also be split evenly between tasks.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "parsort.h"
+#include "ws_pool.h"
+
+// blocks are never made smaller than this many elements
+#define MIN_BLOCK_ELEMENTS 16384
+
+// A run of consecutive misplaced elements
+struct Interval {
+  unsigned long start, end;
+};
+
+// Shared state of one parallel partition
+struct ParPartition {
+  int64_t *arr;
+  int64_t pivot_val;
+  unsigned long start, end;   // range being partitioned
+  int num_blocks;
+  unsigned long *num_small;   // per block: elements less than the pivot
+
+  // misplaced elements: large ones left of the boundary, and small ones
+  // right of it (at most one interval of each per block)
+  struct Interval *large, *small;
+  int num_large, num_small_intervals;
+  unsigned long num_swaps;
+  struct ws_group group;
+};
+
+static unsigned long block_start( const struct ParPartition *pp, int block ) {
+  return pp->start + ( pp->end - pp->start ) * block / pp->num_blocks;
+}
+
+// Partition one block in place, counting its elements less than the pivot
+static void classify_task( struct ws_worker *self, void *arg,
+                           unsigned long block, unsigned long unused ) {
+  struct ParPartition *pp = arg;
+  unsigned long first = block_start( pp, block );
+  (void) self;
+  (void) unused;
+
+  pp->num_small[block] = partition_range( pp->arr, first, block_start( pp, block + 1 ),
+                                          pp->pivot_val ) - first;
+}
+
+// Find the interval containing misplaced element k, and k's offset in it
+static void locate( const struct Interval *intervals, unsigned long k, int *index,
+                    unsigned long *offset ) {
+  int i = 0;
+  while ( k >= intervals[i].end - intervals[i].start ) {
+    k -= intervals[i].end - intervals[i].start;
+    i++;
+  }
+  *index = i;
+  *offset = k;
+}
+
+// Do swaps [first, last) of the cleanup: swap the k-th misplaced large
+// element with the k-th misplaced small element
+static void cleanup_task( struct ws_worker *self, void *arg,
+                          unsigned long first, unsigned long last ) {
+  struct ParPartition *pp = arg;
+  int li, si;
+  unsigned long loff, soff;
+  (void) self;
+
+  if ( first >= last )
+    return;
+  locate( pp->large, first, &li, &loff );
+  locate( pp->small, first, &si, &soff );
+  unsigned long l = pp->large[li].start + loff, s = pp->small[si].start + soff;
+
+  for ( unsigned long k = first; k < last; k++ ) {
+    if ( l == pp->large[li].end )
+      l = pp->large[++li].start;
+    if ( s == pp->small[si].end )
+      s = pp->small[++si].start;
+    swap( pp->arr, l++, s++ );
+  }
+}
+
+// Rearrange arr[start..end) around pivot_val like partition_range(),
+// using tasks on the thread pool.
+//
+// Return:
+//   index of the first element greater than or equal to the pivot
+static unsigned long partition_blocks( struct ws_worker *self, int64_t *arr, unsigned long start,
+                                       unsigned long end, int64_t pivot_val, int max_blocks ) {
+  unsigned long len = end - start;
+
+  int num_blocks = max_blocks;
+  if ( (unsigned long) num_blocks > len / MIN_BLOCK_ELEMENTS )
+    num_blocks = (int) ( len / MIN_BLOCK_ELEMENTS );
+  if ( num_blocks < 2 )
+    return partition_range( arr, start, end, pivot_val );
+
+  struct ParPartition pp;
+  pp.num_small = malloc( num_blocks * sizeof(unsigned long) );
+  pp.large = malloc( 2 * num_blocks * sizeof(struct Interval) );
+  if ( pp.num_small == NULL || pp.large == NULL ) {
+    free( pp.num_small );
+    free( pp.large );
+    return partition_range( arr, start, end, pivot_val );
+  }
+  pp.small = pp.large + num_blocks;
+
+  pp.arr = arr;
+  pp.pivot_val = pivot_val;
+  pp.start = start;
+  pp.end = end;
+  pp.num_blocks = num_blocks;
+  pp.group.pending = 0;
+
+  // partition each block
+  for ( int b = 1; b < num_blocks; b++ )
+    ws_spawn( self, &pp.group, classify_task, &pp, b, 0 );
+  classify_task( self, &pp, 0, 0 );
+  ws_wait( self, &pp.group );
+
+  // the boundary is after all the small elements
+  unsigned long boundary = pp.start;
+  for ( int b = 0; b < num_blocks; b++ )
+    boundary += pp.num_small[b];
+
+  // collect the misplaced elements of each block
+  pp.num_large = pp.num_small_intervals = 0;
+  pp.num_swaps = 0;
+  for ( int b = 0; b < num_blocks; b++ ) {
+    unsigned long bs = block_start( &pp, b ), be = block_start( &pp, b + 1 );
+    unsigned long split = bs + pp.num_small[b];
+
+    // large elements [split, be) that are left of the boundary
+    unsigned long large_end = be < boundary ? be : boundary;
+    if ( split < large_end ) {
+      pp.large[pp.num_large].start = split;
+      pp.large[pp.num_large++].end = large_end;
+      pp.num_swaps += large_end - split;
+    }
+
+    // small elements [bs, split) that are right of the boundary
+    unsigned long small_start = bs > boundary ? bs : boundary;
+    if ( small_start < split ) {
+      pp.small[pp.num_small_intervals].start = small_start;
+      pp.small[pp.num_small_intervals++].end = split;
+    }
+  }
+
+  // swap them, in evenly sized pieces
+  for ( int b = 1; b < num_blocks; b++ )
+    ws_spawn( self, &pp.group, cleanup_task, &pp,
+              pp.num_swaps * b / num_blocks, pp.num_swaps * ( b + 1 ) / num_blocks );
+  cleanup_task( self, &pp, 0, pp.num_swaps / num_blocks );
+  ws_wait( self, &pp.group );
+
+  free( pp.num_small );
+  free( pp.large );
+  return boundary;
+}
+
+// Partition a region of given array from start (inclusive) to end
+// (exclusive) using tasks on the thread pool, with the same result
+// guarantees as partition_equal().
+//
+// Parameters:
+//   self - the worker calling the function
+//   arr - pointer to first element of array
+//   start - inclusive lower bound index
+//   end - exclusive upper bound index
+//   max_blocks - maximum number of blocks to split the range into
+//                (usually the number of workers)
+//   equal_end - set to the index after the last element equal to the
+//               pivot
+//
+// Return:
+//   index of the first element equal to the pivot
+unsigned long parallel_partition( struct ws_worker *self, int64_t *arr, unsigned long start,
+                                  unsigned long end, int max_blocks, unsigned long *equal_end ) {
+  assert( end - start >= 2 );
+  unsigned long pivot_index = choose_pivot( arr, start, end );
+  int64_t pivot_val = arr[pivot_index];
+
+  if ( has_many_equal( arr, start, end, pivot_val ) ) {
+    // three-way: split off the elements less than the pivot, then
+    // those equal to it
+    unsigned long boundary = partition_blocks( self, arr, start, end, pivot_val, max_blocks );
+    if ( pivot_val == INT64_MAX )
+      *equal_end = end;
+    else
+      *equal_end = partition_blocks( self, arr, boundary, end, pivot_val + 1, max_blocks );
+    return boundary;
+  }
+
+  // stash the pivot at the end, and place it after the small elements
+  swap( arr, pivot_index, end - 1 );
+  unsigned long boundary = partition_blocks( self, arr, start, end - 1, pivot_val, max_blocks );
+  swap( arr, boundary, end - 1 );
+  *equal_end = boundary + 1;
+  return boundary;
+}
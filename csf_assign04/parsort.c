@@ -10,27 +10,234 @@
 
 #include <sys/types.h>
 #include <signal.h>
-
-int compare( const void *left, const void *right );
-void swap( int64_t *arr, unsigned long i, unsigned long j );
-unsigned long partition( int64_t *arr, unsigned long start, unsigned long end );
-int quicksort( int64_t *arr, unsigned long start, unsigned long end, unsigned long par_threshold );
+#include <string.h>
+#include <getopt.h>
+
+#include "parsort.h"
+#include "ws_pool.h"
+
+// How subranges are sorted concurrently
+enum Engine {
+  ENGINE_FORK,      // a child process per subrange
+  ENGINE_THREADS,   // tasks on a work-stealing thread pool
+  ENGINE_POOL,      // a fixed set of worker processes
+};
+
+// Sorting algorithm (algorithms other than quicksort always run on the
+// thread pool)
+enum Algo {
+  ALGO_QUICKSORT,
+  ALGO_SAMPLESORT,
+  ALGO_RADIX,
+  ALGO_IPS4O,
+};
+
+// Shared state of a sort on the thread pool
+struct ThreadSortJob {
+  int64_t *arr;
+  unsigned long par_threshold;
+  int num_workers;
+  struct ws_group group;
+};
+
+// How the file's data is brought into memory
+enum Load {
+  LOAD_MMAP,        // sorted in place in a MAP_SHARED mapping of the file
+  LOAD_COPY,        // read into huge-page memory and written back
+};
+
+// How to sort an array in memory (for sort_array)
+struct SortOptions {
+  enum Engine engine;
+  enum Algo algo;
+  unsigned long par_threshold;
+  int num_workers;
+  int shared;       // whether child processes can sort the array in place
+};
 
 // TODO: declare additional helper functions if needed
+void usage( void );
+int default_num_workers( void );
+int engine_quicksort( enum Engine engine, int64_t *arr, unsigned long start, unsigned long end,
+                      unsigned long par_threshold, int num_workers );
+int sort_array( int64_t *arr, unsigned long n, void *arg );
+int parse_size( const char *str, unsigned long *size );
+void thread_quicksort_task( struct ws_worker *self, void *arg,
+                            unsigned long start, unsigned long end );
 
 
 int main( int argc, char **argv ) {
-  unsigned long par_threshold;
-  if ( argc != 3 || sscanf( argv[2], "%lu", &par_threshold ) != 1 ) {
-    fprintf( stderr, "Usage: parsort <file> <par threshold>\n" );
+  static const struct option long_options[] = {
+    { "engine", required_argument, NULL, 'e' },
+    { "workers", required_argument, NULL, 'j' },
+    { "algo", required_argument, NULL, 'a' },
+    { "leaf", required_argument, NULL, 'l' },
+    { "simd", required_argument, NULL, 's' },
+    { "memory", required_argument, NULL, 'm' },
+    { "load", required_argument, NULL, 'L' },
+    { "record-size", required_argument, NULL, 'r' },
+    { "key-offset", required_argument, NULL, 'k' },
+    { "key-type", required_argument, NULL, 't' },
+    { "key-size", required_argument, NULL, 'K' },
+    { "stable", no_argument, NULL, 'S' },
+    { "text", no_argument, NULL, 'T' },
+    { NULL, 0, NULL, 0 },
+  };
+  enum Engine engine = ENGINE_THREADS;
+  enum Algo algo = ALGO_QUICKSORT;
+  int num_workers = default_num_workers();
+  enum SimdLevel simd = simd_detect(), simd_supported = simd;
+  unsigned long memory_budget = 0;
+  enum Load load = LOAD_MMAP;
+  struct RecordFormat record = { 0, 0, 0, KEY_INT64 };
+  int key_options = 0;
+  int text = 0;
+  int opt;
+
+  while ( ( opt = getopt_long( argc, argv, "e:j:a:l:s:m:L:r:k:t:K:ST", long_options, NULL ) ) != -1 ) {
+    switch ( opt ) {
+    case 'e':
+      if ( strcmp( optarg, "fork" ) == 0 )
+        engine = ENGINE_FORK;
+      else if ( strcmp( optarg, "threads" ) == 0 )
+        engine = ENGINE_THREADS;
+      else if ( strcmp( optarg, "pool" ) == 0 )
+        engine = ENGINE_POOL;
+      else
+        usage();
+      break;
+    case 'j':
+      if ( sscanf( optarg, "%d", &num_workers ) != 1 || num_workers < 1 )
+        usage();
+      break;
+    case 'a':
+      if ( strcmp( optarg, "quicksort" ) == 0 )
+        algo = ALGO_QUICKSORT;
+      else if ( strcmp( optarg, "samplesort" ) == 0 )
+        algo = ALGO_SAMPLESORT;
+      else if ( strcmp( optarg, "radix" ) == 0 )
+        algo = ALGO_RADIX;
+      else if ( strcmp( optarg, "ips4o" ) == 0 )
+        algo = ALGO_IPS4O;
+      else
+        usage();
+      break;
+    case 'l':
+      if ( strcmp( optarg, "pdqsort" ) == 0 )
+        set_leaf_algo( LEAF_PDQSORT );
+      else if ( strcmp( optarg, "qsort" ) == 0 )
+        set_leaf_algo( LEAF_QSORT );
+      else if ( strcmp( optarg, "radix" ) == 0 )
+        set_leaf_algo( LEAF_RADIX );
+      else if ( strcmp( optarg, "simd" ) == 0 )
+        set_leaf_algo( LEAF_SIMD );
+      else
+        usage();
+      break;
+    case 's':
+      if ( strcmp( optarg, "off" ) == 0 )
+        simd = SIMD_NONE;
+      else if ( strcmp( optarg, "avx2" ) == 0 )
+        simd = SIMD_AVX2;
+      else if ( strcmp( optarg, "avx512" ) == 0 )
+        simd = SIMD_AVX512;
+      else
+        usage();
+      if ( simd > simd_supported ) {
+        fprintf( stderr, "Error: this CPU doesn't support %s\n", optarg );
+        exit( 1 );
+      }
+      break;
+    case 'm':
+      if ( !parse_size( optarg, &memory_budget ) || memory_budget == 0 )
+        usage();
+      break;
+    case 'L':
+      if ( strcmp( optarg, "mmap" ) == 0 )
+        load = LOAD_MMAP;
+      else if ( strcmp( optarg, "copy" ) == 0 )
+        load = LOAD_COPY;
+      else
+        usage();
+      break;
+    case 'r':
+      if ( sscanf( optarg, "%zu", &record.record_size ) != 1 || record.record_size < 1 )
+        usage();
+      break;
+    case 'k':
+      if ( sscanf( optarg, "%zu", &record.key_offset ) != 1 )
+        usage();
+      key_options = 1;
+      break;
+    case 't':
+      if ( strcmp( optarg, "int32" ) == 0 )
+        record.key_type = KEY_INT32;
+      else if ( strcmp( optarg, "int64" ) == 0 )
+        record.key_type = KEY_INT64;
+      else if ( strcmp( optarg, "uint64" ) == 0 )
+        record.key_type = KEY_UINT64;
+      else if ( strcmp( optarg, "double" ) == 0 )
+        record.key_type = KEY_DOUBLE;
+      else if ( strcmp( optarg, "bytes" ) == 0 )
+        record.key_type = KEY_BYTES;
+      else
+        usage();
+      key_options = 1;
+      break;
+    case 'K':
+      if ( sscanf( optarg, "%zu", &record.key_size ) != 1 || record.key_size < 1 )
+        usage();
+      key_options = 1;
+      break;
+    case 'S':
+      // record sorts are always stable (and int64 values can't be told
+      // apart), so this only needs --record-size
+      key_options = 1;
+      break;
+    case 'T':
+      text = 1;
+      break;
+    default:
+      usage();
+    }
+  }
+
+  set_simd_level( simd );
+
+  if ( key_options && record.record_size == 0 )
+    usage();
+  if ( record.record_size > 0 ) {
+    if ( record.key_type == KEY_BYTES ) {
+      if ( record.key_size == 0 && record.key_offset < record.record_size )
+        record.key_size = record.record_size - record.key_offset;
+    } else {
+      record.key_size = record.key_type == KEY_INT32 ? sizeof(int32_t) : sizeof(int64_t);
+    }
+    if ( record.key_size == 0 || record.key_offset + record.key_size > record.record_size ) {
+      fprintf( stderr, "Error: the key doesn't fit in a record\n" );
+      exit( 1 );
+    }
+    if ( memory_budget > 0 || load != LOAD_MMAP ) {
+      fprintf( stderr, "Error: --record-size can't be used with --memory or --load\n" );
+      exit( 1 );
+    }
+  }
+
+  if ( text && ( record.record_size > 0 || memory_budget > 0 || load != LOAD_MMAP ) ) {
+    fprintf( stderr, "Error: --text can't be used with --record-size, --memory or --load\n" );
     exit( 1 );
   }
 
+  unsigned long par_threshold;
+  if ( argc - optind != 2 || sscanf( argv[optind + 1], "%lu", &par_threshold ) != 1 )
+    usage();
+  const char *filename = argv[optind];
+
   int fd;
 
   // open the named file
   // TODO: open the named file
-  fd = open(argv[1], O_RDWR);
+  fd = open(filename, O_RDWR);
   if (fd < 0) {
     // file couldn't be opened: handle error and exit
     exit(1);
@@ -50,6 +257,77 @@ int main( int argc, char **argv ) {
   num_elements = file_size / sizeof(int64_t);
   ////
 
+  struct SortOptions sort_opts = { engine, algo, par_threshold, num_workers, 1 };
+
+  // lines of text are sorted into a new file, which replaces this one
+  if ( text ) {
+    int ok = text_sort( filename, fd, file_size, par_threshold, num_workers );
+    close( fd );
+    if ( !ok ) {
+      fprintf( stderr, "Error: sorting failed\n" );
+      exit( 1 );
+    }
+    return 0;
+  }
+
+  // records are sorted in a shared mapping of the file (a partial record
+  // at the end of the file is left where it is)
+  if ( record.record_size > 0 ) {
+    unsigned long num_records = file_size / record.record_size;
+    char *data = NULL;
+    if ( file_size > 0 )
+      data = mmap( NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    close( fd );
+    if ( data == MAP_FAILED )
+      exit( 1 );
+    if ( !record_sort( data, num_records, &record, num_workers ) ) {
+      fprintf( stderr, "Error: sorting failed\n" );
+      exit( 1 );
+    }
+    if ( data != NULL )
+      munmap( data, file_size );
+    return 0;
+  }
+
+  // files larger than the memory budget are sorted in pieces
+  if ( memory_budget > 0 && file_size > memory_budget ) {
+    // samplesort and radix sort need a buffer as large as each chunk
+    // (and samplesort a byte per element more), which must fit too
+    unsigned scratch = 0;
+    if ( algo == ALGO_SAMPLESORT )
+      scratch = sizeof(int64_t) + 1;
+    else if ( algo == ALGO_RADIX )
+      scratch = sizeof(int64_t);
+    int ok = external_sort( filename, fd, num_elements, memory_budget / sizeof(int64_t),
+                            num_workers, scratch, sort_array, &sort_opts );
+    close( fd );
+    if ( !ok ) {
+      fprintf( stderr, "Error: sorting failed\n" );
+      exit( 1 );
+    }
+    return 0;
+  }
+
+  // read the data into huge-page memory, sort it there and write it
+  // back (falling back to mmap if it can't be loaded)
+  if ( load == LOAD_COPY && num_elements > 0 ) {
+    sort_opts.shared = engine != ENGINE_THREADS;
+    int64_t *copy = load_array( fd, num_elements, sort_opts.shared, num_workers );
+    if ( copy != NULL ) {
+      if ( !sort_array( copy, num_elements, &sort_opts ) ) {
+        fprintf( stderr, "Error: sorting failed\n" );
+        exit( 1 );
+      }
+      if ( !store_array( fd, copy, num_elements, num_workers ) ) {
+        fprintf( stderr, "Error: couldn't write the sorted data\n" );
+        exit( 1 );
+      }
+      close( fd );
+      return 0;
+    }
+    sort_opts.shared = 1;
+  }
+
   // mmap the file data
   int64_t *arr;
   // TODO: mmap the file data
@@ -63,9 +341,7 @@ int main( int argc, char **argv ) {
   ////
 
   // Sort the data!
-  int success;
-  success = quicksort( arr, 0, num_elements, par_threshold );
-  if ( !success ) {
+  if ( !sort_array( arr, num_elements, &sort_opts ) ) {
     fprintf( stderr, "Error: sorting failed\n" );
     exit( 1 );
   }
@@ -111,6 +387,122 @@ void swap( int64_t *arr, unsigned long i, unsigned long j ) {
   arr[j] = tmp;
 }
 
+// Return the index of the median of arr[a], arr[b] and arr[c].
+static unsigned long median3( const int64_t *arr, unsigned long a, unsigned long b,
+                              unsigned long c ) {
+  if ( arr[a] < arr[b] ) {
+    if ( arr[b] < arr[c] )
+      return b;
+    return arr[a] < arr[c] ? c : a;
+  }
+  if ( arr[a] < arr[c] )
+    return a;
+  return arr[b] < arr[c] ? c : b;
+}
+
+// Choose a pivot for a region of given array from start (inclusive) to
+// end (exclusive): the median of the first, middle and last elements,
+// or for longer regions the median of three such medians (Tukey's
+// ninther), which is much less likely to be near either end.
+//
+// Parameters:
+//   arr - pointer to first element of array
+//   start - inclusive lower bound index
+//   end - exclusive upper bound index (at least start + 1)
+//
+// Return:
+//   index of the pivot element
+unsigned long choose_pivot( const int64_t *arr, unsigned long start, unsigned long end ) {
+  unsigned long len = end - start, mid = start + len / 2, last = end - 1;
+
+  if ( len < NINTHER_MIN )
+    return median3( arr, start, mid, last );
+
+  unsigned long step = len / 8;
+  return median3( arr,
+                  median3( arr, start, start + step, start + 2 * step ),
+                  median3( arr, mid - step, mid, mid + step ),
+                  median3( arr, last - 2 * step, last - step, last ) );
+}
+
+// Rearrange a region of given array from left (inclusive) to right
+// (exclusive) around a pivot value.
+//
+// Most of the region is partitioned a block at a time, as in Edelkamp
+// and Weiss, "BlockQuicksort": a block from each end is scanned, and
+// the offsets of its misplaced elements are recorded without branches
+// on the comparisons. Then as many pairs as possible are swapped. A
+// comparison's outcome then only decides where the next offset is
+// written, not which code runs, so random data doesn't cause branch
+// mispredictions. The last few blocks are finished one element at a
+// time. If vector instructions were chosen (see simd_sort.c), they are
+// used instead.
+//
+// Parameters:
+//   arr - pointer to first element of array
+//   left - inclusive lower bound index
+//   right - exclusive upper bound index
+//   pivot_val - the pivot value
+//
+// Return:
+//   index of the first element greater than or equal to the pivot;
+//   all elements before it are less than the pivot
+unsigned long partition_range( int64_t *arr, unsigned long left, unsigned long right,
+                               int64_t pivot_val ) {
+  unsigned char offsets_l[PARTITION_BLOCK], offsets_r[PARTITION_BLOCK];
+  unsigned start_l = 0, start_r = 0, num_l = 0, num_r = 0;
+
+  if ( get_simd_level() != SIMD_NONE )
+    return simd_partition_range( arr, left, right, pivot_val );
+
+  // blocks [left, left + PARTITION_BLOCK) and [right - PARTITION_BLOCK,
+  // right) are being worked on; everything before left is less than
+  // the pivot and everything from right on is greater or equal
+  while ( right - left >= 2 * PARTITION_BLOCK ) {
+    if ( num_l == 0 ) {
+      start_l = 0;
+      for ( unsigned i = 0; i < PARTITION_BLOCK; i++ ) {
+        offsets_l[num_l] = i;
+        num_l += !( arr[left + i] < pivot_val );
+      }
+    }
+    if ( num_r == 0 ) {
+      start_r = 0;
+      for ( unsigned i = 0; i < PARTITION_BLOCK; i++ ) {
+        offsets_r[num_r] = i;
+        num_r += arr[right - 1 - i] < pivot_val;
+      }
+    }
+
+    unsigned num = num_l < num_r ? num_l : num_r;
+    for ( unsigned k = 0; k < num; k++ )
+      swap( arr, left + offsets_l[start_l + k], right - 1 - offsets_r[start_r + k] );
+    num_l -= num;
+    num_r -= num;
+    start_l += num;
+    start_r += num;
+
+    if ( num_l == 0 )
+      left += PARTITION_BLOCK;
+    if ( num_r == 0 )
+      right -= PARTITION_BLOCK;
+  }
+
+  // the rest, including any misplaced elements left in a block
+  while ( left < right ) {
+    if ( arr[left] < pivot_val ) {
+      ++left;
+    } else if ( arr[right - 1] >= pivot_val ) {
+      --right;
+    } else {
+      swap( arr, left, right - 1 );
+      ++left;
+      --right;
+    }
+  }
+  return left;
+}
+
 // Partition a region of given array from start (inclusive)
 // to end (exclusive).
 //
@@ -126,48 +518,89 @@ void swap( int64_t *arr, unsigned long i, unsigned long j ) {
 //   have values greater than or equal to the pivot
 unsigned long partition( int64_t *arr, unsigned long start, unsigned long end ) {
   assert( end > start );
-
-  // choose the middle element as the pivot
   unsigned long len = end - start;
   assert( len >= 2 );
-  unsigned long pivot_index = start + (len / 2);
+
+  unsigned long pivot_index = choose_pivot( arr, start, end );
   int64_t pivot_val = arr[pivot_index];
 
   // stash the pivot at the end of the sequence
   swap( arr, pivot_index, end - 1 );
 
-  // partition all of the elements based on how they compare
-  // to the pivot element: elements less than the pivot element
-  // should be in the left partition, elements greater than or
-  // equal to the pivot should go in the right partition
-  unsigned long left_index = start,
-                right_index = start + ( len - 2 );
+  // partition all of the other elements: elements less than the pivot
+  // element go in the left partition, elements greater than or equal
+  // to the pivot go in the right partition
+  unsigned long boundary = partition_range( arr, start, end - 1, pivot_val );
 
-  while ( left_index <= right_index ) {
-    // extend the left partition?
-    if ( arr[left_index] < pivot_val ) {
-      ++left_index;
-      continue;
-    }
+  // boundary is the first element in the right partition, so place
+  // the pivot element there
+  swap( arr, boundary, end - 1 );
+  return boundary;
+}
 
-    // extend the right partition?
-    if ( arr[right_index] >= pivot_val ) {
-      --right_index;
-      continue;
-    }
+// Check whether a value looks common in a region of given array, by
+// counting the copies of it in an evenly spaced sample. With many
+// copies of the pivot, a two-way partition makes little progress: all
+// of them go to the right, and are partitioned again.
+//
+// Parameters:
+//   arr - pointer to first element of array
+//   start - inclusive lower bound index
+//   end - exclusive upper bound index
+//   value - the value to look for
+//
+// Return:
+//   1 if at least 1 in DUP_FRACTION sampled elements equal value,
+//   0 otherwise
+int has_many_equal( const int64_t *arr, unsigned long start, unsigned long end, int64_t value ) {
+  unsigned long len = end - start;
+  unsigned long samples = len < DUP_SAMPLES ? len : DUP_SAMPLES;
+  unsigned long equal = 0;
+
+  for ( unsigned long i = 0; i < samples; i++ )
+    equal += arr[start + len * i / samples] == value;
+  return equal * DUP_FRACTION >= samples;
+}
+
+// Partition a region of given array from start (inclusive) to end
+// (exclusive) like partition(), except that if the pivot value looks
+// common, every element equal to the pivot is moved between the two
+// partitions (a three-way partition). This takes a second pass over the
+// right partition, this time splitting off elements less than or equal
+// to the pivot. Equal elements are then in their final places, so a
+// region with few distinct values needs only a few partitions.
+//
+// Parameters:
+//   arr - pointer to first element of array
+//   start - inclusive lower bound index
+//   end - exclusive upper bound index
+//   equal_end - set to the index after the last element equal to the
+//               pivot
+//
+// Return:
+//   index of the first element equal to the pivot; all elements before
+//   it are less than the pivot, and all elements from *equal_end on are
+//   greater
+unsigned long partition_equal( int64_t *arr, unsigned long start, unsigned long end,
+                               unsigned long *equal_end ) {
+  assert( end - start >= 2 );
+  unsigned long pivot_index = choose_pivot( arr, start, end );
+  int64_t pivot_val = arr[pivot_index];
 
-    // left_index refers to an element that should be in the right
-    // partition, and right_index refers to an element that should
-    // be in the left partition, so swap them
-    swap( arr, left_index, right_index );
+  if ( !has_many_equal( arr, start, end, pivot_val ) ) {
+    swap( arr, pivot_index, end - 1 );
+    unsigned long boundary = partition_range( arr, start, end - 1, pivot_val );
+    swap( arr, boundary, end - 1 );
+    *equal_end = boundary + 1;
+    return boundary;
   }
 
-  // at this point, left_index points to the first element
-  // in the right partition, so place the pivot element there
-  // and return the left index, since that's where the pivot
-  // element is now
-  swap( arr, left_index, end - 1 );
-  return left_index;
+  unsigned long boundary = partition_range( arr, start, end, pivot_val );
+  if ( pivot_val == INT64_MAX )
+    *equal_end = end;   // nothing can be greater
+  else
+    *equal_end = partition_range( arr, boundary, end, pivot_val + 1 );
+  return boundary;
 }
 
 
@@ -182,12 +615,13 @@ int quicksort(int64_t *arr, unsigned long start, unsigned long end, unsigned lon
 
     // Base case: if number of elements is less than or equal to the threshold, sort sequentially
     if (len <= par_threshold) {
-        qsort(arr + start, len, sizeof(int64_t), compare);
+        leaf_sort(arr + start, len);
         return 1;
     }
 
     // Partition
-    unsigned long mid = partition(arr, start, end);
+    unsigned long mid_end;
+    unsigned long mid = partition_equal(arr, start, end, &mid_end);
 
     // Use child processes for parallel sorting
     pid_t left_child, right_child;
@@ -206,7 +640,7 @@ int quicksort(int64_t *arr, unsigned long start, unsigned long end, unsigned lon
     right_child = fork();
     if (right_child == 0) {
         // Right child process
-        exit(quicksort(arr, mid + 1, end, par_threshold) ? 0 : 1);
+        exit(quicksort(arr, mid_end, end, par_threshold) ? 0 : 1);
     } else if (right_child < 0) {
         // Fork failed
         kill(left_child, SIGTERM);
@@ -225,4 +659,177 @@ int quicksort(int64_t *arr, unsigned long start, unsigned long end, unsigned lon
     return left_success && right_success;
 }
 
-// TODO: define additional helper functions if needed
\ No newline at end of file
+// TODO: define additional helper functions if needed
+
+// Print a usage message and exit.
+void usage( void ) {
+  fprintf( stderr, "Usage: parsort [options] <file> <par threshold>\n" );
+  fprintf( stderr, "Options:\n" );
+  fprintf( stderr, "  -e, --engine ENGINE  how subranges are sorted concurrently:\n" );
+  fprintf( stderr, "                         fork     a child process per partition\n" );
+  fprintf( stderr, "                         threads  a work-stealing thread pool (default)\n" );
+  fprintf( stderr, "                         pool     a fixed set of worker processes\n" );
+  fprintf( stderr, "  -j, --workers N      number of worker threads or processes\n" );
+  fprintf( stderr, "                       (default: one per CPU)\n" );
+  fprintf( stderr, "  -a, --algo ALGO      sorting algorithm:\n" );
+  fprintf( stderr, "                         quicksort   (default)\n" );
+  fprintf( stderr, "                         samplesort  parallel samplesort on the thread pool\n" );
+  fprintf( stderr, "                         radix       parallel LSD radix sort on the thread pool\n" );
+  fprintf( stderr, "                         ips4o       in-place parallel samplesort on the thread pool\n" );
+  fprintf( stderr, "  -l, --leaf LEAF      sequential sort for ranges up to the threshold:\n" );
+  fprintf( stderr, "                         pdqsort  pattern-defeating quicksort\n" );
+  fprintf( stderr, "                         qsort    libc qsort\n" );
+  fprintf( stderr, "                         radix    LSD radix sort\n" );
+  fprintf( stderr, "                         simd     vectorized quicksort, or pdqsort with\n" );
+  fprintf( stderr, "                                  --simd off (default)\n" );
+  fprintf( stderr, "  -s, --simd SET       vector instructions for partitioning and the\n" );
+  fprintf( stderr, "                       simd leaf sort: off, avx2 or avx512\n" );
+  fprintf( stderr, "                       (default: the best the CPU supports)\n" );
+  fprintf( stderr, "  -m, --memory SIZE    sort files larger than SIZE bytes (suffix K, M or G)\n" );
+  fprintf( stderr, "                       externally, in sorted runs merged through\n" );
+  fprintf( stderr, "                       temporary files next to the file\n" );
+  fprintf( stderr, "  -L, --load MODE      how the data is brought into memory:\n" );
+  fprintf( stderr, "                         mmap  sorted in place in a shared mapping (default)\n" );
+  fprintf( stderr, "                         copy  read into huge-page memory by all workers,\n" );
+  fprintf( stderr, "                               sorted there and written back\n" );
+  fprintf( stderr, "  -r, --record-size N  sort records of N bytes by a key, rather than int64_t\n" );
+  fprintf( stderr, "                       values (the engine, algorithm and threshold don't\n" );
+  fprintf( stderr, "                       apply; records with equal keys keep their order)\n" );
+  fprintf( stderr, "  -k, --key-offset N   offset of the key in a record (default: 0)\n" );
+  fprintf( stderr, "  -t, --key-type TYPE  int32, int64 (default), uint64, double, or bytes\n" );
+  fprintf( stderr, "                       (compared like memcmp)\n" );
+  fprintf( stderr, "  -K, --key-size N     size of a bytes key (default: the rest of the record)\n" );
+  fprintf( stderr, "  -S, --stable         keep records with equal keys in order (always done)\n" );
+  fprintf( stderr, "  -T, --text           sort the lines of a text file bytewise (like\n" );
+  fprintf( stderr, "                       LC_ALL=C sort), with parallel multikey quicksort\n" );
+  exit( 1 );
+}
+
+// Return the default number of workers: one per online CPU.
+int default_num_workers( void ) {
+  long ncpus = sysconf( _SC_NPROCESSORS_ONLN );
+  return ncpus < 1 ? 1 : (int) ncpus;
+}
+
+// Quicksort a region of given array from start (inclusive) to end
+// (exclusive) with the given engine. The thread engine falls back to
+// the fork engine if its thread pool can't be created.
+//
+// Return:
+//   1 if the sort succeeded, 0 if not
+int engine_quicksort( enum Engine engine, int64_t *arr, unsigned long start, unsigned long end,
+                      unsigned long par_threshold, int num_workers ) {
+  if ( engine == ENGINE_POOL )
+    return process_pool_quicksort( arr, start, end, par_threshold, num_workers );
+  if ( engine == ENGINE_THREADS && thread_quicksort( arr, start, end, par_threshold, num_workers ) )
+    return 1;
+  return quicksort( arr, start, end, par_threshold );
+}
+
+// Sort an array with the algorithm and engine chosen on the command
+// line. Algorithms other than quicksort fall back to quicksort if they
+// can't allocate what they need. An array child processes can't sort
+// (private memory) is never given to the fork engine: if the thread pool
+// can't be created, it is sorted by this thread instead.
+//
+// Parameters:
+//   arr - pointer to first element to sort
+//   n - number of elements
+//   arg - pointer to the SortOptions
+//
+// Return:
+//   1 if the sort succeeded, 0 if not
+int sort_array( int64_t *arr, unsigned long n, void *arg ) {
+  const struct SortOptions *opts = arg;
+  int success = 0;
+  if ( opts->algo == ALGO_SAMPLESORT )
+    success = samplesort( arr, 0, n, opts->par_threshold, opts->num_workers );
+  else if ( opts->algo == ALGO_RADIX )
+    success = radix_sort( arr, 0, n, opts->par_threshold, opts->num_workers );
+  else if ( opts->algo == ALGO_IPS4O )
+    success = inplace_samplesort( arr, 0, n, opts->par_threshold, opts->num_workers );
+  if ( success )
+    return 1;
+
+  if ( !opts->shared ) {
+    if ( !thread_quicksort( arr, 0, n, opts->par_threshold, opts->num_workers ) )
+      leaf_sort( arr, n );
+    return 1;
+  }
+  return engine_quicksort( opts->engine, arr, 0, n, opts->par_threshold, opts->num_workers );
+}
+
+// Parse a size in bytes, with an optional K, M or G suffix (powers of
+// 1024).
+//
+// Return:
+//   1 if successful, 0 if str isn't a valid size
+int parse_size( const char *str, unsigned long *size ) {
+  char *end;
+  unsigned long value = strtoul( str, &end, 10 );
+  if ( end == str )
+    return 0;
+  switch ( *end ) {
+  case 'K': case 'k': value <<= 10; end++; break;
+  case 'M': case 'm': value <<= 20; end++; break;
+  case 'G': case 'g': value <<= 30; end++; break;
+  }
+  if ( *end != '\0' )
+    return 0;
+  *size = value;
+  return 1;
+}
+
+// Quicksort task for the thread pool: partition the range, spawn a task
+// for the right part and keep going with the left part, until it is no
+// larger than the threshold, which is then sorted sequentially. Ranges
+// much larger than the threshold are partitioned in parallel.
+//
+// Parameters:
+//   self - the worker running the task
+//   arg - pointer to the ThreadSortJob
+//   start - inclusive lower bound index
+//   end - exclusive upper bound index
+void thread_quicksort_task( struct ws_worker *self, void *arg,
+                            unsigned long start, unsigned long end ) {
+  struct ThreadSortJob *job = arg;
+
+  while ( end - start >= 2 && end - start > job->par_threshold ) {
+    unsigned long mid, mid_end;
+    if ( job->num_workers > 1 && end - start >= PAR_PARTITION_MIN &&
+         ( end - start ) / PAR_PARTITION_FACTOR > job->par_threshold )
+      mid = parallel_partition( self, job->arr, start, end, job->num_workers, &mid_end );
+    else
+      mid = partition_equal( job->arr, start, end, &mid_end );
+    ws_spawn( self, &job->group, thread_quicksort_task, job, mid_end, end );
+    end = mid;
+  }
+
+  leaf_sort( job->arr + start, end - start );
+}
+
+// Sort a region of given array from start (inclusive) to end
+// (exclusive) using a pool of worker threads. Unlike quicksort, the
+// number of threads is fixed no matter how small par_threshold is.
+//
+// Parameters:
+//   arr - pointer to first element of array
+//   start - inclusive lower bound index
+//   end - exclusive upper bound index
+//   par_threshold - ranges this long or shorter are sorted sequentially
+//   num_workers - number of threads to use
+//
+// Return:
+//   1 if the sort succeeded, 0 if the thread pool couldn't be created
+int thread_quicksort( int64_t *arr, unsigned long start, unsigned long end,
+                      unsigned long par_threshold, int num_workers ) {
+  struct ws_pool *pool = ws_pool_create( num_workers );
+  if ( pool == NULL )
+    return 0;
+
+  struct ThreadSortJob job = { arr, par_threshold, ws_pool_num_workers( pool ), { 0 } };
+  ws_pool_run( pool, &job.group, thread_quicksort_task, &job, start, end );
+
+  ws_pool_destroy( pool );
+  return 1;
+}
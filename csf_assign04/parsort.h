@@ -0,0 +1,197 @@
+#ifndef PARSORT_H
+#define PARSORT_H
+
+// Functions shared by the parsort sorting engines
+
+#include <stdint.h>
+#include <sys/types.h>
+
+int compare( const void *left, const void *right );
+void swap( int64_t *arr, unsigned long i, unsigned long j );
+unsigned long partition( int64_t *arr, unsigned long start, unsigned long end );
+unsigned long partition_range( int64_t *arr, unsigned long left, unsigned long right,
+                               int64_t pivot_val );
+unsigned long choose_pivot( const int64_t *arr, unsigned long start, unsigned long end );
+int has_many_equal( const int64_t *arr, unsigned long start, unsigned long end, int64_t value );
+unsigned long partition_equal( int64_t *arr, unsigned long start, unsigned long end,
+                               unsigned long *equal_end );
+
+// Elements per block in partition_range (at most 256, so offsets fit in
+// a byte)
+#define PARTITION_BLOCK 128
+
+// Regions at least this long get a ninther pivot rather than a median
+// of 3
+#define NINTHER_MIN 128
+
+// partition_equal switches to a three-way partition when at least 1 in
+// DUP_FRACTION of DUP_SAMPLES sampled elements equal the pivot
+#define DUP_SAMPLES 32
+#define DUP_FRACTION 8
+
+// Algorithms for sorting the ranges no longer than par_threshold
+enum LeafAlgo {
+  LEAF_PDQSORT,   // pattern-defeating quicksort
+  LEAF_QSORT,     // libc qsort
+  LEAF_RADIX,     // LSD radix sort (with a temporary buffer)
+  LEAF_SIMD,      // vectorized quicksort (in simd_sort.c)
+};
+
+// Leaf sorting (in leaf_sort.c)
+void set_leaf_algo( enum LeafAlgo algo );
+void leaf_sort( int64_t *arr, unsigned long n );
+
+// Ranges longer than PAR_PARTITION_FACTOR * par_threshold (and at least
+// PAR_PARTITION_MIN elements) are partitioned in parallel by the thread
+// engine
+#define PAR_PARTITION_FACTOR 16
+#define PAR_PARTITION_MIN 65536
+
+struct ws_worker;
+
+// Partition using tasks on the thread pool (in par_partition.c)
+unsigned long parallel_partition( struct ws_worker *self, int64_t *arr, unsigned long start,
+                                  unsigned long end, int max_blocks, unsigned long *equal_end );
+
+// Sorting engines: each sorts arr[start..end), partitioning ranges
+// longer than par_threshold and sorting shorter ones sequentially, and
+// returns 1 if successful or 0 if not.
+
+// A child process per partition (in parsort.c)
+int quicksort( int64_t *arr, unsigned long start, unsigned long end, unsigned long par_threshold );
+
+// Tasks on a work-stealing thread pool (in parsort.c)
+int thread_quicksort( int64_t *arr, unsigned long start, unsigned long end,
+                      unsigned long par_threshold, int num_workers );
+
+// A fixed set of worker processes sharing a task queue (in proc_pool.c)
+int process_pool_quicksort( int64_t *arr, unsigned long start, unsigned long end,
+                            unsigned long par_threshold, int num_workers );
+
+// Other algorithms, on the thread pool
+
+// Parallel samplesort (in samplesort.c); uses a buffer the size of the
+// array, and returns 0 without sorting if it can't be allocated
+int samplesort( int64_t *arr, unsigned long start, unsigned long end,
+                unsigned long par_threshold, int num_workers );
+
+// Parallel LSD radix sort (in radix_sort.c); uses a buffer the size of
+// the array, and returns 0 without sorting if it can't be allocated
+int radix_sort( int64_t *arr, unsigned long start, unsigned long end,
+                unsigned long par_threshold, int num_workers );
+
+// In-place parallel samplesort (in inplace_samplesort.c); needs extra
+// memory for a few blocks per bucket per worker, not for a copy of the
+// array
+int inplace_samplesort( int64_t *arr, unsigned long start, unsigned long end,
+                        unsigned long par_threshold, int num_workers );
+
+// Vector instruction sets, in increasing order of capability
+enum SimdLevel {
+  SIMD_NONE,
+  SIMD_AVX2,
+  SIMD_AVX512,
+};
+
+// Vectorized partitioning and sorting (in simd_sort.c)
+enum SimdLevel simd_detect( void );
+void set_simd_level( enum SimdLevel level );
+enum SimdLevel get_simd_level( void );
+unsigned long simd_partition_range( int64_t *arr, unsigned long left, unsigned long right,
+                                    int64_t pivot_val );
+void simd_sort( int64_t *arr, unsigned long n );
+
+// Sequential pattern-defeating quicksort (in pdqsort.c)
+void pdqsort( int64_t *arr, unsigned long n );
+
+// Sequential LSD radix sort of n elements, using buf (n elements) as
+// scratch space (in radix_sort.c)
+void radix_sort_seq( int64_t *arr, int64_t *buf, unsigned long n );
+
+// Function sorting an array in memory for external_sort, returning 1 if
+// successful or 0 if not
+typedef int (*sort_fn)( int64_t *arr, unsigned long n, void *arg );
+
+// Sort a file too large for the memory budget (in ext_sort.c): sort
+// chunks with sort, as large as the budget allows for two of them and
+// the scratch memory sort uses, and merge the sorted runs with
+// num_workers threads, through temporary files next to path.
+//
+// Parameters:
+//   path - name of the file (for placing temporary files)
+//   fd - the file, open for reading and writing
+//   n - number of elements in the file
+//   budget - memory budget, in elements
+//   num_workers - number of merging threads
+//   scratch - bytes of memory sort allocates per element it sorts
+//   sort, sort_arg - function sorting each chunk, and its argument
+//
+// Return:
+//   1 if successful, 0 if not
+int external_sort( const char *path, int fd, unsigned long n, unsigned long budget,
+                   int num_workers, unsigned scratch, sort_fn sort, void *sort_arg );
+
+// Types of record keys
+enum KeyType {
+  KEY_INT32,
+  KEY_INT64,
+  KEY_UINT64,
+  KEY_DOUBLE,
+  KEY_BYTES,    // compared as unsigned bytes, like memcmp
+};
+
+// Layout of fixed-size records
+struct RecordFormat {
+  size_t record_size;
+  size_t key_offset;    // of the key in a record
+  size_t key_size;      // in bytes
+  enum KeyType key_type;
+};
+
+// Sort n records by their keys, stably, with num_workers threads (in
+// record_sort.c). Uses 32 bytes per record, and a buffer of 1 MiB (or
+// one record, if larger) to permute them in place.
+//
+// Return:
+//   1 if successful, 0 if memory or threads couldn't be allocated (in
+//   which case the records are unchanged)
+int record_sort( char *data, unsigned long n, const struct RecordFormat *fmt, int num_workers );
+
+// Sort the lines of a text file bytewise, with multikey quicksort tasks
+// for ranges longer than par_threshold lines (in text_sort.c). The
+// sorted lines (each ending in a newline) replace the file through a
+// temporary file next to it.
+//
+// Parameters:
+//   path - name of the file
+//   fd - the file, open for reading
+//   size - size of the file in bytes
+//   par_threshold - ranges this long or shorter are sorted sequentially
+//   num_workers - number of threads to use
+//
+// Return:
+//   1 if successful, 0 if not
+int text_sort( const char *path, int fd, size_t size, unsigned long par_threshold,
+               int num_workers );
+
+// Read (write = 0) or write (write = 1) bytes at offset in a file,
+// until all are done (in ext_sort.c)
+int transfer_all( int fd, char *buf, size_t bytes, off_t offset, int write );
+
+// Read a file of n elements into anonymous memory advised to use
+// transparent huge pages, a stripe per worker (in load_data.c). The
+// memory is MAP_SHARED if shared is nonzero, for engines using
+// processes.
+//
+// Return:
+//   the array, or NULL if it couldn't be allocated or read
+int64_t *load_array( int fd, unsigned long n, int shared, int num_workers );
+
+// Write an array from load_array back to the file, a stripe per
+// worker, and free it.
+//
+// Return:
+//   1 if successful, 0 if not
+int store_array( int fd, int64_t *arr, unsigned long n, int num_workers );
+
+#endif // PARSORT_H
@@ -0,0 +1,295 @@
+// Pattern-defeating quicksort for int64_t, after Orson Peters' pdqsort.
+//
+// This is an introsort with the comparisons inlined, unlike qsort's
+// call through a function pointer per comparison:
+// - Ranges shorter than INSERTION_SORT_THRESHOLD use insertion sort.
+// - Pivots are the median of 3, or of 3 medians of 3 (Tukey's ninther)
+//   for larger ranges.
+// - Runs of elements equal to the pivot are split off in linear time.
+// - Already sorted ranges are detected by a partition that moved no
+//   elements, followed by a bounded insertion sort.
+// - Bad partitions are answered by shuffling a few elements, and after
+//   log2(n) of them by heapsort, so the worst case is O(n log n).
+
+#include <stdint.h>
+
+#include "parsort.h"
+
+// ranges shorter than this are insertion sorted
+#define INSERTION_SORT_THRESHOLD 24
+
+// ranges longer than this use the ninther as the pivot
+#define NINTHER_THRESHOLD 128
+
+// most elements partial_insertion_sort may move before giving up
+#define PARTIAL_INSERTION_SORT_LIMIT 8
+
+static inline void swap_ptr( int64_t *a, int64_t *b ) {
+  int64_t tmp = *a;
+  *a = *b;
+  *b = tmp;
+}
+
+// Order *a <= *b
+static inline void sort2( int64_t *a, int64_t *b ) {
+  if ( *b < *a )
+    swap_ptr( a, b );
+}
+
+// Order *a <= *b <= *c
+static inline void sort3( int64_t *a, int64_t *b, int64_t *c ) {
+  sort2( a, b );
+  sort2( b, c );
+  sort2( a, b );
+}
+
+static void insertion_sort( int64_t *begin, int64_t *end ) {
+  if ( begin == end )
+    return;
+  for ( int64_t *cur = begin + 1; cur != end; cur++ ) {
+    if ( *cur < cur[-1] ) {
+      int64_t tmp = *cur, *sift = cur;
+      do {
+        *sift = sift[-1];
+        sift--;
+      } while ( sift != begin && tmp < sift[-1] );
+      *sift = tmp;
+    }
+  }
+}
+
+// Insertion sort of a range that has an element no greater than any of
+// its elements just before it (so the bounds check can be left out)
+static void unguarded_insertion_sort( int64_t *begin, int64_t *end ) {
+  if ( begin == end )
+    return;
+  for ( int64_t *cur = begin + 1; cur != end; cur++ ) {
+    if ( *cur < cur[-1] ) {
+      int64_t tmp = *cur, *sift = cur;
+      do {
+        *sift = sift[-1];
+        sift--;
+      } while ( tmp < sift[-1] );
+      *sift = tmp;
+    }
+  }
+}
+
+// Insertion sort that gives up (returning 0) once it has moved more
+// than PARTIAL_INSERTION_SORT_LIMIT elements; returns 1 if it sorted the
+// range
+static int partial_insertion_sort( int64_t *begin, int64_t *end ) {
+  unsigned long moved = 0;
+  if ( begin == end )
+    return 1;
+  for ( int64_t *cur = begin + 1; cur != end; cur++ ) {
+    if ( moved > PARTIAL_INSERTION_SORT_LIMIT )
+      return 0;
+    if ( *cur < cur[-1] ) {
+      int64_t tmp = *cur, *sift = cur;
+      do {
+        *sift = sift[-1];
+        sift--;
+      } while ( sift != begin && tmp < sift[-1] );
+      *sift = tmp;
+      moved += cur - sift;
+    }
+  }
+  return 1;
+}
+
+static void sift_down( int64_t *heap, unsigned long n, unsigned long i ) {
+  int64_t x = heap[i];
+  for ( ;; ) {
+    unsigned long child = 2 * i + 1;
+    if ( child >= n )
+      break;
+    if ( child + 1 < n && heap[child] < heap[child + 1] )
+      child++;
+    if ( !( x < heap[child] ) )
+      break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = x;
+}
+
+static void heapsort( int64_t *begin, int64_t *end ) {
+  unsigned long n = end - begin;
+  for ( unsigned long i = n / 2; i-- > 0; )
+    sift_down( begin, n, i );
+  for ( unsigned long last = n - 1; last > 0; last-- ) {
+    swap_ptr( begin, begin + last );
+    sift_down( begin, last, 0 );
+  }
+}
+
+// Partition [begin, end) around the pivot *begin into elements less than
+// the pivot, then the pivot, then elements greater than or equal to it.
+// The range must have an element greater than or equal to the pivot
+// just after it, or be followed by the end of a median-of-3 pivot
+// selection. Sets *already_partitioned if no elements had to be swapped.
+//
+// Return:
+//   the pivot's final position
+static int64_t *partition_right( int64_t *begin, int64_t *end, int *already_partitioned ) {
+  int64_t pivot = *begin;
+  int64_t *first = begin, *last = end;
+
+  // the median of 3 guarantees an element >= pivot (end[-1])
+  while ( *++first < pivot )
+    ;
+
+  // if the first element was already in place, nothing guarantees an
+  // element < pivot before last, so check the bounds
+  if ( first - 1 == begin ) {
+    while ( first < last && !( *--last < pivot ) )
+      ;
+  } else {
+    while ( !( *--last < pivot ) )
+      ;
+  }
+
+  *already_partitioned = first >= last;
+
+  while ( first < last ) {
+    swap_ptr( first, last );
+    while ( *++first < pivot )
+      ;
+    while ( !( *--last < pivot ) )
+      ;
+  }
+
+  int64_t *pivot_pos = first - 1;
+  *begin = *pivot_pos;
+  *pivot_pos = pivot;
+  return pivot_pos;
+}
+
+// Partition [begin, end) around the pivot *begin into elements equal to
+// the pivot, then elements greater than it. Used when the element just
+// before the range equals the pivot, so nothing in the range is smaller.
+//
+// Return:
+//   the position of the last element equal to the pivot
+static int64_t *partition_left( int64_t *begin, int64_t *end ) {
+  int64_t pivot = *begin;
+  int64_t *first = begin, *last = end;
+
+  while ( pivot < *--last )
+    ;
+
+  if ( last + 1 == end ) {
+    while ( first < last && !( pivot < *++first ) )
+      ;
+  } else {
+    while ( !( pivot < *++first ) )
+      ;
+  }
+
+  while ( first < last ) {
+    swap_ptr( first, last );
+    while ( pivot < *--last )
+      ;
+    while ( !( pivot < *++first ) )
+      ;
+  }
+
+  int64_t *pivot_pos = last;
+  *begin = *pivot_pos;
+  *pivot_pos = pivot;
+  return pivot_pos;
+}
+
+// Sort [begin, end). leftmost is 0 if the element before begin belongs
+// to the same array and is no greater than any element of the range.
+static void pdqsort_loop( int64_t *begin, int64_t *end, int bad_allowed, int leftmost ) {
+  for ( ;; ) {
+    unsigned long size = end - begin;
+
+    if ( size < INSERTION_SORT_THRESHOLD ) {
+      if ( leftmost )
+        insertion_sort( begin, end );
+      else
+        unguarded_insertion_sort( begin, end );
+      return;
+    }
+
+    // choose the pivot and move it to *begin
+    unsigned long s2 = size / 2;
+    if ( size > NINTHER_THRESHOLD ) {
+      sort3( begin, begin + s2, end - 1 );
+      sort3( begin + 1, begin + ( s2 - 1 ), end - 2 );
+      sort3( begin + 2, begin + ( s2 + 1 ), end - 3 );
+      sort3( begin + ( s2 - 1 ), begin + s2, begin + ( s2 + 1 ) );
+      swap_ptr( begin, begin + s2 );
+    } else {
+      sort3( begin + s2, begin, end - 1 );
+    }
+
+    // if the element before the range equals the pivot, no element of
+    // the range is smaller: put the pivot's equals first and skip them
+    if ( !leftmost && !( begin[-1] < *begin ) ) {
+      begin = partition_left( begin, end ) + 1;
+      continue;
+    }
+
+    int already_partitioned;
+    int64_t *pivot_pos = partition_right( begin, end, &already_partitioned );
+    unsigned long l_size = pivot_pos - begin;
+    unsigned long r_size = end - ( pivot_pos + 1 );
+
+    if ( l_size < size / 8 || r_size < size / 8 ) {
+      // a bad partition: after too many, switch to heapsort
+      if ( --bad_allowed == 0 ) {
+        heapsort( begin, end );
+        return;
+      }
+
+      // otherwise break up patterns that may have caused it
+      if ( l_size >= INSERTION_SORT_THRESHOLD ) {
+        swap_ptr( begin, begin + l_size / 4 );
+        swap_ptr( pivot_pos - 1, pivot_pos - l_size / 4 );
+        if ( l_size > NINTHER_THRESHOLD ) {
+          swap_ptr( begin + 1, begin + ( l_size / 4 + 1 ) );
+          swap_ptr( begin + 2, begin + ( l_size / 4 + 2 ) );
+          swap_ptr( pivot_pos - 2, pivot_pos - ( l_size / 4 + 1 ) );
+          swap_ptr( pivot_pos - 3, pivot_pos - ( l_size / 4 + 2 ) );
+        }
+      }
+      if ( r_size >= INSERTION_SORT_THRESHOLD ) {
+        swap_ptr( pivot_pos + 1, pivot_pos + ( 1 + r_size / 4 ) );
+        swap_ptr( end - 1, end - r_size / 4 );
+        if ( r_size > NINTHER_THRESHOLD ) {
+          swap_ptr( pivot_pos + 2, pivot_pos + ( 2 + r_size / 4 ) );
+          swap_ptr( pivot_pos + 3, pivot_pos + ( 3 + r_size / 4 ) );
+          swap_ptr( end - 2, end - ( 1 + r_size / 4 ) );
+          swap_ptr( end - 3, end - ( 2 + r_size / 4 ) );
+        }
+      }
+    } else if ( already_partitioned && partial_insertion_sort( begin, pivot_pos ) &&
+                partial_insertion_sort( pivot_pos + 1, end ) ) {
+      // the range was (nearly) sorted already
+      return;
+    }
+
+    // recurse into the left part, loop on the right one
+    pdqsort_loop( begin, pivot_pos, bad_allowed, leftmost );
+    begin = pivot_pos + 1;
+    leftmost = 0;
+  }
+}
+
+// Sort n elements with pattern-defeating quicksort.
+//
+// Parameters:
+//   arr - pointer to first element to sort
+//   n - number of elements
+void pdqsort( int64_t *arr, unsigned long n ) {
+  int log2_n = 0;
+  if ( n < 2 )
+    return;
+  while ( ( n >> ( log2_n + 1 ) ) > 0 )
+    log2_n++;
+  pdqsort_loop( arr, arr + n, log2_n, 1 );
+}
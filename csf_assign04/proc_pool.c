@@ -0,0 +1,216 @@
+// Process-pool engine: a fixed number of worker processes, forked up
+// front, take (start, end) ranges from a lock-free queue in shared
+// memory, partition them, and put one part back on the queue for any
+// worker to take. Completion is detected by counting the elements that
+// have reached their final position, rather than by waiting for a tree
+// of child processes.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/types.h>
+
+#include "parsort.h"
+
+// number of ranges the queue can hold per worker (when the queue is
+// full, a worker sorts the range itself instead)
+#define QUEUE_SLOTS_PER_WORKER 1024
+
+// idle workers yield this many times before sleeping between polls
+#define IDLE_SPINS 64
+#define IDLE_SLEEP_NS 50000
+
+// A queue slot. seq tells producers and consumers whose turn it is:
+// the slot at position pos is free for the producer of pos when
+// seq == pos, and holds a range for the consumer of pos when
+// seq == pos + 1.
+struct QueueSlot {
+  long seq;
+  unsigned long start, end;
+};
+
+// Shared state of a process pool sort, in a MAP_SHARED | MAP_ANONYMOUS
+// region so that every worker sees the same copy. The queue is a
+// bounded multi-producer multi-consumer ring (Vyukov's algorithm).
+struct ProcPool {
+  unsigned long total;       // number of elements being sorted
+  unsigned long done;        // number in their final position
+  int failed;                // set if a worker died
+  long mask;                 // number of slots - 1 (a power of 2 minus 1)
+  long head;                 // next position to take from
+  long tail;                 // next position to put into
+  struct QueueSlot slots[];
+};
+
+// Put a range on the queue.
+//
+// Return:
+//   1 if successful, 0 if the queue is full
+static int queue_put( struct ProcPool *pool, unsigned long start, unsigned long end ) {
+  long pos = __atomic_load_n( &pool->tail, __ATOMIC_RELAXED );
+  struct QueueSlot *slot;
+
+  for ( ;; ) {
+    slot = &pool->slots[pos & pool->mask];
+    long seq = __atomic_load_n( &slot->seq, __ATOMIC_ACQUIRE );
+    if ( seq == pos ) {
+      if ( __atomic_compare_exchange_n( &pool->tail, &pos, pos + 1, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+        break;
+    } else if ( seq < pos ) {
+      return 0;
+    } else {
+      pos = __atomic_load_n( &pool->tail, __ATOMIC_RELAXED );
+    }
+  }
+
+  slot->start = start;
+  slot->end = end;
+  __atomic_store_n( &slot->seq, pos + 1, __ATOMIC_RELEASE );
+  return 1;
+}
+
+// Take a range from the queue.
+//
+// Return:
+//   1 if successful, 0 if the queue is empty
+static int queue_take( struct ProcPool *pool, unsigned long *start, unsigned long *end ) {
+  long pos = __atomic_load_n( &pool->head, __ATOMIC_RELAXED );
+  struct QueueSlot *slot;
+
+  for ( ;; ) {
+    slot = &pool->slots[pos & pool->mask];
+    long seq = __atomic_load_n( &slot->seq, __ATOMIC_ACQUIRE );
+    if ( seq == pos + 1 ) {
+      if ( __atomic_compare_exchange_n( &pool->head, &pos, pos + 1, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+        break;
+    } else if ( seq < pos + 1 ) {
+      return 0;
+    } else {
+      pos = __atomic_load_n( &pool->head, __ATOMIC_RELAXED );
+    }
+  }
+
+  *start = slot->start;
+  *end = slot->end;
+  __atomic_store_n( &slot->seq, pos + pool->mask + 1, __ATOMIC_RELEASE );
+  return 1;
+}
+
+// Sort one range: partition it until what's left is no longer than the
+// threshold, offering the right part of each partition to the other
+// workers (or sorting it here if the queue is full).
+static void sort_range( struct ProcPool *pool, int64_t *arr, unsigned long start,
+                        unsigned long end, unsigned long par_threshold ) {
+  while ( end - start >= 2 && end - start > par_threshold ) {
+    unsigned long mid_end;
+    unsigned long mid = partition_equal( arr, start, end, &mid_end );
+    __atomic_add_fetch( &pool->done, mid_end - mid, __ATOMIC_RELEASE );   // the pivot and its equals
+
+    if ( mid_end < end && !queue_put( pool, mid_end, end ) )
+      sort_range( pool, arr, mid_end, end, par_threshold );
+    end = mid;
+  }
+
+  leaf_sort( arr + start, end - start );
+  __atomic_add_fetch( &pool->done, end - start, __ATOMIC_RELEASE );
+}
+
+// Main loop of a worker: take ranges and sort them until every element
+// is in place (or another worker has died).
+static void worker_main( struct ProcPool *pool, int64_t *arr, unsigned long par_threshold ) {
+  int failures = 0;
+
+  while ( __atomic_load_n( &pool->done, __ATOMIC_ACQUIRE ) < pool->total &&
+          !__atomic_load_n( &pool->failed, __ATOMIC_RELAXED ) ) {
+    unsigned long start, end;
+    if ( queue_take( pool, &start, &end ) ) {
+      sort_range( pool, arr, start, end, par_threshold );
+      failures = 0;
+    } else if ( ++failures < IDLE_SPINS ) {
+      sched_yield();
+    } else {
+      struct timespec ts = { 0, IDLE_SLEEP_NS };
+      nanosleep( &ts, NULL );
+    }
+  }
+}
+
+// Sort a region of given array from start (inclusive) to end
+// (exclusive) using num_workers worker processes, which share the
+// array (it must be mapped MAP_SHARED) and a queue of ranges.
+//
+// Parameters:
+//   arr - pointer to first element of array
+//   start - inclusive lower bound index
+//   end - exclusive upper bound index
+//   par_threshold - ranges this long or shorter are sorted sequentially
+//   num_workers - number of worker processes
+//
+// Return:
+//   1 if the sort succeeded, 0 if a worker failed or the shared queue
+//   couldn't be created
+int process_pool_quicksort( int64_t *arr, unsigned long start, unsigned long end,
+                            unsigned long par_threshold, int num_workers ) {
+  if ( end - start < 2 )
+    return 1;
+  if ( num_workers < 1 )
+    num_workers = 1;
+
+  long num_slots = 1;
+  while ( num_slots < (long) num_workers * QUEUE_SLOTS_PER_WORKER )
+    num_slots *= 2;
+  size_t size = sizeof(struct ProcPool) + num_slots * sizeof(struct QueueSlot);
+  struct ProcPool *pool = mmap( NULL, size, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+  if ( pool == MAP_FAILED )
+    return 0;
+
+  pool->total = end - start;
+  pool->done = 0;
+  pool->failed = 0;
+  pool->mask = num_slots - 1;
+  pool->head = pool->tail = 0;
+  for ( long i = 0; i < num_slots; i++ )
+    pool->slots[i].seq = i;
+  queue_put( pool, start, end );
+
+  // start the workers; if some can't be forked, carry on with fewer
+  int num_started = 0;
+  for ( int i = 0; i < num_workers; i++ ) {
+    pid_t pid = fork();
+    if ( pid == 0 ) {
+      worker_main( pool, arr, par_threshold );
+      _exit( 0 );
+    } else if ( pid < 0 ) {
+      break;
+    }
+    num_started++;
+  }
+
+  int success = 1;
+  if ( num_started == 0 ) {
+    // no workers at all: do the work in this process
+    worker_main( pool, arr, par_threshold );
+  } else {
+    // wait for the workers; if one dies, tell the others to stop
+    for ( int i = 0; i < num_started; i++ ) {
+      int status;
+      pid_t pid = waitpid( -1, &status, 0 );
+      if ( pid < 0 || !WIFEXITED( status ) || WEXITSTATUS( status ) != 0 ) {
+        success = 0;
+        __atomic_store_n( &pool->failed, 1, __ATOMIC_RELAXED );
+      }
+    }
+  }
+  if ( __atomic_load_n( &pool->done, __ATOMIC_ACQUIRE ) != pool->total )
+    success = 0;
+
+  munmap( pool, size );
+  return success;
+}
@@ -0,0 +1,279 @@
+// LSD radix sort for int64_t keys: sequential (as a leaf sort) and
+// parallel on the thread pool (for a whole file).
+//
+// Keys are sorted as unsigned integers with the sign bit flipped, so
+// that negative numbers come first. A digit pass is skipped when every
+// key has the same value of that digit, which is common for the high
+// digits of data with a small range.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "parsort.h"
+#include "ws_pool.h"
+
+// digits for the sequential sort: 11 bits (6 passes), whose 2048-entry
+// histograms still fit in L1 cache
+#define SEQ_RADIX_BITS 11
+#define SEQ_RADIX_SIZE ( 1 << SEQ_RADIX_BITS )
+#define SEQ_RADIX_PASSES ( ( 64 + SEQ_RADIX_BITS - 1 ) / SEQ_RADIX_BITS )
+
+// digits for the parallel sort: 8 bits (8 passes), so that each
+// thread's write-combining buffers (a cache line per digit) fit in L1
+#define PAR_RADIX_BITS 8
+#define PAR_RADIX_SIZE ( 1 << PAR_RADIX_BITS )
+#define PAR_RADIX_PASSES ( 64 / PAR_RADIX_BITS )
+
+// elements per write-combining buffer (one 64 byte cache line)
+#define WC_ELEMENTS 8
+
+// ranges shorter than this are sorted with pdqsort instead
+#define MIN_RADIX_ELEMENTS 256
+
+// smallest number of elements per thread for the parallel sort
+#define MIN_BLOCK_ELEMENTS 65536
+
+static inline uint64_t radix_key( int64_t x ) {
+  return (uint64_t) x ^ ( (uint64_t) 1 << 63 );
+}
+
+// Sort n elements of arr with a sequential LSD radix sort, using buf (at
+// least n elements) as scratch space.
+void radix_sort_seq( int64_t *arr, int64_t *buf, unsigned long n ) {
+  unsigned long counts[SEQ_RADIX_PASSES][SEQ_RADIX_SIZE];
+
+  if ( n < MIN_RADIX_ELEMENTS ) {
+    pdqsort( arr, n );
+    return;
+  }
+
+  // histograms of every digit, in one pass over the data
+  memset( counts, 0, sizeof( counts ) );
+  for ( unsigned long i = 0; i < n; i++ ) {
+    uint64_t key = radix_key( arr[i] );
+    for ( int p = 0; p < SEQ_RADIX_PASSES; p++ )
+      counts[p][( key >> ( p * SEQ_RADIX_BITS ) ) & ( SEQ_RADIX_SIZE - 1 )]++;
+  }
+
+  int64_t *src = arr, *dst = buf;
+  for ( int p = 0; p < SEQ_RADIX_PASSES; p++ ) {
+    int shift = p * SEQ_RADIX_BITS;
+    unsigned long *count = counts[p];
+
+    // every key has the same digit: nothing would move
+    if ( count[( radix_key( src[0] ) >> shift ) & ( SEQ_RADIX_SIZE - 1 )] == n )
+      continue;
+
+    unsigned long offset = 0;
+    for ( int d = 0; d < SEQ_RADIX_SIZE; d++ ) {
+      unsigned long c = count[d];
+      count[d] = offset;
+      offset += c;
+    }
+    for ( unsigned long i = 0; i < n; i++ ) {
+      int64_t x = src[i];
+      dst[count[( radix_key( x ) >> shift ) & ( SEQ_RADIX_SIZE - 1 )]++] = x;
+    }
+
+    int64_t *tmp = src;
+    src = dst;
+    dst = tmp;
+  }
+
+  if ( src != arr )
+    memcpy( arr, src, n * sizeof(int64_t) );
+}
+
+// Shared state of a parallel radix sort
+struct RadixSort {
+  int64_t *src, *dst;   // the data before and after the current pass
+  unsigned long n;
+  int num_blocks;
+  int shift;            // of the current digit
+  unsigned long *counts;   // [block][digit] counts, then offsets
+  unsigned long totals[PAR_RADIX_PASSES][PAR_RADIX_SIZE];   // from the first pass
+};
+
+static unsigned long block_start( const struct RadixSort *rs, int block ) {
+  return rs->n * block / rs->num_blocks;
+}
+
+static inline unsigned digit( int64_t x, int shift ) {
+  return ( radix_key( x ) >> shift ) & ( PAR_RADIX_SIZE - 1 );
+}
+
+// Count every digit of one block (before the first pass), into the
+// block's row of counts, which is PAR_RADIX_PASSES times as long here
+static void count_all_task( struct ws_worker *self, void *arg,
+                            unsigned long block, unsigned long unused ) {
+  struct RadixSort *rs = arg;
+  unsigned long *counts = rs->counts + block * PAR_RADIX_PASSES * PAR_RADIX_SIZE;
+  unsigned long end = block_start( rs, block + 1 );
+  (void) self;
+  (void) unused;
+
+  memset( counts, 0, PAR_RADIX_PASSES * PAR_RADIX_SIZE * sizeof(unsigned long) );
+  for ( unsigned long i = block_start( rs, block ); i < end; i++ ) {
+    uint64_t key = radix_key( rs->src[i] );
+    for ( int p = 0; p < PAR_RADIX_PASSES; p++ )
+      counts[p * PAR_RADIX_SIZE + ( ( key >> ( p * PAR_RADIX_BITS ) ) & ( PAR_RADIX_SIZE - 1 ) )]++;
+  }
+}
+
+// Count the current digit of one block
+static void count_task( struct ws_worker *self, void *arg,
+                        unsigned long block, unsigned long unused ) {
+  struct RadixSort *rs = arg;
+  unsigned long *counts = rs->counts + block * PAR_RADIX_SIZE;
+  unsigned long end = block_start( rs, block + 1 );
+  (void) self;
+  (void) unused;
+
+  memset( counts, 0, PAR_RADIX_SIZE * sizeof(unsigned long) );
+  for ( unsigned long i = block_start( rs, block ); i < end; i++ )
+    counts[digit( rs->src[i], rs->shift )]++;
+}
+
+// Move the elements of one block to their places for the current digit.
+// Elements are collected in a cache line sized buffer per digit, and
+// written out a whole line at a time, so the writes to 256 different
+// places don't each cost a read of the destination line.
+static void scatter_task( struct ws_worker *self, void *arg,
+                          unsigned long block, unsigned long unused ) {
+  struct RadixSort *rs = arg;
+  unsigned long *offsets = rs->counts + block * PAR_RADIX_SIZE;
+  unsigned long end = block_start( rs, block + 1 );
+  int64_t wc[PAR_RADIX_SIZE][WC_ELEMENTS] __attribute__(( aligned( 64 ) ));
+  unsigned char fill[PAR_RADIX_SIZE];
+  (void) self;
+  (void) unused;
+
+  memset( fill, 0, sizeof( fill ) );
+  for ( unsigned long i = block_start( rs, block ); i < end; i++ ) {
+    int64_t x = rs->src[i];
+    unsigned d = digit( x, rs->shift );
+    wc[d][fill[d]++] = x;
+    if ( fill[d] == WC_ELEMENTS ) {
+      memcpy( rs->dst + offsets[d], wc[d], sizeof( wc[d] ) );
+      offsets[d] += WC_ELEMENTS;
+      fill[d] = 0;
+    }
+  }
+
+  for ( int d = 0; d < PAR_RADIX_SIZE; d++ )
+    memcpy( rs->dst + offsets[d], wc[d], fill[d] * sizeof(int64_t) );
+}
+
+// Copy one block of the sorted data back to the array
+static void copy_task( struct ws_worker *self, void *arg,
+                       unsigned long block, unsigned long unused ) {
+  struct RadixSort *rs = arg;
+  unsigned long start = block_start( rs, block ), end = block_start( rs, block + 1 );
+  (void) self;
+  (void) unused;
+
+  memcpy( rs->dst + start, rs->src + start, ( end - start ) * sizeof(int64_t) );
+}
+
+// Root task: the digit passes, each of them a parallel count and a
+// parallel scatter
+static void radix_sort_task( struct ws_worker *self, void *arg,
+                             unsigned long start, unsigned long end ) {
+  struct RadixSort *rs = arg;
+  int64_t *arr = rs->src;
+  (void) start;
+  (void) end;
+
+  // totals of every digit, to find the passes that can be skipped
+  ws_parallel_for( self, rs->num_blocks, count_all_task, rs );
+  memset( rs->totals, 0, sizeof( rs->totals ) );
+  for ( int b = 0; b < rs->num_blocks; b++ ) {
+    const unsigned long *counts = rs->counts + b * PAR_RADIX_PASSES * PAR_RADIX_SIZE;
+    for ( int p = 0; p < PAR_RADIX_PASSES; p++ )
+      for ( int d = 0; d < PAR_RADIX_SIZE; d++ )
+        rs->totals[p][d] += counts[p * PAR_RADIX_SIZE + d];
+  }
+
+  for ( int p = 0; p < PAR_RADIX_PASSES; p++ ) {
+    rs->shift = p * PAR_RADIX_BITS;
+    if ( rs->totals[p][digit( rs->src[0], rs->shift )] == rs->n )
+      continue;
+
+    ws_parallel_for( self, rs->num_blocks, count_task, rs );
+
+    // offsets: digits in order, and within a digit, blocks in order
+    unsigned long offset = 0;
+    for ( int d = 0; d < PAR_RADIX_SIZE; d++ ) {
+      for ( int b = 0; b < rs->num_blocks; b++ ) {
+        unsigned long c = rs->counts[b * PAR_RADIX_SIZE + d];
+        rs->counts[b * PAR_RADIX_SIZE + d] = offset;
+        offset += c;
+      }
+    }
+
+    ws_parallel_for( self, rs->num_blocks, scatter_task, rs );
+    int64_t *tmp = rs->src;
+    rs->src = rs->dst;
+    rs->dst = tmp;
+  }
+
+  if ( rs->src != arr ) {
+    rs->dst = arr;
+    ws_parallel_for( self, rs->num_blocks, copy_task, rs );
+  }
+}
+
+// Sort a region of given array from start (inclusive) to end
+// (exclusive) with a parallel LSD radix sort.
+//
+// Parameters:
+//   arr - pointer to first element of array
+//   start - inclusive lower bound index
+//   end - exclusive upper bound index
+//   par_threshold - ranges this long or shorter are sorted sequentially
+//   num_workers - number of threads to use
+//
+// Return:
+//   1 if the sort succeeded, 0 if memory or threads couldn't be
+//   allocated (in which case the array is unchanged)
+int radix_sort( int64_t *arr, unsigned long start, unsigned long end,
+                unsigned long par_threshold, int num_workers ) {
+  unsigned long n = end - start;
+
+  if ( n <= par_threshold || n < 2 * MIN_BLOCK_ELEMENTS || num_workers < 2 ) {
+    int64_t *buf = malloc( n * sizeof(int64_t) );
+    if ( buf == NULL )
+      return 0;
+    radix_sort_seq( arr + start, buf, n );
+    free( buf );
+    return 1;
+  }
+
+  struct RadixSort *rs = malloc( sizeof(struct RadixSort) );
+  if ( rs == NULL )
+    return 0;
+  rs->src = arr + start;
+  rs->n = n;
+  rs->num_blocks = num_workers;
+  if ( (unsigned long) rs->num_blocks > n / MIN_BLOCK_ELEMENTS )
+    rs->num_blocks = (int) ( n / MIN_BLOCK_ELEMENTS );
+
+  rs->dst = malloc( n * sizeof(int64_t) );
+  rs->counts = malloc( rs->num_blocks * PAR_RADIX_PASSES * PAR_RADIX_SIZE * sizeof(unsigned long) );
+  struct ws_pool *pool = ws_pool_create( num_workers );
+
+  int success = rs->dst != NULL && rs->counts != NULL && pool != NULL;
+  int64_t *buf = rs->dst;
+  if ( success ) {
+    struct ws_group group = { 0 };
+    ws_pool_run( pool, &group, radix_sort_task, rs, 0, n );
+  }
+
+  if ( pool != NULL )
+    ws_pool_destroy( pool );
+  free( buf );
+  free( rs->counts );
+  free( rs );
+  return success;
+}
@@ -0,0 +1,476 @@
+// Sorting a file of fixed-size records by a key at a fixed offset in
+// each record (parsort --record-size).
+//
+// The sort is indirect: every record's key is converted to an unsigned
+// integer with the same order and paired with the record's index, the
+// (key, index) pairs are sorted, and then the records are put in
+// the order of the sorted pairs. Only 16 bytes per record are moved
+// during the sort, however large the records are.
+//
+// The pairs are sorted with a parallel LSD radix sort on the key, in
+// which (as in radix_sort.c) a digit pass is skipped when every key has
+// the same value of that digit, e.g. the high 4 bytes of int32 keys.
+// LSD radix sort is stable, so records with equal keys keep their
+// order. Keys are extracted by a task specialized for each key type.
+// Byte string keys are compared as unsigned bytes (like memcmp), 8 bytes
+// ("words") at a time. The pairs are first sorted by the first word,
+// which is enough if no two of them are equal. If some are, the pairs
+// are sorted again by the last word, then (with it extracted from each
+// pair's record in its place) by the word before, and so on up to the
+// first: being stable, the passes sort them by the whole key, and keep
+// records with equal keys in the order the first sort left them, which
+// is their order in the file.
+//
+// The records are permuted in place, a block of the output at a time,
+// through a buffer of PERMUTE_BYTES. The records for the block are
+// gathered into the buffer, prefetching a few ahead (they are at random
+// places in the file). The records in the block that are still needed
+// are moved to the places the gathered ones came from, after the block,
+// and the buffer is copied into the block. The second pairs array (free
+// once the pairs are sorted) tracks where each record has moved to.
+// Each step is split between the workers.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "parsort.h"
+#include "ws_pool.h"
+
+// bytes of a key sorted by at a time
+#define KEY_WORD 8
+
+// digits of the key: 8 bits (at most 8 passes)
+#define RECORD_RADIX_BITS 8
+#define RECORD_RADIX_SIZE ( 1 << RECORD_RADIX_BITS )
+#define RECORD_RADIX_PASSES ( 64 / RECORD_RADIX_BITS )
+
+// pairs per write-combining buffer (one 64 byte cache line)
+#define WC_PAIRS 4
+
+// smallest number of records per block
+#define MIN_BLOCK_RECORDS 65536
+
+// records to prefetch ahead while gathering
+#define PREFETCH_DISTANCE 8
+
+// size of the buffer records are permuted through
+#define PERMUTE_BYTES ( 1 << 20 )
+
+// A record's key (converted to an unsigned integer with the same
+// order), and its index in the file
+struct KeyIndex {
+  uint64_t key;
+  uint64_t index;
+};
+
+// Shared state of a record sort
+struct RecordSort {
+  char *data;                  // the records
+  unsigned long n;
+  const struct RecordFormat *fmt;
+  struct KeyIndex *src, *dst;  // the pairs before and after the current pass
+  size_t num_words;            // of KEY_WORD bytes in the key
+  size_t word;                 // being sorted by
+  int extracted;               // whether the pairs have been filled in yet
+  int ties;                    // whether some pairs have equal keys
+  int num_blocks;
+  int shift;                   // of the current digit
+  unsigned long *counts;       // [block][digit] counts, then offsets
+  unsigned long totals[RECORD_RADIX_PASSES][RECORD_RADIX_SIZE];
+
+  // permuting: records [start, end) of the output are being gathered
+  unsigned long block_records; // at most PERMUTE_BYTES of them, at a time
+  unsigned long start, end;
+  char *buf;                   // the gathered records
+  unsigned char *gathered;     // whether a record was gathered from each place in the block
+  uint64_t *who, *where;       // the record at each place, the place of each record
+  unsigned long *from, *to;    // records moved out of the block
+  unsigned long num_moves;
+};
+
+static unsigned long block_start( const struct RecordSort *rs, int block ) {
+  return rs->n * block / rs->num_blocks;
+}
+
+// Key conversions: each returns an unsigned integer that orders keys
+// the same way as their type does
+
+static inline uint64_t int32_key( const char *p, size_t size ) {
+  int32_t x;
+  (void) size;
+  memcpy( &x, p, sizeof( x ) );
+  return (uint32_t) x ^ ( (uint32_t) 1 << 31 );
+}
+
+static inline uint64_t int64_key( const char *p, size_t size ) {
+  int64_t x;
+  (void) size;
+  memcpy( &x, p, sizeof( x ) );
+  return (uint64_t) x ^ ( (uint64_t) 1 << 63 );
+}
+
+static inline uint64_t uint64_key( const char *p, size_t size ) {
+  uint64_t x;
+  (void) size;
+  memcpy( &x, p, sizeof( x ) );
+  return x;
+}
+
+// Negative doubles have all their bits flipped (so larger magnitudes
+// come first), others just the sign bit. -0.0 is made equal to 0.0, and
+// NaNs go to the ends.
+static inline uint64_t double_key( const char *p, size_t size ) {
+  uint64_t bits;
+  (void) size;
+  memcpy( &bits, p, sizeof( bits ) );
+  if ( bits == (uint64_t) 1 << 63 )
+    bits = 0;
+  return ( bits >> 63 ) ? ~bits : bits | ( (uint64_t) 1 << 63 );
+}
+
+// The first 8 bytes (zero padded), most significant first; word w of a
+// longer key is the key at p + w * KEY_WORD
+static inline uint64_t bytes_key( const char *p, size_t size ) {
+  uint64_t x = 0;
+  memcpy( &x, p, size < sizeof( x ) ? size : sizeof( x ) );
+  return __builtin_bswap64( x );
+}
+
+// Define a task extracting the current word of the keys of one block
+// of pairs, and counting every digit of them into the block's row of
+// counts (RECORD_RADIX_PASSES times as long here), for one key type.
+// The first time, pair i gets record i; later, the words are extracted
+// from the records the pairs were sorted into, at random places.
+#define DEFINE_EXTRACT_TASK( type )                                                       \
+  static void extract_##type##_task( struct ws_worker *self, void *arg,                   \
+                                     unsigned long block, unsigned long unused ) {        \
+    struct RecordSort *rs = arg;                                                          \
+    unsigned long *counts = rs->counts + block * RECORD_RADIX_PASSES * RECORD_RADIX_SIZE; \
+    unsigned long end = block_start( rs, block + 1 );                                     \
+    size_t record_size = rs->fmt->record_size;                                            \
+    size_t key_size = rs->fmt->key_size - rs->word * KEY_WORD;                            \
+    const char *key = rs->data + rs->fmt->key_offset + rs->word * KEY_WORD;               \
+    int first = !rs->extracted;                                                           \
+    (void) self;                                                                          \
+    (void) unused;                                                                        \
+                                                                                          \
+    memset( counts, 0, RECORD_RADIX_PASSES * RECORD_RADIX_SIZE * sizeof(unsigned long) ); \
+    for ( unsigned long i = block_start( rs, block ); i < end; i++ ) {                    \
+      unsigned long index = i;                                                            \
+      if ( !first ) {                                                                     \
+        if ( i + PREFETCH_DISTANCE < end )                                                \
+          __builtin_prefetch( key + rs->src[i + PREFETCH_DISTANCE].index * record_size ); \
+        index = rs->src[i].index;                                                         \
+      }                                                                                   \
+      uint64_t k = type##_key( key + index * record_size, key_size );                    \
+      rs->src[i].key = k;                                                                 \
+      rs->src[i].index = index;                                                           \
+      for ( int p = 0; p < RECORD_RADIX_PASSES; p++ )                                     \
+        counts[p * RECORD_RADIX_SIZE +                                                    \
+               ( ( k >> ( p * RECORD_RADIX_BITS ) ) & ( RECORD_RADIX_SIZE - 1 ) )]++;     \
+    }                                                                                     \
+  }
+
+DEFINE_EXTRACT_TASK( int32 )
+DEFINE_EXTRACT_TASK( int64 )
+DEFINE_EXTRACT_TASK( uint64 )
+DEFINE_EXTRACT_TASK( double )
+DEFINE_EXTRACT_TASK( bytes )
+
+static const ws_task_fn extract_tasks[] = {
+  [KEY_INT32] = extract_int32_task,
+  [KEY_INT64] = extract_int64_task,
+  [KEY_UINT64] = extract_uint64_task,
+  [KEY_DOUBLE] = extract_double_task,
+  [KEY_BYTES] = extract_bytes_task,
+};
+
+static inline unsigned digit( uint64_t key, int shift ) {
+  return ( key >> shift ) & ( RECORD_RADIX_SIZE - 1 );
+}
+
+// Count the current digit of one block
+static void count_task( struct ws_worker *self, void *arg,
+                        unsigned long block, unsigned long unused ) {
+  struct RecordSort *rs = arg;
+  unsigned long *counts = rs->counts + block * RECORD_RADIX_SIZE;
+  unsigned long end = block_start( rs, block + 1 );
+  (void) self;
+  (void) unused;
+
+  memset( counts, 0, RECORD_RADIX_SIZE * sizeof(unsigned long) );
+  for ( unsigned long i = block_start( rs, block ); i < end; i++ )
+    counts[digit( rs->src[i].key, rs->shift )]++;
+}
+
+// Move the pairs of one block to their places for the current digit,
+// through a cache line sized write-combining buffer per digit
+static void scatter_task( struct ws_worker *self, void *arg,
+                          unsigned long block, unsigned long unused ) {
+  struct RecordSort *rs = arg;
+  unsigned long *offsets = rs->counts + block * RECORD_RADIX_SIZE;
+  unsigned long end = block_start( rs, block + 1 );
+  struct KeyIndex wc[RECORD_RADIX_SIZE][WC_PAIRS] __attribute__(( aligned( 64 ) ));
+  unsigned char fill[RECORD_RADIX_SIZE];
+  (void) self;
+  (void) unused;
+
+  memset( fill, 0, sizeof( fill ) );
+  for ( unsigned long i = block_start( rs, block ); i < end; i++ ) {
+    struct KeyIndex x = rs->src[i];
+    unsigned d = digit( x.key, rs->shift );
+    wc[d][fill[d]++] = x;
+    if ( fill[d] == WC_PAIRS ) {
+      memcpy( rs->dst + offsets[d], wc[d], sizeof( wc[d] ) );
+      offsets[d] += WC_PAIRS;
+      fill[d] = 0;
+    }
+  }
+
+  for ( int d = 0; d < RECORD_RADIX_SIZE; d++ )
+    memcpy( rs->dst + offsets[d], wc[d], fill[d] * sizeof(struct KeyIndex) );
+}
+
+// Start of one worker's part of the block being permuted
+static unsigned long permute_start( const struct RecordSort *rs, int part ) {
+  return rs->start + ( rs->end - rs->start ) * part / rs->num_blocks;
+}
+
+// Start of one worker's part of the moves out of the block
+static unsigned long move_start( const struct RecordSort *rs, int part ) {
+  return rs->num_moves * part / rs->num_blocks;
+}
+
+// Set every record of one block as being in its place in the file
+static void init_permute_task( struct ws_worker *self, void *arg,
+                               unsigned long block, unsigned long unused ) {
+  struct RecordSort *rs = arg;
+  unsigned long end = block_start( rs, block + 1 );
+  (void) self;
+  (void) unused;
+
+  for ( unsigned long i = block_start( rs, block ); i < end; i++ )
+    rs->who[i] = rs->where[i] = i;
+}
+
+// Gather the records of one part of the block into the buffer, leaving
+// the place each came from in its pair's key, and marking the places in
+// the block that records came from
+static void gather_task( struct ws_worker *self, void *arg,
+                         unsigned long part, unsigned long unused ) {
+  struct RecordSort *rs = arg;
+  size_t record_size = rs->fmt->record_size;
+  unsigned long start = permute_start( rs, part ), end = permute_start( rs, part + 1 );
+  struct KeyIndex *pairs = rs->src;
+  (void) self;
+  (void) unused;
+
+  for ( unsigned long i = start; i < end; i++ ) {
+    if ( i + PREFETCH_DISTANCE < end )
+      __builtin_prefetch( rs->where + pairs[i + PREFETCH_DISTANCE].index );
+    pairs[i].key = rs->where[pairs[i].index];
+  }
+  for ( unsigned long i = start; i < end; i++ ) {
+    if ( i + PREFETCH_DISTANCE < end )
+      __builtin_prefetch( rs->data + pairs[i + PREFETCH_DISTANCE].key * record_size );
+    uint64_t place = pairs[i].key;
+    memcpy( rs->buf + ( i - rs->start ) * record_size, rs->data + place * record_size,
+            record_size );
+    if ( place < rs->end )
+      rs->gathered[place - rs->start] = 1;
+  }
+}
+
+// List the moves of records out of the block: the places in the block
+// no record was gathered from, paired with the places after it that
+// records were gathered from
+static void plan_moves( struct RecordSort *rs ) {
+  unsigned long place = rs->start, m = 0;
+  for ( unsigned long i = rs->start; i < rs->end; i++ ) {
+    if ( rs->src[i].key < rs->end )
+      continue;
+    while ( rs->gathered[place - rs->start] )
+      place++;
+    rs->from[m] = place++;
+    rs->to[m] = rs->src[i].key;
+    m++;
+  }
+  rs->num_moves = m;
+}
+
+// Make one part of the moves out of the block
+static void move_task( struct ws_worker *self, void *arg,
+                       unsigned long part, unsigned long unused ) {
+  struct RecordSort *rs = arg;
+  size_t record_size = rs->fmt->record_size;
+  unsigned long start = move_start( rs, part ), end = move_start( rs, part + 1 );
+  (void) self;
+  (void) unused;
+
+  for ( unsigned long m = start; m < end; m++ ) {
+    if ( m + PREFETCH_DISTANCE < end )
+      __builtin_prefetch( rs->data + rs->to[m + PREFETCH_DISTANCE] * record_size, 1 );
+    uint64_t record = rs->who[rs->from[m]];
+    memcpy( rs->data + rs->to[m] * record_size, rs->data + rs->from[m] * record_size,
+            record_size );
+    rs->who[rs->to[m]] = record;
+    rs->where[record] = rs->to[m];
+  }
+}
+
+// Copy one part of the buffer into the block
+static void copy_task( struct ws_worker *self, void *arg,
+                       unsigned long part, unsigned long unused ) {
+  struct RecordSort *rs = arg;
+  size_t record_size = rs->fmt->record_size;
+  unsigned long start = permute_start( rs, part ), end = permute_start( rs, part + 1 );
+  (void) self;
+  (void) unused;
+
+  memcpy( rs->data + start * record_size, rs->buf + ( start - rs->start ) * record_size,
+          ( end - start ) * record_size );
+}
+
+// Put the records in the order of the sorted pairs, a block at a time
+static void permute( struct ws_worker *self, struct RecordSort *rs ) {
+  rs->who = (uint64_t *) rs->dst;
+  rs->where = rs->who + rs->n;
+  ws_parallel_for( self, rs->num_blocks, init_permute_task, rs );
+  for ( rs->start = 0; rs->start < rs->n; rs->start = rs->end ) {
+    rs->end = rs->n - rs->start < rs->block_records ? rs->n : rs->start + rs->block_records;
+    memset( rs->gathered, 0, rs->end - rs->start );
+    ws_parallel_for( self, rs->num_blocks, gather_task, rs );
+    plan_moves( rs );
+    ws_parallel_for( self, rs->num_blocks, move_task, rs );
+    ws_parallel_for( self, rs->num_blocks, copy_task, rs );
+  }
+}
+
+// Sort the pairs by the current word of their keys: extract it, then
+// digit passes of a parallel count and a parallel scatter
+static void sort_pairs( struct ws_worker *self, struct RecordSort *rs ) {
+  ws_parallel_for( self, rs->num_blocks, extract_tasks[rs->fmt->key_type], rs );
+  rs->extracted = 1;
+  memset( rs->totals, 0, sizeof( rs->totals ) );
+  for ( int b = 0; b < rs->num_blocks; b++ ) {
+    const unsigned long *counts = rs->counts + b * RECORD_RADIX_PASSES * RECORD_RADIX_SIZE;
+    for ( int p = 0; p < RECORD_RADIX_PASSES; p++ )
+      for ( int d = 0; d < RECORD_RADIX_SIZE; d++ )
+        rs->totals[p][d] += counts[p * RECORD_RADIX_SIZE + d];
+  }
+
+  for ( int p = 0; p < RECORD_RADIX_PASSES; p++ ) {
+    rs->shift = p * RECORD_RADIX_BITS;
+    if ( rs->totals[p][digit( rs->src[0].key, rs->shift )] == rs->n )
+      continue;
+
+    ws_parallel_for( self, rs->num_blocks, count_task, rs );
+
+    // offsets: digits in order, and within a digit, blocks in order
+    unsigned long offset = 0;
+    for ( int d = 0; d < RECORD_RADIX_SIZE; d++ ) {
+      for ( int b = 0; b < rs->num_blocks; b++ ) {
+        unsigned long c = rs->counts[b * RECORD_RADIX_SIZE + d];
+        rs->counts[b * RECORD_RADIX_SIZE + d] = offset;
+        offset += c;
+      }
+    }
+
+    ws_parallel_for( self, rs->num_blocks, scatter_task, rs );
+    struct KeyIndex *tmp = rs->src;
+    rs->src = rs->dst;
+    rs->dst = tmp;
+  }
+}
+
+// Check whether any pair of one block has the same key as the one
+// before it
+static void find_ties_task( struct ws_worker *self, void *arg,
+                            unsigned long block, unsigned long unused ) {
+  struct RecordSort *rs = arg;
+  unsigned long end = block_start( rs, block + 1 );
+  (void) self;
+  (void) unused;
+
+  for ( unsigned long i = block_start( rs, block ); i < end; i++ ) {
+    if ( i > 0 && rs->src[i].key == rs->src[i - 1].key ) {
+      __atomic_store_n( &rs->ties, 1, __ATOMIC_RELAXED );
+      return;
+    }
+  }
+}
+
+// Root task: sort the pairs by the first word of their keys, and if
+// that leaves ties, by every word from the last; then permute the records
+static void record_sort_task( struct ws_worker *self, void *arg,
+                              unsigned long start, unsigned long end ) {
+  struct RecordSort *rs = arg;
+  (void) start;
+  (void) end;
+
+  rs->word = 0;
+  sort_pairs( self, rs );
+  if ( rs->num_words > 1 ) {
+    ws_parallel_for( self, rs->num_blocks, find_ties_task, rs );
+    if ( rs->ties ) {
+      for ( rs->word = rs->num_words; rs->word-- > 0; )
+        sort_pairs( self, rs );
+    }
+  }
+
+  permute( self, rs );
+}
+
+int record_sort( char *data, unsigned long n, const struct RecordFormat *fmt, int num_workers ) {
+  if ( n < 2 )
+    return 1;
+
+  struct RecordSort *rs = malloc( sizeof(struct RecordSort) );
+  if ( rs == NULL )
+    return 0;
+  rs->data = data;
+  rs->n = n;
+  rs->fmt = fmt;
+  rs->num_words = 1;
+  if ( fmt->key_type == KEY_BYTES )
+    rs->num_words = ( fmt->key_size + KEY_WORD - 1 ) / KEY_WORD;
+  rs->extracted = 0;
+  rs->ties = 0;
+  rs->num_blocks = num_workers < 1 ? 1 : num_workers;
+  if ( (unsigned long) rs->num_blocks > n / MIN_BLOCK_RECORDS )
+    rs->num_blocks = n < MIN_BLOCK_RECORDS ? 1 : (int) ( n / MIN_BLOCK_RECORDS );
+
+  struct KeyIndex *pairs = rs->src = malloc( n * sizeof(struct KeyIndex) );
+  struct KeyIndex *buf = rs->dst = malloc( n * sizeof(struct KeyIndex) );
+  rs->counts = malloc( rs->num_blocks * RECORD_RADIX_PASSES * RECORD_RADIX_SIZE * sizeof(unsigned long) );
+  rs->block_records = PERMUTE_BYTES / fmt->record_size;
+  if ( rs->block_records == 0 )
+    rs->block_records = 1;
+  if ( rs->block_records > n )
+    rs->block_records = n;
+  rs->buf = malloc( rs->block_records * fmt->record_size );
+  rs->gathered = malloc( rs->block_records );
+  rs->from = malloc( rs->block_records * sizeof(unsigned long) );
+  rs->to = malloc( rs->block_records * sizeof(unsigned long) );
+  struct ws_pool *pool = ws_pool_create( num_workers );
+
+  int success = pairs != NULL && buf != NULL && rs->counts != NULL && rs->buf != NULL &&
+                rs->gathered != NULL && rs->from != NULL && rs->to != NULL && pool != NULL;
+  if ( success ) {
+    struct ws_group group = { 0 };
+    ws_pool_run( pool, &group, record_sort_task, rs, 0, n );
+  }
+
+  if ( pool != NULL )
+    ws_pool_destroy( pool );
+  free( pairs );
+  free( buf );
+  free( rs->counts );
+  free( rs->buf );
+  free( rs->gathered );
+  free( rs->from );
+  free( rs->to );
+  free( rs );
+  return success;
+}
@@ -0,0 +1,226 @@
+// Parallel samplesort on the thread pool.
+//
+// Splitters drawn from an oversampled random sample divide the key
+// range into buckets of about equal size. The array is split into
+// blocks, and every block is classified in parallel by descending the
+// splitter tree (see splitters.h). The elements are then scattered into
+// a buffer, bucket by bucket, at offsets given by a prefix sum over the
+// per-block counts. Finally each bucket is copied back and sorted
+// sequentially by one worker.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "parsort.h"
+#include "splitters.h"
+#include "ws_pool.h"
+
+// number of sample elements per bucket
+#define OVERSAMPLING 16
+
+// number of buckets per worker (more buckets than workers evens out
+// the load when bucket sizes vary)
+#define BUCKETS_PER_WORKER 4
+
+// smallest average bucket size worth splitting the data for
+#define MIN_BUCKET_ELEMENTS 4096
+
+// number of classification blocks per worker, and smallest block size
+#define BLOCKS_PER_WORKER 4
+#define MIN_BLOCK_ELEMENTS 65536
+
+struct SampleSort {
+  int64_t *arr;               // data being sorted
+  int64_t *buf;               // buffer the data is scattered into
+  unsigned long n;
+  struct Splitters sp;
+  uint8_t *oracle;            // bucket of each element
+  int num_blocks;
+  unsigned long *counts;      // [block][bucket] number of elements, then offsets
+  unsigned long bucket_start[MAX_BUCKETS + 1];
+};
+
+// Store sorted splitters s[lo..hi) in the tree rooted at node j
+static void build_tree( int64_t *tree, const int64_t *s, int j, int lo, int hi ) {
+  if ( lo >= hi )
+    return;
+  int mid = lo + ( hi - lo ) / 2;
+  tree[j] = s[mid];
+  build_tree( tree, s, 2 * j, lo, mid );
+  build_tree( tree, s, 2 * j + 1, mid + 1, hi );
+}
+
+void choose_splitters( struct Splitters *sp, const int64_t *arr, unsigned long n,
+                       int num_workers ) {
+  int64_t sample[OVERSAMPLING * MAX_BUCKETS], splitters[MAX_BUCKETS];
+  uint64_t state = 0x9E3779B97F4A7C15ULL;
+
+  // a power of 2 number of buckets, enough for every worker to have
+  // several, but not so many that they become tiny
+  sp->log_buckets = 1;
+  while ( sp->log_buckets < MAX_LOG_BUCKETS &&
+          ( 1 << sp->log_buckets ) < BUCKETS_PER_WORKER * num_workers &&
+          n >> ( sp->log_buckets + 1 ) >= MIN_BUCKET_ELEMENTS )
+    sp->log_buckets++;
+  sp->num_buckets = 1 << sp->log_buckets;
+
+  // sort an oversampled random sample, and take evenly spaced splitters
+  int num_samples = OVERSAMPLING * sp->num_buckets;
+  for ( int i = 0; i < num_samples; i++ ) {
+    // xorshift64
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    sample[i] = arr[state % n];
+  }
+  pdqsort( sample, num_samples );
+
+  for ( int i = 0; i < sp->num_buckets - 1; i++ )
+    splitters[i] = sample[( i + 1 ) * OVERSAMPLING - 1];
+  build_tree( sp->tree, splitters, 1, 0, sp->num_buckets - 1 );
+}
+
+static unsigned long block_start( const struct SampleSort *ss, int block ) {
+  return ss->n * block / ss->num_blocks;
+}
+
+// Classify the elements of one block, counting the elements per bucket
+static void classify_task( struct ws_worker *self, void *arg,
+                           unsigned long block, unsigned long unused ) {
+  struct SampleSort *ss = arg;
+  const struct Splitters *sp = &ss->sp;
+  unsigned long *counts = ss->counts + block * sp->num_buckets;
+  unsigned long i = block_start( ss, block ), end = block_start( ss, block + 1 );
+  (void) self;
+  (void) unused;
+
+  memset( counts, 0, sp->num_buckets * sizeof(unsigned long) );
+
+  // four elements at a time, so their tree descents overlap
+  for ( ; i + 4 <= end; i += 4 ) {
+    int b0 = splitters_classify( sp, ss->arr[i] ), b1 = splitters_classify( sp, ss->arr[i + 1] );
+    int b2 = splitters_classify( sp, ss->arr[i + 2] ), b3 = splitters_classify( sp, ss->arr[i + 3] );
+    ss->oracle[i] = b0;
+    ss->oracle[i + 1] = b1;
+    ss->oracle[i + 2] = b2;
+    ss->oracle[i + 3] = b3;
+    counts[b0]++;
+    counts[b1]++;
+    counts[b2]++;
+    counts[b3]++;
+  }
+  for ( ; i < end; i++ ) {
+    int b = splitters_classify( sp, ss->arr[i] );
+    ss->oracle[i] = b;
+    counts[b]++;
+  }
+}
+
+// Move the elements of one block to their buckets in the buffer
+static void scatter_task( struct ws_worker *self, void *arg,
+                          unsigned long block, unsigned long unused ) {
+  struct SampleSort *ss = arg;
+  unsigned long *offsets = ss->counts + block * ss->sp.num_buckets;
+  unsigned long end = block_start( ss, block + 1 );
+  (void) self;
+  (void) unused;
+
+  for ( unsigned long i = block_start( ss, block ); i < end; i++ )
+    ss->buf[offsets[ss->oracle[i]]++] = ss->arr[i];
+}
+
+// Copy one bucket back to the array and sort it there
+static void bucket_task( struct ws_worker *self, void *arg,
+                         unsigned long bucket, unsigned long unused ) {
+  struct SampleSort *ss = arg;
+  unsigned long start = ss->bucket_start[bucket], end = ss->bucket_start[bucket + 1];
+  (void) self;
+  (void) unused;
+
+  memcpy( ss->arr + start, ss->buf + start, ( end - start ) * sizeof(int64_t) );
+  leaf_sort( ss->arr + start, end - start );
+}
+
+// Root task: runs the phases of the sort one after another, each of them
+// in parallel
+static void samplesort_task( struct ws_worker *self, void *arg,
+                             unsigned long start, unsigned long end ) {
+  struct SampleSort *ss = arg;
+  (void) start;
+  (void) end;
+
+  ws_parallel_for( self, ss->num_blocks, classify_task, ss );
+
+  // turn the counts into each block's offset for each bucket: buckets in
+  // order, and within a bucket, blocks in order
+  unsigned long offset = 0;
+  for ( int b = 0; b < ss->sp.num_buckets; b++ ) {
+    ss->bucket_start[b] = offset;
+    for ( int k = 0; k < ss->num_blocks; k++ ) {
+      unsigned long count = ss->counts[k * ss->sp.num_buckets + b];
+      ss->counts[k * ss->sp.num_buckets + b] = offset;
+      offset += count;
+    }
+  }
+  ss->bucket_start[ss->sp.num_buckets] = offset;
+
+  ws_parallel_for( self, ss->num_blocks, scatter_task, ss );
+  ws_parallel_for( self, ss->sp.num_buckets, bucket_task, ss );
+}
+
+// Sort a region of given array from start (inclusive) to end
+// (exclusive) with a parallel samplesort.
+//
+// Parameters:
+//   arr - pointer to first element of array
+//   start - inclusive lower bound index
+//   end - exclusive upper bound index
+//   par_threshold - ranges this long or shorter are sorted sequentially
+//   num_workers - number of threads to use
+//
+// Return:
+//   1 if the sort succeeded, 0 if memory or threads couldn't be
+//   allocated (in which case the array is unchanged)
+int samplesort( int64_t *arr, unsigned long start, unsigned long end,
+                unsigned long par_threshold, int num_workers ) {
+  unsigned long n = end - start;
+
+  if ( n <= par_threshold || n < 2 * MIN_BUCKET_ELEMENTS ) {
+    leaf_sort( arr + start, n );
+    return 1;
+  }
+
+  struct SampleSort *ss = malloc( sizeof(struct SampleSort) );
+  if ( ss == NULL )
+    return 0;
+  ss->arr = arr + start;
+  ss->n = n;
+
+  choose_splitters( &ss->sp, ss->arr, n, num_workers );
+
+  ss->num_blocks = BLOCKS_PER_WORKER * num_workers;
+  if ( (unsigned long) ss->num_blocks > n / MIN_BLOCK_ELEMENTS )
+    ss->num_blocks = (int) ( n / MIN_BLOCK_ELEMENTS );
+  if ( ss->num_blocks < 1 )
+    ss->num_blocks = 1;
+
+  ss->buf = malloc( n * sizeof(int64_t) );
+  ss->oracle = malloc( n );
+  ss->counts = malloc( ss->num_blocks * ss->sp.num_buckets * sizeof(unsigned long) );
+  struct ws_pool *pool = ws_pool_create( num_workers );
+
+  int success = ss->buf != NULL && ss->oracle != NULL && ss->counts != NULL && pool != NULL;
+  if ( success ) {
+    struct ws_group group = { 0 };
+    ws_pool_run( pool, &group, samplesort_task, ss, 0, n );
+  }
+
+  if ( pool != NULL )
+    ws_pool_destroy( pool );
+  free( ss->buf );
+  free( ss->oracle );
+  free( ss->counts );
+  free( ss );
+  return success;
+}
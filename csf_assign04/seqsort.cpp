@@ -1,52 +1,243 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <filesystem>
 #include <stdexcept>
 #include <algorithm>
 #include <memory>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <iomanip>
+#include <cstring>
+#include <cerrno>
 #include <cstdint>
 #include <cstdlib>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef SEQSORT_HAVE_PSTL
+#include <execution>
+#endif
 
-void execute( int argc, char **argv ) {
-  std::filesystem::path p( argv[1] );
+// How the data is read and written
+enum class Io {
+  STREAM,   // read into a buffer with ifstream, written back with ofstream
+  MMAP,     // sorted in place in a shared mapping of the file
+};
 
-  // Open the file for input
-  std::ifstream in( p, std::ios_base::binary );
-  if ( !in.is_open() ) {
-    std::stringstream ss;
-    ss << "Could not open '" << p << "'";
-    throw std::runtime_error( ss.str() );
+// How the data is sorted
+enum class Mode {
+  SORT,     // std::sort
+  PAR,      // std::sort( std::execution::par_unseq, ... ), or parallel_sort
+  STABLE,   // std::stable_sort
+};
+
+struct Options {
+  Io io = Io::STREAM;
+  Mode mode = Mode::SORT;
+  unsigned num_threads = std::max( 1u, std::thread::hardware_concurrency() );
+};
+
+// Sort [first, last) with num_threads threads: each sorts a chunk with
+// std::sort, then adjacent sorted chunks are merged in place in pairs,
+// the pairs of each round in parallel. Used for --mode par when the
+// standard library has no parallel backend.
+void parallel_sort( int64_t *first, int64_t *last, unsigned num_threads ) {
+  size_t n = last - first;
+  if ( num_threads < 2 || n < 2 * num_threads ) {
+    std::sort( first, last );
+    return;
+  }
+
+  std::vector<int64_t *> bounds;
+  for ( unsigned i = 0; i <= num_threads; i++ )
+    bounds.push_back( first + n * i / num_threads );
+
+  std::vector<std::thread> threads;
+  for ( unsigned i = 0; i < num_threads; i++ )
+    threads.emplace_back( [&bounds, i]() { std::sort( bounds[i], bounds[i + 1] ); } );
+  for ( auto &t : threads )
+    t.join();
+
+  while ( bounds.size() > 2 ) {
+    std::vector<int64_t *> merged;
+    threads.clear();
+    for ( size_t i = 0; i + 1 < bounds.size(); i += 2 ) {
+      merged.push_back( bounds[i] );
+      if ( i + 2 < bounds.size() ) {
+        int64_t *lo = bounds[i], *mid = bounds[i + 1], *hi = bounds[i + 2];
+        threads.emplace_back( [lo, mid, hi]() { std::inplace_merge( lo, mid, hi ); } );
+      }
+    }
+    merged.push_back( bounds.back() );
+    for ( auto &t : threads )
+      t.join();
+    bounds = merged;
   }
+}
+
+void sort_data( int64_t *first, int64_t *last, const Options &opts ) {
+  switch ( opts.mode ) {
+  case Mode::SORT:
+    std::sort( first, last );
+    break;
+  case Mode::STABLE:
+    std::stable_sort( first, last );
+    break;
+  case Mode::PAR:
+#ifdef SEQSORT_HAVE_PSTL
+    std::sort( std::execution::par_unseq, first, last );
+#else
+    parallel_sort( first, last, opts.num_threads );
+#endif
+    break;
+  }
+}
+
+double seconds_since( std::chrono::steady_clock::time_point start ) {
+  return std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+}
+
+void execute( const char *filename, const Options &opts ) {
+  std::filesystem::path p( filename );
+  double load_time, sort_time, store_time;
+  auto start = std::chrono::steady_clock::now();
 
   // Determine file size and number of elements
   auto file_size = std::filesystem::file_size( p );
   size_t num_elements = file_size / sizeof(int64_t);
 
-  // Allocate memory
-  std::unique_ptr<int64_t[]> buf( new int64_t[num_elements] );
+  if ( opts.io == Io::MMAP ) {
+    int fd = open( filename, O_RDWR );
+    if ( fd < 0 ) {
+      std::stringstream ss;
+      ss << "Could not open '" << p << "'";
+      throw std::runtime_error( ss.str() );
+    }
+    void *data = num_elements == 0 ? nullptr :
+                 mmap( nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    close( fd );
+    if ( data == MAP_FAILED )
+      throw std::runtime_error( std::string( "Could not map file: " ) + strerror( errno ) );
+    int64_t *arr = static_cast<int64_t *>( data );
+    load_time = seconds_since( start );
+
+    // page faults are counted in the sorting time
+    start = std::chrono::steady_clock::now();
+    sort_data( arr, arr + num_elements, opts );
+    sort_time = seconds_since( start );
+
+    start = std::chrono::steady_clock::now();
+    if ( data != nullptr )
+      munmap( data, file_size );
+    store_time = seconds_since( start );
+  } else {
+    // Open the file for input
+    std::ifstream in( p, std::ios_base::binary );
+    if ( !in.is_open() ) {
+      std::stringstream ss;
+      ss << "Could not open '" << p << "'";
+      throw std::runtime_error( ss.str() );
+    }
 
-  if ( !in.read( reinterpret_cast<char*>( buf.get() ), num_elements * sizeof(int64_t) ) )
-    throw std::runtime_error( "Could not read data from file" );
+    // Allocate memory
+    std::unique_ptr<int64_t[]> buf( new int64_t[num_elements] );
 
-  in.close();
+    if ( !in.read( reinterpret_cast<char*>( buf.get() ), num_elements * sizeof(int64_t) ) )
+      throw std::runtime_error( "Could not read data from file" );
 
-  std::sort( buf.get(), buf.get() + num_elements );
+    in.close();
+    load_time = seconds_since( start );
 
-  std::ofstream out( p, std::ios_base::binary );
-  if ( !out.write( reinterpret_cast<char *>( buf.get() ), num_elements * sizeof(int64_t) ) )
-    throw std::runtime_error( "Could not write sorted data" );
+    start = std::chrono::steady_clock::now();
+    sort_data( buf.get(), buf.get() + num_elements, opts );
+    sort_time = seconds_since( start );
+
+    start = std::chrono::steady_clock::now();
+    std::ofstream out( p, std::ios_base::binary );
+    if ( !out.write( reinterpret_cast<char *>( buf.get() ), num_elements * sizeof(int64_t) ) )
+      throw std::runtime_error( "Could not write sorted data" );
+    out.close();
+    store_time = seconds_since( start );
+
+    // Success! the std::unique_ptr will delete the array
+  }
 
-  // Success! the std::unique_ptr will delete the array
+  // timings only, in seconds
+  std::cout << std::fixed << std::setprecision( 6 )
+            << "load " << load_time << "\n"
+            << "sort " << sort_time << "\n"
+            << "store " << store_time << "\n";
+}
+
+void usage() {
+  std::cerr << "Usage: ./seqsort [options] <filename>\n"
+            << "Sorts the file of int64_t values and prints the time taken (in seconds)\n"
+            << "to load, sort and store the data.\n"
+            << "Options:\n"
+            << "  -i, --io IO        how the data is read and written:\n"
+            << "                       stream  ifstream into a buffer, ofstream back (default)\n"
+            << "                       mmap    sorted in place in a shared mapping\n"
+            << "  -m, --mode MODE    how the data is sorted:\n"
+            << "                       sort    std::sort (default)\n"
+#ifdef SEQSORT_HAVE_PSTL
+            << "                       par     std::sort with std::execution::par_unseq\n"
+#else
+            << "                       par     chunks sorted in parallel, then merged (no\n"
+            << "                               parallel std::sort in this build)\n"
+#endif
+            << "                       stable  std::stable_sort\n"
+            << "  -j, --threads N    threads for --mode par without a parallel std::sort\n"
+            << "                     (default: one per CPU)\n";
+  exit( 1 );
 }
 
 int main( int argc, char **argv ) {
-  if ( argc != 2 ) {
-    std::cerr << "Usage: ./seqsort <filename>\n";
-    exit( 1 );
+  static const struct option long_options[] = {
+    { "io", required_argument, nullptr, 'i' },
+    { "mode", required_argument, nullptr, 'm' },
+    { "threads", required_argument, nullptr, 'j' },
+    { nullptr, 0, nullptr, 0 },
+  };
+  Options opts;
+  int opt;
+
+  while ( ( opt = getopt_long( argc, argv, "i:m:j:", long_options, nullptr ) ) != -1 ) {
+    switch ( opt ) {
+    case 'i':
+      if ( strcmp( optarg, "stream" ) == 0 )
+        opts.io = Io::STREAM;
+      else if ( strcmp( optarg, "mmap" ) == 0 )
+        opts.io = Io::MMAP;
+      else
+        usage();
+      break;
+    case 'm':
+      if ( strcmp( optarg, "sort" ) == 0 )
+        opts.mode = Mode::SORT;
+      else if ( strcmp( optarg, "par" ) == 0 )
+        opts.mode = Mode::PAR;
+      else if ( strcmp( optarg, "stable" ) == 0 )
+        opts.mode = Mode::STABLE;
+      else
+        usage();
+      break;
+    case 'j':
+      if ( sscanf( optarg, "%u", &opts.num_threads ) != 1 || opts.num_threads < 1 )
+        usage();
+      break;
+    default:
+      usage();
+    }
   }
 
+  if ( argc - optind != 1 )
+    usage();
+
   try {
-    execute( argc, argv );
+    execute( argv[optind], opts );
   } catch ( std::exception &ex ) {
     std::cerr << "Error: " << ex.what() << "\n";
     exit( 1 );
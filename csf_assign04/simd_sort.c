@@ -0,0 +1,330 @@
+// Vectorized partitioning and sorting of int64_t, using AVX-512 or AVX2
+// when the CPU has them (checked at run time, so the rest of the program
+// doesn't need to be compiled for either).
+//
+// Partitioning reads a vector at a time and writes its elements less
+// than the pivot to the left end of the free space, and the rest to the
+// right end (as in Bramas, "A Novel Hybrid Quicksort Algorithm
+// Vectorized using AVX-512 on Intel Skylake"). Vectors from both ends
+// are held in registers at the start, so there is always room to write
+// on both sides. AVX-512 does this with compress-stores. AVX2 has no
+// compress instruction, so each vector is permuted with a table entry
+// for its comparison mask instead, and stored whole at both ends.
+//
+// simd_sort() is a quicksort on this partition. With AVX-512, ranges of
+// up to 16 elements are finished with a bitonic sorting network in two
+// registers.
+
+#include <stdint.h>
+
+#include "parsort.h"
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+// ranges this short are sorted by small_sort
+#define SMALL_SORT_ELEMENTS 16
+
+static enum SimdLevel simd_level = SIMD_NONE;
+
+// Return the best instruction set the CPU supports.
+enum SimdLevel simd_detect( void ) {
+#ifdef HAVE_X86_SIMD
+  if ( __builtin_cpu_supports( "avx512f" ) )
+    return SIMD_AVX512;
+  if ( __builtin_cpu_supports( "avx2" ) )
+    return SIMD_AVX2;
+#endif
+  return SIMD_NONE;
+}
+
+// Choose the instruction set to use. Worker processes inherit the
+// choice, so it must be made before sorting starts.
+void set_simd_level( enum SimdLevel level ) {
+  simd_level = level;
+}
+
+enum SimdLevel get_simd_level( void ) {
+  return simd_level;
+}
+
+// Move the elements of tmp to the ends of the free space
+// arr[*left_w..*right_w): those less than the pivot to the left end,
+// the others to the right end
+static void distribute( int64_t *arr, unsigned long *left_w, unsigned long *right_w,
+                        const int64_t *tmp, unsigned n, int64_t pivot_val ) {
+  for ( unsigned i = 0; i < n; i++ ) {
+    if ( tmp[i] < pivot_val )
+      arr[( *left_w )++] = tmp[i];
+    else
+      arr[--( *right_w )] = tmp[i];
+  }
+}
+
+#ifdef HAVE_X86_SIMD
+
+// For each comparison mask of 4 lanes, the permutation (as pairs of
+// 32-bit lanes) moving the lanes in the mask to the front, in order
+static const int32_t avx2_compress_table[16][8] = {
+  { 0, 1, 2, 3, 4, 5, 6, 7 },
+  { 0, 1, 2, 3, 4, 5, 6, 7 },
+  { 2, 3, 0, 1, 4, 5, 6, 7 },
+  { 0, 1, 2, 3, 4, 5, 6, 7 },
+  { 4, 5, 0, 1, 2, 3, 6, 7 },
+  { 0, 1, 4, 5, 2, 3, 6, 7 },
+  { 2, 3, 4, 5, 0, 1, 6, 7 },
+  { 0, 1, 2, 3, 4, 5, 6, 7 },
+  { 6, 7, 0, 1, 2, 3, 4, 5 },
+  { 0, 1, 6, 7, 2, 3, 4, 5 },
+  { 2, 3, 6, 7, 0, 1, 4, 5 },
+  { 0, 1, 2, 3, 6, 7, 4, 5 },
+  { 4, 5, 6, 7, 0, 1, 2, 3 },
+  { 0, 1, 4, 5, 6, 7, 2, 3 },
+  { 2, 3, 4, 5, 6, 7, 0, 1 },
+  { 0, 1, 2, 3, 4, 5, 6, 7 },
+};
+
+__attribute__(( target( "avx2" ) ))
+static unsigned long partition_avx2( int64_t *arr, unsigned long left, unsigned long right,
+                                     int64_t pivot_val ) {
+  __m256i pivot = _mm256_set1_epi64x( pivot_val );
+
+  // elements are written to [left, left_w) and [right_w, right), and
+  // not yet read from [left_r, right_r)
+  unsigned long left_w = left, right_w = right;
+  __m256i first = _mm256_loadu_si256( (const __m256i *) ( arr + left ) );
+  __m256i last = _mm256_loadu_si256( (const __m256i *) ( arr + right - 4 ) );
+  unsigned long left_r = left + 4, right_r = right - 4;
+
+  while ( right_r - left_r >= 4 ) {
+    // read from the side with less free space, so both sides have room
+    // for a whole vector
+    __m256i v;
+    if ( left_r - left_w <= right_w - right_r ) {
+      v = _mm256_loadu_si256( (const __m256i *) ( arr + left_r ) );
+      left_r += 4;
+    } else {
+      right_r -= 4;
+      v = _mm256_loadu_si256( (const __m256i *) ( arr + right_r ) );
+    }
+
+    int mask = _mm256_movemask_pd( _mm256_castsi256_pd( _mm256_cmpgt_epi64( pivot, v ) ) );
+    __m256i perm = _mm256_loadu_si256( (const __m256i *) avx2_compress_table[mask] );
+    v = _mm256_permutevar8x32_epi32( v, perm );
+    int num_less = __builtin_popcount( mask );
+    _mm256_storeu_si256( (__m256i *) ( arr + left_w ), v );
+    left_w += num_less;
+    _mm256_storeu_si256( (__m256i *) ( arr + right_w - 4 ), v );
+    right_w -= 4 - num_less;
+  }
+
+  // the rest of the free space is exactly big enough for the unread
+  // elements and the two saved vectors
+  int64_t tmp[3 + 2 * 4];
+  unsigned n = 0;
+  while ( left_r < right_r )
+    tmp[n++] = arr[left_r++];
+  _mm256_storeu_si256( (__m256i *) ( tmp + n ), first );
+  _mm256_storeu_si256( (__m256i *) ( tmp + n + 4 ), last );
+  distribute( arr, &left_w, &right_w, tmp, n + 8, pivot_val );
+  return left_w;
+}
+
+__attribute__(( target( "avx512f" ) ))
+static unsigned long partition_avx512( int64_t *arr, unsigned long left, unsigned long right,
+                                       int64_t pivot_val ) {
+  __m512i pivot = _mm512_set1_epi64( pivot_val );
+
+  unsigned long left_w = left, right_w = right;
+  __m512i first = _mm512_loadu_si512( arr + left );
+  __m512i last = _mm512_loadu_si512( arr + right - 8 );
+  unsigned long left_r = left + 8, right_r = right - 8;
+
+  while ( right_r - left_r >= 8 ) {
+    __m512i v;
+    if ( left_r - left_w <= right_w - right_r ) {
+      v = _mm512_loadu_si512( arr + left_r );
+      left_r += 8;
+    } else {
+      right_r -= 8;
+      v = _mm512_loadu_si512( arr + right_r );
+    }
+
+    __mmask8 less = _mm512_cmplt_epi64_mask( v, pivot );
+    int num_less = __builtin_popcount( less );
+    _mm512_mask_compressstoreu_epi64( arr + left_w, less, v );
+    left_w += num_less;
+    right_w -= 8 - num_less;
+    _mm512_mask_compressstoreu_epi64( arr + right_w, (__mmask8) ~less, v );
+  }
+
+  int64_t tmp[7 + 2 * 8];
+  unsigned n = 0;
+  while ( left_r < right_r )
+    tmp[n++] = arr[left_r++];
+  _mm512_storeu_si512( tmp + n, first );
+  _mm512_storeu_si512( tmp + n + 8, last );
+  distribute( arr, &left_w, &right_w, tmp, n + 16, pivot_val );
+  return left_w;
+}
+
+// One step of a sorting network on 8 lanes: each lane is compared with
+// lane idx[i], and the lanes in max_lanes keep the larger value
+__attribute__(( target( "avx512f" ) ))
+static inline __m512i compare_exchange( __m512i v, __m512i idx, __mmask8 max_lanes ) {
+  __m512i other = _mm512_permutexvar_epi64( idx, v );
+  return _mm512_mask_mov_epi64( _mm512_min_epi64( v, other ), max_lanes,
+                                _mm512_max_epi64( v, other ) );
+}
+
+// Sort a bitonic sequence of 8 lanes
+__attribute__(( target( "avx512f" ) ))
+static inline __m512i bitonic_merge8( __m512i v ) {
+  v = compare_exchange( v, _mm512_set_epi64( 3, 2, 1, 0, 7, 6, 5, 4 ), 0xF0 );
+  v = compare_exchange( v, _mm512_set_epi64( 5, 4, 7, 6, 1, 0, 3, 2 ), 0xCC );
+  v = compare_exchange( v, _mm512_set_epi64( 6, 7, 4, 5, 2, 3, 0, 1 ), 0xAA );
+  return v;
+}
+
+// Sort 8 lanes with a bitonic network
+__attribute__(( target( "avx512f" ) ))
+static inline __m512i bitonic_sort8( __m512i v ) {
+  __m512i pairs = _mm512_set_epi64( 6, 7, 4, 5, 2, 3, 0, 1 );
+  v = compare_exchange( v, pairs, 0xAA );
+  v = compare_exchange( v, _mm512_set_epi64( 4, 5, 6, 7, 0, 1, 2, 3 ), 0xCC );
+  v = compare_exchange( v, pairs, 0xAA );
+  v = compare_exchange( v, _mm512_set_epi64( 0, 1, 2, 3, 4, 5, 6, 7 ), 0xF0 );
+  v = compare_exchange( v, _mm512_set_epi64( 5, 4, 7, 6, 1, 0, 3, 2 ), 0xCC );
+  v = compare_exchange( v, pairs, 0xAA );
+  return v;
+}
+
+// Sort up to 16 elements in two registers, padding with INT64_MAX
+__attribute__(( target( "avx512f" ) ))
+static void small_sort_avx512( int64_t *arr, unsigned long n ) {
+  __m512i pad = _mm512_set1_epi64( INT64_MAX );
+
+  if ( n <= 8 ) {
+    __mmask8 mask = (__mmask8) ( ( 1u << n ) - 1 );
+    __m512i v = bitonic_sort8( _mm512_mask_loadu_epi64( pad, mask, arr ) );
+    _mm512_mask_storeu_epi64( arr, mask, v );
+    return;
+  }
+
+  __mmask8 mask = (__mmask8) ( ( 1u << ( n - 8 ) ) - 1 );
+  __m512i a = bitonic_sort8( _mm512_loadu_si512( arr ) );
+  __m512i b = bitonic_sort8( _mm512_mask_loadu_epi64( pad, mask, arr + 8 ) );
+
+  // a and reversed b form a bitonic sequence: split it into its 8
+  // smallest and 8 largest elements, each bitonic
+  b = _mm512_permutexvar_epi64( _mm512_set_epi64( 0, 1, 2, 3, 4, 5, 6, 7 ), b );
+  __m512i lo = _mm512_min_epi64( a, b ), hi = _mm512_max_epi64( a, b );
+  _mm512_storeu_si512( arr, bitonic_merge8( lo ) );
+  _mm512_mask_storeu_epi64( arr + 8, mask, bitonic_merge8( hi ) );
+}
+
+#endif // HAVE_X86_SIMD
+
+// Rearrange a region of given array from left (inclusive) to right
+// (exclusive) around a pivot value, like partition_range(), using the
+// chosen SIMD instruction set.
+//
+// Parameters:
+//   arr - pointer to first element of array
+//   left - inclusive lower bound index
+//   right - exclusive upper bound index
+//   pivot_val - the pivot value
+//
+// Return:
+//   index of the first element greater than or equal to the pivot
+unsigned long simd_partition_range( int64_t *arr, unsigned long left, unsigned long right,
+                                    int64_t pivot_val ) {
+#ifdef HAVE_X86_SIMD
+  if ( right - left >= 16 ) {
+    if ( simd_level == SIMD_AVX512 )
+      return partition_avx512( arr, left, right, pivot_val );
+    if ( simd_level == SIMD_AVX2 )
+      return partition_avx2( arr, left, right, pivot_val );
+  }
+#endif
+
+  unsigned long left_w = left, right_w = right;
+  while ( left_w < right_w ) {
+    if ( arr[left_w] < pivot_val ) {
+      ++left_w;
+    } else if ( arr[right_w - 1] >= pivot_val ) {
+      --right_w;
+    } else {
+      swap( arr, left_w, right_w - 1 );
+      ++left_w;
+      --right_w;
+    }
+  }
+  return left_w;
+}
+
+static void small_sort( int64_t *arr, unsigned long n ) {
+#ifdef HAVE_X86_SIMD
+  if ( simd_level == SIMD_AVX512 ) {
+    small_sort_avx512( arr, n );
+    return;
+  }
+#endif
+  pdqsort( arr, n );
+}
+
+// Quicksort on the vectorized partition; after depth_allowed levels, the
+// rest is left to pdqsort (whose worst case is O(n log n))
+static void simd_quicksort( int64_t *arr, unsigned long n, int depth_allowed ) {
+  while ( n > SMALL_SORT_ELEMENTS ) {
+    if ( depth_allowed-- == 0 ) {
+      pdqsort( arr, n );
+      return;
+    }
+
+    int64_t pivot_val = arr[choose_pivot( arr, 0, n )];
+    unsigned long boundary = simd_partition_range( arr, 0, n, pivot_val );
+
+    if ( boundary == 0 ) {
+      // the pivot is the smallest value: split off its copies instead,
+      // which are then in place
+      if ( pivot_val == INT64_MAX )
+        return;
+      boundary = simd_partition_range( arr, 0, n, pivot_val + 1 );
+      arr += boundary;
+      n -= boundary;
+      continue;
+    }
+
+    // recurse into the smaller part, and loop on the larger one
+    if ( boundary < n - boundary ) {
+      simd_quicksort( arr, boundary, depth_allowed );
+      arr += boundary;
+      n -= boundary;
+    } else {
+      simd_quicksort( arr + boundary, n - boundary, depth_allowed );
+      n = boundary;
+    }
+  }
+  small_sort( arr, n );
+}
+
+// Sort n elements with a vectorized quicksort (or pdqsort, if no SIMD
+// instruction set was chosen).
+//
+// Parameters:
+//   arr - pointer to first element to sort
+//   n - number of elements
+void simd_sort( int64_t *arr, unsigned long n ) {
+  if ( simd_level == SIMD_NONE ) {
+    pdqsort( arr, n );
+    return;
+  }
+
+  int log2_n = 0;
+  while ( ( n >> ( log2_n + 1 ) ) > 0 )
+    log2_n++;
+  simd_quicksort( arr, n, 2 * log2_n );
+}
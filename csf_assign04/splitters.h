@@ -0,0 +1,37 @@
+#ifndef SPLITTERS_H
+#define SPLITTERS_H
+
+// Splitters for the samplesorts (in samplesort.c).
+//
+// The splitters are stored as an implicit complete binary tree, so an
+// element's bucket is found by descending the tree with no
+// data-dependent branches (as in Sanders and Winkel, "Super Scalar
+// Sample Sort").
+
+#include <stdint.h>
+
+// at most 2^8 buckets, so that bucket numbers fit in a byte
+#define MAX_LOG_BUCKETS 8
+#define MAX_BUCKETS ( 1 << MAX_LOG_BUCKETS )
+
+struct Splitters {
+  int log_buckets;
+  int num_buckets;
+  int64_t tree[MAX_BUCKETS];  // tree[1..num_buckets - 1]
+};
+
+// Choose the number of buckets for sorting n elements with num_workers
+// workers, and splitters for them from a random sample of arr[0..n).
+void choose_splitters( struct Splitters *sp, const int64_t *arr, unsigned long n,
+                       int num_workers );
+
+// Return the bucket of a value: bucket i holds values greater than
+// splitter i - 1 and less than or equal to splitter i
+static inline int splitters_classify( const struct Splitters *sp, int64_t x ) {
+  unsigned j = 1;
+  for ( int level = 0; level < sp->log_buckets; level++ )
+    j = 2 * j + ( x > sp->tree[j] );
+  return (int) ( j - sp->num_buckets );
+}
+
+#endif // SPLITTERS_H
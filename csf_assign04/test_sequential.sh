@@ -1,12 +1,6 @@
 #! /usr/bin/env bash
 
 make gen_rand_data parsort seqsort
-gcc -g -Wall -c gen_rand_data.c -o gen_rand_data.o
-gcc -o gen_rand_data gen_rand_data.o
-gcc -g -Wall -c parsort.c -o parsort.o
-gcc -o parsort parsort.o
-g++ -g -Wall -std=c++17 -c seqsort.cpp -o seqsort.o
-g++ -o seqsort seqsort.o
 ./gen_rand_data 1M test_data_1.bin
 echo "Wrote 1048576 bytes to 'test_data_1.bin'"
 ./parsort test_data_1.bin 65536
@@ -14,4 +8,165 @@ echo "Wrote 1048576 bytes to 'test_data_1.bin'"
 echo "Wrote 1048576 bytes to 'test_data_2.bin'"
 ./seqsort test_data_2.bin 
 diff test_data_1.bin test_data_2.bin 
-echo $?
\ No newline at end of file
+echo $?
+# every seqsort mode must match the default one, including the chunked
+# parallel sort used without TBB (with 3 threads, so a merge round has
+# an odd chunk out)
+make seqsort_chunked > /dev/null
+for mode in "seqsort --io mmap" "seqsort --mode par" "seqsort --mode stable" \
+            "seqsort_chunked --mode par -j 3" "seqsort_chunked --io mmap --mode par -j 3"; do
+  ./gen_rand_data 1M test_data_3.bin > /dev/null
+  ./$mode test_data_3.bin > /dev/null
+  if ! cmp -s test_data_2.bin test_data_3.bin; then
+    echo "$mode differs from seqsort"
+    exit 1
+  fi
+done
+# every engine must produce the same output as seqsort (the fork
+# engine can't use tiny thresholds, which would need too many processes)
+check() {
+  local threshold=$1
+  shift
+  ./gen_rand_data 1M test_data_3.bin > /dev/null
+  ./parsort "$@" test_data_3.bin $threshold
+  if ! cmp -s test_data_2.bin test_data_3.bin; then
+    echo "parsort $* (threshold $threshold) differs from seqsort"
+    exit 1
+  fi
+}
+for threshold in 65536 4096; do
+  check $threshold --engine fork
+done
+for threshold in 65536 1000 1; do
+  check $threshold --engine threads -j 4
+done
+for threshold in 65536 1000 1; do
+  check $threshold --engine pool -j 4
+done
+for threshold in 65536 1; do
+  check $threshold --algo samplesort -j 4
+done
+for threshold in 65536 1; do
+  check $threshold --algo radix -j 4
+  check $threshold --algo radix -j 1
+done
+for threshold in 65536 1; do
+  check $threshold --algo ips4o -j 4
+  check $threshold --algo ips4o -j 1
+done
+check 65536 --leaf radix
+check 65536 --leaf pdqsort
+# each vector instruction set the CPU has, and none
+for simd in off avx2 avx512; do
+  if [ $simd = off ] || grep -qw ${simd/avx512/avx512f} /proc/cpuinfo; then
+    check 1000 --simd $simd -j 4
+    check 100000000 --simd $simd
+    check 1 --engine pool --simd $simd -j 4
+  fi
+done
+check 65536 --leaf qsort
+check 4096 --engine pool --leaf qsort
+check 65536 --engine pool --leaf radix
+# loading into anonymous memory, private and shared
+check 65536 --load copy -j 4
+check 4096 --load copy --engine pool -j 3
+# int64 values as records
+check 1 --record-size 8 -j 4
+check 1 --record-size 8 --key-type int64 --stable -j 1
+# records of each key type must match a stable sort by Python (keys
+# at an offset, many equal keys, and a partial record at the end)
+check_records() {
+  python3 - "$@" <<'EOF' || exit 1
+import random, struct, subprocess, sys
+key_type, offset, key_size, size = sys.argv[1], int( sys.argv[2] ), int( sys.argv[3] ), int( sys.argv[4] )
+rng = random.Random( 1 )
+def make_key():
+    if key_type == 'int32':
+        return struct.pack( '<i', rng.choice( [ -2**31, 2**31 - 1, rng.randrange( -50, 50 ) ] ) )
+    if key_type == 'int64':
+        return struct.pack( '<q', rng.choice( [ -2**63, 2**63 - 1, rng.randrange( -50, 50 ) ] ) )
+    if key_type == 'uint64':
+        return struct.pack( '<Q', rng.choice( [ 0, 2**64 - 1, 2**63 + rng.randrange( -50, 50 ) ] ) )
+    if key_type == 'double':
+        special = [ 0.0, -0.0, float( 'inf' ), -float( 'inf' ), 1e-310, -1e-310 ]
+        nan = [ struct.pack( '<Q', 0x7ff8000000000000 ), struct.pack( '<Q', 0xfff8000000000001 ) ]
+        return rng.choice( [ struct.pack( '<d', rng.choice( special ) ), rng.choice( nan ),
+                             struct.pack( '<d', rng.randrange( -50, 50 ) / 4 ) ] )
+    # bytes: often a shared first 8 bytes, so the rest decides
+    prefix = bytes( min( key_size, 8 ) ) if rng.random() < 0.7 else rng.randbytes( min( key_size, 8 ) )
+    return prefix + bytes( rng.choice( b'ab' ) for _ in range( key_size - len( prefix ) ) )
+def sort_key( record ):
+    key = record[offset:offset + key_size]
+    if key_type == 'bytes':
+        return ( key, )
+    value = struct.unpack( { 'int32': '<i', 'int64': '<q', 'uint64': '<Q', 'double': '<d' }[key_type], key )[0]
+    if value != value:
+        return ( 0 if key[-1] & 0x80 else 2, )   # -NaN first, NaN last
+    return ( 1, value )
+records = []
+for i in range( 150000 ):
+    record = bytearray( rng.randbytes( size ) )
+    record[offset:offset + key_size] = make_key()
+    records.append( bytes( record ) )
+tail = rng.randbytes( size - 1 )
+with open( 'test_data_rec.bin', 'wb' ) as f:
+    f.write( b''.join( records ) + tail )
+args = [ '--record-size', str( size ), '--key-offset', str( offset ), '--key-type', key_type ]
+if key_type == 'bytes':
+    args += [ '--key-size', str( key_size ) ]
+subprocess.run( [ './parsort', '-j', '4' ] + args + [ 'test_data_rec.bin', '1' ], check=True )
+with open( 'test_data_rec.bin', 'rb' ) as f:
+    if f.read() != b''.join( sorted( records, key=sort_key ) ) + tail:
+        sys.exit( 'parsort ' + ' '.join( args ) + ' differs from a stable sort' )
+EOF
+}
+check_records int32 5 4 24
+check_records int64 8 8 16
+check_records uint64 3 8 20
+check_records double 8 8 32
+check_records bytes 4 20 40
+check_records bytes 0 5 7
+# external sorts: one merge pass, several passes, and a process engine
+check 65536 --memory 512K -j 4
+check 4096 --memory 384K -j 1
+check 4096 --memory 384K --engine pool -j 4
+
+# duplicate-heavy inputs: 256 distinct values, and every value equal
+./gen_rand_data 1M test_data_4.bin > /dev/null
+tr '\000-\377' '[\000*128][\001*128]' < test_data_4.bin > test_data_dups.bin
+head -c 1M /dev/zero > test_data_zero.bin
+check_dups() {
+  local threshold=$1
+  shift
+  for input in test_data_dups.bin test_data_zero.bin; do
+    cp $input test_data_4.bin
+    ./seqsort test_data_4.bin > /dev/null
+    cp $input test_data_5.bin
+    ./parsort "$@" test_data_5.bin $threshold
+    if ! cmp -s test_data_4.bin test_data_5.bin; then
+      echo "parsort $* (threshold $threshold) differs from seqsort on $input"
+      exit 1
+    fi
+  done
+}
+check_dups 4096 --engine fork
+check_dups 1 --engine threads -j 4
+check_dups 1 --engine pool -j 4
+check_dups 1 --algo samplesort -j 4
+check_dups 1 --algo ips4o -j 4
+check_dups 4096 --memory 384K -j 2
+check_dups 1 --load copy -j 4
+
+# text mode must match LC_ALL=C sort
+./gen_rand_data 1M test_data_6.bin > /dev/null
+od -An -v -tx1 test_data_6.bin | cut -c1-13 > test_data_text.txt
+LC_ALL=C sort test_data_text.txt > test_data_text_sorted.txt
+for threshold in 1 1000000; do
+  cp test_data_text.txt test_data_text_out.txt
+  ./parsort --text -j 4 test_data_text_out.txt $threshold
+  if ! cmp -s test_data_text_sorted.txt test_data_text_out.txt; then
+    echo "parsort --text (threshold $threshold) differs from sort"
+    exit 1
+  fi
+done
+echo "All engines match seqsort"
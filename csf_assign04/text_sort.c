@@ -0,0 +1,418 @@
+// Sorting the lines of a text file (parsort --text), byte by byte like
+// memcmp (the order of LC_ALL=C sort).
+//
+// The file is mapped read-only, and an array of its lines (start and
+// length) is built in parallel: each worker counts the newlines in one
+// chunk of the file, and then records the lines ending in that chunk.
+//
+// The lines are sorted with a multikey quicksort (Bentley and
+// Sedgewick), 8 bytes at a time: each line caches the 8 bytes of its
+// key at the current depth as an integer, lines are partitioned three
+// ways by that integer, and only the lines equal to the pivot go on to
+// the next 8 bytes, with their cached prefixes refreshed. So a common
+// prefix is compared once per 8 bytes for each line, not once per
+// comparison. Parts longer than the threshold are sorted by tasks on
+// the thread pool.
+//
+// The sorted lines are written to a temporary file next to the input
+// with writev, a batch of IOV_MAX lines at a time (lines that follow
+// each other in the input too share one iovec), and the temporary file
+// is then renamed over the input.
+
+#define _GNU_SOURCE   // for memrchr
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "parsort.h"
+#include "ws_pool.h"
+
+// ranges shorter than this are insertion sorted
+#define INSERTION_SORT_THRESHOLD 16
+
+// smallest chunk of the file for building the line array in parallel
+#define MIN_CHUNK_BYTES ( 1UL << 20 )
+
+struct Line {
+  uint64_t prefix;      // bytes [depth, depth + 8) of the line, most significant first
+  const char *start;
+  size_t len;           // not counting the newline
+};
+
+// Shared state of a text sort
+struct TextSort {
+  const char *data;
+  size_t size;
+  struct Line *lines;
+  unsigned long num_lines;
+  int num_chunks;
+  unsigned long *newlines;    // newlines before each chunk (counts, then offsets)
+  unsigned long par_threshold;
+  struct ws_group group;
+  int failed;
+};
+
+// A range of lines to sort, whose first depth bytes are all equal
+struct TextRange {
+  struct TextSort *ts;
+  size_t depth;
+};
+
+static size_t chunk_start( const struct TextSort *ts, unsigned long chunk ) {
+  return ts->size * chunk / ts->num_chunks;
+}
+
+// Count the newlines in one chunk of the file
+static void count_lines_task( struct ws_worker *self, void *arg,
+                              unsigned long chunk, unsigned long unused ) {
+  struct TextSort *ts = arg;
+  const char *p = ts->data + chunk_start( ts, chunk ), *end = ts->data + chunk_start( ts, chunk + 1 );
+  unsigned long count = 0;
+  (void) self;
+  (void) unused;
+
+  while ( p < end && ( p = memchr( p, '\n', end - p ) ) != NULL ) {
+    count++;
+    p++;
+  }
+  ts->newlines[chunk] = count;
+}
+
+static inline uint64_t line_prefix( const struct Line *line, size_t depth ) {
+  uint64_t x = 0;
+  if ( depth < line->len ) {
+    size_t rest = line->len - depth;
+    memcpy( &x, line->start + depth, rest < sizeof( x ) ? rest : sizeof( x ) );
+  }
+  return __builtin_bswap64( x );
+}
+
+// Record the lines ending at the newlines in one chunk of the file (the
+// line ending at newline number i is line i, and line i + 1 starts
+// after it), and the last line if it has no newline
+static void find_lines_task( struct ws_worker *self, void *arg,
+                             unsigned long chunk, unsigned long unused ) {
+  struct TextSort *ts = arg;
+  const char *p = ts->data + chunk_start( ts, chunk ), *end = ts->data + chunk_start( ts, chunk + 1 );
+  unsigned long i = ts->newlines[chunk];
+  const char *line_start = p;
+  (void) self;
+  (void) unused;
+
+  // the start of the first line ending here
+  if ( p > ts->data ) {
+    const char *nl = memrchr( ts->data, '\n', p - ts->data );
+    line_start = nl == NULL ? ts->data : nl + 1;
+  }
+
+  while ( p < end && ( p = memchr( p, '\n', end - p ) ) != NULL ) {
+    ts->lines[i].start = line_start;
+    ts->lines[i].len = p - line_start;
+    ts->lines[i].prefix = line_prefix( &ts->lines[i], 0 );
+    line_start = ++p;
+    i++;
+  }
+  if ( (unsigned long) chunk == (unsigned long) ts->num_chunks - 1 && i < ts->num_lines ) {
+    ts->lines[i].start = line_start;
+    ts->lines[i].len = ts->data + ts->size - line_start;
+    ts->lines[i].prefix = line_prefix( &ts->lines[i], 0 );
+  }
+}
+
+// Compare two lines from depth on, given their cached prefixes at depth
+static inline int compare_lines( const struct Line *a, const struct Line *b, size_t depth ) {
+  if ( a->prefix != b->prefix )
+    return a->prefix < b->prefix ? -1 : 1;
+  size_t a_len = a->len > depth ? a->len - depth : 0, b_len = b->len > depth ? b->len - depth : 0;
+  int cmp = memcmp( a->start + depth, b->start + depth, a_len < b_len ? a_len : b_len );
+  if ( cmp != 0 )
+    return cmp;
+  return a_len < b_len ? -1 : a_len > b_len;
+}
+
+static void insertion_sort_lines( struct Line *lines, unsigned long n, size_t depth ) {
+  for ( unsigned long i = 1; i < n; i++ ) {
+    struct Line tmp = lines[i];
+    unsigned long j = i;
+    while ( j > 0 && compare_lines( &tmp, &lines[j - 1], depth ) < 0 ) {
+      lines[j] = lines[j - 1];
+      j--;
+    }
+    lines[j] = tmp;
+  }
+}
+
+static inline void swap_lines( struct Line *lines, unsigned long i, unsigned long j ) {
+  struct Line tmp = lines[i];
+  lines[i] = lines[j];
+  lines[j] = tmp;
+}
+
+static uint64_t median3_prefix( uint64_t a, uint64_t b, uint64_t c ) {
+  if ( a < b )
+    return b < c ? b : ( a < c ? c : a );
+  return a < c ? a : ( b < c ? c : b );
+}
+
+static void multikey_sort( struct ws_worker *self, struct TextSort *ts, unsigned long start,
+                           unsigned long end, size_t depth );
+
+// Task sorting a range of lines (arg is a TextRange, freed here)
+static void text_sort_task( struct ws_worker *self, void *arg, unsigned long start, unsigned long end ) {
+  struct TextRange *range = arg;
+  struct TextSort *ts = range->ts;
+  size_t depth = range->depth;
+  free( range );
+  multikey_sort( self, ts, start, end, depth );
+}
+
+// A range of lines left to sort by multikey_sort
+struct Part {
+  unsigned long start, end;
+  size_t depth;
+};
+
+// Spawn a task sorting a part if it is longer than the threshold.
+//
+// Return:
+//   1 if a task was spawned, 0 if the part is left to the caller
+static int spawn_part( struct ws_worker *self, struct TextSort *ts, const struct Part *part ) {
+  if ( part->end - part->start <= ts->par_threshold )
+    return 0;
+  struct TextRange *range = malloc( sizeof(struct TextRange) );
+  if ( range == NULL )
+    return 0;
+  range->ts = ts;
+  range->depth = part->depth;
+  ws_spawn( self, &ts->group, text_sort_task, range, part->start, part->end );
+  return 1;
+}
+
+// Multikey quicksort of lines [start, end), whose first depth bytes are
+// all equal and whose cached prefixes are for that depth
+static void multikey_sort( struct ws_worker *self, struct TextSort *ts, unsigned long start,
+                           unsigned long end, size_t depth ) {
+  struct Line *lines = ts->lines;
+
+  while ( end - start >= INSERTION_SORT_THRESHOLD ) {
+    unsigned long mid = start + ( end - start ) / 2;
+    uint64_t pivot = median3_prefix( lines[start].prefix, lines[mid].prefix, lines[end - 1].prefix );
+
+    // three-way partition: [start, lt) < pivot, [lt, gt) == pivot,
+    // [gt, end) > pivot
+    unsigned long lt = start, i = start, gt = end;
+    while ( i < gt ) {
+      uint64_t prefix = lines[i].prefix;
+      if ( prefix < pivot )
+        swap_lines( lines, lt++, i++ );
+      else if ( prefix > pivot )
+        swap_lines( lines, i, --gt );
+      else
+        i++;
+    }
+
+    // equal lines that end within these 8 bytes come first: they only
+    // differ in how many zero bytes they end with, so the shorter ones
+    // first
+    size_t min_len = SIZE_MAX, max_len = 0;
+    unsigned long done = lt;
+    for ( unsigned long j = lt; j < gt; j++ ) {
+      if ( lines[j].len <= depth + 8 ) {
+        if ( lines[j].len < min_len )
+          min_len = lines[j].len;
+        if ( lines[j].len > max_len )
+          max_len = lines[j].len;
+        swap_lines( lines, done++, j );
+      }
+    }
+    for ( size_t len = min_len, first = lt; len < max_len; len++ )
+      for ( unsigned long j = first; j < done; j++ )
+        if ( lines[j].len == len )
+          swap_lines( lines, first++, j );
+
+    // the others go on to the next 8 bytes
+    for ( unsigned long j = done; j < gt; j++ )
+      lines[j].prefix = line_prefix( &lines[j], depth + 8 );
+
+    // parts longer than the threshold become tasks. Of the others, the
+    // largest is sorted by this loop and the rest by recursion; those
+    // are at most half as long, so the recursion is O(log n) deep.
+    struct Part parts[3] = {
+      { start, lt, depth },
+      { done, gt, depth + 8 },
+      { gt, end, depth },
+    };
+    int largest = -1;
+    for ( int p = 0; p < 3; p++ ) {
+      if ( parts[p].end - parts[p].start < 2 || spawn_part( self, ts, &parts[p] ) )
+        parts[p].end = parts[p].start;
+      else if ( largest < 0 ||
+                parts[p].end - parts[p].start > parts[largest].end - parts[largest].start )
+        largest = p;
+    }
+    for ( int p = 0; p < 3; p++ )
+      if ( p != largest && parts[p].end > parts[p].start )
+        multikey_sort( self, ts, parts[p].start, parts[p].end, parts[p].depth );
+    if ( largest < 0 )
+      return;
+    start = parts[largest].start;
+    end = parts[largest].end;
+    depth = parts[largest].depth;
+  }
+
+  insertion_sort_lines( lines + start, end - start, depth );
+}
+
+// Write all of the iovecs, continuing after partial writes
+static int writev_all( int fd, struct iovec *iov, int count ) {
+  while ( count > 0 ) {
+    ssize_t n = writev( fd, iov, count );
+    if ( n < 0 && errno == EINTR )
+      continue;
+    if ( n < 0 )
+      return 0;
+    while ( count > 0 && (size_t) n >= iov->iov_len ) {
+      n -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if ( count > 0 ) {
+      iov->iov_base = (char *) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 1;
+}
+
+// Write the lines in order, each followed by a newline
+static int write_lines( int fd, const struct TextSort *ts ) {
+  static char newline = '\n';
+  struct iovec iov[IOV_MAX];
+  int count = 0;
+
+  for ( unsigned long i = 0; i < ts->num_lines; i++ ) {
+    const struct Line *line = &ts->lines[i];
+    const char *start = line->start;
+    size_t len = line->len + 1;
+    int has_newline = start + line->len < ts->data + ts->size;
+
+    if ( !has_newline )
+      len--;
+    if ( count > 0 && (char *) iov[count - 1].iov_base + iov[count - 1].iov_len == start ) {
+      iov[count - 1].iov_len += len;
+    } else {
+      if ( count == IOV_MAX ) {
+        if ( !writev_all( fd, iov, count ) )
+          return 0;
+        count = 0;
+      }
+      iov[count].iov_base = (char *) start;
+      iov[count++].iov_len = len;
+    }
+    if ( !has_newline ) {
+      if ( count == IOV_MAX ) {
+        if ( !writev_all( fd, iov, count ) )
+          return 0;
+        count = 0;
+      }
+      iov[count].iov_base = &newline;
+      iov[count++].iov_len = 1;
+    }
+  }
+  return writev_all( fd, iov, count );
+}
+
+// Root task: count the lines, build the line array, then sort it
+static void text_sort_root_task( struct ws_worker *self, void *arg,
+                                 unsigned long start, unsigned long end ) {
+  struct TextSort *ts = arg;
+  (void) start;
+  (void) end;
+
+  ws_parallel_for( self, ts->num_chunks, count_lines_task, ts );
+
+  // the number of the first line ending in each chunk
+  unsigned long offset = 0;
+  for ( int c = 0; c < ts->num_chunks; c++ ) {
+    unsigned long count = ts->newlines[c];
+    ts->newlines[c] = offset;
+    offset += count;
+  }
+  ts->num_lines = offset + ( ts->data[ts->size - 1] != '\n' );
+  ts->lines = malloc( ts->num_lines * sizeof(struct Line) );
+  if ( ts->lines == NULL ) {
+    ts->failed = 1;
+    return;
+  }
+
+  ws_parallel_for( self, ts->num_chunks, find_lines_task, ts );
+  multikey_sort( self, ts, 0, ts->num_lines, 0 );
+  ws_wait( self, &ts->group );
+}
+
+int text_sort( const char *path, int fd, size_t size, unsigned long par_threshold,
+               int num_workers ) {
+  struct stat statbuf;
+  if ( size == 0 )
+    return 1;
+  if ( fstat( fd, &statbuf ) != 0 )
+    return 0;
+
+  struct TextSort ts;
+  ts.size = size;
+  ts.par_threshold = par_threshold;
+  ts.group.pending = 0;
+  ts.failed = 0;
+  ts.num_chunks = num_workers < 1 ? 1 : num_workers;
+  if ( (size_t) ts.num_chunks > size / MIN_CHUNK_BYTES )
+    ts.num_chunks = size < MIN_CHUNK_BYTES ? 1 : (int) ( size / MIN_CHUNK_BYTES );
+  ts.data = mmap( NULL, size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  if ( ts.data == MAP_FAILED )
+    return 0;
+
+  ts.newlines = malloc( ts.num_chunks * sizeof(unsigned long) );
+  ts.lines = NULL;
+  struct ws_pool *pool = ws_pool_create( num_workers );
+  int ok = ts.newlines != NULL && pool != NULL;
+  if ( ok ) {
+    struct ws_group group = { 0 };
+    ws_pool_run( pool, &group, text_sort_root_task, &ts, 0, size );
+    ok = !ts.failed;
+  }
+
+  // write to a temporary file, and replace the input with it
+  if ( ok ) {
+    char *tmp_name = malloc( strlen( path ) + sizeof( ".tmpXXXXXX" ) );
+    int tmp_fd = -1;
+    if ( tmp_name != NULL ) {
+      sprintf( tmp_name, "%s.tmpXXXXXX", path );
+      tmp_fd = mkstemp( tmp_name );
+    }
+    ok = tmp_fd >= 0 && fchmod( tmp_fd, statbuf.st_mode & 07777 ) == 0 &&
+         write_lines( tmp_fd, &ts );
+    if ( tmp_fd >= 0 && close( tmp_fd ) != 0 )
+      ok = 0;
+    if ( ok && rename( tmp_name, path ) != 0 )
+      ok = 0;
+    if ( !ok && tmp_fd >= 0 )
+      unlink( tmp_name );
+    if ( !ok )
+      perror( "Error: couldn't write the sorted lines" );
+    free( tmp_name );
+  }
+
+  if ( pool != NULL )
+    ws_pool_destroy( pool );
+  free( ts.lines );
+  free( ts.newlines );
+  munmap( (void *) ts.data, size );
+  return ok;
+}
@@ -0,0 +1,322 @@
+// Work-stealing thread pool (see ws_pool.h), using the Chase-Lev
+// deque with the memory orderings from Le et al., "Correct and
+// Efficient Work-Stealing for Weak Memory Models" (PPoPP 2013).
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "ws_pool.h"
+
+// initial number of slots in each deque (a power of 2)
+#define DEQUE_INITIAL_CAPACITY 256
+
+// number of failed attempts to find a task before an idle worker
+// starts sleeping between attempts
+#define IDLE_SPINS 64
+#define IDLE_SLEEP_NS 50000
+
+struct ws_task {
+  ws_task_fn fn;
+  void *arg;
+  unsigned long start, end;
+  struct ws_group *group;
+};
+
+// Circular array of task pointers. When a deque grows, the old array is
+// kept (linked from the new one) until the pool is destroyed, since
+// thieves may still be reading from it.
+struct ws_array {
+  long capacity;
+  struct ws_array *prev;
+  struct ws_task *slots[];
+};
+
+struct ws_deque {
+  long top;      // next task to steal
+  long bottom;   // next free slot (only changed by the owner)
+  struct ws_array *array;
+};
+
+struct ws_worker {
+  int id;
+  unsigned rng;   // for choosing victims
+  struct ws_pool *pool;
+  struct ws_deque deque;
+  pthread_t thread;
+};
+
+struct ws_pool {
+  int num_workers;     // number of running workers
+  int num_allocated;   // number of workers with deques
+  int stop;
+  struct ws_worker *workers;
+};
+
+static struct ws_array *array_create( long capacity ) {
+  struct ws_array *a = malloc( sizeof( struct ws_array ) + capacity * sizeof( struct ws_task * ) );
+  if ( a != NULL ) {
+    a->capacity = capacity;
+    a->prev = NULL;
+  }
+  return a;
+}
+
+static struct ws_task *array_get( struct ws_array *a, long i ) {
+  return __atomic_load_n( &a->slots[i & ( a->capacity - 1 )], __ATOMIC_RELAXED );
+}
+
+static void array_put( struct ws_array *a, long i, struct ws_task *task ) {
+  __atomic_store_n( &a->slots[i & ( a->capacity - 1 )], task, __ATOMIC_RELAXED );
+}
+
+// Push a task onto the bottom of a worker's own deque.
+//
+// Return:
+//   1 if successful, 0 if the deque was full and couldn't grow
+static int deque_push( struct ws_deque *d, struct ws_task *task ) {
+  long b = __atomic_load_n( &d->bottom, __ATOMIC_RELAXED );
+  long t = __atomic_load_n( &d->top, __ATOMIC_ACQUIRE );
+  struct ws_array *a = __atomic_load_n( &d->array, __ATOMIC_RELAXED );
+
+  if ( b - t > a->capacity - 1 ) {
+    struct ws_array *bigger = array_create( 2 * a->capacity );
+    if ( bigger == NULL )
+      return 0;
+    for ( long i = t; i < b; i++ )
+      array_put( bigger, i, array_get( a, i ) );
+    bigger->prev = a;
+    __atomic_store_n( &d->array, bigger, __ATOMIC_RELEASE );
+    a = bigger;
+  }
+
+  array_put( a, b, task );
+  __atomic_thread_fence( __ATOMIC_RELEASE );
+  __atomic_store_n( &d->bottom, b + 1, __ATOMIC_RELAXED );
+  return 1;
+}
+
+// Pop the newest task from the bottom of a worker's own deque.
+//
+// Return:
+//   the task, or NULL if the deque is empty
+static struct ws_task *deque_take( struct ws_deque *d ) {
+  long b = __atomic_load_n( &d->bottom, __ATOMIC_RELAXED ) - 1;
+  struct ws_array *a = __atomic_load_n( &d->array, __ATOMIC_RELAXED );
+  __atomic_store_n( &d->bottom, b, __ATOMIC_RELAXED );
+  __atomic_thread_fence( __ATOMIC_SEQ_CST );
+  long t = __atomic_load_n( &d->top, __ATOMIC_RELAXED );
+
+  struct ws_task *task = NULL;
+  if ( t <= b ) {
+    task = array_get( a, b );
+    if ( t == b ) {
+      // last task: race against thieves for it
+      if ( !__atomic_compare_exchange_n( &d->top, &t, t + 1, 0,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED ) )
+        task = NULL;
+      __atomic_store_n( &d->bottom, b + 1, __ATOMIC_RELAXED );
+    }
+  } else {
+    __atomic_store_n( &d->bottom, b + 1, __ATOMIC_RELAXED );
+  }
+  return task;
+}
+
+// Steal the oldest task from the top of another worker's deque.
+//
+// Return:
+//   the task, or NULL if the deque is empty or another thief won
+static struct ws_task *deque_steal( struct ws_deque *d ) {
+  long t = __atomic_load_n( &d->top, __ATOMIC_ACQUIRE );
+  __atomic_thread_fence( __ATOMIC_SEQ_CST );
+  long b = __atomic_load_n( &d->bottom, __ATOMIC_ACQUIRE );
+
+  if ( t >= b )
+    return NULL;
+  struct ws_array *a = __atomic_load_n( &d->array, __ATOMIC_ACQUIRE );
+  struct ws_task *task = array_get( a, t );
+  if ( !__atomic_compare_exchange_n( &d->top, &t, t + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED ) )
+    return NULL;
+  return task;
+}
+
+// Find a task to run: the worker's own newest task, or else one stolen
+// from a randomly chosen worker (trying each other worker once).
+static struct ws_task *find_task( struct ws_worker *self ) {
+  struct ws_task *task = deque_take( &self->deque );
+  if ( task != NULL )
+    return task;
+
+  int n = self->pool->num_workers;
+  if ( n < 2 )
+    return NULL;
+  self->rng = self->rng * 1103515245u + 12345u;
+  int first = ( self->rng >> 16 ) % n;
+  for ( int i = 0; i < n; i++ ) {
+    int victim = ( first + i ) % n;
+    if ( victim == self->id )
+      continue;
+    task = deque_steal( &self->pool->workers[victim].deque );
+    if ( task != NULL )
+      return task;
+  }
+  return NULL;
+}
+
+static void run_task( struct ws_worker *self, struct ws_task *task ) {
+  struct ws_group *group = task->group;
+  task->fn( self, task->arg, task->start, task->end );
+  free( task );
+  __atomic_sub_fetch( &group->pending, 1, __ATOMIC_RELEASE );
+}
+
+// Back off after failing to find a task: yield at first, then sleep
+// briefly so idle workers don't take CPU time from busy ones.
+static void idle( int *failures ) {
+  if ( ++*failures < IDLE_SPINS ) {
+    sched_yield();
+  } else {
+    struct timespec ts = { 0, IDLE_SLEEP_NS };
+    nanosleep( &ts, NULL );
+  }
+}
+
+static void *worker_main( void *p ) {
+  struct ws_worker *self = p;
+  int failures = 0;
+
+  while ( !__atomic_load_n( &self->pool->stop, __ATOMIC_ACQUIRE ) ) {
+    struct ws_task *task = find_task( self );
+    if ( task != NULL ) {
+      run_task( self, task );
+      failures = 0;
+    } else {
+      idle( &failures );
+    }
+  }
+  return NULL;
+}
+
+struct ws_pool *ws_pool_create( int num_workers ) {
+  if ( num_workers < 1 )
+    num_workers = 1;
+
+  struct ws_pool *pool = malloc( sizeof( struct ws_pool ) );
+  if ( pool == NULL )
+    return NULL;
+  pool->num_workers = 1;
+  pool->num_allocated = 0;
+  pool->stop = 0;
+  pool->workers = calloc( num_workers, sizeof( struct ws_worker ) );
+  if ( pool->workers == NULL ) {
+    free( pool );
+    return NULL;
+  }
+
+  for ( int i = 0; i < num_workers; i++ ) {
+    struct ws_worker *w = &pool->workers[i];
+    w->id = i;
+    w->rng = 2654435761u * ( i + 1 );
+    w->pool = pool;
+    w->deque.array = array_create( DEQUE_INITIAL_CAPACITY );
+    if ( w->deque.array == NULL ) {
+      ws_pool_destroy( pool );
+      return NULL;
+    }
+    pool->num_allocated++;
+  }
+  pool->num_workers = num_workers;
+
+  // worker 0 is the thread calling ws_pool_run; if a thread can't be
+  // started, carry on with the workers started so far
+  for ( int i = 1; i < num_workers; i++ ) {
+    if ( pthread_create( &pool->workers[i].thread, NULL, worker_main, &pool->workers[i] ) != 0 ) {
+      pool->num_workers = i;
+      break;
+    }
+  }
+  return pool;
+}
+
+void ws_pool_destroy( struct ws_pool *pool ) {
+  __atomic_store_n( &pool->stop, 1, __ATOMIC_RELEASE );
+  for ( int i = 1; i < pool->num_workers; i++ )
+    pthread_join( pool->workers[i].thread, NULL );
+
+  for ( int i = 0; i < pool->num_allocated; i++ ) {
+    struct ws_array *a = pool->workers[i].deque.array;
+    while ( a != NULL ) {
+      struct ws_array *prev = a->prev;
+      free( a );
+      a = prev;
+    }
+  }
+  free( pool->workers );
+  free( pool );
+}
+
+int ws_pool_num_workers( struct ws_pool *pool ) {
+  return pool->num_workers;
+}
+
+int ws_worker_num_workers( struct ws_worker *self ) {
+  return self->pool->num_workers;
+}
+
+int ws_worker_id( struct ws_worker *self ) {
+  return self->id;
+}
+
+void ws_spawn( struct ws_worker *self, struct ws_group *group, ws_task_fn fn, void *arg,
+               unsigned long start, unsigned long end ) {
+  struct ws_task *task = malloc( sizeof( struct ws_task ) );
+  if ( task != NULL ) {
+    task->fn = fn;
+    task->arg = arg;
+    task->start = start;
+    task->end = end;
+    task->group = group;
+    __atomic_add_fetch( &group->pending, 1, __ATOMIC_RELAXED );
+    if ( deque_push( &self->deque, task ) )
+      return;
+    __atomic_sub_fetch( &group->pending, 1, __ATOMIC_RELAXED );
+    free( task );
+  }
+
+  // no memory for the task: do the work now instead
+  fn( self, arg, start, end );
+}
+
+void ws_wait( struct ws_worker *self, struct ws_group *group ) {
+  int failures = 0;
+
+  while ( __atomic_load_n( &group->pending, __ATOMIC_ACQUIRE ) > 0 ) {
+    struct ws_task *task = find_task( self );
+    if ( task != NULL ) {
+      run_task( self, task );
+      failures = 0;
+    } else {
+      idle( &failures );
+    }
+  }
+}
+
+void ws_pool_run( struct ws_pool *pool, struct ws_group *group, ws_task_fn fn, void *arg,
+                  unsigned long start, unsigned long end ) {
+  struct ws_worker *self = &pool->workers[0];
+  ws_spawn( self, group, fn, arg, start, end );
+  ws_wait( self, group );
+}
+
+void ws_parallel_for( struct ws_worker *self, unsigned long count, ws_task_fn fn, void *arg ) {
+  struct ws_group group = { 0 };
+
+  if ( count == 0 )
+    return;
+  for ( unsigned long i = 1; i < count; i++ )
+    ws_spawn( self, &group, fn, arg, i, i + 1 );
+  fn( self, arg, 0, 1 );
+  ws_wait( self, &group );
+}
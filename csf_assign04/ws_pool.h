@@ -0,0 +1,85 @@
+#ifndef WS_POOL_H
+#define WS_POOL_H
+
+// Work-stealing thread pool.
+//
+// A task is a function applied to a range [start, end) of some shared
+// data. Each worker thread owns a Chase-Lev deque: tasks it spawns are
+// pushed onto the bottom of its own deque and popped from the bottom
+// again (newest first, while their data is still in cache), and a worker
+// that runs out of tasks steals from the top of another worker's deque
+// (oldest first, which for divide-and-conquer algorithms are the
+// largest pieces of work).
+
+struct ws_pool;
+struct ws_worker;
+
+// Counter of unfinished tasks, used to wait for a set of tasks
+struct ws_group {
+  long pending;
+};
+
+// Task function.
+//
+// Parameters:
+//   self - the worker running the task (for spawning further tasks)
+//   arg - pointer passed to ws_spawn
+//   start - inclusive lower bound of the task's range
+//   end - exclusive upper bound of the task's range
+typedef void (*ws_task_fn)( struct ws_worker *self, void *arg,
+                            unsigned long start, unsigned long end );
+
+// Create a pool of worker threads.
+//
+// Parameters:
+//   num_workers - number of workers, including the thread that will call
+//                 ws_pool_run (values less than 1 are treated as 1)
+//
+// Return:
+//   pointer to the pool, or NULL if it couldn't be created
+struct ws_pool *ws_pool_create( int num_workers );
+
+// Stop the worker threads and free the pool.
+void ws_pool_destroy( struct ws_pool *pool );
+
+// Return the number of workers in a pool.
+int ws_pool_num_workers( struct ws_pool *pool );
+
+// Run a task on the pool from the thread that created it, and wait
+// until the task and every task it spawned (directly or indirectly,
+// into the same group) has finished. The calling thread works on tasks
+// while it waits.
+//
+// Parameters:
+//   pool - the pool
+//   group - group counting the outstanding tasks
+//   fn, arg, start, end - the task
+void ws_pool_run( struct ws_pool *pool, struct ws_group *group, ws_task_fn fn, void *arg,
+                  unsigned long start, unsigned long end );
+
+// Spawn a task, to be run by this worker or stolen by another one.
+// If memory for the task can't be allocated, the task is run
+// immediately instead.
+//
+// Parameters:
+//   self - the worker spawning the task
+//   group - group to count the task in
+//   fn, arg, start, end - the task
+void ws_spawn( struct ws_worker *self, struct ws_group *group, ws_task_fn fn, void *arg,
+               unsigned long start, unsigned long end );
+
+// Wait until every task in a group has finished, running tasks
+// (from any group) in the meantime.
+void ws_wait( struct ws_worker *self, struct ws_group *group );
+
+// Run fn( self, arg, i, i + 1 ) as a task for each i from 0 to count - 1,
+// and wait for all of them to finish.
+void ws_parallel_for( struct ws_worker *self, unsigned long count, ws_task_fn fn, void *arg );
+
+// Return the number of workers in the pool a worker belongs to.
+int ws_worker_num_workers( struct ws_worker *self );
+
+// Return the index (0 to num_workers - 1) of a worker.
+int ws_worker_id( struct ws_worker *self );
+
+#endif // WS_POOL_H